@@ -0,0 +1,89 @@
+#include "access_log.h"
+#include "bench.h"
+#include "request.h"
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define RECORDS 1000000
+
+static const char TARGET[] = "/static/css/site.css?v=3";
+
+// What finishing a request costs the worker with the access log on. Records
+// go in bursts of half a ring, so the flusher can keep up and only the
+// worker's side is timed
+static double time_ring(AccessLogRing *ring, unsigned long long *dropped, double *flushed_per_sec)
+{
+    unsigned long long producing = 0, start = now_ns();
+    for (int burst = 0; burst < RECORDS / (ACCESS_LOG_RING_RECORDS / 2); burst++) {
+        unsigned long long burst_start = now_ns();
+        for (int i = 0; i < ACCESS_LOG_RING_RECORDS / 2; i++) {
+            AccessLogRecord *record = access_log_reserve(ring);
+            if (!record) {
+                (*dropped)++;
+                continue;
+            }
+            record->time = time(NULL);
+            record->bytes = 1234;
+            record->duration_ms = 0;
+            record->addr = 0x0100007f;
+            record->port = 0;
+            record->status = 200;
+            record->method = METHOD_GET;
+            record->minor_version = 1;
+            record->target_len = sizeof(TARGET) - 1;
+            memcpy(record->target, TARGET, sizeof(TARGET) - 1);
+            access_log_commit(ring);
+        }
+        producing += now_ns() - burst_start;
+        while (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) != ring->tail) {
+            sched_yield();
+        }
+    }
+    *flushed_per_sec = ring->tail / ((now_ns() - start) / 1e9);
+    return (double)producing / ring->tail;
+}
+
+// The same line written synchronously, as a worker printing to a log would
+static double time_stdio(FILE *out)
+{
+    unsigned long long start = now_ns();
+    for (int i = 0; i < RECORDS; i++) {
+        fprintf(out, "127.0.0.1 - - [%ld] \"GET %s HTTP/1.1\" 200 1234 0.000\n", (long)time(NULL), TARGET);
+        fflush(out);
+    }
+    return (double)(now_ns() - start) / RECORDS;
+}
+
+int main()
+{
+    if (access_log_open("/dev/null", 0) < 0) {
+        return 1;
+    }
+    AccessLogRing ring;
+    if (access_log_ring_init(&ring) < 0) {
+        return 1;
+    }
+    unsigned long long dropped = 0;
+    double flushed_per_sec;
+    double ring_ns = time_ring(&ring, &dropped, &flushed_per_sec);
+    access_log_ring_destroy(&ring);
+    access_log_close();
+
+    FILE *out = fopen("/dev/null", "w");
+    if (!out) {
+        return 1;
+    }
+    double stdio_ns = time_stdio(out);
+    fclose(out);
+
+    printf("%-24s %10s\n", "access log", "ns/request");
+    printf("%-24s %10.1f (%llu dropped)\n", "ring", ring_ns, dropped);
+    printf("%-24s %10.1f\n", "fprintf + fflush", stdio_ns);
+    printf("flusher formats %.0f records/s\n", flushed_per_sec);
+    bench_report("access_log.record", ring_ns, "ns");
+    bench_report("access_log.fprintf", stdio_ns, "ns");
+    bench_report("access_log.flusher", flushed_per_sec, "records/s");
+    return 0;
+}
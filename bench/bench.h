@@ -0,0 +1,41 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Each measurement runs at least this long
+#define MIN_BENCH_NS 300000000ULL
+
+static inline unsigned long long now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Append one result to the report named by $BENCH_REPORT, if it is set.
+ * Lines are "name value unit", tab separated, so reports from two commits
+ * can be joined on the name
+ * @param name Dotted name, stable across runs
+ * @param value Measured value
+ * @param unit What value counts, e.g. ns, rps or calls
+ */
+static inline void bench_report(const char *name, double value, const char *unit)
+{
+    const char *path = getenv("BENCH_REPORT");
+    if (!path || !*path) {
+        return;
+    }
+    FILE *report = fopen(path, "a");
+    if (!report) {
+        perror("Failed to open bench report");
+        return;
+    }
+    fprintf(report, "%s\t%.6g\t%s\n", name, value, unit);
+    fclose(report);
+}
+
+#endif // BENCH_H
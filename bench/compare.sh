@@ -0,0 +1,13 @@
+#!/bin/sh
+# Compare two bench reports entry by entry, both as sorted by make bench.
+# Usage: compare.sh OLD NEW
+if [ $# -ne 2 ]; then
+    echo "Usage: $0 OLD NEW" >&2
+    exit 1
+fi
+export LC_ALL=C
+printf "%-44s %14s %14s %9s  %s\n" name old new change unit
+join -t "$(printf '\t')" "$1" "$2" | awk -F '\t' '{
+    change = $2 != 0 ? ($4 - $2) / $2 * 100 : 0
+    printf "%-44s %14s %14s %+8.1f%%  %s\n", $1, $2, $4, change, $3
+}'
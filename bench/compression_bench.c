@@ -0,0 +1,109 @@
+#include "bench.h"
+#include "compression.h"
+#include "worker.h"
+#include <stdio.h>
+#include <string.h>
+#include <zlib.h>
+
+#define BODY_SIZE 8192
+
+static volatile size_t sink;
+
+// A JSON listing, about as repetitive as real API responses
+static size_t fill_body(char *body, size_t size)
+{
+    size_t len = 0;
+    for (int i = 0; len + 64 < size; i++) {
+        len += snprintf(body + len, size - len, "{\"id\":%d,\"name\":\"item-%d\",\"in_stock\":%s},", i, i * 7,
+            i % 3 ? "true" : "false");
+    }
+    return len;
+}
+
+int main()
+{
+    static const char *const HEADERS[] = {
+        "gzip, deflate, br, zstd",
+        "gzip;q=1.0, identity; q=0.5, *;q=0",
+    };
+    printf("%-40s %10s\n", "Accept-Encoding", "ns");
+    for (size_t i = 0; i < sizeof(HEADERS) / sizeof(HEADERS[0]); i++) {
+        StringView value = { .data = HEADERS[i], .len = strlen(HEADERS[i]) };
+        unsigned long long start = now_ns(), elapsed, calls = 0;
+        do {
+            for (int j = 0; j < 1000; j++) {
+                sink += parse_accept_encoding(&value);
+            }
+            calls += 1000;
+            elapsed = now_ns() - start;
+        } while (elapsed < MIN_BENCH_NS);
+        double ns = (double)elapsed / calls;
+        printf("%-40s %10.1f\n", HEADERS[i], ns);
+        char name[64];
+        snprintf(name, sizeof(name), "parse_accept_encoding.%zu", i);
+        bench_report(name, ns, "ns");
+    }
+
+    static char body[BODY_SIZE];
+    size_t body_len = fill_body(body, sizeof(body));
+
+    // What the server does: one deflate state per worker, reset per response
+    int levels[CONTENT_TYPE_COUNT];
+    default_compression_levels(levels);
+    static Worker worker;
+    compressor_init(&worker.compressor, levels, DEFAULT_COMPRESS_MIN_SIZE);
+    BufferPool pool;
+    buffer_pool_init(&pool);
+    ClientInfo client;
+    memset(&client, 0, sizeof(client));
+    client.worker = &worker;
+    client.accepted_encodings = ENCODING_BIT(CONTENT_ENCODING_GZIP);
+    arena_init(&client.arena, &pool);
+
+    size_t compressed_len = 0;
+    unsigned long long start = now_ns(), elapsed, calls = 0;
+    do {
+        for (int j = 0; j < 100; j++) {
+            Response res = { .status = STATUS_OK, .content_type = CONTENT_TYPE_JSON, .content_body = body,
+                .content_len = body_len };
+            compress_response(&client, &res);
+            compressed_len = res.content_len;
+            arena_reset(&client.arena);
+        }
+        calls += 100;
+        elapsed = now_ns() - start;
+    } while (elapsed < MIN_BENCH_NS);
+    double reused_ns = (double)elapsed / calls;
+
+    // The same with a fresh deflate state per response
+    static unsigned char out[BODY_SIZE * 2];
+    start = now_ns();
+    calls = 0;
+    do {
+        for (int j = 0; j < 100; j++) {
+            z_stream stream = { 0 };
+            deflateInit2(&stream, DEFAULT_COMPRESSION_LEVEL, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
+            stream.next_in = (Bytef *)body;
+            stream.avail_in = body_len;
+            stream.next_out = out;
+            stream.avail_out = sizeof(out);
+            deflate(&stream, Z_FINISH);
+            sink += stream.total_out;
+            deflateEnd(&stream);
+        }
+        calls += 100;
+        elapsed = now_ns() - start;
+    } while (elapsed < MIN_BENCH_NS);
+    double fresh_ns = (double)elapsed / calls;
+
+    printf("\ngzip level %d, %zu byte JSON body to %zu bytes\n", DEFAULT_COMPRESSION_LEVEL, body_len, compressed_len);
+    printf("%-24s %10.0f ns  %8.1f MB/s\n", "reused state", reused_ns, body_len * 1e3 / reused_ns);
+    printf("%-24s %10.0f ns  %8.1f MB/s\n", "state per response", fresh_ns, body_len * 1e3 / fresh_ns);
+    bench_report("compress_response.reused", reused_ns, "ns");
+    bench_report("compress_response.fresh_state", fresh_ns, "ns");
+    bench_report("compress_response.ratio", (double)compressed_len / body_len, "ratio");
+
+    compressor_destroy(&worker.compressor);
+    buffer_pool_destroy(&pool);
+    return 0;
+}
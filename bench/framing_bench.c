@@ -0,0 +1,110 @@
+#include "bench.h"
+#include "client_info.h"
+#include "http_utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define HEADER_PADDING 4096
+
+// What check_http_end did before framing became incremental: scan the whole
+// buffer from byte 0, one byte at a time, after every read
+static const char *byte_loop_find_headers_end(const char *buffer, size_t length)
+{
+    if (buffer == NULL || length < 4) {
+        return NULL;
+    }
+    for (size_t i = 0; i <= length - 4; i++) {
+        if (buffer[i] == '\r' && buffer[i + 1] == '\n' && buffer[i + 2] == '\r' && buffer[i + 3] == '\n') {
+            return &buffer[i];
+        }
+    }
+    return NULL;
+}
+
+// A GET with a few KB of cookies, so the terminator is far from the start
+static size_t build_request(char *buf, size_t size)
+{
+    size_t len = snprintf(buf, size, "GET /index.html HTTP/1.1\r\nHost: example.com\r\n"
+                                     "User-Agent: framing-bench\r\nCookie: ");
+    for (size_t i = 0; i < HEADER_PADDING; i++) {
+        buf[len++] = 'a' + i % 26;
+    }
+    len += snprintf(buf + len, size - len, "\r\nAccept: */*\r\n\r\n");
+    return len;
+}
+
+static volatile size_t sink;
+
+// Feed the request in segment sized reads, rescanning from 0 every time
+static void run_byte_loop(const char *request, size_t len, size_t segment)
+{
+    for (size_t used = segment < len ? segment : len;; used += segment) {
+        if (used > len)
+            used = len;
+        const char *end = byte_loop_find_headers_end(request, used);
+        if (end) {
+            sink += end - request;
+            return;
+        }
+    }
+}
+
+// Feed the request in segment sized reads through the resumable framer
+static void run_incremental(ClientInfo *client, char *request, size_t len, size_t segment)
+{
+    reset_http_framing(client);
+    client->buffer = request;
+    for (size_t used = segment < len ? segment : len;; used += segment) {
+        if (used > len)
+            used = len;
+        client->buf_used = used;
+        if (check_http_end(client)) {
+            sink += client->headers_len;
+            return;
+        }
+    }
+}
+
+int main()
+{
+    static char request[HEADER_PADDING + 256];
+    size_t len = build_request(request, sizeof(request));
+    const size_t segments[] = { 1, 100, 8192 };
+    ClientInfo client;
+    memset(&client, 0, sizeof(client));
+
+    printf("%-12s %10s %16s %16s %8s\n", "segment", "bytes", "byte loop ns", "incremental ns", "speedup");
+    for (size_t s = 0; s < sizeof(segments) / sizeof(size_t); s++) {
+        size_t segment = segments[s];
+        unsigned long long start, elapsed;
+        unsigned long long iterations;
+
+        iterations = 0;
+        start = now_ns();
+        do {
+            run_byte_loop(request, len, segment);
+            iterations++;
+            elapsed = now_ns() - start;
+        } while (elapsed < MIN_BENCH_NS);
+        double byte_loop_ns = (double)elapsed / iterations;
+
+        iterations = 0;
+        start = now_ns();
+        do {
+            run_incremental(&client, request, len, segment);
+            iterations++;
+            elapsed = now_ns() - start;
+        } while (elapsed < MIN_BENCH_NS);
+        double incremental_ns = (double)elapsed / iterations;
+
+        printf("%-12zu %10zu %16.1f %16.1f %7.1fx\n", segment, len, byte_loop_ns, incremental_ns,
+            byte_loop_ns / incremental_ns);
+        char name[64];
+        snprintf(name, sizeof(name), "framing.segment_%zu", segment);
+        bench_report(name, incremental_ns, "ns");
+    }
+
+    return 0;
+}
@@ -0,0 +1,199 @@
+#define _GNU_SOURCE
+#include "bench.h"
+#include "server.h"
+#include "worker.h"
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+// Reported per this many connections, measured over as many as fds allow
+#define IDLE_CONNECTIONS 100000
+// Enough to touch every pooled and loop buffer before measuring
+#define WARMUP_REQUESTS 4096
+// Twice the loop buffers io_uring provides
+#define PARTIAL_CONNECTIONS 2048
+#define PROBE_TIMEOUT_SECONDS 2
+#define REQUEST "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n"
+
+static void handle_request(ClientInfo *client, RequestOrError *req_or_err)
+{
+    static const char greeting[] = "Hello, World!";
+    Response res = { 0 };
+    res.status = req_or_err->has_error ? STATUS_BAD_REQUEST : STATUS_OK;
+    res.content_type = CONTENT_TYPE_PLAINTEXT;
+    res.content_len = sizeof(greeting) - 1;
+    res.content_body = (char *)greeting;
+    write_response(client, &res);
+}
+
+static size_t resident_bytes()
+{
+    unsigned long size, resident;
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (!statm || fscanf(statm, "%lu %lu", &size, &resident) != 2) {
+        perror("Failed to read /proc/self/statm");
+        exit(1);
+    }
+    fclose(statm);
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+static int connect_to(int port)
+{
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port) };
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("connect failed");
+        exit(1);
+    }
+    return fd;
+}
+
+static void request_once(int fd)
+{
+    if (send(fd, REQUEST, sizeof(REQUEST) - 1, MSG_NOSIGNAL) != sizeof(REQUEST) - 1) {
+        perror("send failed");
+        exit(1);
+    }
+    char buf[1024];
+    size_t received = 0;
+    while (!memmem(buf, received, "Hello, World!", 13)) {
+        ssize_t n = recv(fd, buf + received, sizeof(buf) - received, 0);
+        if (n <= 0) {
+            fprintf(stderr, "connection lost\n");
+            exit(1);
+        }
+        received += n;
+    }
+}
+
+// A keep-alive connection that has had one request answered and now sits idle
+static int open_idle_connection(int port)
+{
+    int fd = connect_to(port);
+    request_once(fd);
+    return fd;
+}
+
+// Connections that each sent the first byte of a request and went quiet,
+// more of them than the loop has buffers, must not keep a new request from
+// being answered
+static bool serves_beside_partial_requests(int port, int *fds, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        fds[i] = connect_to(port);
+        if (send(fds[i], "G", 1, MSG_NOSIGNAL) != 1) {
+            perror("send failed");
+            exit(1);
+        }
+    }
+    usleep(200000);
+
+    int probe = connect_to(port);
+    struct timeval timeout = { .tv_sec = PROBE_TIMEOUT_SECONDS };
+    setsockopt(probe, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    bool served = false;
+    char buf[1024];
+    size_t received = 0;
+    if (send(probe, REQUEST, sizeof(REQUEST) - 1, MSG_NOSIGNAL) == sizeof(REQUEST) - 1) {
+        while (!(served = memmem(buf, received, "Hello, World!", 13) != NULL) && received < sizeof(buf)) {
+            ssize_t n = recv(probe, buf + received, sizeof(buf) - received, 0);
+            if (n <= 0) {
+                break;
+            }
+            received += n;
+        }
+    }
+    close(probe);
+    for (size_t i = 0; i < count; i++) {
+        close(fds[i]);
+    }
+    return served;
+}
+
+int main()
+{
+    const char *backends[] = { "epoll", "io_uring" };
+
+    // Both ends of every connection live in this process
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    size_t count = (limit.rlim_cur - 256) / 2;
+    count = count < IDLE_CONNECTIONS ? count : IDLE_CONNECTIONS;
+    int *fds = malloc(count * sizeof(int));
+    if (!fds) {
+        return 1;
+    }
+
+    int failed = 0;
+    printf("%-10s %12s %16s %14s\n", "backend", "connections", "MB per 100k", "bytes each");
+    for (size_t b = 0; b < sizeof(backends) / sizeof(char *); b++) {
+        ServerConfig config;
+        init_server_config(&config);
+        config.port = 0;
+        config.backend = backends[b];
+        config.handler = handle_request;
+        config.keep_alive_timeout_ms = 0;
+        config.metrics_path = NULL;
+
+        Worker *worker = create_worker(&config, 0, -1);
+        if (!worker) {
+            printf("%-10s unavailable\n", backends[b]);
+            continue;
+        }
+        struct sockaddr_in addr;
+        socklen_t addr_len = sizeof(addr);
+        getsockname(worker->listen_handle.fd, (struct sockaddr *)&addr, &addr_len);
+        int port = ntohs(addr.sin_port);
+        if (start_worker(worker) < 0) {
+            perror("Failed to start worker");
+            return 1;
+        }
+
+        // Only the connections should count, not pools and io_uring's
+        // buffer ring filling up
+        int warmup = open_idle_connection(port);
+        for (int i = 0; i < WARMUP_REQUESTS; i++) {
+            request_once(warmup);
+        }
+        close(warmup);
+        usleep(100000);
+        size_t before = resident_bytes();
+        for (size_t i = 0; i < count; i++) {
+            fds[i] = open_idle_connection(port);
+        }
+        // The last responses' sends complete on the worker's own time
+        usleep(200000);
+        double per_connection = (double)(resident_bytes() - before) / count;
+
+        printf("%-10s %12zu %16.1f %14.0f\n", backends[b], count, per_connection * IDLE_CONNECTIONS / 1e6,
+            per_connection);
+        char name[64];
+        snprintf(name, sizeof(name), "idle.%s.rss_per_100k", backends[b]);
+        bench_report(name, per_connection * IDLE_CONNECTIONS / 1e6, "MB");
+
+        for (size_t i = 0; i < count; i++) {
+            close(fds[i]);
+        }
+        usleep(200000);
+
+        size_t partial = count < PARTIAL_CONNECTIONS ? count : PARTIAL_CONNECTIONS;
+        if (!serves_beside_partial_requests(port, fds, partial)) {
+            printf("%-10s not served beside %zu partial requests\n", backends[b], partial);
+            failed = 1;
+        }
+        usleep(200000);
+        // Workers run until the process exits
+    }
+    free(fds);
+    printf(failed ? "FAIL: requests starved by partial ones\n" : "OK: requests served beside partial ones\n");
+    return failed;
+}
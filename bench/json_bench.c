@@ -0,0 +1,148 @@
+#include "bench.h"
+#include "json.h"
+#include "worker.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define BASELINE_BUFFER_SIZE (1 << 20)
+
+static volatile size_t sink;
+
+static const char *const TAGS[] = { "new", "sale", "popular" };
+
+// Run op until MIN_BENCH_NS has passed, returns ns per call
+#define TIME_OP(op)                                             \
+    ({                                                          \
+        unsigned long long start = now_ns(), elapsed, calls = 0; \
+        do {                                                    \
+            for (int i = 0; i < 100; i++) {                     \
+                op;                                             \
+            }                                                   \
+            calls += 100;                                       \
+            elapsed = now_ns() - start;                         \
+        } while (elapsed < MIN_BENCH_NS);                       \
+        (double)elapsed / calls;                                \
+    })
+
+// The same page GET /items answers with
+static void write_items(ClientInfo *client, long count)
+{
+    JsonWriter json;
+    json_begin(&json, client, STATUS_OK);
+    json_object_begin(&json);
+    json_key(&json, "count");
+    json_int(&json, count);
+    json_key(&json, "items");
+    json_array_begin(&json);
+    for (long i = 0; i < count; i++) {
+        char name[32];
+        int name_len = snprintf(name, sizeof(name), "Item \"%ld\"", i);
+        json_object_begin(&json);
+        json_key(&json, "id");
+        json_int(&json, i);
+        json_key(&json, "name");
+        json_string(&json, name, name_len);
+        json_key(&json, "price");
+        json_double(&json, (i % 1000) * 0.25 + 0.99);
+        json_key(&json, "in_stock");
+        json_bool(&json, i % 7 != 0);
+        json_key(&json, "tags");
+        json_array_begin(&json);
+        json_string(&json, TAGS[i % 3], strlen(TAGS[i % 3]));
+        json_array_end(&json);
+        json_object_end(&json);
+    }
+    json_array_end(&json);
+    json_object_end(&json);
+    json_end(&json);
+}
+
+// What handlers did before: format into a buffer of their own, with no
+// escaping, then copy it into request memory for the response
+static void write_items_snprintf(ClientInfo *client, long count, char *buf)
+{
+    size_t len = snprintf(buf, BASELINE_BUFFER_SIZE, "{\"count\":%ld,\"items\":[", count);
+    for (long i = 0; i < count; i++) {
+        len += snprintf(buf + len, BASELINE_BUFFER_SIZE - len,
+            "%s{\"id\":%ld,\"name\":\"Item \\\"%ld\\\"\",\"price\":%.17g,\"in_stock\":%s,\"tags\":[\"%s\"]}",
+            i > 0 ? "," : "", i, i, (i % 1000) * 0.25 + 0.99, i % 7 != 0 ? "true" : "false", TAGS[i % 3]);
+    }
+    len += snprintf(buf + len, BASELINE_BUFFER_SIZE - len, "]}");
+
+    Response res = { 0 };
+    res.status = STATUS_OK;
+    res.content_type = CONTENT_TYPE_JSON;
+    res.content_body = client_alloc(client, len);
+    res.content_len = len;
+    memcpy(res.content_body, buf, len);
+    write_response(client, &res);
+}
+
+// Send what a response queued and read it back, the way a client would.
+// Large pages flush as they are written, so both ways are sent
+static void send_client(ClientInfo *client, int peer)
+{
+    char buf[64 * 1024];
+    flush_client(client);
+    ssize_t len;
+    while ((len = read(peer, buf, sizeof(buf))) > 0) {
+        sink += len;
+    }
+}
+
+int main()
+{
+    // A client on one end of a socket pair, read back from the other
+    ServerConfig config;
+    init_server_config(&config);
+    Worker *worker = calloc(1, sizeof(Worker));
+    Connection *conn = calloc(1, sizeof(Connection));
+    ClientInfo *client = calloc(1, sizeof(ClientInfo));
+    char *baseline = malloc(BASELINE_BUFFER_SIZE);
+    int fds[2];
+    if (!worker || !conn || !client || !baseline
+        || socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds) < 0) {
+        return 1;
+    }
+    worker->config = &config;
+    worker->loop = create_event_loop("epoll");
+    if (!worker->loop) {
+        return 1;
+    }
+    conn->handle.fd = fds[0];
+    conn->worker = worker;
+    conn->client = client;
+    buffer_pool_init(&worker->buffers);
+    metrics_init(&worker->metrics, DEFAULT_METRICS_SAMPLE);
+    // Serializing is what's measured, compression_bench has gzip
+    worker->compressor.min_size = SIZE_MAX;
+    client->worker = worker;
+    client->conn = conn;
+    client->keep_alive = true;
+    arena_init(&client->arena, &worker->buffers);
+
+    const long counts[] = { 1, 10, 1000 };
+    char name[64];
+    printf("%-8s %14s %14s %10s\n", "items", "snprintf ns", "writer ns", "speedup");
+    for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+        long count = counts[c];
+        double baseline_ns = TIME_OP({
+            write_items_snprintf(client, count, baseline);
+            send_client(client, fds[1]);
+        });
+        double writer_ns = TIME_OP({
+            write_items(client, count);
+            send_client(client, fds[1]);
+        });
+        printf("%-8ld %14.1f %14.1f %9.1fx\n", count, baseline_ns, writer_ns, baseline_ns / writer_ns);
+        snprintf(name, sizeof(name), "json.snprintf.items_%ld", count);
+        bench_report(name, baseline_ns, "ns");
+        snprintf(name, sizeof(name), "json.writer.items_%ld", count);
+        bench_report(name, writer_ns, "ns");
+    }
+    return 0;
+}
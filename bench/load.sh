@@ -0,0 +1,70 @@
+#!/bin/sh
+# Load tests against the optimized server, every scenario on every backend.
+# Usage: load.sh SERVER LOADGEN
+# LOAD_DURATION, LOAD_WORKERS, LOAD_RATE and LOAD_PORT override the defaults. The proxied
+# scenario starts a second server on LOAD_PORT + 1 as its backend. Each worker admits at most
+# MAX_CONNECTIONS connections, more than any scenario but the overloaded one opens
+SERVER=$1
+LOADGEN=$2
+PORT=${LOAD_PORT:-18080}
+DURATION=${LOAD_DURATION:-2}
+WORKERS=${LOAD_WORKERS:-1}
+RATE=${LOAD_RATE:-20000}
+UPSTREAM_PORT=$((PORT + 1))
+MAX_CONNECTIONS=64
+
+run() {
+    name=$1
+    shift
+    "$LOADGEN" --port "$PORT" --duration "$DURATION" --name "load.$backend.$name" "$@" || status=1
+}
+
+status=0
+# A second instance stands in for the backend of the proxied scenario
+"$SERVER" --port "$UPSTREAM_PORT" --workers 1 --no-pin > /dev/null 2>&1 &
+upstream=$!
+
+for backend in epoll io_uring; do
+    "$SERVER" --port "$PORT" --backend "$backend" --workers "$WORKERS" --no-pin \
+        --max-connections "$MAX_CONNECTIONS" --proxy "/hello/proxied=127.0.0.1:$UPSTREAM_PORT" > /dev/null 2>&1 &
+    server=$!
+
+    # Wait until it accepts connections, probes stay out of the report
+    tries=0
+    until BENCH_REPORT= "$LOADGEN" --port "$PORT" --connections 1 --duration 0.01 --warmup 0 > /dev/null 2>&1; do
+        tries=$((tries + 1))
+        if ! kill -0 "$server" 2> /dev/null || [ "$tries" -ge 50 ]; then
+            echo "$backend: server did not start, skipped"
+            kill "$server" 2> /dev/null
+            continue 2
+        fi
+        sleep 0.1
+    done
+
+    run keep_alive --connections 16
+    run pipelined --connections 16 --depth 16
+    run cached --connections 16 --path /hello/bench
+    run connection_per_request --connections 8 --close
+    run post_4k --connections 16 --payload 4096
+    run open_loop --connections 16 --rate "$RATE"
+    run proxied --connections 16 --path /hello/proxied
+    run json --connections 16 --path "/items?count=10"
+    run json_chunked --connections 16 --path "/items?count=1000"
+    # Cheap requests while large transforms keep the offload threads busy,
+    # their latency shouldn't move
+    BENCH_REPORT= "$LOADGEN" --port "$PORT" --duration "$DURATION" --connections 4 --path /transform \
+        --payload 262144 > /dev/null 2>&1 &
+    heavy=$!
+    run beside_offloaded --connections 16
+    wait "$heavy"
+    # Half again as many connections as are admitted, the rest are shed with
+    # 503s, which count as errors, and reconnect
+    run overloaded --connections $((MAX_CONNECTIONS * WORKERS * 3 / 2))
+
+    kill "$server"
+    wait "$server" 2> /dev/null
+done
+
+kill "$upstream"
+wait "$upstream" 2> /dev/null
+exit $status
@@ -0,0 +1,654 @@
+// HTTP/1.1 load generator for benchmarking the server. Closed loop keeps
+// every connection's pipeline full; open loop sends at a fixed rate and
+// measures latency from when each request was due rather than when it went
+// out, so a stalled server can't hide its queueing delay
+#define _GNU_SOURCE
+#include "bench.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#define MAX_DEPTH 256
+#define MAX_EVENTS 256
+#define MAX_RESPONSE_HEADERS 8192
+#define BACKLOG_SIZE (1 << 20) // Open loop requests due while every pipeline is full
+
+// Log-linear latency buckets, 128 per power of two, so percentiles are
+// within 1% of the true value
+#define SUB_BITS 7
+#define SUB_BUCKETS (1 << SUB_BITS)
+#define MAX_SHIFT 40
+#define BUCKETS ((MAX_SHIFT - SUB_BITS + 2) * SUB_BUCKETS)
+
+typedef struct Options {
+    const char *host;
+    int port;
+    int connections;
+    int depth; // Requests in flight per connection
+    double duration; // Seconds measured
+    double warmup; // Seconds run before measuring
+    double rate; // Requests per second across all connections, 0 for closed loop
+    size_t payload; // POST body size, 0 sends GETs
+    const char *path;
+    bool close; // A new connection for every request
+    const char *name; // Prefix of the report entries
+} Options;
+
+// Where in a chunked body the reader is, framing is read a byte at a time
+typedef enum ChunkState {
+    CHUNK_NONE, // Body has a Content-Length
+    CHUNK_SIZE,
+    CHUNK_EXTENSION, // Rest of the size line
+    CHUNK_DATA, // body_left counts the chunk and its CRLF
+    CHUNK_TRAILER, // At the start of a trailer line
+    CHUNK_TRAILER_LINE,
+    CHUNK_DONE,
+} ChunkState;
+
+typedef struct Connection {
+    int fd;
+    bool connected;
+    uint64_t due[MAX_DEPTH]; // When each request in flight was due, oldest first
+    unsigned due_head;
+    unsigned in_flight;
+    size_t out_pos; // Offset into the repeated request stream
+    size_t out_left; // Bytes queued and not sent yet
+    // Response being read
+    char headers[MAX_RESPONSE_HEADERS];
+    size_t headers_len;
+    size_t body_left;
+    bool in_body;
+    ChunkState chunk_state;
+    int status;
+} Connection;
+
+typedef struct LoadGen {
+    Options options;
+    int epoll_fd;
+    int timer_fd;
+    Connection *connections;
+    char *requests; // MAX_DEPTH + 1 copies of the request back to back
+    size_t request_len;
+    uint64_t start;
+    uint64_t measure_from;
+    uint64_t end;
+    // Open loop
+    uint64_t interval; // ns between requests
+    uint64_t next_due;
+    uint64_t *backlog;
+    size_t backlog_head;
+    size_t backlog_count;
+    int next_connection;
+    // Results, for requests due within the measured window
+    uint64_t completed;
+    uint64_t errors; // Responses other than 2xx and 3xx, and connections lost
+    uint64_t latency[BUCKETS];
+    uint64_t latency_max;
+} LoadGen;
+
+static size_t bucket_index(uint64_t ns)
+{
+    if (ns < SUB_BUCKETS) {
+        return ns;
+    }
+    unsigned shift = 63 - __builtin_clzll(ns);
+    if (shift > MAX_SHIFT) {
+        return BUCKETS - 1;
+    }
+    return (size_t)(shift - SUB_BITS + 1) * SUB_BUCKETS + ((ns >> (shift - SUB_BITS)) & (SUB_BUCKETS - 1));
+}
+
+// Middle of a bucket's range
+static double bucket_value(size_t index)
+{
+    if (index < SUB_BUCKETS) {
+        return index;
+    }
+    unsigned shift = index / SUB_BUCKETS + SUB_BITS - 1;
+    uint64_t low = (uint64_t)(SUB_BUCKETS + index % SUB_BUCKETS) << (shift - SUB_BITS);
+    return low + ((1ULL << (shift - SUB_BITS)) - 1) / 2.0;
+}
+
+static double percentile(const LoadGen *gen, double fraction)
+{
+    uint64_t rank = (uint64_t)(fraction * gen->completed + 0.5);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < BUCKETS; i++) {
+        seen += gen->latency[i];
+        if (seen >= rank && seen > 0) {
+            return bucket_value(i);
+        }
+    }
+    return 0;
+}
+
+static void build_requests(LoadGen *gen)
+{
+    const Options *options = &gen->options;
+    char headers[512];
+    int len;
+    if (options->payload > 0) {
+        len = snprintf(headers, sizeof(headers),
+            "POST %s HTTP/1.1\r\nHost: %s\r\nContent-Type: application/octet-stream\r\nContent-Length: %zu\r\n%s\r\n",
+            options->path, options->host, options->payload, options->close ? "Connection: close\r\n" : "");
+    } else {
+        len = snprintf(headers, sizeof(headers), "GET %s HTTP/1.1\r\nHost: %s\r\n%s\r\n", options->path,
+            options->host, options->close ? "Connection: close\r\n" : "");
+    }
+    gen->request_len = len + options->payload;
+    gen->requests = malloc(gen->request_len * (MAX_DEPTH + 1));
+    if (!gen->requests) {
+        perror("malloc");
+        exit(1);
+    }
+    for (int i = 0; i <= MAX_DEPTH; i++) {
+        char *request = gen->requests + i * gen->request_len;
+        memcpy(request, headers, len);
+        memset(request + len, 'x', options->payload);
+    }
+}
+
+static void open_connection(LoadGen *gen, Connection *conn)
+{
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(gen->options.port) };
+    if (inet_pton(AF_INET, gen->options.host, &addr.sin_addr) != 1) {
+        fprintf(stderr, "Invalid address %s\n", gen->options.host);
+        exit(1);
+    }
+    conn->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (conn->fd < 0) {
+        perror("socket");
+        exit(1);
+    }
+    int opt = 1;
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+    if (connect(conn->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS) {
+        perror("connect");
+        exit(1);
+    }
+    conn->connected = false;
+    conn->headers_len = 0;
+    conn->in_body = false;
+    conn->chunk_state = CHUNK_NONE;
+
+    struct epoll_event event = { .events = EPOLLIN | EPOLLOUT | EPOLLET, .data.ptr = conn };
+    if (epoll_ctl(gen->epoll_fd, EPOLL_CTL_ADD, conn->fd, &event) < 0) {
+        perror("epoll_ctl");
+        exit(1);
+    }
+}
+
+// Queue one request that was due at the given time
+static void queue_request(LoadGen *gen, Connection *conn, uint64_t due)
+{
+    conn->due[(conn->due_head + conn->in_flight) % MAX_DEPTH] = due;
+    conn->in_flight++;
+    conn->out_left += gen->request_len;
+}
+
+static void flush_connection(LoadGen *gen, Connection *conn)
+{
+    while (conn->connected && conn->out_left > 0) {
+        size_t stream_len = gen->request_len * (MAX_DEPTH + 1);
+        size_t len = conn->out_left < stream_len - conn->out_pos ? conn->out_left : stream_len - conn->out_pos;
+        ssize_t sent = send(conn->fd, gen->requests + conn->out_pos, len, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                conn->connected = false;
+            }
+            return;
+        }
+        conn->out_left -= sent;
+        conn->out_pos = (conn->out_pos + sent) % gen->request_len;
+    }
+}
+
+static bool accepts_more(const LoadGen *gen, const Connection *conn)
+{
+    return conn->in_flight < (unsigned)gen->options.depth;
+}
+
+// Closed loop refills a connection's pipeline; open loop hands it requests
+// that came due while every pipeline was full
+static void refill(LoadGen *gen, Connection *conn, uint64_t now)
+{
+    while (accepts_more(gen, conn)) {
+        if (gen->options.rate == 0) {
+            queue_request(gen, conn, now);
+        } else if (gen->backlog_count > 0) {
+            queue_request(gen, conn, gen->backlog[gen->backlog_head]);
+            gen->backlog_head = (gen->backlog_head + 1) % BACKLOG_SIZE;
+            gen->backlog_count--;
+        } else {
+            break;
+        }
+    }
+}
+
+static void record_response(LoadGen *gen, Connection *conn, uint64_t now)
+{
+    uint64_t due = conn->due[conn->due_head];
+    conn->due_head = (conn->due_head + 1) % MAX_DEPTH;
+    conn->in_flight--;
+    if (due < gen->measure_from || due >= gen->end) {
+        return;
+    }
+    gen->completed++;
+    if (conn->status < 200 || conn->status >= 400) {
+        gen->errors++;
+    }
+    uint64_t latency = now - due;
+    gen->latency[bucket_index(latency)]++;
+    if (latency > gen->latency_max) {
+        gen->latency_max = latency;
+    }
+}
+
+// Find the status and the body's framing once a response's headers are in
+static bool parse_response_headers(Connection *conn, size_t headers_len)
+{
+    conn->headers[headers_len - 1] = '\0';
+    if (sscanf(conn->headers, "HTTP/1.%*d %d", &conn->status) != 1) {
+        return false;
+    }
+    conn->body_left = 0;
+    conn->chunk_state = CHUNK_NONE;
+    for (char *line = strstr(conn->headers, "\r\n"); line; line = strstr(line + 2, "\r\n")) {
+        if (strncasecmp(line + 2, "Content-Length:", 15) == 0) {
+            conn->body_left = strtoull(line + 17, NULL, 10);
+        } else if (strncasecmp(line + 2, "Transfer-Encoding: chunked", 26) == 0) {
+            conn->chunk_state = CHUNK_SIZE;
+        }
+    }
+    return true;
+}
+
+static int hex_value(char c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    c |= 0x20;
+    return c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+}
+
+// Step through one byte of chunk framing
+static void read_chunk_framing(Connection *conn, char c)
+{
+    switch (conn->chunk_state) {
+    case CHUNK_SIZE:
+        if (hex_value(c) >= 0) {
+            conn->body_left = conn->body_left * 16 + hex_value(c);
+            break;
+        }
+        conn->chunk_state = CHUNK_EXTENSION;
+        // fall through
+    case CHUNK_EXTENSION:
+        if (c == '\n') {
+            conn->chunk_state = conn->body_left > 0 ? CHUNK_DATA : CHUNK_TRAILER;
+            conn->body_left += conn->body_left > 0 ? 2 : 0;
+        }
+        break;
+    case CHUNK_TRAILER:
+        if (c == '\n') {
+            conn->chunk_state = CHUNK_DONE;
+        } else if (c != '\r') {
+            conn->chunk_state = CHUNK_TRAILER_LINE;
+        }
+        break;
+    case CHUNK_TRAILER_LINE:
+        if (c == '\n') {
+            conn->chunk_state = CHUNK_TRAILER;
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+// Consume received bytes, returns false if the response is garbled
+static bool consume_response_bytes(LoadGen *gen, Connection *conn, const char *data, size_t len, uint64_t now)
+{
+    while (len > 0) {
+        if (conn->in_body && conn->chunk_state != CHUNK_NONE && conn->chunk_state != CHUNK_DATA) {
+            read_chunk_framing(conn, *data);
+            data++;
+            len--;
+        } else if (conn->in_body) {
+            size_t take = len < conn->body_left ? len : conn->body_left;
+            conn->body_left -= take;
+            data += take;
+            len -= take;
+            if (conn->chunk_state == CHUNK_DATA && conn->body_left == 0) {
+                conn->chunk_state = CHUNK_SIZE;
+            }
+        } else {
+            // Headers are copied until their end is found, the body only counted
+            size_t take = len < MAX_RESPONSE_HEADERS - conn->headers_len ? len : MAX_RESPONSE_HEADERS - conn->headers_len;
+            if (take == 0) {
+                return false;
+            }
+            memcpy(conn->headers + conn->headers_len, data, take);
+            size_t scan_from = conn->headers_len > 3 ? conn->headers_len - 3 : 0;
+            conn->headers_len += take;
+            char *end = memmem(conn->headers + scan_from, conn->headers_len - scan_from, "\r\n\r\n", 4);
+            if (!end) {
+                data += take;
+                len -= take;
+                continue;
+            }
+            size_t headers_len = end + 4 - conn->headers;
+            size_t used = take - (conn->headers_len - headers_len);
+            data += used;
+            len -= used;
+            if (!parse_response_headers(conn, headers_len)) {
+                return false;
+            }
+            conn->in_body = true;
+        }
+
+        bool body_done = conn->chunk_state == CHUNK_NONE ? conn->body_left == 0 : conn->chunk_state == CHUNK_DONE;
+        if (conn->in_body && body_done) {
+            if (conn->in_flight == 0) {
+                return false;
+            }
+            record_response(gen, conn, now);
+            conn->in_body = false;
+            conn->headers_len = 0;
+            conn->chunk_state = CHUNK_NONE;
+        }
+    }
+    return true;
+}
+
+static void restart_connection(LoadGen *gen, Connection *conn, bool failed, uint64_t now)
+{
+    if (failed && conn->in_flight > 0) {
+        gen->errors += conn->in_flight;
+    }
+    close(conn->fd);
+    conn->in_flight = 0;
+    conn->out_left = 0;
+    conn->out_pos = 0;
+    if (now < gen->end) {
+        open_connection(gen, conn);
+        refill(gen, conn, now);
+    }
+}
+
+static void handle_connection(LoadGen *gen, Connection *conn, uint32_t events)
+{
+    uint64_t now = now_ns();
+    if (!conn->connected && (events & EPOLLOUT)) {
+        int err = 0;
+        socklen_t err_len = sizeof(err);
+        getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &err_len);
+        if (err != 0) {
+            errno = err;
+            perror("connect");
+            exit(1);
+        }
+        conn->connected = true;
+    }
+
+    char buf[65536];
+    while (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        ssize_t n = recv(conn->fd, buf, sizeof(buf), 0);
+        if (n > 0) {
+            if (!consume_response_bytes(gen, conn, buf, n, now)) {
+                restart_connection(gen, conn, true, now);
+                return;
+            }
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        // Closed, expected after each response with --close
+        restart_connection(gen, conn, conn->in_flight > 0, now);
+        return;
+    }
+
+    // With --close the server's close is what starts the next connection
+    if (now < gen->end && !gen->options.close) {
+        refill(gen, conn, now);
+    }
+    flush_connection(gen, conn);
+}
+
+// Open loop: hand out every request that has come due
+static void send_due_requests(LoadGen *gen)
+{
+    uint64_t now = now_ns();
+    while (gen->next_due <= now && gen->next_due < gen->end) {
+        Connection *target = NULL;
+        for (int i = 0; i < gen->options.connections; i++) {
+            Connection *conn = &gen->connections[(gen->next_connection + i) % gen->options.connections];
+            if (accepts_more(gen, conn)) {
+                target = conn;
+                gen->next_connection = (gen->next_connection + i + 1) % gen->options.connections;
+                break;
+            }
+        }
+        if (target) {
+            queue_request(gen, target, gen->next_due);
+            flush_connection(gen, target);
+        } else if (gen->backlog_count < BACKLOG_SIZE) {
+            gen->backlog[(gen->backlog_head + gen->backlog_count) % BACKLOG_SIZE] = gen->next_due;
+            gen->backlog_count++;
+        } else {
+            fprintf(stderr, "Server fell more than %d requests behind the rate\n", BACKLOG_SIZE);
+            exit(1);
+        }
+        gen->next_due += gen->interval;
+    }
+
+    struct itimerspec when = { 0 };
+    when.it_value.tv_sec = gen->next_due / 1000000000ULL;
+    when.it_value.tv_nsec = gen->next_due % 1000000000ULL;
+    timerfd_settime(gen->timer_fd, TFD_TIMER_ABSTIME, &when, NULL);
+}
+
+static void run(LoadGen *gen)
+{
+    const Options *options = &gen->options;
+    gen->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    gen->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (gen->epoll_fd < 0 || gen->timer_fd < 0) {
+        perror("epoll_create1");
+        exit(1);
+    }
+    struct epoll_event timer_event = { .events = EPOLLIN, .data.ptr = NULL };
+    epoll_ctl(gen->epoll_fd, EPOLL_CTL_ADD, gen->timer_fd, &timer_event);
+
+    gen->connections = calloc(options->connections, sizeof(Connection));
+    if (!gen->connections) {
+        perror("calloc");
+        exit(1);
+    }
+    gen->start = now_ns();
+    gen->measure_from = gen->start + (uint64_t)(options->warmup * 1e9);
+    gen->end = gen->measure_from + (uint64_t)(options->duration * 1e9);
+    for (int i = 0; i < options->connections; i++) {
+        open_connection(gen, &gen->connections[i]);
+        if (options->rate == 0) {
+            refill(gen, &gen->connections[i], gen->start);
+        }
+    }
+    if (options->rate > 0) {
+        gen->interval = (uint64_t)(1e9 / options->rate);
+        gen->next_due = gen->start;
+        gen->backlog = malloc(BACKLOG_SIZE * sizeof(uint64_t));
+        if (!gen->backlog) {
+            perror("malloc");
+            exit(1);
+        }
+        send_due_requests(gen);
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    while (now_ns() < gen->end) {
+        int timeout = (int)((gen->end - now_ns()) / 1000000) + 1;
+        int n = epoll_wait(gen->epoll_fd, events, MAX_EVENTS, timeout);
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL) {
+                uint64_t expirations;
+                ssize_t unused = read(gen->timer_fd, &expirations, sizeof(expirations));
+                (void)unused;
+                send_due_requests(gen);
+            } else {
+                handle_connection(gen, events[i].data.ptr, events[i].events);
+            }
+        }
+    }
+}
+
+static void report(const LoadGen *gen)
+{
+    const Options *options = &gen->options;
+    double rps = gen->completed / options->duration;
+    double p50 = percentile(gen, 0.5) / 1000, p99 = percentile(gen, 0.99) / 1000;
+    double p999 = percentile(gen, 0.999) / 1000;
+
+    printf("%s: %s loop, %d connections, depth %d, %s%zu byte bodies, %.1fs\n", options->name,
+        options->rate > 0 ? "open" : "closed", options->connections, options->depth,
+        options->close ? "connection per request, " : "", options->payload, options->duration);
+    printf("  requests %llu  rps %.0f  errors %llu\n", (unsigned long long)gen->completed, rps,
+        (unsigned long long)gen->errors);
+    printf("  latency us  p50 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n", p50, p99, p999, gen->latency_max / 1000.0);
+
+    char name[128];
+#define REPORT(suffix, value, unit)                                    \
+    do {                                                               \
+        snprintf(name, sizeof(name), "%s.%s", options->name, suffix); \
+        bench_report(name, value, unit);                               \
+    } while (0)
+    REPORT("rps", rps, "rps");
+    REPORT("p50", p50, "us");
+    REPORT("p99", p99, "us");
+    REPORT("p999", p999, "us");
+    REPORT("errors", gen->errors, "requests");
+#undef REPORT
+}
+
+static void print_usage(const char *program)
+{
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  -a, --host ADDR       IPv4 address of the server (default 127.0.0.1)\n"
+        "  -p, --port PORT       Port of the server (default 8080)\n"
+        "  -c, --connections N   Connections kept open (default 16)\n"
+        "  -d, --depth N         Pipelined requests in flight per connection (default 1, at most %d)\n"
+        "  -t, --duration SECONDS\n"
+        "                        Time measured (default 3)\n"
+        "  -w, --warmup SECONDS  Time run before measuring (default 1)\n"
+        "  -r, --rate N          Open loop at N requests per second, 0 for closed loop (default 0)\n"
+        "  -s, --payload BYTES   POST bodies of this size instead of GETs (default 0)\n"
+        "  -u, --path PATH       Request target (default /)\n"
+        "      --close           Open a new connection for every request\n"
+        "  -n, --name NAME       Prefix of this run's report entries (default load)\n"
+        "Results are appended to $BENCH_REPORT if it is set\n",
+        program, MAX_DEPTH);
+}
+
+int main(int argc, char **argv)
+{
+    static LoadGen gen;
+    Options *options = &gen.options;
+    *options = (Options) {
+        .host = "127.0.0.1",
+        .port = 8080,
+        .connections = 16,
+        .depth = 1,
+        .duration = 3,
+        .warmup = 1,
+        .path = "/",
+        .name = "load",
+    };
+
+    static const struct option OPTIONS[] = {
+        { "host", required_argument, NULL, 'a' },
+        { "port", required_argument, NULL, 'p' },
+        { "connections", required_argument, NULL, 'c' },
+        { "depth", required_argument, NULL, 'd' },
+        { "duration", required_argument, NULL, 't' },
+        { "warmup", required_argument, NULL, 'w' },
+        { "rate", required_argument, NULL, 'r' },
+        { "payload", required_argument, NULL, 's' },
+        { "path", required_argument, NULL, 'u' },
+        { "close", no_argument, NULL, 'C' },
+        { "name", required_argument, NULL, 'n' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 },
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "a:p:c:d:t:w:r:s:u:n:h", OPTIONS, NULL)) != -1) {
+        switch (opt) {
+        case 'a':
+            options->host = optarg;
+            break;
+        case 'p':
+            options->port = atoi(optarg);
+            break;
+        case 'c':
+            options->connections = atoi(optarg);
+            break;
+        case 'd':
+            options->depth = atoi(optarg);
+            break;
+        case 't':
+            options->duration = strtod(optarg, NULL);
+            break;
+        case 'w':
+            options->warmup = strtod(optarg, NULL);
+            break;
+        case 'r':
+            options->rate = strtod(optarg, NULL);
+            break;
+        case 's':
+            options->payload = strtoul(optarg, NULL, 10);
+            break;
+        case 'u':
+            options->path = optarg;
+            break;
+        case 'C':
+            options->close = true;
+            break;
+        case 'n':
+            options->name = optarg;
+            break;
+        default:
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    // A connection that closes after every response carries one at a time
+    if (options->close) {
+        options->depth = 1;
+    }
+    if (options->port <= 0 || options->connections <= 0 || options->depth <= 0 || options->depth > MAX_DEPTH
+        || options->duration <= 0 || options->warmup < 0 || options->rate < 0) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    build_requests(&gen);
+    run(&gen);
+    report(&gen);
+    return 0;
+}
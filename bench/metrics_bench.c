@@ -0,0 +1,81 @@
+#include "bench.h"
+#include "metrics.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static volatile size_t sink;
+
+// Stand in for a stage's work, so the compiler can't fold the timing away
+static inline void work(size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        sink += i;
+    }
+}
+
+// Everything the server records for one keep-alive request: bytes in and
+// out, the read, parse, handler and write stages, and the request count
+static void serve_request(Metrics *metrics, bool instrumented)
+{
+    if (!instrumented) {
+        work(4);
+        return;
+    }
+    metrics_add(&metrics->bytes_received, 78);
+    uint64_t start = metrics_start(metrics, STAGE_READ);
+    work(1);
+    metrics_end(metrics, STAGE_READ, start);
+    start = metrics_start(metrics, STAGE_PARSE);
+    work(1);
+    metrics_end(metrics, STAGE_PARSE, start);
+    metrics_add(&metrics->requests, 1);
+    uint64_t handler = metrics_start(metrics, STAGE_HANDLER);
+    start = metrics_start(metrics, STAGE_WRITE);
+    work(2);
+    metrics_end(metrics, STAGE_WRITE, start);
+    metrics_end(metrics, STAGE_HANDLER, handler);
+    metrics_add(&metrics->bytes_sent, 133);
+}
+
+static double time_requests(Metrics *metrics, bool instrumented)
+{
+    unsigned long long start = now_ns(), elapsed;
+    unsigned long long requests = 0;
+    do {
+        for (int i = 0; i < 100000; i++) {
+            serve_request(metrics, instrumented);
+        }
+        requests += 100000;
+        elapsed = now_ns() - start;
+    } while (elapsed < MIN_BENCH_NS);
+    return (double)elapsed / requests;
+}
+
+int main()
+{
+    const unsigned rates[] = { 1, 4, 16, 64 };
+    Metrics metrics;
+
+    metrics_init(&metrics, 1);
+    double baseline = time_requests(&metrics, false);
+    metrics_destroy(&metrics);
+
+    printf("%-12s %18s\n", "sample 1 in", "ns/request added");
+    int failed = 0;
+    for (size_t r = 0; r < sizeof(rates) / sizeof(rates[0]); r++) {
+        metrics_init(&metrics, rates[r]);
+        double cost = time_requests(&metrics, true) - baseline;
+        metrics_destroy(&metrics);
+        printf("%-12u %18.1f\n", rates[r], cost);
+        char name[64];
+        snprintf(name, sizeof(name), "metrics.sample_%u", rates[r]);
+        bench_report(name, cost, "ns");
+        if (rates[r] == DEFAULT_METRICS_SAMPLE && cost > 20) {
+            failed = 1;
+        }
+    }
+    printf(failed ? "FAIL: default sampling costs over 20ns per request\n"
+                  : "OK: default sampling costs under 20ns per request\n");
+    return failed;
+}
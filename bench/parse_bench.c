@@ -0,0 +1,121 @@
+#include "bench.h"
+#include "client_info.h"
+#include "http_utils.h"
+#include "request_parser.h"
+#include "response.h"
+#include <stdio.h>
+#include <string.h>
+
+static volatile size_t sink;
+
+static const struct {
+    const char *name;
+    const char *request;
+} REQUESTS[] = {
+    { "minimal", "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n" },
+    { "browser",
+        "GET /static/css/site.css?v=3 HTTP/1.1\r\n"
+        "Host: www.example.com\r\n"
+        "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:128.0) Gecko/20100101 Firefox/128.0\r\n"
+        "Accept: text/css,*/*;q=0.1\r\n"
+        "Accept-Language: en-US,en;q=0.5\r\n"
+        "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+        "Referer: https://www.example.com/\r\n"
+        "Cookie: session=4f1c2a9be0d34c7f8a61; theme=dark; consent=1\r\n"
+        "Connection: keep-alive\r\n"
+        "Sec-Fetch-Dest: style\r\n"
+        "Sec-Fetch-Mode: no-cors\r\n"
+        "Sec-Fetch-Site: same-origin\r\n"
+        "\r\n" },
+    { "post",
+        "POST /api/v1/items HTTP/1.1\r\n"
+        "Host: api.example.com\r\n"
+        "Content-Type: application/json\r\n"
+        "Content-Length: 27\r\n"
+        "\r\n"
+        "{\"name\":\"widget\",\"qty\":12}\n" },
+};
+
+// Run op until MIN_BENCH_NS has passed, returns ns per call
+#define TIME_OP(op)                                             \
+    ({                                                          \
+        unsigned long long start = now_ns(), elapsed, calls = 0; \
+        do {                                                    \
+            for (int i = 0; i < 1000; i++) {                    \
+                op;                                             \
+            }                                                   \
+            calls += 1000;                                      \
+            elapsed = now_ns() - start;                         \
+        } while (elapsed < MIN_BENCH_NS);                       \
+        (double)elapsed / calls;                                \
+    })
+
+int main()
+{
+    char name[64];
+
+    printf("%-10s %8s %18s %18s\n", "request", "bytes", "find_headers_end", "parse_request");
+    for (size_t r = 0; r < sizeof(REQUESTS) / sizeof(REQUESTS[0]); r++) {
+        char buffer[2048];
+        size_t len = strlen(REQUESTS[r].request);
+        memcpy(buffer, REQUESTS[r].request, len);
+
+        double find_ns = TIME_OP(sink += find_headers_end(buffer, len) - buffer);
+
+        // Frame once, parsing starts from what framing found
+        ClientInfo client;
+        memset(&client, 0, sizeof(client));
+        reset_http_framing(&client);
+        client.buffer = buffer;
+        client.buf_used = len;
+        client.buf_size = sizeof(buffer);
+        client.max_body_size = sizeof(buffer);
+        if (!check_http_end(&client) || client.framing_error != FRAMING_OK) {
+            fprintf(stderr, "%s did not frame\n", REQUESTS[r].name);
+            return 1;
+        }
+        client.state = CLIENT_READY;
+        RequestOrError result;
+        double parse_ns = TIME_OP({
+            parse_request(&client, &result);
+            sink += result.has_error ? 0 : result.data.req.path.len;
+        });
+        if (result.has_error) {
+            fprintf(stderr, "%s did not parse\n", REQUESTS[r].name);
+            return 1;
+        }
+
+        printf("%-10s %8zu %18.1f %18.1f\n", REQUESTS[r].name, len, find_ns, parse_ns);
+        snprintf(name, sizeof(name), "find_headers_end.%s", REQUESTS[r].name);
+        bench_report(name, find_ns, "ns");
+        snprintf(name, sizeof(name), "parse_request.%s", REQUESTS[r].name);
+        bench_report(name, parse_ns, "ns");
+    }
+
+    static const char BODY[] = "Hello, World!";
+    static const char EXTRA[] = "ETag: \"5f3a-1b2c\"\r\nCache-Control: max-age=60\r\n";
+    const struct {
+        const char *name;
+        Response res;
+    } responses[] = {
+        { "plain",
+            { .status = STATUS_OK, .content_type = CONTENT_TYPE_PLAINTEXT, .content_len = sizeof(BODY) - 1,
+                .content_body = (char *)BODY } },
+        { "extra_headers",
+            { .status = STATUS_OK, .content_type = CONTENT_TYPE_CSS, .content_len = 48213,
+                .connection = CONNECTION_KEEP_ALIVE, .extra_headers = EXTRA,
+                .extra_headers_len = sizeof(EXTRA) - 1 } },
+    };
+    DateCache date = { 0 };
+    const char *now = update_date_cache(&date);
+
+    printf("\n%-14s %18s\n", "response", "marshal_response");
+    for (size_t r = 0; r < sizeof(responses) / sizeof(responses[0]); r++) {
+        char headers[MAX_RESPONSE_HEADERS_LEN];
+        double marshal_ns = TIME_OP(sink += marshal_response(headers, sizeof(headers), &responses[r].res, now));
+        printf("%-14s %18.1f\n", responses[r].name, marshal_ns);
+        snprintf(name, sizeof(name), "marshal_response.%s", responses[r].name);
+        bench_report(name, marshal_ns, "ns");
+    }
+    return 0;
+}
@@ -0,0 +1,135 @@
+#include "bench.h"
+#include "router.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define MAX_ROUTES 1000
+#define PATH_LEN 96
+
+static volatile size_t sink;
+
+static void handle_route(ClientInfo *client, Request *req, const RouteMatch *match)
+{
+    (void)client;
+    (void)req;
+    sink += match->num_params;
+}
+
+// What a router without a tree does: try every pattern in turn, segment by
+// segment
+static bool linear_match(const char *pattern, const char *path, size_t len)
+{
+    const char *end = path + len;
+    while (*pattern && path <= end) {
+        if (*pattern == '*') {
+            return true;
+        }
+        if (*pattern == ':') {
+            while (*pattern && *pattern != '/')
+                pattern++;
+            if (path == end || *path == '/')
+                return false;
+            while (path < end && *path != '/')
+                path++;
+            continue;
+        }
+        if (path == end || *pattern != *path)
+            return false;
+        pattern++;
+        path++;
+    }
+    return !*pattern && path == end;
+}
+
+// Route i gets one of a few API shapes, so the tree has shared prefixes,
+// parameters and wildcards the way a real mount table does
+static void make_route(size_t i, char *pattern, char *path)
+{
+    switch (i % 4) {
+    case 0:
+        sprintf(pattern, "/api/v1/resource%zu", i);
+        sprintf(path, "/api/v1/resource%zu", i);
+        break;
+    case 1:
+        sprintf(pattern, "/api/v1/resource%zu/:id", i);
+        sprintf(path, "/api/v1/resource%zu/12345", i);
+        break;
+    case 2:
+        sprintf(pattern, "/api/v1/resource%zu/:id/items/:item", i);
+        sprintf(path, "/api/v1/resource%zu/12345/items/678", i);
+        break;
+    default:
+        sprintf(pattern, "/assets/bundle%zu/*path", i);
+        sprintf(path, "/assets/bundle%zu/js/app.min.js", i);
+        break;
+    }
+}
+
+int main()
+{
+    static char patterns[MAX_ROUTES][PATH_LEN];
+    static char paths[MAX_ROUTES][PATH_LEN];
+    static size_t path_lens[MAX_ROUTES];
+    const size_t sizes[] = { 10, 100, 1000 };
+
+    printf("%-8s %16s %16s %16s\n", "routes", "tree lookups/s", "tree ns", "linear ns");
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(size_t); s++) {
+        size_t count = sizes[s];
+        Router router;
+        if (router_init(&router) < 0) {
+            return 1;
+        }
+        for (size_t i = 0; i < count; i++) {
+            make_route(i, patterns[i], paths[i]);
+            path_lens[i] = strlen(paths[i]);
+            if (router_add(&router, METHOD_GET, patterns[i], handle_route) < 0) {
+                return 1;
+            }
+        }
+
+        unsigned long long start, elapsed;
+        unsigned long long lookups = 0;
+        RouteMatch match;
+        RouteHandler handler;
+        start = now_ns();
+        do {
+            for (size_t i = 0; i < count; i++) {
+                StringView path = { .data = paths[i], .len = path_lens[i] };
+                if (router_lookup(&router, METHOD_GET, path, &match, &handler) != ROUTE_FOUND) {
+                    fprintf(stderr, "No route for %s\n", paths[i]);
+                    return 1;
+                }
+                handler(NULL, NULL, &match);
+            }
+            lookups += count;
+            elapsed = now_ns() - start;
+        } while (elapsed < MIN_BENCH_NS);
+        double tree_ns = (double)elapsed / lookups;
+
+        lookups = 0;
+        start = now_ns();
+        do {
+            for (size_t i = 0; i < count; i++) {
+                for (size_t r = 0; r < count; r++) {
+                    if (linear_match(patterns[r], paths[i], path_lens[i])) {
+                        sink += r;
+                        break;
+                    }
+                }
+            }
+            lookups += count;
+            elapsed = now_ns() - start;
+        } while (elapsed < MIN_BENCH_NS);
+        double linear_ns = (double)elapsed / lookups;
+
+        printf("%-8zu %16.0f %16.1f %16.1f\n", count, 1e9 / tree_ns, tree_ns, linear_ns);
+        char name[64];
+        snprintf(name, sizeof(name), "router.routes_%zu", count);
+        bench_report(name, tree_ns, "ns");
+        router_destroy(&router);
+    }
+
+    return 0;
+}
@@ -0,0 +1,89 @@
+#include "bench.h"
+#include "url.h"
+#include <stdio.h>
+#include <string.h>
+
+static volatile size_t sink;
+
+// Run op until MIN_BENCH_NS has passed, returns ns per call
+#define TIME_OP(op)                                             \
+    ({                                                          \
+        unsigned long long start = now_ns(), elapsed, calls = 0; \
+        do {                                                    \
+            for (int i = 0; i < 1000; i++) {                    \
+                op;                                             \
+            }                                                   \
+            calls += 1000;                                      \
+            elapsed = now_ns() - start;                         \
+        } while (elapsed < MIN_BENCH_NS);                       \
+        (double)elapsed / calls;                                \
+    })
+
+static const struct {
+    const char *name;
+    const char *path;
+} PATHS[] = {
+    { "short", "/api/v1/items" },
+    { "long", "/static/assets/vendor/framework-4.2.1/dist/js/components/navigation.bundle.min.js" },
+    { "escaped", "/files/My%20Documents/report%202024%20final.pdf" },
+    { "dotted", "/static/css/../js/./vendor//app.js" },
+};
+
+static const char QUERY[] = "utm_source=newsletter&utm_medium=email&utm_campaign=autumn+sale"
+                            "&page=3&per_page=50&sort=created_at&q=caf%C3%A9+au+lait";
+
+// A byte at a time, what a decoder without the vector scan does before it
+// knows there is nothing to decode
+static size_t scalar_first_escape(const char *data, size_t len)
+{
+    size_t i = 0;
+    while (i < len && data[i] != '%' && data[i] != '+') {
+        i++;
+    }
+    return i;
+}
+
+int main()
+{
+    char name[64];
+    char buffer[256];
+
+    printf("%-10s %8s %16s %18s\n", "path", "bytes", "path_is_normal", "normalize_path");
+    for (size_t p = 0; p < sizeof(PATHS) / sizeof(PATHS[0]); p++) {
+        size_t len = strlen(PATHS[p].path);
+        double check_ns = TIME_OP(sink += url_path_is_normal(PATHS[p].path, len));
+        // What the parser does for a path that isn't normal: copy, then fix up in place
+        double normalize_ns = TIME_OP({
+            size_t out_len = len;
+            memcpy(buffer, PATHS[p].path, len);
+            sink += url_normalize_path(buffer, &out_len) ? out_len : 0;
+        });
+        printf("%-10s %8zu %16.1f %18.1f\n", PATHS[p].name, len, check_ns, normalize_ns);
+        snprintf(name, sizeof(name), "url.path_is_normal.%s", PATHS[p].name);
+        bench_report(name, check_ns, "ns");
+        snprintf(name, sizeof(name), "url.normalize_path.%s", PATHS[p].name);
+        bench_report(name, normalize_ns, "ns");
+    }
+
+    // Values with nothing to decode are the common case, only scanned
+    static const char PLAIN[] = "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ-_.~0123456789abcdefghijklmnop";
+    size_t plain_len = sizeof(PLAIN) - 1;
+    memcpy(buffer, PLAIN, plain_len);
+    double scalar_ns = TIME_OP(sink += scalar_first_escape(buffer, plain_len));
+    double decode_ns = TIME_OP(sink += url_decode(buffer, plain_len, true));
+    printf("\n%-28s %8.1f ns\n%-28s %8.1f ns\n", "scan, byte at a time", scalar_ns, "url_decode, nothing to do", decode_ns);
+    bench_report("url.scan_scalar.plain", scalar_ns, "ns");
+    bench_report("url.decode.plain", decode_ns, "ns");
+
+    // Handlers ask for a couple of the many parameters a query carries
+    StringView query = { .data = QUERY, .len = sizeof(QUERY) - 1 };
+    double first_ns = TIME_OP(sink += query_get(query, "utm_source", buffer, sizeof(buffer)));
+    double last_ns = TIME_OP(sink += query_get(query, "q", buffer, sizeof(buffer)));
+    double missing_ns = TIME_OP(sink += query_get(query, "missing", buffer, sizeof(buffer)));
+    printf("%-28s %8.1f ns\n%-28s %8.1f ns\n%-28s %8.1f ns\n", "query_get, first pair", first_ns,
+        "query_get, last and encoded", last_ns, "query_get, missing", missing_ns);
+    bench_report("url.query_get.first", first_ns, "ns");
+    bench_report("url.query_get.last", last_ns, "ns");
+    bench_report("url.query_get.missing", missing_ns, "ns");
+    return 0;
+}
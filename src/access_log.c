@@ -0,0 +1,275 @@
+#include "access_log.h"
+#include "request.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define FLUSH_INTERVAL_MS 10 // How long the flusher sleeps once every ring is empty
+#define BATCH_SIZE (64 * 1024)
+// Longest formatted line: every target byte escaped, plus the fixed fields
+#define MAX_LINE_LEN (ACCESS_LOG_TARGET_LEN * 4 + 192)
+#define MAX_PATH_LEN 4096
+
+// The log file, the flusher and the registered rings. Workers only take the
+// lock to register, the flusher holds it for a whole pass
+typedef struct AccessLog {
+    const char *path;
+    int fd; // -1 when logging is off
+    size_t max_size; // Rotate once the file would grow past this, 0 never rotates
+    size_t size; // Bytes in the current file
+    pthread_t thread;
+    bool running;
+    pthread_mutex_t lock;
+    AccessLogRing *rings;
+    char batch[BATCH_SIZE]; // Formatted lines not written yet
+    size_t batch_len;
+    time_t formatted_second; // Second formatted_time is for
+    char formatted_time[32];
+} AccessLog;
+
+static AccessLog log_state = { .fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static int open_log_file(AccessLog *log)
+{
+    log->fd = open(log->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (log->fd < 0) {
+        perror("Failed to open access log");
+        return -1;
+    }
+    struct stat st;
+    log->size = fstat(log->fd, &st) == 0 ? (size_t)st.st_size : 0;
+    return 0;
+}
+
+// Shift PATH.1 to PATH.2 and so on, dropping the oldest, and start a new PATH
+static void rotate_log_file(AccessLog *log)
+{
+    char from[MAX_PATH_LEN], to[MAX_PATH_LEN];
+    for (int i = ACCESS_LOG_KEEP - 1; i >= 1; i--) {
+        snprintf(from, sizeof(from), "%s.%d", log->path, i);
+        snprintf(to, sizeof(to), "%s.%d", log->path, i + 1);
+        rename(from, to);
+    }
+    snprintf(to, sizeof(to), "%s.1", log->path);
+    if (rename(log->path, to) < 0) {
+        perror("Failed to rotate access log");
+        return;
+    }
+    close(log->fd);
+    open_log_file(log);
+}
+
+static void write_batch(AccessLog *log)
+{
+    if (log->batch_len == 0) {
+        return;
+    }
+    if (log->max_size && log->size > 0 && log->size + log->batch_len > log->max_size) {
+        rotate_log_file(log);
+    }
+
+    size_t written = 0;
+    while (log->fd >= 0 && written < log->batch_len) {
+        ssize_t n = write(log->fd, log->batch + written, log->batch_len - written);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Failed to write access log");
+            break;
+        }
+        written += n;
+    }
+    log->size += written;
+    log->batch_len = 0;
+}
+
+// Common Log Format timestamps, formatted once per second
+static const char *format_time(AccessLog *log, time_t time)
+{
+    if (time != log->formatted_second) {
+        struct tm tm;
+        gmtime_r(&time, &tm);
+        strftime(log->formatted_time, sizeof(log->formatted_time), "%d/%b/%Y:%H:%M:%S +0000", &tm);
+        log->formatted_second = time;
+    }
+    return log->formatted_time;
+}
+
+// Copy the target, escaping anything that could break up the line
+static size_t escape_target(char *out, const AccessLogRecord *record)
+{
+    static const char HEX[] = "0123456789abcdef";
+    size_t len = record->target_len < ACCESS_LOG_TARGET_LEN ? record->target_len : ACCESS_LOG_TARGET_LEN;
+    size_t n = 0;
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = record->target[i];
+        if (c < 0x20 || c >= 0x7f || c == '"' || c == '\\') {
+            out[n++] = '\\';
+            out[n++] = 'x';
+            out[n++] = HEX[c >> 4];
+            out[n++] = HEX[c & 0xf];
+        } else {
+            out[n++] = c;
+        }
+    }
+    return n;
+}
+
+// One line in the Common Log Format, followed by the request time in seconds
+static void format_record(AccessLog *log, const AccessLogRecord *record)
+{
+    if (BATCH_SIZE - log->batch_len < MAX_LINE_LEN) {
+        write_batch(log);
+    }
+
+    char addr[INET_ADDRSTRLEN];
+    struct in_addr in = { .s_addr = record->addr };
+    inet_ntop(AF_INET, &in, addr, sizeof(addr));
+
+    char *line = log->batch + log->batch_len;
+    size_t room = BATCH_SIZE - log->batch_len;
+    int len;
+    if (record->method < METHOD_COUNT) {
+        char target[ACCESS_LOG_TARGET_LEN * 4];
+        size_t target_len = escape_target(target, record);
+        len = snprintf(line, room, "%s - - [%s] \"%s %.*s%s HTTP/1.%u\" %u %llu %.3f\n", addr,
+            format_time(log, record->time), VALID_METHODS_LITERALS[record->method], (int)target_len, target,
+            record->target_len > ACCESS_LOG_TARGET_LEN ? "..." : "", record->minor_version, record->status,
+            (unsigned long long)record->bytes, record->duration_ms / 1000.0);
+    } else {
+        len = snprintf(line, room, "%s - - [%s] \"-\" %u %llu %.3f\n", addr, format_time(log, record->time),
+            record->status, (unsigned long long)record->bytes, record->duration_ms / 1000.0);
+    }
+    if (len > 0 && (size_t)len < room) {
+        log->batch_len += len;
+    }
+}
+
+// Format everything committed to a ring so far, then give the slots back
+static size_t drain_ring(AccessLog *log, AccessLogRing *ring)
+{
+    uint64_t head = ring->head;
+    uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    for (uint64_t i = head; i < tail; i++) {
+        format_record(log, &ring->records[i & (ACCESS_LOG_RING_RECORDS - 1)]);
+    }
+    __atomic_store_n(&ring->head, tail, __ATOMIC_RELEASE);
+    return tail - head;
+}
+
+static size_t drain_rings(AccessLog *log)
+{
+    size_t drained = 0;
+    pthread_mutex_lock(&log->lock);
+    for (AccessLogRing *ring = log->rings; ring; ring = ring->next) {
+        drained += drain_ring(log, ring);
+    }
+    write_batch(log);
+    pthread_mutex_unlock(&log->lock);
+    return drained;
+}
+
+static void *flusher_main(void *arg)
+{
+    AccessLog *log = arg;
+    struct timespec interval = { 0, FLUSH_INTERVAL_MS * 1000000L };
+    while (__atomic_load_n(&log->running, __ATOMIC_ACQUIRE)) {
+        // Keep going while records come in, sleep once they stop
+        if (drain_rings(log) == 0) {
+            nanosleep(&interval, NULL);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Open the access log and start the thread that writes it
+ * @param path File to append to, rotated to PATH.1 and so on
+ * @param max_size Size at which the file is rotated, 0 to never rotate
+ * @return 0 on success, -1 on failure
+ */
+int access_log_open(const char *path, size_t max_size)
+{
+    AccessLog *log = &log_state;
+    log->path = path;
+    log->max_size = max_size;
+    if (open_log_file(log) < 0) {
+        return -1;
+    }
+
+    log->running = true;
+    int err = pthread_create(&log->thread, NULL, flusher_main, log);
+    if (err != 0) {
+        errno = err;
+        perror("Failed to start access log flusher");
+        close(log->fd);
+        log->fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+// Stop the flusher, writing out whatever the rings still hold
+void access_log_close(void)
+{
+    AccessLog *log = &log_state;
+    if (log->fd < 0) {
+        return;
+    }
+    __atomic_store_n(&log->running, false, __ATOMIC_RELEASE);
+    pthread_join(log->thread, NULL);
+    drain_rings(log);
+    close(log->fd);
+    log->fd = -1;
+}
+
+/**
+ * Allocate a worker's ring and have the flusher drain it
+ * @param ring Ring to set up
+ * @return 0 on success, -1 on failure
+ */
+int access_log_ring_init(AccessLogRing *ring)
+{
+    memset(ring, 0, sizeof(AccessLogRing));
+    ring->records = malloc(ACCESS_LOG_RING_RECORDS * sizeof(AccessLogRecord));
+    if (!ring->records) {
+        perror("Failed to allocate access log ring");
+        return -1;
+    }
+
+    pthread_mutex_lock(&log_state.lock);
+    ring->next = log_state.rings;
+    log_state.rings = ring;
+    pthread_mutex_unlock(&log_state.lock);
+    return 0;
+}
+
+// Write out a ring's last records and stop draining it
+void access_log_ring_destroy(AccessLogRing *ring)
+{
+    if (!ring->records) {
+        return;
+    }
+    AccessLog *log = &log_state;
+    pthread_mutex_lock(&log->lock);
+    if (log->fd >= 0) {
+        drain_ring(log, ring);
+        write_batch(log);
+    }
+    for (AccessLogRing **link = &log->rings; *link; link = &(*link)->next) {
+        if (*link == ring) {
+            *link = ring->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&log->lock);
+    free(ring->records);
+    ring->records = NULL;
+}
@@ -0,0 +1,70 @@
+#ifndef ACCESS_LOG_H
+#define ACCESS_LOG_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#define DEFAULT_ACCESS_LOG_MAX_SIZE (64 * 1024 * 1024)
+#define ACCESS_LOG_KEEP 5 // Rotated files kept as PATH.1 to PATH.5
+#define ACCESS_LOG_RING_RECORDS 16384 // Per worker, a power of two
+#define ACCESS_LOG_TARGET_LEN 96
+
+// One finished request, exactly as the worker saw it. Formatting is left to
+// the flusher thread, so recording is a few stores into the ring
+typedef struct AccessLogRecord {
+    time_t time; // When the request finished
+    uint64_t bytes; // Response bytes queued, headers included
+    uint32_t duration_ms; // From parsing the request to finishing it
+    uint32_t addr; // Client IPv4 address, network order
+    uint16_t port; // Client port, network order
+    uint16_t status; // Status code, 0 if nothing was answered
+    uint16_t target_len; // Full length, only ACCESS_LOG_TARGET_LEN bytes are kept
+    uint8_t method; // RequestMethod, METHOD_COUNT if the request didn't parse
+    uint8_t minor_version;
+    char target[ACCESS_LOG_TARGET_LEN];
+} AccessLogRecord;
+
+_Static_assert(sizeof(AccessLogRecord) == 128, "access log records should fill two cache lines");
+
+// Single producer, single consumer: the worker owns tail and the flusher
+// owns head, each on its own cache line. Both count records ever written,
+// the slot is the count modulo the ring size
+typedef struct AccessLogRing {
+    _Alignas(64) uint64_t tail; // Next record the worker writes
+    uint64_t head_seen; // The worker's last look at head, refreshed when the ring looks full
+    AccessLogRecord *records; // NULL when access logging is off
+    _Alignas(64) uint64_t head; // Next record the flusher formats
+    struct AccessLogRing *next; // Every registered ring, walked by the flusher
+} AccessLogRing;
+
+extern int access_log_open(const char *path, size_t max_size);
+extern void access_log_close(void);
+extern int access_log_ring_init(AccessLogRing *ring);
+extern void access_log_ring_destroy(AccessLogRing *ring);
+
+/**
+ * Claim the next slot of a ring, on the worker that owns it
+ * @param ring Ring to write to
+ * @return Slot to fill and commit, or NULL if the flusher is behind and the
+ * record has to be dropped
+ */
+static inline AccessLogRecord *access_log_reserve(AccessLogRing *ring)
+{
+    if (ring->tail - ring->head_seen >= ACCESS_LOG_RING_RECORDS) {
+        ring->head_seen = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if (ring->tail - ring->head_seen >= ACCESS_LOG_RING_RECORDS) {
+            return NULL;
+        }
+    }
+    return &ring->records[ring->tail & (ACCESS_LOG_RING_RECORDS - 1)];
+}
+
+// Hand the reserved slot to the flusher
+static inline void access_log_commit(AccessLogRing *ring)
+{
+    __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+}
+
+#endif // ACCESS_LOG_H
@@ -0,0 +1,123 @@
+#include "access_log.h"
+#include "request.h"
+#include "test.h"
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static void fill_record(AccessLogRecord *record, RequestMethod method, const char *target, size_t target_len)
+{
+    memset(record, 0, sizeof(*record));
+    record->time = 86400 + 3661;
+    record->bytes = 123;
+    record->duration_ms = 1500;
+    record->addr = htonl(INADDR_LOOPBACK);
+    record->port = htons(5000);
+    record->status = 200;
+    record->method = method;
+    record->minor_version = 1;
+    record->target_len = target_len;
+    memcpy(record->target, target,
+        target_len < ACCESS_LOG_TARGET_LEN ? target_len : ACCESS_LOG_TARGET_LEN);
+}
+
+// Nothing drains the ring here, the test moves head as the flusher would
+static void test_full_ring()
+{
+    AccessLogRing ring;
+    CHECK(access_log_ring_init(&ring) == 0);
+    for (int i = 0; i < ACCESS_LOG_RING_RECORDS; i++) {
+        AccessLogRecord *record = access_log_reserve(&ring);
+        CHECK(record == &ring.records[i]);
+        if (!record) {
+            break;
+        }
+        access_log_commit(&ring);
+    }
+    // Dropped, as often as asked, without moving tail
+    CHECK(access_log_reserve(&ring) == NULL);
+    CHECK(access_log_reserve(&ring) == NULL);
+    CHECK(ring.tail == ACCESS_LOG_RING_RECORDS);
+
+    // Slots come back as the flusher moves past them, wrapping around
+    __atomic_store_n(&ring.head, 2, __ATOMIC_RELEASE);
+    for (int i = 0; i < 2; i++) {
+        CHECK(access_log_reserve(&ring) == &ring.records[i]);
+        access_log_commit(&ring);
+    }
+    CHECK(access_log_reserve(&ring) == NULL);
+    access_log_ring_destroy(&ring);
+}
+
+// Anything that could end the quoted request or the line is escaped, and
+// targets past what a record keeps are marked as cut
+static void test_lines()
+{
+    char path[] = "/tmp/access_log_testXXXXXX";
+    int fd = mkstemp(path);
+    CHECK(fd >= 0);
+    if (fd < 0) {
+        return;
+    }
+    close(fd);
+    CHECK(access_log_open(path, 0) == 0);
+
+    AccessLogRing ring;
+    CHECK(access_log_ring_init(&ring) == 0);
+    static const char odd[] = "/a b\"c\\d\x01\n\x7f\xc3\xa9?q=%20";
+    char long_target[ACCESS_LOG_TARGET_LEN + 50];
+    memset(long_target, 'a', sizeof(long_target));
+    long_target[0] = '/';
+    const struct {
+        RequestMethod method;
+        const char *target;
+        size_t target_len;
+    } records[] = {
+        { METHOD_GET, "/index.html", 11 },
+        { METHOD_POST, odd, sizeof(odd) - 1 },
+        { METHOD_GET, long_target, ACCESS_LOG_TARGET_LEN },
+        { METHOD_GET, long_target, sizeof(long_target) },
+        { METHOD_COUNT, "", 0 },
+    };
+    for (size_t i = 0; i < sizeof(records) / sizeof(records[0]); i++) {
+        AccessLogRecord *record = access_log_reserve(&ring);
+        CHECK(record != NULL);
+        if (record) {
+            fill_record(record, records[i].method, records[i].target, records[i].target_len);
+            access_log_commit(&ring);
+        }
+    }
+    // Writes out what the flusher hasn't yet
+    access_log_ring_destroy(&ring);
+    access_log_close();
+
+    char expected[4096];
+    int len = snprintf(expected, sizeof(expected),
+        "127.0.0.1 - - [02/Jan/1970:01:01:01 +0000] \"GET /index.html HTTP/1.1\" 200 123 1.500\n"
+        "127.0.0.1 - - [02/Jan/1970:01:01:01 +0000] \"POST /a b\\x22c\\x5cd\\x01\\x0a\\x7f\\xc3\\xa9?q=%%20 HTTP/1.1\" "
+        "200 123 1.500\n"
+        "127.0.0.1 - - [02/Jan/1970:01:01:01 +0000] \"GET %.*s HTTP/1.1\" 200 123 1.500\n"
+        "127.0.0.1 - - [02/Jan/1970:01:01:01 +0000] \"GET %.*s... HTTP/1.1\" 200 123 1.500\n"
+        "127.0.0.1 - - [02/Jan/1970:01:01:01 +0000] \"-\" 200 123 1.500\n",
+        ACCESS_LOG_TARGET_LEN, long_target, ACCESS_LOG_TARGET_LEN, long_target);
+
+    char written[4096];
+    FILE *file = fopen(path, "r");
+    size_t written_len = file ? fread(written, 1, sizeof(written) - 1, file) : 0;
+    written[written_len] = '\0';
+    if (file) {
+        fclose(file);
+    }
+    CHECK(written_len == (size_t)len);
+    CHECK(strcmp(written, expected) == 0);
+    unlink(path);
+}
+
+int main()
+{
+    test_full_ring();
+    test_lines();
+    return TEST_RESULT();
+}
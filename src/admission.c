@@ -0,0 +1,104 @@
+#include "admission.h"
+#include "worker.h"
+#include <sys/socket.h>
+#include <unistd.h>
+
+static const char OVERLOADED_BODY[] = "Service Unavailable";
+static const char OVERLOADED_HEADERS[] = "Retry-After: 1\r\n";
+static const Response OVERLOADED_TEMPLATE = {
+    .content_len = sizeof(OVERLOADED_BODY) - 1,
+    .content_body = (char *)OVERLOADED_BODY,
+    .content_type = CONTENT_TYPE_PLAINTEXT,
+    .status = STATUS_SERVICE_UNAVAILABLE,
+    .extra_headers = OVERLOADED_HEADERS,
+    .extra_headers_len = sizeof(OVERLOADED_HEADERS) - 1,
+};
+
+static StaticResponseId overloaded_response = -1;
+
+/**
+ * Register the response shed connections get. Only valid before the server
+ * is started, like any static response
+ * @return 0 on success, -1 if there are too many static responses
+ */
+int admission_register(void)
+{
+    overloaded_response = register_static_response(&OVERLOADED_TEMPLATE);
+    return overloaded_response < 0 ? -1 : 0;
+}
+
+static void set_limit(Admission *admission, size_t limit)
+{
+    admission->limit = limit;
+    metrics_set(&admission->worker->metrics.admission_limit, limit);
+}
+
+// AIMD on the longest turn the loop took since the last interval
+static void adapt_limit(Timer *timer)
+{
+    Admission *admission = timer->data;
+    EventLoop *loop = admission->worker->loop;
+
+    if (loop->longest_turn_ms > admission->target_ms) {
+        size_t limit = admission->limit - admission->limit / 4;
+        set_limit(admission, limit > admission->min_limit ? limit : admission->min_limit);
+    } else if (admission->limit < admission->max_limit) {
+        size_t step = (admission->max_limit - admission->min_limit) / ADMISSION_RECOVERY_STEPS;
+        size_t limit = admission->limit + (step ? step : 1);
+        set_limit(admission, limit < admission->max_limit ? limit : admission->max_limit);
+    }
+    loop->longest_turn_ms = 0;
+    timer_schedule(&loop->timers, timer, ADMISSION_INTERVAL_MS);
+}
+
+void admission_init(Admission *admission, Worker *worker)
+{
+    const ServerConfig *config = worker->config;
+    admission->worker = worker;
+    admission->max_limit = config->max_connections;
+    admission->min_limit = config->max_connections < ADMISSION_MIN_LIMIT ? config->max_connections
+                                                                          : ADMISSION_MIN_LIMIT;
+    admission->target_ms = config->admission_latency_ms;
+    timer_init(&admission->timer, adapt_limit, admission);
+    set_limit(admission, admission->max_limit);
+    if (admission->limit && admission->target_ms) {
+        worker->loop->longest_turn_ms = 0;
+        timer_schedule(&worker->loop->timers, &admission->timer, ADMISSION_INTERVAL_MS);
+    }
+}
+
+void admission_destroy(Admission *admission)
+{
+    if (timer_pending(&admission->timer)) {
+        timer_cancel(&admission->worker->loop->timers, &admission->timer);
+    }
+}
+
+/**
+ * Admit a freshly accepted connection, or shed it. Shedding answers straight
+ * from the accept path: whatever part of the request already arrived is
+ * read and dropped, so closing doesn't reset the connection under the 503,
+ * and the 503 is written without waiting. A client whose send buffer is full
+ * or who is already gone only loses the response
+ * @param admission The accepting worker's admission state
+ * @param fd Accepted connection, closed if it is shed
+ * @return Whether the connection may be served
+ */
+bool admit_connection(Admission *admission, int fd)
+{
+    Worker *worker = admission->worker;
+    if (admission->limit == 0 || worker->num_connections < admission->limit) {
+        return true;
+    }
+
+    char discard[4096];
+    recv(fd, discard, sizeof(discard), MSG_DONTWAIT);
+    const PreparedResponse *res = current_static_response(worker, overloaded_response, CONNECTION_CLOSE);
+    ssize_t sent = send(fd, res->data, res->len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (sent > 0) {
+        metrics_add(&worker->metrics.bytes_sent, sent);
+    }
+    close(fd);
+    metrics_add(&worker->metrics.connections_shed, 1);
+    return false;
+}
@@ -0,0 +1,36 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include "timer_wheel.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+#define DEFAULT_MAX_CONNECTIONS 0 // Per worker, 0 admits every connection
+#define DEFAULT_ADMISSION_LATENCY_MS 50
+#define ADMISSION_INTERVAL_MS 100
+#define ADMISSION_MIN_LIMIT 16
+// Healthy intervals the limit takes to climb from its floor back to the cap
+#define ADMISSION_RECOVERY_STEPS 64
+
+struct Worker;
+
+// A worker's cap on open connections. Connections past it are answered with
+// a pre-serialized 503 and closed before anything is allocated for them.
+// Every interval the cap is cut by a quarter if a turn of the event loop took
+// longer than target_ms, and otherwise raised by a fixed step, so it settles
+// where queueing stays under the target
+typedef struct Admission {
+    size_t limit; // Current cap, 0 when admission control is off
+    size_t min_limit;
+    size_t max_limit; // --max-connections
+    unsigned target_ms; // 0 keeps the cap at max_limit
+    Timer timer;
+    struct Worker *worker;
+} Admission;
+
+extern int admission_register(void);
+extern void admission_init(Admission *admission, struct Worker *worker);
+extern void admission_destroy(Admission *admission);
+extern bool admit_connection(Admission *admission, int fd);
+
+#endif // ADMISSION_H
@@ -0,0 +1,114 @@
+#include "admission.h"
+#include "server.h"
+#include "test.h"
+#include "worker.h"
+
+// Only what admission control looks at, the loop's timers are advanced by hand
+static ServerConfig config;
+static EventLoop loop;
+static Worker worker;
+static uint64_t now_ms;
+
+static void start(Admission *admission, size_t max_connections, unsigned target_ms)
+{
+    init_server_config(&config);
+    config.max_connections = max_connections;
+    config.admission_latency_ms = target_ms;
+    now_ms = 1000;
+    timer_wheel_init(&loop.timers, now_ms);
+    worker.config = &config;
+    worker.loop = &loop;
+    worker.num_connections = 0;
+    admission_init(admission, &worker);
+}
+
+// One interval whose longest loop turn took turn_ms
+static size_t run_interval(Admission *admission, uint64_t turn_ms)
+{
+    loop.longest_turn_ms = turn_ms;
+    now_ms += ADMISSION_INTERVAL_MS;
+    timer_wheel_advance(&loop.timers, now_ms);
+    return admission->limit;
+}
+
+// Cut by a quarter per slow interval down to the floor, then back up to
+// the cap in equal steps
+static void test_aimd()
+{
+    Admission admission;
+    start(&admission, 1000, 50);
+    CHECK(admission.limit == 1000);
+    CHECK(worker.metrics.admission_limit == 1000);
+
+    CHECK(run_interval(&admission, 51) == 750);
+    CHECK(loop.longest_turn_ms == 0);
+    CHECK(worker.metrics.admission_limit == 750);
+    CHECK(run_interval(&admission, 500) == 563);
+    // A turn right at the target is fine
+    CHECK(run_interval(&admission, 50) == 563 + (1000 - ADMISSION_MIN_LIMIT) / ADMISSION_RECOVERY_STEPS);
+
+    size_t limit = admission.limit;
+    for (int i = 0; i < 30; i++) {
+        size_t next = run_interval(&admission, 51);
+        CHECK(next == (limit - limit / 4 > ADMISSION_MIN_LIMIT ? limit - limit / 4 : ADMISSION_MIN_LIMIT));
+        limit = next;
+    }
+    CHECK(limit == ADMISSION_MIN_LIMIT);
+
+    size_t step = (1000 - ADMISSION_MIN_LIMIT) / ADMISSION_RECOVERY_STEPS;
+    int intervals = 0;
+    while (run_interval(&admission, 0) < 1000 && intervals < 1000) {
+        intervals++;
+        CHECK(admission.limit == ADMISSION_MIN_LIMIT + intervals * step);
+    }
+    CHECK(intervals + 1 == (int)((1000 - ADMISSION_MIN_LIMIT + step - 1) / step));
+    CHECK(run_interval(&admission, 0) == 1000);
+    admission_destroy(&admission);
+}
+
+// Steps too small to count are one connection. A cap below the floor is
+// the floor, it never moves
+static void test_small_cap()
+{
+    Admission admission;
+    start(&admission, ADMISSION_MIN_LIMIT + 4, 50);
+    CHECK(run_interval(&admission, 100) == ADMISSION_MIN_LIMIT);
+    CHECK(run_interval(&admission, 100) == ADMISSION_MIN_LIMIT);
+    for (size_t i = 1; i <= 4; i++) {
+        CHECK(run_interval(&admission, 0) == ADMISSION_MIN_LIMIT + i);
+    }
+    CHECK(run_interval(&admission, 0) == ADMISSION_MIN_LIMIT + 4);
+    admission_destroy(&admission);
+
+    start(&admission, 8, 50);
+    CHECK(run_interval(&admission, 100) == 8);
+    CHECK(run_interval(&admission, 0) == 8);
+    admission_destroy(&admission);
+}
+
+// Without a target the cap stays put, without a cap everything is admitted
+static void test_fixed()
+{
+    Admission admission;
+    start(&admission, 100, 0);
+    CHECK(!timer_pending(&admission.timer));
+    CHECK(run_interval(&admission, 1000) == 100);
+    worker.num_connections = 99;
+    CHECK(admit_connection(&admission, -1));
+    admission_destroy(&admission);
+
+    start(&admission, 0, 50);
+    CHECK(admission.limit == 0);
+    CHECK(!timer_pending(&admission.timer));
+    worker.num_connections = 1000000;
+    CHECK(admit_connection(&admission, -1));
+    admission_destroy(&admission);
+}
+
+int main()
+{
+    test_aimd();
+    test_small_cap();
+    test_fixed();
+    return TEST_RESULT();
+}
@@ -0,0 +1,133 @@
+#include "chunked.h"
+#include <stdbool.h>
+
+// Chunk sizes past this many hex digits can't be real
+#define MAX_SIZE_DIGITS 15
+
+void chunked_decoder_init(ChunkedDecoder *decoder)
+{
+    decoder->state = CHUNK_SIZE;
+    decoder->remaining = 0;
+    decoder->digits = 0;
+}
+
+static int hex_value(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+/**
+ * Decode chunked framing until the next run of body bytes, the end of the
+ * body or the end of the input, whichever comes first
+ * @param decoder Decoder state, carried over between calls
+ * @param in Raw bytes following whatever was consumed before
+ * @param len Number of raw bytes
+ * @param consumed Set to how many raw bytes were used
+ * @param data Set to the body bytes for CHUNKED_DATA, they are part of in
+ * @param data_len Set to the number of body bytes for CHUNKED_DATA
+ * @return What was found, see ChunkedResult
+ */
+ChunkedResult chunked_decode(ChunkedDecoder *decoder, const char *in, size_t len, size_t *consumed,
+    const char **data, size_t *data_len)
+{
+    size_t i = 0;
+
+    while (i < len) {
+        char c = in[i];
+        switch (decoder->state) {
+        case CHUNK_SIZE: {
+            int value = hex_value(c);
+            if (value >= 0) {
+                if (++decoder->digits > MAX_SIZE_DIGITS) {
+                    return CHUNKED_ERROR;
+                }
+                decoder->remaining = decoder->remaining * 16 + value;
+                break;
+            }
+            if (decoder->digits == 0) {
+                return CHUNKED_ERROR;
+            }
+            if (c == ';' || c == ' ' || c == '\t') {
+                decoder->state = CHUNK_EXTENSION;
+            } else if (c == '\r') {
+                decoder->state = CHUNK_SIZE_LF;
+            } else {
+                return CHUNKED_ERROR;
+            }
+            break;
+        }
+        case CHUNK_EXTENSION:
+            if (c == '\r') {
+                decoder->state = CHUNK_SIZE_LF;
+            } else if (c == '\n') {
+                return CHUNKED_ERROR;
+            }
+            break;
+        case CHUNK_SIZE_LF:
+            if (c != '\n') {
+                return CHUNKED_ERROR;
+            }
+            decoder->state = decoder->remaining > 0 ? CHUNK_DATA : CHUNK_TRAILER_START;
+            break;
+        case CHUNK_DATA: {
+            // Hand out as much of the chunk as has arrived, in place
+            size_t run = len - i < decoder->remaining ? len - i : decoder->remaining;
+            decoder->remaining -= run;
+            if (decoder->remaining == 0) {
+                decoder->state = CHUNK_DATA_CR;
+            }
+            *data = in + i;
+            *data_len = run;
+            *consumed = i + run;
+            return CHUNKED_DATA;
+        }
+        case CHUNK_DATA_CR:
+            if (c != '\r') {
+                return CHUNKED_ERROR;
+            }
+            decoder->state = CHUNK_DATA_LF;
+            break;
+        case CHUNK_DATA_LF:
+            if (c != '\n') {
+                return CHUNKED_ERROR;
+            }
+            decoder->state = CHUNK_SIZE;
+            decoder->digits = 0;
+            break;
+        case CHUNK_TRAILER_START:
+            decoder->state = c == '\r' ? CHUNK_FINAL_LF : CHUNK_TRAILER;
+            break;
+        case CHUNK_TRAILER:
+            if (c == '\r') {
+                decoder->state = CHUNK_TRAILER_LF;
+            }
+            break;
+        case CHUNK_TRAILER_LF:
+            if (c != '\n') {
+                return CHUNKED_ERROR;
+            }
+            decoder->state = CHUNK_TRAILER_START;
+            break;
+        case CHUNK_FINAL_LF:
+            if (c != '\n') {
+                return CHUNKED_ERROR;
+            }
+            decoder->state = CHUNK_DONE;
+            *consumed = i + 1;
+            return CHUNKED_DONE;
+        case CHUNK_DONE:
+            *consumed = i;
+            return CHUNKED_DONE;
+        }
+        i++;
+    }
+
+    *consumed = i;
+    return decoder->state == CHUNK_DONE ? CHUNKED_DONE : CHUNKED_MORE;
+}
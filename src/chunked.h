@@ -0,0 +1,40 @@
+#ifndef CHUNKED_H
+#define CHUNKED_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum ChunkedState {
+    CHUNK_SIZE,
+    CHUNK_EXTENSION, // ";name=value" after the size, ignored
+    CHUNK_SIZE_LF,
+    CHUNK_DATA,
+    CHUNK_DATA_CR,
+    CHUNK_DATA_LF,
+    CHUNK_TRAILER_START, // Start of a trailer line, or of the final CRLF
+    CHUNK_TRAILER, // Trailer fields are skipped
+    CHUNK_TRAILER_LF,
+    CHUNK_FINAL_LF,
+    CHUNK_DONE,
+} ChunkedState;
+
+// Resumable decoder for a chunked body, it never needs a chunk to have
+// arrived whole and never copies
+typedef struct ChunkedDecoder {
+    ChunkedState state;
+    uint64_t remaining; // Size being parsed, then data bytes left in the chunk
+    unsigned digits;
+} ChunkedDecoder;
+
+typedef enum ChunkedResult {
+    CHUNKED_MORE, // All input used, the body continues
+    CHUNKED_DATA, // A run of body bytes was found
+    CHUNKED_DONE, // The body and its trailers ended
+    CHUNKED_ERROR,
+} ChunkedResult;
+
+extern void chunked_decoder_init(ChunkedDecoder *decoder);
+extern ChunkedResult chunked_decode(ChunkedDecoder *decoder, const char *in, size_t len, size_t *consumed,
+    const char **data, size_t *data_len);
+
+#endif // CHUNKED_H
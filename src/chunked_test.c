@@ -0,0 +1,103 @@
+#include "chunked.h"
+#include "test.h"
+#include <string.h>
+
+#define MAX_DECODED 256
+
+// Decode in reads of segment bytes, as they would arrive. Returns the last
+// result, with the body in out and the raw bytes used in consumed
+static ChunkedResult decode(const char *in, size_t segment, char *out, size_t *out_len, size_t *consumed)
+{
+    ChunkedDecoder decoder;
+    chunked_decoder_init(&decoder);
+    size_t len = strlen(in);
+    size_t used = 0, read = 0;
+    ChunkedResult result = CHUNKED_MORE;
+    *out_len = 0;
+    while (result != CHUNKED_DONE && result != CHUNKED_ERROR) {
+        if (used == read) {
+            if (read == len) {
+                break;
+            }
+            read = read + segment < len ? read + segment : len;
+        }
+        size_t step;
+        const char *data;
+        size_t data_len;
+        result = chunked_decode(&decoder, in + used, read - used, &step, &data, &data_len);
+        used += step;
+        if (result == CHUNKED_DATA) {
+            if (*out_len + data_len > MAX_DECODED) {
+                return CHUNKED_ERROR;
+            }
+            memcpy(out + *out_len, data, data_len);
+            *out_len += data_len;
+        }
+    }
+    *consumed = used;
+    return result;
+}
+
+// The same body decodes the same whichever way it is split up
+static void check_body(const char *in, const char *body, size_t raw_len)
+{
+    for (size_t segment = 1; segment <= strlen(in); segment++) {
+        char out[MAX_DECODED];
+        size_t out_len, consumed;
+        CHECK(decode(in, segment, out, &out_len, &consumed) == CHUNKED_DONE);
+        CHECK(out_len == strlen(body) && memcmp(out, body, out_len) == 0);
+        // Bytes after the body are left for the next request
+        CHECK(consumed == raw_len);
+    }
+}
+
+static void check_error(const char *in)
+{
+    for (size_t segment = 1; segment <= strlen(in); segment++) {
+        char out[MAX_DECODED];
+        size_t out_len, consumed;
+        CHECK(decode(in, segment, out, &out_len, &consumed) == CHUNKED_ERROR);
+    }
+}
+
+static void test_bodies()
+{
+    check_body("5\r\nhello\r\n6\r\n world\r\n0\r\n\r\n", "hello world", 26);
+    check_body("0\r\n\r\n", "", 5);
+    check_body("5\r\nhello\r\n0\r\n\r\nGET / HTTP/1.1\r\n", "hello", 15);
+    check_body("A\r\n0123456789\r\na\r\nabcdefghij\r\n0\r\n\r\n", "0123456789abcdefghij", 35);
+    // Extensions and trailers are skipped
+    check_body("5;name=value\r\nhello\r\n0;last\r\n\r\n", "hello", 31);
+    check_body("5\r\nhello\r\n0\r\nX-Checksum: 1\r\nX-More: 2\r\n\r\n", "hello", 41);
+    check_body("00005\r\nhello\r\n0\r\n\r\n", "hello", 19);
+}
+
+static void test_errors()
+{
+    // Sizes need hex digits, and at most fifteen of them
+    check_error("\r\n");
+    check_error("x\r\n");
+    check_error("-5\r\nhello\r\n0\r\n\r\n");
+    check_error("5x\r\nhello\r\n0\r\n\r\n");
+    check_error("1000000000000000\r\n");
+    // Bare LFs and missing CRLFs around data
+    check_error("5\nhello\r\n0\r\n\r\n");
+    check_error("5;ext\nhello\r\n0\r\n\r\n");
+    check_error("5\r\nhelloX\r\n0\r\n\r\n");
+    check_error("5\r\nhello\rX0\r\n\r\n");
+    check_error("0\r\n\rX");
+    check_error("0\r\nX-Trailer: 1\rX");
+
+    // Fifteen digits is a size, it just never arrives
+    char out[MAX_DECODED];
+    size_t out_len, consumed;
+    CHECK(decode("fffffffffffffff\r\nabc", 1, out, &out_len, &consumed) == CHUNKED_DATA);
+    CHECK(out_len == 3);
+}
+
+int main()
+{
+    test_bodies();
+    test_errors();
+    return TEST_RESULT();
+}
@@ -1,45 +1,889 @@
+#define _GNU_SOURCE
 #include "client_info.h"
+#include "access_log.h"
 #include "http_utils.h"
+#include "request_body.h"
+#include "worker.h"
 #include <errno.h>
 #include <fcntl.h>
+#include <netinet/in.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
+#include <time.h>
 
-// Initialize a new client structure
-ClientInfo *create_client(int fd)
+// Most iovecs passed to a single sendmsg or send chain
+#define MAX_FLUSH_IOVECS 64
+// Streamed body bytes read ahead of the handler before it gets them
+#define BODY_READ_AHEAD (16 * 1024)
+
+// A read buffer that queued output may still point into
+typedef struct RetiredBuffer {
+    struct RetiredBuffer *next;
+    char *buffer;
+    size_t size;
+    int ring_buffer_id;
+} RetiredBuffer;
+
+// Something queued output points into, released once the queue drains
+typedef struct HeldOutput {
+    struct HeldOutput *next;
+    void (*release)(void *data);
+    void *data;
+} HeldOutput;
+
+/**
+ * Track a newly accepted socket, taken from the worker's pool. It starts
+ * out idle, request state is only attached once there is something to read
+ * @param worker Worker that accepted it
+ * @param fd Non-blocking socket, closed with the connection
+ * @return The connection, or NULL if out of memory
+ */
+Connection *create_connection(Worker *worker, int fd)
 {
-    ClientInfo *client = malloc(sizeof(ClientInfo));
+    Connection *conn = slab_alloc(&worker->connection_pool);
+    if (!conn)
+        return NULL;
+
+    conn->handle.fd = fd;
+    conn->handle.events = 0;
+    conn->handle.callback = NULL;
+    conn->client = NULL;
+    timer_init(&conn->timer, NULL, conn);
+    conn->timeout = TIMEOUT_NONE;
+    conn->timeout_mark = 0;
+    conn->requests = 0;
+    conn->bytes_received = 0;
+    conn->bytes_sent = 0;
+    conn->accepted_at = 0;
+    conn->peer_addr = 0;
+    conn->peer_port = 0;
+    conn->worker = worker;
+
+    // Only the access log needs the peer, and only once per connection
+    if (worker->access_log.records) {
+        struct sockaddr_in addr;
+        socklen_t addr_len = sizeof(addr);
+        if (getpeername(fd, (struct sockaddr *)&addr, &addr_len) == 0 && addr.sin_family == AF_INET) {
+            conn->peer_addr = addr.sin_addr.s_addr;
+            conn->peer_port = addr.sin_port;
+        }
+    }
+    return conn;
+}
+
+// Close the socket and put the record back, any ClientInfo is freed first
+void free_connection(Connection *conn)
+{
+    close(conn->handle.fd);
+    slab_free(&conn->worker->connection_pool, conn);
+}
+
+// Attach request state to a connection that has become busy, taken from the
+// worker's pool
+ClientInfo *create_client(Connection *conn)
+{
+    Worker *worker = conn->worker;
+    ClientInfo *client = slab_alloc(&worker->client_pool);
     if (!client)
         return NULL;
 
-    client->fd = fd;
-    client->buf_size = BUFFER_SIZE;
+    client->conn = conn;
+    client->worker = worker;
+    // The read buffer is only allocated once data arrives, completion
+    // backends lend theirs instead
+    client->buffer = NULL;
+    client->buf_start = 0;
+    client->buf_size = 0;
     client->buf_used = 0;
-    client->buffer = malloc(BUFFER_SIZE);
+    reset_http_framing(client);
+    client->ring_buffer_id = -1;
+    client->max_body_size = worker->config->max_body_size;
+    client->offer_bodies = worker->config->stream_handler != NULL;
+    client->body_callback = NULL;
+    client->body_data = NULL;
+    client->body_delivered = 0;
+    client->body_paused = false;
+    client->producer = NULL;
+    client->producer_data = NULL;
+    client->response_in_progress = false;
+    client->out_iov = NULL;
+    client->out_iov_size = 0;
+    client->out_head = 0;
+    client->out_tail = 0;
+    client->out_in_flight = 0;
+    client->out_pending = 0;
+    client->out_files = NULL;
+    client->out_files_size = 0;
+    client->out_files_head = 0;
+    client->out_files_tail = 0;
+    client->write_blocked = false;
+    client->retired = NULL;
+    client->held = NULL;
+    arena_init(&client->arena, &worker->buffers);
     client->state = CLIENT_WRITING;
+    client->keep_alive = true;
+    client->peer_closed = false;
+    client->http_1_0 = false;
+    client->head_request = false;
+    client->accepted_encodings = 0;
+    client->unread_data = false;
+    client->method = METHOD_COUNT;
+    client->minor_version = 1;
+    client->target_offset = 0;
+    client->target_len = 0;
+    client->request_started_ms = 0;
+    client->request_queued = 0;
+    client->status_code = 0;
+    client->cache_fill = NULL;
+    client->upstream = NULL;
+    client->offload = NULL;
+    conn->client = client;
+    return client;
+}
 
-    if (!client->buffer) {
-        free(client);
-        return NULL;
+static void release_retired_buffers(ClientInfo *client)
+{
+    for (RetiredBuffer *retired = client->retired; retired; retired = retired->next) {
+        if (retired->ring_buffer_id >= 0) {
+            event_loop_release_buffer(client->worker->loop, retired->ring_buffer_id);
+        } else {
+            buffer_free(&client->worker->buffers, retired->buffer, retired->size);
+        }
     }
+    // The list itself lives in the arena
+    client->retired = NULL;
+}
 
-    // Set socket to non-blocking mode
-    int flags = fcntl(fd, F_GETFL, 0);
-    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+// Keep a buffer around until everything queued has been sent
+static bool retire_buffer(ClientInfo *client, char *buffer, size_t size, int ring_buffer_id)
+{
+    RetiredBuffer *retired = client_alloc(client, sizeof(RetiredBuffer));
+    if (!retired) {
+        return false;
+    }
+    retired->buffer = buffer;
+    retired->size = size;
+    retired->ring_buffer_id = ring_buffer_id;
+    retired->next = client->retired;
+    client->retired = retired;
+    return true;
+}
 
-    return client;
+static void release_held_output(ClientInfo *client)
+{
+    for (HeldOutput *held = client->held; held; held = held->next) {
+        held->release(held->data);
+    }
+    // The list itself lives in the arena
+    client->held = NULL;
+}
+
+/**
+ * Hand the rest of the current response to a producer, called each time the
+ * client has taken everything queued, so only about --output-high-water
+ * bytes of a response of any size are ever held. The next request waits
+ * until the producer reports the response complete
+ * @param client Client being answered, the handler returns once this is set
+ * @param producer Queues the next part of the response
+ * @param data Passed to producer, it has to outlive the handler, e.g. in
+ * request memory, which is kept until the response is complete
+ */
+void produce_client_response(ClientInfo *client, ResponseProducer producer, void *data)
+{
+    client->producer = producer;
+    client->producer_data = data;
+    client->response_in_progress = true;
+    client->state = CLIENT_PRODUCING;
+}
+
+/**
+ * Have the producer queue the next part of the response once the client has
+ * taken the last, and move on to the next request once it is complete
+ * @param client Client in CLIENT_PRODUCING
+ */
+void resume_client_response(ClientInfo *client)
+{
+    if (client->state != CLIENT_PRODUCING || client_has_pending_output(client)) {
+        return;
+    }
+    if (client->producer(client, false, client->producer_data)) {
+        client->producer = NULL;
+        client->response_in_progress = false;
+        if (client->state == CLIENT_PRODUCING) {
+            client->state = CLIENT_READY;
+            finish_client_request(client, client->worker->loop);
+        }
+    }
+    flush_client(client);
+}
+
+/**
+ * Keep memory someone else owns alive while the output queue points into
+ * it, e.g. a shared cache entry queued without copying
+ * @param client Client whose queue holds the memory
+ * @param release Called with data once everything queued so far has been
+ * sent or dropped
+ * @param data Passed to release
+ * @return false if it couldn't be recorded, release is not called then
+ */
+bool client_hold(ClientInfo *client, void (*release)(void *data), void *data)
+{
+    HeldOutput *held = client_alloc(client, sizeof(HeldOutput));
+    if (!held) {
+        return false;
+    }
+    held->release = release;
+    held->data = data;
+    held->next = client->held;
+    client->held = held;
+    return true;
+}
+
+// Let go of the read buffer, or keep it around until queued output that
+// points into it has been sent
+static bool drop_client_buffer(ClientInfo *client, EventLoop *loop)
+{
+    if (client_has_pending_output(client)) {
+        if (!retire_buffer(client, client->buffer, client->buf_size, client->ring_buffer_id)) {
+            return false;
+        }
+    } else if (client->ring_buffer_id >= 0) {
+        event_loop_release_buffer(loop, client->ring_buffer_id);
+    } else {
+        buffer_free(&client->worker->buffers, client->buffer, client->buf_size);
+    }
+    client->ring_buffer_id = -1;
+    return true;
+}
+
+// Make room for at least extra more bytes in the client's own buffer,
+// moving out of a borrowed loop buffer if needed. Only the current request
+// moves, bytes before buf_start belong to requests already answered
+static bool reserve_client_buffer(ClientInfo *client, EventLoop *loop, size_t extra)
+{
+    if (client->ring_buffer_id < 0 && client->buf_size - client->buf_used >= extra) {
+        return true;
+    }
+
+    size_t keep = client->buf_used - client->buf_start;
+    size_t new_size;
+    char *new_buf = buffer_alloc(&client->worker->buffers, keep + extra, &new_size);
+    if (!new_buf) {
+        return false;
+    }
+    if (keep > 0) {
+        memcpy(new_buf, client->buffer + client->buf_start, keep);
+    }
+
+    if (!drop_client_buffer(client, loop)) {
+        buffer_free(&client->worker->buffers, new_buf, new_size);
+        return false;
+    }
+    client->buffer = new_buf;
+    client->buf_size = new_size;
+    client->buf_start = 0;
+    client->buf_used = keep;
+    return true;
+}
+
+// Give a borrowed loop buffer back, or free the client's own buffer
+void release_client_buffer(ClientInfo *client, EventLoop *loop)
+{
+    if (client->ring_buffer_id >= 0) {
+        event_loop_release_buffer(loop, client->ring_buffer_id);
+        client->ring_buffer_id = -1;
+    } else {
+        buffer_free(&client->worker->buffers, client->buffer, client->buf_size);
+    }
+    client->buffer = NULL;
+    client->buf_start = 0;
+    client->buf_size = 0;
+    client->buf_used = 0;
+}
+
+// Move the current request to the front of the buffer once nothing queued
+// points at the requests before it any more
+static void compact_client_buffer(ClientInfo *client)
+{
+    if (client->buf_start == 0) {
+        return;
+    }
+
+    size_t leftover = client->buf_used - client->buf_start;
+    if (leftover == 0) {
+        // Idle connections don't hold on to loop buffers
+        if (client->ring_buffer_id >= 0) {
+            release_client_buffer(client, client->worker->loop);
+        }
+        client->buf_used = 0;
+    } else {
+        memmove(client->buffer, client->buffer + client->buf_start, leftover);
+        client->buf_used = leftover;
+    }
+    client->buf_start = 0;
+}
+
+/**
+ * Note what the access log needs of a request that was just parsed
+ * @param client Client the request came in on
+ * @param req_or_err The request, or why it couldn't be parsed
+ */
+void start_client_request(ClientInfo *client, const RequestOrError *req_or_err)
+{
+    client->request_started_ms = client->worker->loop->timers.now_ms;
+    client->request_queued = client->conn->bytes_sent + client->out_pending;
+    client->status_code = 0;
+    if (req_or_err->has_error) {
+        client->method = METHOD_COUNT;
+        return;
+    }
+
+    // The target is logged as it was sent, not as it was decoded
+    const Request *req = &req_or_err->data.req;
+    client->method = req->method;
+    client->minor_version = req->minor_version;
+    client->target_offset = req->target.data - (client->buffer + client->buf_start);
+    client->target_len = req->target.len;
+}
+
+// Queue a record of the request at buf_start for the access log flusher, or
+// count it as dropped if the flusher has fallen behind
+static void log_client_request(ClientInfo *client)
+{
+    Worker *worker = client->worker;
+    AccessLogRecord *record = access_log_reserve(&worker->access_log);
+    if (!record) {
+        metrics_add(&worker->metrics.access_log_dropped, 1);
+        return;
+    }
+
+    uint64_t queued = client->conn->bytes_sent + client->out_pending;
+    record->time = time(NULL);
+    record->bytes = queued > client->request_queued ? queued - client->request_queued : 0;
+    record->duration_ms = worker->loop->timers.now_ms - client->request_started_ms;
+    record->addr = client->conn->peer_addr;
+    record->port = client->conn->peer_port;
+    record->status = client->status_code;
+    record->method = client->method;
+    record->minor_version = client->minor_version;
+    record->target_len = 0;
+    size_t buffered = client->buf_used - client->buf_start;
+    if (client->method != METHOD_COUNT && client->target_offset + client->target_len <= buffered) {
+        size_t len = client->target_len < ACCESS_LOG_TARGET_LEN ? client->target_len : ACCESS_LOG_TARGET_LEN;
+        memcpy(record->target, client->buffer + client->buf_start + client->target_offset, len);
+        record->target_len = client->target_len > UINT16_MAX ? UINT16_MAX : client->target_len;
+    }
+    access_log_commit(&worker->access_log);
 }
 
-// Clean up client structure
+// Done with the request at buf_start: skip past it and check whether another
+// complete request is waiting. The bytes stay put until its response is sent
+void finish_client_request(ClientInfo *client, EventLoop *loop)
+{
+    client->conn->requests++;
+    if (client->worker->access_log.records) {
+        log_client_request(client);
+    }
+    if (!client->keep_alive) {
+        client->state = CLIENT_DONE;
+        return;
+    }
+
+    client->buf_start += client->req_len;
+    reset_http_framing(client);
+    if (!client_has_pending_output(client)) {
+        compact_client_buffer(client);
+    }
+
+    if (check_http_end(client)) {
+        client->state = CLIENT_READY;
+    } else if (client->peer_closed) {
+        client->state = CLIENT_DONE;
+    } else {
+        client->state = CLIENT_WRITING;
+        // Partial requests move out of loop buffers so they can't run dry
+        if (client->ring_buffer_id >= 0 && client->buf_used > client->buf_start
+            && !reserve_client_buffer(client, loop, 0)) {
+            client->state = CLIENT_DONE;
+        }
+    }
+}
+
+// Make room for one more entry at the end of the output queue
+static bool reserve_output_entry(ClientInfo *client)
+{
+    if ((client->out_tail + 1) * sizeof(struct iovec) <= client->out_iov_size) {
+        return true;
+    }
+
+    // Grow, dropping entries that have been sent
+    size_t live = client->out_tail - client->out_head;
+    size_t new_size;
+    struct iovec *new_iov = (struct iovec *)buffer_alloc(&client->worker->buffers,
+        (live + 1) * sizeof(struct iovec), &new_size);
+    if (!new_iov) {
+        return false;
+    }
+    if (live > 0) {
+        memcpy(new_iov, client->out_iov + client->out_head, live * sizeof(struct iovec));
+    }
+    // A completion backend may still be reading the old array
+    if (client->out_in_flight > 0) {
+        if (!retire_buffer(client, (char *)client->out_iov, client->out_iov_size, -1)) {
+            buffer_free(&client->worker->buffers, (char *)new_iov, new_size);
+            return false;
+        }
+    } else {
+        buffer_free(&client->worker->buffers, (char *)client->out_iov, client->out_iov_size);
+    }
+    client->out_iov = new_iov;
+    client->out_iov_size = new_size;
+    client->out_head = 0;
+    client->out_tail = live;
+    return true;
+}
+
+/**
+ * Queue bytes to be sent after everything already queued, without copying
+ * @param client Client to send to
+ * @param data Bytes to send, they must stay valid until the queue drains,
+ * e.g. static data, client_alloc memory or views of the request
+ * @param len Number of bytes
+ * @return false if the queue could not grow
+ */
+bool queue_client_output(ClientInfo *client, const void *data, size_t len)
+{
+    if (len == 0) {
+        return true;
+    }
+    if (!reserve_output_entry(client)) {
+        return false;
+    }
+
+    client->out_iov[client->out_tail].iov_base = (void *)data;
+    client->out_iov[client->out_tail].iov_len = len;
+    client->out_tail++;
+    client->out_pending += len;
+    return true;
+}
+
+/**
+ * Queue part of a file to be sent with sendfile, so it never passes through
+ * user space
+ * @param client Client to send to
+ * @param fd File to send from, it must stay open until release is called
+ * @param offset Where in the file to start
+ * @param len Number of bytes
+ * @param release Called with data once the range has been sent or dropped
+ * @param data Passed to release
+ * @return false if the queue could not grow, release is not called then
+ */
+bool queue_client_file(ClientInfo *client, int fd, off_t offset, size_t len,
+    void (*release)(void *data), void *data)
+{
+    if (len == 0) {
+        release(data);
+        return true;
+    }
+
+    if (client->out_files_tail == client->out_files_size / sizeof(OutputFile)) {
+        size_t live = client->out_files_tail - client->out_files_head;
+        size_t new_size;
+        OutputFile *new_files = (OutputFile *)buffer_alloc(&client->worker->buffers,
+            (live + 1) * sizeof(OutputFile), &new_size);
+        if (!new_files) {
+            return false;
+        }
+        if (live > 0) {
+            memcpy(new_files, client->out_files + client->out_files_head, live * sizeof(OutputFile));
+        }
+        buffer_free(&client->worker->buffers, (char *)client->out_files, client->out_files_size);
+        client->out_files = new_files;
+        client->out_files_size = new_size;
+        client->out_files_head = 0;
+        client->out_files_tail = live;
+    }
+    if (!reserve_output_entry(client)) {
+        return false;
+    }
+
+    // The file's place in the queue is marked by an entry without memory
+    client->out_iov[client->out_tail].iov_base = NULL;
+    client->out_iov[client->out_tail].iov_len = len;
+    client->out_tail++;
+    client->out_pending += len;
+
+    OutputFile *file = &client->out_files[client->out_files_tail++];
+    file->fd = fd;
+    file->offset = offset;
+    file->release = release;
+    file->data = data;
+    return true;
+}
+
+/**
+ * Queue bytes already sitting in a pipe, e.g. spliced from another socket,
+ * to be spliced on to the client without passing through user space
+ * @param client Client to send to
+ * @param pipe_fd Read end of the pipe, holding at least len bytes until release
+ * @param len Number of bytes
+ * @param release Called with data once the bytes have been sent or dropped
+ * @param data Passed to release
+ * @return false if the queue could not grow, release is not called then
+ */
+bool queue_client_pipe(ClientInfo *client, int pipe_fd, size_t len, void (*release)(void *data), void *data)
+{
+    return queue_client_file(client, pipe_fd, -1, len, release, data);
+}
+
+bool client_has_pending_output(ClientInfo *client)
+{
+    return client->out_head < client->out_tail;
+}
+
+// Whether enough output is queued that the client should not be given more
+// until some of it has been sent
+bool client_output_over_high_water(ClientInfo *client)
+{
+    return client->out_pending >= client->worker->config->output_high_water;
+}
+
+// Memory for the current request, handlers can point responses at it since
+// it is only reclaimed once everything queued has been sent
+void *client_alloc(ClientInfo *client, size_t size)
+{
+    return arena_alloc(&client->arena, size);
+}
+
+// Let go of everything the output queue holds, sent or not
+static void drop_client_output(ClientInfo *client)
+{
+    // Files are only left over when the queue is dropped early
+    for (size_t i = client->out_files_head; i < client->out_files_tail; i++) {
+        client->out_files[i].release(client->out_files[i].data);
+    }
+    buffer_free(&client->worker->buffers, (char *)client->out_files, client->out_files_size);
+    client->out_files = NULL;
+    client->out_files_size = 0;
+    client->out_files_head = 0;
+    client->out_files_tail = 0;
+
+    release_retired_buffers(client);
+    release_held_output(client);
+    // A streamed body's handler, or a response still being written, may
+    // still hold state in the arena
+    if (client->state != CLIENT_BODY && !client->response_in_progress) {
+        arena_reset(&client->arena);
+    }
+    buffer_free(&client->worker->buffers, (char *)client->out_iov, client->out_iov_size);
+    client->out_iov = NULL;
+    client->out_iov_size = 0;
+    client->out_head = 0;
+    client->out_tail = 0;
+    client->out_pending = 0;
+}
+
+// The client is going away before its response is complete
+static void abort_client_response(ClientInfo *client)
+{
+    if (client->producer) {
+        client->producer(client, true, client->producer_data);
+        client->producer = NULL;
+    }
+    client->response_in_progress = false;
+}
+
+// Detach the request state from its connection and put it back in the pool
 void free_client(ClientInfo *client)
 {
     if (client) {
+        abort_request_body(client);
+        abort_client_response(client);
+        // Drops whatever is still queued
+        drop_client_output(client);
         if (client->buffer) {
-            free(client->buffer);
+            release_client_buffer(client, client->worker->loop);
         }
-        close(client->fd);
-        free(client);
+        client->conn->client = NULL;
+        slab_free(&client->worker->client_pool, client);
+    }
+}
+
+/**
+ * Whether the connection is only waiting for its next request, with nothing
+ * buffered, queued or in progress, so its ClientInfo can go back to the pool
+ * @param client Client to check
+ * @return true if free_client would lose nothing
+ */
+bool client_is_idle(const ClientInfo *client)
+{
+    return client->state == CLIENT_WRITING && client->buf_used == 0 && !client->unread_data
+        && client->out_head == client->out_tail && client->out_files_head == client->out_files_tail
+        && !client->retired && !client->held && !client->body_callback && !client->cache_fill && !client->upstream
+        && !client->offload && !client->producer;
+}
+
+// Everything queued has been sent or dropped, so nothing points into the
+// arena or at earlier requests any more
+static void reclaim_client_output(ClientInfo *client)
+{
+    drop_client_output(client);
+    // The request's bytes stay put while its response is being written
+    if (!client->response_in_progress) {
+        compact_client_buffer(client);
+    }
+}
+
+static void count_sent(ClientInfo *client, size_t len)
+{
+    client->conn->bytes_sent += len;
+    metrics_add(&client->worker->metrics.bytes_sent, len);
+}
+
+// Advance the queue past written bytes, trimming a partially sent entry
+static void consume_client_output(ClientInfo *client, size_t written)
+{
+    client->out_pending -= written;
+    count_sent(client, written);
+    while (written > 0) {
+        struct iovec *iov = &client->out_iov[client->out_head];
+        if (written >= iov->iov_len) {
+            written -= iov->iov_len;
+            client->out_head++;
+        } else {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= written;
+            written = 0;
+        }
+    }
+}
+
+// Memory entries from the head of the queue up to the next file
+static size_t count_memory_entries(ClientInfo *client)
+{
+    size_t count = 0;
+    while (client->out_head + count < client->out_tail && count < MAX_FLUSH_IOVECS
+        && client->out_iov[client->out_head + count].iov_base != NULL) {
+        count++;
+    }
+    return count;
+}
+
+// Send the file at the head of the queue straight from the page cache, or
+// splice the pipe's bytes. Returns 1 once it is all sent, 0 if the socket
+// is full and -1 on errors
+static int send_client_file(ClientInfo *client)
+{
+    struct iovec *iov = &client->out_iov[client->out_head];
+    OutputFile *file = &client->out_files[client->out_files_head];
+
+    while (iov->iov_len > 0) {
+        ssize_t sent = file->offset < 0
+            ? splice(file->fd, NULL, client->conn->handle.fd, NULL, iov->iov_len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK)
+            : sendfile(client->conn->handle.fd, file->fd, &file->offset, iov->iov_len);
+        if (sent < 0) {
+            if (errno == EINTR)
+                continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        if (sent == 0) {
+            // The file shrank under us or the pipe ran dry, the promised length can't be sent
+            errno = EIO;
+            return -1;
+        }
+        iov->iov_len -= sent;
+        client->out_pending -= sent;
+        count_sent(client, sent);
+    }
+
+    file->release(file->data);
+    client->out_files_head++;
+    client->out_head++;
+    return 1;
+}
+
+// Ask to be told once the socket is writable again
+static bool wait_client_writable(ClientInfo *client)
+{
+    if (event_loop_wait_writable(client->worker->loop, &client->conn->handle) < 0) {
+        return false;
+    }
+    client->write_blocked = true;
+    return true;
+}
+
+static void fail_client_output(ClientInfo *client)
+{
+    perror("send failed");
+    client->state = CLIENT_DONE;
+    reclaim_client_output(client);
+}
+
+// Send as much of the output queue as the socket takes. Whatever is left
+// goes out once it is writable again, or once the in-flight send completes
+void flush_client(ClientInfo *client)
+{
+    EventLoop *loop = client->worker->loop;
+
+    // Already waiting for EVENT_WRITABLE, or for EVENT_SENT
+    if (client->write_blocked || client->out_in_flight > 0) {
+        return;
+    }
+
+    while (client_has_pending_output(client)) {
+        if (client->out_iov[client->out_head].iov_base == NULL) {
+            int result = send_client_file(client);
+            if (result < 0 || (result == 0 && !wait_client_writable(client))) {
+                fail_client_output(client);
+                return;
+            }
+            if (result == 0) {
+                return;
+            }
+            continue;
+        }
+
+        size_t count = count_memory_entries(client);
+        if (event_loop_completes_io(loop)) {
+            // One send in flight at a time, the rest goes out on EVENT_SENT
+            if (event_loop_send(loop, &client->conn->handle, client->out_iov + client->out_head, count) < 0) {
+                fail_client_output(client);
+                return;
+            }
+            client->out_in_flight = count;
+            return;
+        }
+
+        struct msghdr msg = { .msg_iov = client->out_iov + client->out_head, .msg_iovlen = count };
+        ssize_t written = sendmsg(client->conn->handle.fd, &msg, MSG_NOSIGNAL);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            // Keep the rest queued until the socket drains
+            if ((errno != EAGAIN && errno != EWOULDBLOCK) || !wait_client_writable(client)) {
+                fail_client_output(client);
+            }
+            return;
+        }
+        consume_client_output(client, written);
+    }
+
+    reclaim_client_output(client);
+    if (client->conn->handle.events & EVENT_WRITABLE) {
+        event_loop_modify(loop, &client->conn->handle, client->conn->handle.events & ~EVENT_WRITABLE);
+    }
+}
+
+// The socket can take more after a write came back with EAGAIN
+void resume_client_output(ClientInfo *client)
+{
+    client->write_blocked = false;
+    flush_client(client);
+}
+
+// A completion backend finished sending the in-flight entries
+void complete_client_send(ClientInfo *client, int result)
+{
+    client->out_in_flight = 0;
+
+    if (result < 0) {
+        client->state = CLIENT_DONE;
+        reclaim_client_output(client);
+        return;
+    }
+
+    // Sends are retried in the kernel until everything is out, so this
+    // covers all in-flight entries unless the connection broke
+    consume_client_output(client, result);
+
+    // Responses queued while the last send was in flight
+    flush_client(client);
+}
+
+// Count bytes from the client, timing how long the first ones took to come
+static void count_received(ClientInfo *client, size_t len)
+{
+    Metrics *metrics = &client->worker->metrics;
+    if (client->conn->bytes_received == 0) {
+        metrics_end(metrics, STAGE_FIRST_BYTE, client->conn->accepted_at);
+    }
+    client->conn->bytes_received += len;
+    metrics_add(&metrics->bytes_received, len);
+}
+
+// Check newly received bytes for the end of the request
+static bool received_request_end(ClientInfo *client)
+{
+    Metrics *metrics = &client->worker->metrics;
+    uint64_t start = metrics_start(metrics, STAGE_READ);
+    bool complete = check_http_end(client);
+    metrics_end(metrics, STAGE_READ, start);
+    return complete;
+}
+
+// Whether a request is being answered, which the client shutting down its
+// side doesn't stop
+static bool answering_request(const ClientInfo *client)
+{
+    return client->state == CLIENT_READY || client->state == CLIENT_BODY || client->state == CLIENT_UPSTREAM
+        || client->state == CLIENT_OFFLOADED || client->state == CLIENT_PRODUCING;
+}
+
+// Handle data received by a completion backend into one of its buffers.
+// If nothing is pending the buffer is used in place as the client's buffer,
+// otherwise its bytes are appended and it is handed straight back
+void receive_client_data(ClientInfo *client, EventLoop *loop, const Event *event)
+{
+    if (event->result <= 0) {
+        if (event->data) {
+            event_loop_release_buffer(loop, event->buffer_id);
+        }
+        if (event->result == 0) {
+            // End of stream, whatever is buffered can still be answered
+            client->peer_closed = true;
+            if (!answering_request(client)) {
+                client->state = CLIENT_DONE;
+            }
+        } else {
+            errno = -event->result;
+            perror("recv failed");
+            client->state = CLIENT_DONE;
+        }
+        return;
+    }
+
+    size_t len = event->result;
+    count_received(client, len);
+
+    if (client->buf_used == 0 && client->ring_buffer_id < 0) {
+        buffer_free(&client->worker->buffers, client->buffer, client->buf_size);
+        client->buffer = event->data;
+        // Anything appended later moves the data into an owned buffer
+        client->buf_size = len;
+        client->buf_used = len;
+        client->ring_buffer_id = event->buffer_id;
+    } else {
+        if (!reserve_client_buffer(client, loop, len)) {
+            event_loop_release_buffer(loop, event->buffer_id);
+            client->state = CLIENT_DONE;
+            return;
+        }
+        memcpy(client->buffer + client->buf_used, event->data, len);
+        client->buf_used += len;
+        event_loop_release_buffer(loop, event->buffer_id);
+    }
+
+    // If the end of the HTTP request, set client state to ready
+    if (client->state == CLIENT_WRITING && received_request_end(client)) {
+        client->state = CLIENT_READY;
+    }
+    // A request still waiting on the client moves out of the loop buffer,
+    // a trickle of them must not run the loop dry for everyone else
+    if (client->state != CLIENT_READY && client->ring_buffer_id >= 0 && !reserve_client_buffer(client, loop, 0)) {
+        client->state = CLIENT_DONE;
     }
 }
 
@@ -47,40 +891,48 @@ void free_client(ClientInfo *client)
 void handle_client_data(ClientInfo *client)
 {
     while (1) {
+        // A streamed body is handed over before more of it is read
+        if (client->state == CLIENT_BODY
+            && client->buf_used - client->buf_start - client->headers_len >= BODY_READ_AHEAD) {
+            client->unread_data = true;
+            return;
+        }
+        // So is a complete request. Pipelined ones are answered before more
+        // is read, the header and body limits cap what a partial one buffers
+        if (client->state == CLIENT_READY) {
+            client->unread_data = true;
+            return;
+        }
+
         // Ensure we have room in the buffer
-        if (client->buf_used == client->buf_size) {
-            size_t new_size = client->buf_size * 2;
-            char *new_buf = realloc(client->buffer, new_size);
-            if (!new_buf) {
-                perror("realloc failed");
-                break;
-            }
-            client->buffer = new_buf;
-            client->buf_size = new_size;
+        if (client->buf_used == client->buf_size
+            && !reserve_client_buffer(client, client->worker->loop, BUFFER_SIZE)) {
+            break;
         }
 
         // TODO: Convert this to recv, potentially more performant
         // Read what we can
-        ssize_t bytes_read = read(client->fd, client->buffer + client->buf_used,
+        ssize_t bytes_read = read(client->conn->handle.fd, client->buffer + client->buf_used,
             client->buf_size - client->buf_used);
 
         if (bytes_read > 0) {
             client->buf_used += bytes_read;
-            // Process the data here. For this example, we'll just print it.
-            printf("Received %zd bytes: %.*s", bytes_read, (int)bytes_read,
+            count_received(client, bytes_read);
+            debug_log("Received %zd bytes: %.*s", bytes_read, (int)bytes_read,
                 client->buffer + client->buf_used - bytes_read);
 
             // If the end of the HTTP request, set client state to ready
-            if (check_http_end(client)) {
+            if (client->state == CLIENT_WRITING && received_request_end(client)) {
                 client->state = CLIENT_READY;
             }
         } else if (bytes_read == 0) {
-            // End of stream
-            // Set client state to ready
-            client->state = CLIENT_READY;
+            // End of stream, whatever is buffered can still be answered
+            client->peer_closed = true;
+            if (!answering_request(client)) {
+                client->state = CLIENT_DONE;
+            }
 
-            printf("Client closed connection. Total bytes received: %zu\n",
-                client->buf_used);
+            debug_log("Client closed connection. Total bytes received: %zu\n", client->buf_used);
             return;
 
         } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
@@ -90,7 +942,7 @@ void handle_client_data(ClientInfo *client)
         } else {
             // Error occurred
             perror("read failed");
-            shutdown(client->fd, SHUT_WR);
+            client->state = CLIENT_DONE;
             return;
         }
     }
@@ -1,9 +1,15 @@
 #ifndef CLIENT_INFO_H
 #define CLIENT_INFO_H
 
+#include "chunked.h"
+#include "common.h"
+#include "event_loop.h"
+#include "pool.h"
 #include "request.h"
+#include "timer_wheel.h"
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <unistd.h>
 
 #define BUFFER_SIZE 1024
@@ -11,21 +17,167 @@
 typedef enum ClientState {
     CLIENT_WRITING,
     CLIENT_READY,
+    CLIENT_BODY, // Headers answered, the body is streamed to a BodyCallback
+    CLIENT_UPSTREAM, // Request forwarded, the response is relayed as the backend sends it
+    CLIENT_OFFLOADED, // Handler running on an offload thread, the response comes back to the worker
+    CLIENT_PRODUCING, // The rest of the response is written by a ResponseProducer as the client takes it
     CLIENT_DONE,
+    CLIENT_CLOSING, // Removed from the loop, waiting for in-flight I/O
 } ClientState;
 
-// Structure to track client state
+// A file range queued for sendfile, or bytes waiting in a pipe for splice.
+// Its place in the output queue is an entry with a NULL iov_base and the
+// bytes still to send as iov_len
+typedef struct OutputFile {
+    int fd;
+    off_t offset; // -1 for a pipe
+    void (*release)(void *data); // Called once the range is sent or dropped
+    void *data;
+} OutputFile;
+
+typedef enum FramingError {
+    FRAMING_OK,
+    FRAMING_MALFORMED,
+    FRAMING_TOO_LARGE, // Body over the configured maximum
+} FramingError;
+
+typedef enum BodyStatus {
+    BODY_MORE, // Another fragment, more follow
+    BODY_COMPLETE, // The last fragment, possibly empty
+    BODY_ABORTED, // The body will never complete, e.g. the client went away
+} BodyStatus;
+
+// What a connection's timer is counting down to
+typedef enum ClientTimeout {
+    TIMEOUT_NONE,
+    TIMEOUT_HEADERS, // A request's headers, from its first byte or the connection's start
+    TIMEOUT_BODY, // More of a request body
+    TIMEOUT_KEEP_ALIVE, // The next request on an idle connection
+    TIMEOUT_WRITE, // The client taking more of the queued output
+} ClientTimeout;
+
+struct ClientInfo;
+
+// What an open connection keeps whether or not a request is in progress.
+// The loop, its timer and the worker's list only ever see this. A ClientInfo
+// with the buffers and request state is attached while the connection is
+// busy and goes back to the pool once it is idle again, so each of many idle
+// keep-alive connections costs this record and nothing else
+typedef struct Connection {
+    EventHandle handle; // Must stay first, holds the socket file descriptor
+    struct ClientInfo *client; // NULL while the connection is idle
+    Timer timer; // Closes the connection once it has waited too long
+    ClientTimeout timeout;
+    uint64_t timeout_mark; // Progress counter as of when the timer was started
+    uint64_t requests; // Requests finished on this connection
+    uint64_t bytes_received;
+    uint64_t bytes_sent;
+    uint64_t accepted_at; // metrics_clock at accept if the first byte is timed, else 0
+    // IPv4 address and port, network order, only kept while logging
+    uint32_t peer_addr;
+    uint16_t peer_port;
+    struct Worker *worker; // Worker that owns this connection
+    struct Connection *prev; // Neighbours in the worker's connection list
+    struct Connection *next;
+} Connection;
+
+// Receives a streamed body. Fragments point into the read buffer and are only
+// valid during the call, copy what has to be kept
+typedef void (*BodyCallback)(struct ClientInfo *client, StringView fragment, BodyStatus status, void *data);
+
+// Queues more of a response each time everything queued before has been
+// sent, and returns true once the response is complete. When aborted is set
+// the client is going away, and only what it holds is let go of
+typedef bool (*ResponseProducer)(struct ClientInfo *client, bool aborted, void *data);
+
+// A connection's state while it has a request in progress, bytes of the
+// next one buffered, or output queued
 typedef struct ClientInfo {
-    Request *req;
-    int fd; // Socket file descriptor
+    Connection *conn; // Outlives the ClientInfo
     char *buffer; // Dynamic buffer for incomplete reads
+    size_t buf_start; // Start of the current request, earlier bytes back queued output
     size_t buf_used; // Amount of buffer currently used
     size_t buf_size; // Total buffer size
+    // Framing state for the request at buf_start
+    size_t scan_offset; // Bytes already searched for the end of headers
+    size_t headers_len; // Request line and headers, 0 until they are complete
+    size_t body_len; // Content-Length, or bytes decoded so far for chunked bodies
+    size_t req_len; // headers_len + body_len
+    bool chunked; // Body uses chunked transfer coding
+    ChunkedDecoder chunks;
+    FramingError framing_error;
+    bool offer_body; // Headers are in, the body may still be streamed instead of buffered
+    size_t max_body_size; // Largest body buffered whole
+    bool offer_bodies; // Whether incomplete bodies are offered for streaming first
+    // Streamed body
+    BodyCallback body_callback;
+    void *body_data;
+    size_t body_delivered; // Bytes handed to body_callback so far
+    bool body_paused; // The handler can't take more yet
+    // Response produced a part at a time
+    ResponseProducer producer;
+    void *producer_data;
+    bool response_in_progress; // Parts are queued while request memory and bytes are still written or read
+    int ring_buffer_id; // Loop buffer id if buffer is borrowed, -1 if owned
+    // Output queue. Entries point at response headers in the arena and at
+    // handler bodies, which all stay valid until the queue has drained
+    struct iovec *out_iov;
+    size_t out_iov_size; // Bytes allocated for out_iov
+    size_t out_head; // First entry not completely sent
+    size_t out_tail; // One past the last queued entry
+    size_t out_in_flight; // Entries from out_head handed to a completion backend
+    size_t out_pending; // Bytes queued and not sent yet
+    OutputFile *out_files; // Files for the NULL entries of out_iov, in order
+    size_t out_files_size; // Bytes allocated for out_files
+    size_t out_files_head;
+    size_t out_files_tail;
+    bool write_blocked; // Waiting for EVENT_WRITABLE before writing more
+    struct RetiredBuffer *retired; // Read buffers replaced while output was queued
+    struct HeldOutput *held; // Memory owned elsewhere that queued output points into
+    Arena arena; // Per request allocations, reset once responses are sent
     ClientState state;
+    bool keep_alive; // Keep the connection open after the current request
+    bool peer_closed; // Client shut down its side, no more requests will come
+    bool http_1_0; // Current request is HTTP/1.0, where keep-alive is opt-in
+    bool head_request; // Current request is HEAD, responses go out without their bodies
+    unsigned char accepted_encodings; // ENCODING_BIT of each content coding the current request accepts
+    bool unread_data; // Readable, but reading waits for queued output to drain
+    // The current request as the access log sees it, only kept while logging
+    RequestMethod method; // METHOD_COUNT if the request didn't parse
+    int minor_version;
+    size_t target_offset; // Request target from buf_start, where the request stays until finished
+    size_t target_len;
+    uint64_t request_started_ms; // Loop time when the request was parsed
+    uint64_t request_queued; // bytes_sent + out_pending when the request was parsed
+    int status_code; // Of the last response written, 0 if none was
+    struct CacheFill *cache_fill; // Set while a cacheable route's handler runs
+    struct UpstreamConn *upstream; // Backend connection relaying the current request, if proxied
+    struct OffloadJob *offload; // Job running the current request's handler, if offloaded
+    struct Worker *worker; // Worker that owns this connection
 } ClientInfo;
 
-extern ClientInfo *create_client(int fd);
+extern Connection *create_connection(struct Worker *worker, int fd);
+extern void free_connection(Connection *conn);
+extern ClientInfo *create_client(Connection *conn);
 extern void free_client(ClientInfo *client);
+extern bool client_is_idle(const ClientInfo *client);
 extern void handle_client_data(ClientInfo *client);
+extern void receive_client_data(ClientInfo *client, EventLoop *loop, const Event *event);
+extern void release_client_buffer(ClientInfo *client, EventLoop *loop);
+extern void start_client_request(ClientInfo *client, const RequestOrError *req_or_err);
+extern void finish_client_request(ClientInfo *client, EventLoop *loop);
+extern bool queue_client_output(ClientInfo *client, const void *data, size_t len);
+extern bool queue_client_file(ClientInfo *client, int fd, off_t offset, size_t len,
+    void (*release)(void *data), void *data);
+extern bool queue_client_pipe(ClientInfo *client, int pipe_fd, size_t len, void (*release)(void *data), void *data);
+extern void flush_client(ClientInfo *client);
+extern void resume_client_output(ClientInfo *client);
+extern void complete_client_send(ClientInfo *client, int result);
+extern bool client_has_pending_output(ClientInfo *client);
+extern bool client_output_over_high_water(ClientInfo *client);
+extern void *client_alloc(ClientInfo *client, size_t size);
+extern bool client_hold(ClientInfo *client, void (*release)(void *data), void *data);
+extern void produce_client_response(ClientInfo *client, ResponseProducer producer, void *data);
+extern void resume_client_response(ClientInfo *client);
 
 #endif // CLIENT_INFO_H
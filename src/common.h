@@ -1,9 +1,56 @@
 #ifndef COMMON_H
 #define COMMON_H
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+// Per connection tracing and payload dumps, synchronous stdio that would
+// cost more than serving the request. Only built with make TRACE=1
+#ifdef HAITCHTEEP_TRACE
+#define debug_log(...) printf(__VA_ARGS__)
+#else
+#define debug_log(...) ((void)0)
+#endif
+
 typedef enum ContentType {
     CONTENT_TYPE_PLAINTEXT,
     CONTENT_TYPE_JSON,
+    CONTENT_TYPE_HTML,
+    CONTENT_TYPE_CSS,
+    CONTENT_TYPE_JAVASCRIPT,
+    CONTENT_TYPE_PNG,
+    CONTENT_TYPE_JPEG,
+    CONTENT_TYPE_GIF,
+    CONTENT_TYPE_SVG,
+    CONTENT_TYPE_ICO,
+    CONTENT_TYPE_WEBP,
+    CONTENT_TYPE_WOFF2,
+    CONTENT_TYPE_PDF,
+    CONTENT_TYPE_OCTET_STREAM,
+    CONTENT_TYPE_PROMETHEUS, // Prometheus text exposition format
+    CONTENT_TYPE_COUNT,
 } ContentType;
 
+// A (pointer, length) view into bytes owned by someone else, usually the
+// connection buffer. Not NUL terminated
+typedef struct StringView {
+    const char *data;
+    size_t len;
+} StringView;
+
+static inline bool sv_equals(StringView sv, const char *str)
+{
+    size_t len = strlen(str);
+    return sv.len == len && memcmp(sv.data, str, len) == 0;
+}
+
+static inline bool sv_equals_ignore_case(StringView sv, const char *str)
+{
+    size_t len = strlen(str);
+    return sv.len == len && strncasecmp(sv.data, str, len) == 0;
+}
+
 #endif // COMMON_H
@@ -0,0 +1,231 @@
+#include "compression.h"
+#include "worker.h"
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define GZIP_WINDOW_BITS (15 + 16) // Largest window, with a gzip wrapper
+#define DEFLATE_MEM_LEVEL 8
+
+// Media types as --gzip-level names them, and whether they are text that
+// compresses well by default. Images, fonts and PDFs already are compressed
+static const struct {
+    const char *name;
+    bool compressible;
+} CONTENT_TYPE_NAMES[CONTENT_TYPE_COUNT] = {
+    [CONTENT_TYPE_PLAINTEXT] = { "text/plain", true },
+    [CONTENT_TYPE_JSON] = { "application/json", true },
+    [CONTENT_TYPE_HTML] = { "text/html", true },
+    [CONTENT_TYPE_CSS] = { "text/css", true },
+    [CONTENT_TYPE_JAVASCRIPT] = { "text/javascript", true },
+    [CONTENT_TYPE_PNG] = { "image/png", false },
+    [CONTENT_TYPE_JPEG] = { "image/jpeg", false },
+    [CONTENT_TYPE_GIF] = { "image/gif", false },
+    [CONTENT_TYPE_SVG] = { "image/svg+xml", true },
+    [CONTENT_TYPE_ICO] = { "image/x-icon", false },
+    [CONTENT_TYPE_WEBP] = { "image/webp", false },
+    [CONTENT_TYPE_WOFF2] = { "font/woff2", false },
+    [CONTENT_TYPE_PDF] = { "application/pdf", false },
+    [CONTENT_TYPE_OCTET_STREAM] = { "application/octet-stream", false },
+    [CONTENT_TYPE_PROMETHEUS] = { "text/plain", true },
+};
+
+/**
+ * Fill in the default gzip level of every content type
+ * @param levels CONTENT_TYPE_COUNT levels
+ */
+void default_compression_levels(int *levels)
+{
+    for (int type = 0; type < CONTENT_TYPE_COUNT; type++) {
+        levels[type] = CONTENT_TYPE_NAMES[type].compressible ? DEFAULT_COMPRESSION_LEVEL : 0;
+    }
+}
+
+/**
+ * Set the gzip level of the content types a "TYPE=LEVEL" argument names,
+ * e.g. "application/json=9", "image/svg+xml=0" or "*=1" for every type
+ * @param levels CONTENT_TYPE_COUNT levels to update
+ * @param arg The argument
+ * @return 0 on success, -1 if the type is unknown or the level isn't 0-9
+ */
+int set_compression_level(int *levels, const char *arg)
+{
+    const char *equals = strchr(arg, '=');
+    if (!equals || equals[1] < '0' || equals[1] > '9' || equals[2] != '\0') {
+        return -1;
+    }
+    StringView name = { .data = arg, .len = equals - arg };
+    bool found = false;
+    for (int type = 0; type < CONTENT_TYPE_COUNT; type++) {
+        if (sv_equals(name, "*") || sv_equals_ignore_case(name, CONTENT_TYPE_NAMES[type].name)) {
+            levels[type] = equals[1] - '0';
+            found = true;
+        }
+    }
+    return found ? 0 : -1;
+}
+
+// "0", "0.0" and so on, anything else is some preference
+static bool qvalue_is_zero(const char *c, const char *end)
+{
+    if (c == end || *c != '0') {
+        return false;
+    }
+    c++;
+    if (c < end && *c == '.') {
+        c++;
+        while (c < end && *c == '0') {
+            c++;
+        }
+    }
+    return c == end || *c == ',' || *c == ';' || *c == ' ' || *c == '\t';
+}
+
+/**
+ * Find the content codings an Accept-Encoding value allows. Only q=0 is
+ * taken into account, the server prefers br to gzip whatever the weights
+ * @param value The header's value, NULL if the request has none
+ * @return ENCODING_BIT of every acceptable coding the server can send
+ */
+unsigned parse_accept_encoding(const StringView *value)
+{
+    if (!value) {
+        return 0;
+    }
+    unsigned accepted = 0, refused = 0;
+    bool wildcard = false;
+    const char *c = value->data, *end = value->data + value->len;
+    while (c < end) {
+        while (c < end && (*c == ' ' || *c == '\t' || *c == ',')) {
+            c++;
+        }
+        const char *coding = c;
+        while (c < end && *c != ',' && *c != ';' && *c != ' ' && *c != '\t') {
+            c++;
+        }
+        StringView name = { .data = coding, .len = c - coding };
+
+        // Of the parameters only q matters
+        bool acceptable = true;
+        while (c < end && *c != ',') {
+            if (*c++ != ';') {
+                continue;
+            }
+            while (c < end && (*c == ' ' || *c == '\t')) {
+                c++;
+            }
+            if (end - c >= 2 && (*c == 'q' || *c == 'Q') && c[1] == '=') {
+                c += 2;
+                acceptable = !qvalue_is_zero(c, end);
+            }
+        }
+
+        unsigned bit = 0;
+        if (sv_equals_ignore_case(name, "gzip") || sv_equals_ignore_case(name, "x-gzip")) {
+            bit = ENCODING_BIT(CONTENT_ENCODING_GZIP);
+        } else if (sv_equals_ignore_case(name, "br")) {
+            bit = ENCODING_BIT(CONTENT_ENCODING_BR);
+        } else if (sv_equals(name, "*")) {
+            wildcard = acceptable;
+        }
+        if (acceptable) {
+            accepted |= bit;
+        } else {
+            refused |= bit;
+        }
+    }
+    // "*" covers whatever wasn't listed
+    if (wildcard) {
+        accepted |= ENCODING_BIT(CONTENT_ENCODING_GZIP) | ENCODING_BIT(CONTENT_ENCODING_BR);
+    }
+    return accepted & ~refused;
+}
+
+void compressor_init(Compressor *compressor, const int *levels, size_t min_size)
+{
+    memset(compressor, 0, sizeof(*compressor));
+    compressor->levels = levels;
+    compressor->min_size = min_size;
+}
+
+void compressor_destroy(Compressor *compressor)
+{
+    if (compressor->ready) {
+        deflateEnd(&compressor->stream);
+        compressor->ready = false;
+    }
+}
+
+// Ready the stream for a new body at the given level
+static bool start_stream(Compressor *compressor, int level)
+{
+    z_stream *stream = &compressor->stream;
+    if (!compressor->ready) {
+        memset(stream, 0, sizeof(*stream));
+        if (deflateInit2(stream, level, Z_DEFLATED, GZIP_WINDOW_BITS, DEFLATE_MEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK) {
+            return false;
+        }
+        compressor->ready = true;
+        compressor->level = level;
+        return true;
+    }
+    if (deflateReset(stream) != Z_OK) {
+        return false;
+    }
+    // Nothing has been fed in since the reset, so this only swaps settings
+    if (level != compressor->level) {
+        if (deflateParams(stream, level, Z_DEFAULT_STRATEGY) != Z_OK) {
+            return false;
+        }
+        compressor->level = level;
+    }
+    return true;
+}
+
+/**
+ * gzip a response's body into request memory if its content type is
+ * compressed, it is large enough and the request accepts gzip. Responses
+ * that could have been compressed are marked as negotiated either way, so
+ * they carry Vary: Accept-Encoding. Anything that goes wrong leaves the body
+ * as it was
+ * @param client Client being answered
+ * @param res Response about to be serialized
+ */
+void compress_response(ClientInfo *client, Response *res)
+{
+    Worker *worker = client->worker;
+    Compressor *compressor = &worker->compressor;
+    if (res->content_encoding != CONTENT_ENCODING_NONE || !res->content_body
+        || res->content_len < compressor->min_size || res->content_len > UINT_MAX
+        || res->status == STATUS_PARTIAL_CONTENT || (unsigned)res->content_type >= CONTENT_TYPE_COUNT) {
+        return;
+    }
+    int level = compressor->levels[res->content_type];
+    if (level == 0) {
+        return;
+    }
+    res->content_encoding = CONTENT_ENCODING_IDENTITY;
+    if (!(client->accepted_encodings & ENCODING_BIT(CONTENT_ENCODING_GZIP)) || !start_stream(compressor, level)) {
+        return;
+    }
+
+    // Deflated in one go into memory that lives as long as the request
+    z_stream *stream = &compressor->stream;
+    size_t bound = deflateBound(stream, res->content_len);
+    char *out = client_alloc(client, bound);
+    if (!out) {
+        return;
+    }
+    stream->next_in = (Bytef *)res->content_body;
+    stream->avail_in = res->content_len;
+    stream->next_out = (Bytef *)out;
+    stream->avail_out = bound;
+    if (deflate(stream, Z_FINISH) != Z_STREAM_END || stream->total_out >= res->content_len) {
+        return;
+    }
+    metrics_add(&worker->metrics.compressed_in, res->content_len);
+    metrics_add(&worker->metrics.compressed_out, stream->total_out);
+    res->content_body = out;
+    res->content_len = stream->total_out;
+    res->content_encoding = CONTENT_ENCODING_GZIP;
+}
@@ -0,0 +1,35 @@
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+
+#include "client_info.h"
+#include "common.h"
+#include "response.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <zlib.h>
+
+#define DEFAULT_COMPRESSION_LEVEL 6
+#define DEFAULT_COMPRESS_MIN_SIZE 1024
+
+// Bit per ContentEncoding, for sets of encodings such as what a request accepts
+#define ENCODING_BIT(encoding) (1u << (encoding))
+
+// One worker's gzip encoder. The deflate state is allocated on first use
+// and reset for every response after that, never freed and rebuilt
+typedef struct Compressor {
+    z_stream stream;
+    bool ready; // stream is initialized
+    int level; // Level the stream is currently set to
+    const int *levels; // gzip level per ContentType, 0 leaves the type as is
+    size_t min_size; // Smaller bodies aren't worth the CPU
+} Compressor;
+
+extern void default_compression_levels(int *levels);
+extern int set_compression_level(int *levels, const char *arg);
+extern unsigned parse_accept_encoding(const StringView *value);
+
+extern void compressor_init(Compressor *compressor, const int *levels, size_t min_size);
+extern void compressor_destroy(Compressor *compressor);
+extern void compress_response(ClientInfo *client, Response *res);
+
+#endif // COMPRESSION_H
@@ -0,0 +1,89 @@
+#include "compression.h"
+#include "test.h"
+#include <string.h>
+
+#define GZIP ENCODING_BIT(CONTENT_ENCODING_GZIP)
+#define BR ENCODING_BIT(CONTENT_ENCODING_BR)
+
+static unsigned accepted(const char *value)
+{
+    StringView view = { .data = value, .len = strlen(value) };
+    return parse_accept_encoding(&view);
+}
+
+static void test_accept_encoding()
+{
+    CHECK(parse_accept_encoding(NULL) == 0);
+    CHECK(accepted("") == 0);
+    CHECK(accepted("identity") == 0);
+    CHECK(accepted("gzip") == GZIP);
+    CHECK(accepted("GZip") == GZIP);
+    CHECK(accepted("x-gzip") == GZIP);
+    CHECK(accepted("br") == BR);
+    CHECK(accepted("gzip, deflate, br") == (GZIP | BR));
+    CHECK(accepted(" ,gzip,,br ,") == (GZIP | BR));
+    CHECK(accepted("gzipped, brotli") == 0);
+
+    // Any weight but zero is the same, the server picks br over gzip anyway
+    CHECK(accepted("gzip;q=1.0, br;q=0.1") == (GZIP | BR));
+    CHECK(accepted("gzip;q=0.001") == GZIP);
+    CHECK(accepted("gzip;q=0") == 0);
+    CHECK(accepted("gzip;q=0.") == 0);
+    CHECK(accepted("gzip;q=0.000") == 0);
+    CHECK(accepted("gzip; Q=0, br") == BR);
+    CHECK(accepted("gzip ;q=0 ,br") == BR);
+    CHECK(accepted("gzip;level=9;q=0") == 0);
+    CHECK(accepted("gzip;level=0") == GZIP);
+
+    // "*" stands for every coding not listed, listed refusals still hold
+    CHECK(accepted("*") == (GZIP | BR));
+    CHECK(accepted("*;q=0.5") == (GZIP | BR));
+    CHECK(accepted("*;q=0") == 0);
+    CHECK(accepted("*;q=0, gzip") == GZIP);
+    CHECK(accepted("gzip;q=0, *") == BR);
+    CHECK(accepted("br;q=0.000, *;q=0.2") == GZIP);
+}
+
+static void test_compression_levels()
+{
+    int levels[CONTENT_TYPE_COUNT];
+    default_compression_levels(levels);
+    CHECK(levels[CONTENT_TYPE_JSON] == DEFAULT_COMPRESSION_LEVEL);
+    CHECK(levels[CONTENT_TYPE_SVG] == DEFAULT_COMPRESSION_LEVEL);
+    CHECK(levels[CONTENT_TYPE_PNG] == 0);
+    CHECK(levels[CONTENT_TYPE_OCTET_STREAM] == 0);
+
+    CHECK(set_compression_level(levels, "application/json=9") == 0);
+    CHECK(levels[CONTENT_TYPE_JSON] == 9);
+    CHECK(levels[CONTENT_TYPE_HTML] == DEFAULT_COMPRESSION_LEVEL);
+    CHECK(set_compression_level(levels, "IMAGE/SVG+XML=0") == 0);
+    CHECK(levels[CONTENT_TYPE_SVG] == 0);
+    // Every type with the name, metrics are text/plain as well
+    CHECK(set_compression_level(levels, "text/plain=2") == 0);
+    CHECK(levels[CONTENT_TYPE_PLAINTEXT] == 2);
+    CHECK(levels[CONTENT_TYPE_PROMETHEUS] == 2);
+
+    // Refused arguments change nothing
+    int before[CONTENT_TYPE_COUNT];
+    memcpy(before, levels, sizeof(levels));
+    CHECK(set_compression_level(levels, "text/plain") < 0);
+    CHECK(set_compression_level(levels, "text/plain=") < 0);
+    CHECK(set_compression_level(levels, "text/plain=10") < 0);
+    CHECK(set_compression_level(levels, "text/plain=-1") < 0);
+    CHECK(set_compression_level(levels, "text/plain=a") < 0);
+    CHECK(set_compression_level(levels, "text/unknown=1") < 0);
+    CHECK(set_compression_level(levels, "=1") < 0);
+    CHECK(memcmp(before, levels, sizeof(levels)) == 0);
+
+    CHECK(set_compression_level(levels, "*=1") == 0);
+    for (int type = 0; type < CONTENT_TYPE_COUNT; type++) {
+        CHECK(levels[type] == 1);
+    }
+}
+
+int main()
+{
+    test_accept_encoding();
+    test_compression_levels();
+    return TEST_RESULT();
+}
@@ -0,0 +1,204 @@
+#include "event_loop.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const EventLoopBackend *BACKENDS[] = { &EPOLL_BACKEND, &URING_BACKEND };
+
+static const EventLoopBackend *find_backend(const char *name)
+{
+    if (name == NULL) {
+        return BACKENDS[0];
+    }
+    for (size_t i = 0; i < sizeof(BACKENDS) / sizeof(EventLoopBackend *); i++) {
+        if (strcmp(BACKENDS[i]->name, name) == 0) {
+            return BACKENDS[i];
+        }
+    }
+    return NULL;
+}
+
+// Create a loop on the named backend, or the default one if name is NULL
+EventLoop *create_event_loop(const char *backend_name)
+{
+    const EventLoopBackend *backend = find_backend(backend_name);
+    if (!backend) {
+        fprintf(stderr, "Unknown event loop backend: %s\n", backend_name);
+        return NULL;
+    }
+
+    EventLoop *loop = calloc(1, sizeof(EventLoop));
+    if (!loop)
+        return NULL;
+
+    loop->backend = backend;
+    timer_wheel_init(&loop->timers, monotonic_ms());
+    if (backend->init(loop) < 0) {
+        free(loop);
+        return NULL;
+    }
+
+    return loop;
+}
+
+void free_event_loop(EventLoop *loop)
+{
+    if (loop) {
+        loop->backend->destroy(loop);
+        free(loop);
+    }
+}
+
+int event_loop_add(EventLoop *loop, EventHandle *handle, uint32_t events)
+{
+    handle->pending_ops = 0;
+    handle->closing = false;
+    handle->recv_paused = false;
+    int result = loop->backend->add(loop, handle, events);
+    if (result == 0) {
+        handle->events = events;
+    }
+    return result;
+}
+
+int event_loop_modify(EventLoop *loop, EventHandle *handle, uint32_t events)
+{
+    if (handle->events == events) {
+        return 0;
+    }
+    int result = loop->backend->modify(loop, handle, events);
+    if (result == 0) {
+        handle->events = events;
+    }
+    return result;
+}
+
+int event_loop_remove(EventLoop *loop, EventHandle *handle)
+{
+    return loop->backend->remove(loop, handle);
+}
+
+void event_loop_run(EventLoop *loop)
+{
+    loop->running = true;
+    while (loop->running) {
+        // Sleep no longer than until the next timer is due
+        int result = loop->backend->wait(loop, timer_wheel_timeout(&loop->timers));
+        if (result < 0 && errno != EINTR) {
+            perror("event loop wait failed");
+            break;
+        }
+        // Anything that became ready while this batch was dispatched waited
+        // for all of it, so the longest batch bounds the queueing delay
+        uint64_t now_ms = monotonic_ms();
+        if (result >= 0 && now_ms - loop->timers.now_ms > loop->longest_turn_ms) {
+            loop->longest_turn_ms = now_ms - loop->timers.now_ms;
+        }
+        timer_wheel_advance(&loop->timers, now_ms);
+    }
+}
+
+void event_loop_stop(EventLoop *loop)
+{
+    loop->running = false;
+}
+
+// Backends call this as soon as they stop waiting, so timers scheduled while
+// dispatching count from now rather than from before a long wait
+void event_loop_update_time(EventLoop *loop)
+{
+    loop->timers.now_ms = monotonic_ms();
+}
+
+// Whether accept/recv/send are performed by the backend and reported as
+// completion events, rather than done by the caller on readiness
+bool event_loop_completes_io(EventLoop *loop)
+{
+    return loop->backend->recv != NULL;
+}
+
+// Start accepting on a listener. Completion backends report every new
+// connection as EVENT_ACCEPTED, others report the listener as readable
+int event_loop_accept(EventLoop *loop, EventHandle *listener)
+{
+    if (!loop->backend->accept) {
+        return event_loop_add(loop, listener, EVENT_READABLE);
+    }
+    listener->pending_ops = 0;
+    listener->closing = false;
+    listener->recv_paused = false;
+    listener->events = EVENT_READABLE;
+    return loop->backend->accept(loop, listener);
+}
+
+// Start reading from a connection. Completion backends report data as
+// EVENT_RECEIVED, others report the connection as readable
+int event_loop_recv(EventLoop *loop, EventHandle *handle)
+{
+    if (!loop->backend->recv) {
+        return event_loop_add(loop, handle, EVENT_READABLE);
+    }
+    handle->pending_ops = 0;
+    handle->closing = false;
+    handle->recv_paused = false;
+    handle->events = EVENT_READABLE;
+    return loop->backend->recv(loop, handle);
+}
+
+// Queue iov for sending as one message on a completion backend. The iovec
+// array and the buffers must stay valid until the matching EVENT_SENT (or
+// EVENT_CLOSED) is reported
+int event_loop_send(EventLoop *loop, EventHandle *handle, const struct iovec *iov, int iovcnt)
+{
+    if (!loop->backend->send) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    return loop->backend->send(loop, handle, iov, iovcnt);
+}
+
+// Give a buffer received through EVENT_RECEIVED back to the loop
+void event_loop_release_buffer(EventLoop *loop, uint16_t buffer_id)
+{
+    if (loop->backend->release_buffer) {
+        loop->backend->release_buffer(loop, buffer_id);
+    }
+}
+
+// Get EVENT_WRITABLE once the handle can be written to again, after a
+// write of our own came back with EAGAIN. Readiness backends keep
+// reporting it until EVENT_WRITABLE is taken out of the watched events
+int event_loop_wait_writable(EventLoop *loop, EventHandle *handle)
+{
+    if (loop->backend->wait_writable) {
+        return loop->backend->wait_writable(loop, handle);
+    }
+    return event_loop_modify(loop, handle, handle->events | EVENT_WRITABLE);
+}
+
+// Stop receiving for a handle until event_loop_resume_recv. Readiness
+// backends leave reading to the caller, so only the flag changes there
+int event_loop_pause_recv(EventLoop *loop, EventHandle *handle)
+{
+    if (handle->recv_paused) {
+        return 0;
+    }
+    if (loop->backend->pause_recv && loop->backend->pause_recv(loop, handle) < 0) {
+        return -1;
+    }
+    handle->recv_paused = true;
+    return 0;
+}
+
+int event_loop_resume_recv(EventLoop *loop, EventHandle *handle)
+{
+    if (!handle->recv_paused) {
+        return 0;
+    }
+    if (loop->backend->resume_recv && loop->backend->resume_recv(loop, handle) < 0) {
+        return -1;
+    }
+    handle->recv_paused = false;
+    return 0;
+}
@@ -0,0 +1,103 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include "timer_wheel.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// Readiness events
+#define EVENT_READABLE 0x1
+#define EVENT_WRITABLE 0x2
+#define EVENT_HANGUP 0x4
+#define EVENT_ERROR 0x8
+// Completion events, only reported by backends that perform the I/O themselves
+#define EVENT_ACCEPTED 0x10
+#define EVENT_RECEIVED 0x20
+#define EVENT_SENT 0x40
+#define EVENT_CLOSED 0x80
+
+typedef struct EventLoop EventLoop;
+typedef struct EventHandle EventHandle;
+
+typedef struct Event {
+    uint32_t events;
+    // Accepted fd, bytes received or bytes sent, or -errno on failure
+    int result;
+    // Received bytes, borrowed from the loop until released with buffer_id
+    char *data;
+    uint16_t buffer_id;
+} Event;
+
+typedef void (*EventCallback)(EventLoop *loop, EventHandle *handle, const Event *event);
+
+// Anything watched by the loop embeds an EventHandle as its first member,
+// so backends can hand the owning struct (e.g. Connection) straight back
+struct EventHandle {
+    int fd;
+    uint32_t events; // Events currently being watched
+    EventCallback callback;
+    // Completion backends: operations in flight and whether the handle has
+    // been removed and only waits for those to drain before EVENT_CLOSED
+    uint32_t pending_ops;
+    bool closing;
+    bool recv_paused; // Receiving stopped by event_loop_pause_recv
+};
+
+// Operations every event loop implementation has to provide
+typedef struct EventLoopBackend {
+    const char *name;
+    int (*init)(EventLoop *loop);
+    void (*destroy)(EventLoop *loop);
+    int (*add)(EventLoop *loop, EventHandle *handle, uint32_t events);
+    int (*modify)(EventLoop *loop, EventHandle *handle, uint32_t events);
+    // Returns 0 if the handle can be freed right away, or 1 if EVENT_CLOSED
+    // will be reported once operations still in flight have completed
+    int (*remove)(EventLoop *loop, EventHandle *handle);
+    // Wait for at most timeout_ms (-1 blocks) and dispatch ready handles
+    int (*wait)(EventLoop *loop, int timeout_ms);
+
+    // Completion I/O, left NULL by backends that only report readiness
+    int (*accept)(EventLoop *loop, EventHandle *listener);
+    int (*recv)(EventLoop *loop, EventHandle *handle);
+    int (*send)(EventLoop *loop, EventHandle *handle, const struct iovec *iov, int iovcnt);
+    void (*release_buffer)(EventLoop *loop, uint16_t buffer_id);
+    // Report EVENT_WRITABLE once, for writes done outside the backend
+    int (*wait_writable)(EventLoop *loop, EventHandle *handle);
+    // Stop and restart receiving into loop buffers, for flow control
+    int (*pause_recv)(EventLoop *loop, EventHandle *handle);
+    int (*resume_recv)(EventLoop *loop, EventHandle *handle);
+} EventLoopBackend;
+
+struct EventLoop {
+    const EventLoopBackend *backend;
+    void *backend_data;
+    void *user_data;
+    bool running;
+    TimerWheel timers; // Checked every time the backend is done waiting
+    uint64_t longest_turn_ms; // Longest dispatch of one batch since whoever reads it reset it
+};
+
+extern const EventLoopBackend EPOLL_BACKEND;
+extern const EventLoopBackend URING_BACKEND;
+
+extern EventLoop *create_event_loop(const char *backend_name);
+extern void free_event_loop(EventLoop *loop);
+extern int event_loop_add(EventLoop *loop, EventHandle *handle, uint32_t events);
+extern int event_loop_modify(EventLoop *loop, EventHandle *handle, uint32_t events);
+extern int event_loop_remove(EventLoop *loop, EventHandle *handle);
+extern void event_loop_run(EventLoop *loop);
+extern void event_loop_stop(EventLoop *loop);
+extern void event_loop_update_time(EventLoop *loop);
+
+extern bool event_loop_completes_io(EventLoop *loop);
+extern int event_loop_accept(EventLoop *loop, EventHandle *listener);
+extern int event_loop_recv(EventLoop *loop, EventHandle *handle);
+extern int event_loop_send(EventLoop *loop, EventHandle *handle, const struct iovec *iov, int iovcnt);
+extern void event_loop_release_buffer(EventLoop *loop, uint16_t buffer_id);
+extern int event_loop_wait_writable(EventLoop *loop, EventHandle *handle);
+extern int event_loop_pause_recv(EventLoop *loop, EventHandle *handle);
+extern int event_loop_resume_recv(EventLoop *loop, EventHandle *handle);
+
+#endif // EVENT_LOOP_H
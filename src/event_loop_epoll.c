@@ -0,0 +1,137 @@
+#include "event_loop.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#define EPOLL_MAX_EVENTS 256
+
+typedef struct EpollData {
+    int epoll_fd;
+    struct epoll_event events[EPOLL_MAX_EVENTS];
+    int next, ready; // Events of the batch being dispatched that are still to come
+} EpollData;
+
+static inline uint32_t to_epoll_events(uint32_t events)
+{
+    // Always edge-triggered: callbacks are expected to drain the fd until EAGAIN
+    uint32_t epoll_events = EPOLLET | EPOLLRDHUP;
+    if (events & EVENT_READABLE)
+        epoll_events |= EPOLLIN;
+    if (events & EVENT_WRITABLE)
+        epoll_events |= EPOLLOUT;
+    return epoll_events;
+}
+
+static inline uint32_t from_epoll_events(uint32_t epoll_events)
+{
+    uint32_t events = 0;
+    if (epoll_events & EPOLLIN)
+        events |= EVENT_READABLE;
+    if (epoll_events & EPOLLOUT)
+        events |= EVENT_WRITABLE;
+    if (epoll_events & (EPOLLHUP | EPOLLRDHUP))
+        events |= EVENT_HANGUP;
+    if (epoll_events & EPOLLERR)
+        events |= EVENT_ERROR;
+    return events;
+}
+
+static int epoll_backend_init(EventLoop *loop)
+{
+    EpollData *data = malloc(sizeof(EpollData));
+    if (!data)
+        return -1;
+
+    data->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (data->epoll_fd < 0) {
+        perror("epoll_create1 failed");
+        free(data);
+        return -1;
+    }
+
+    data->next = data->ready = 0;
+    loop->backend_data = data;
+    return 0;
+}
+
+static void epoll_backend_destroy(EventLoop *loop)
+{
+    EpollData *data = loop->backend_data;
+    close(data->epoll_fd);
+    free(data);
+}
+
+static int epoll_backend_ctl(EventLoop *loop, int op, EventHandle *handle, uint32_t events)
+{
+    EpollData *data = loop->backend_data;
+    struct epoll_event ev = {
+        .events = to_epoll_events(events),
+        // The handle is the first member of its owner, so this is the owner pointer
+        .data.ptr = handle,
+    };
+    return epoll_ctl(data->epoll_fd, op, handle->fd, &ev);
+}
+
+static int epoll_backend_add(EventLoop *loop, EventHandle *handle, uint32_t events)
+{
+    return epoll_backend_ctl(loop, EPOLL_CTL_ADD, handle, events);
+}
+
+static int epoll_backend_modify(EventLoop *loop, EventHandle *handle, uint32_t events)
+{
+    return epoll_backend_ctl(loop, EPOLL_CTL_MOD, handle, events);
+}
+
+static int epoll_backend_remove(EventLoop *loop, EventHandle *handle)
+{
+    EpollData *data = loop->backend_data;
+    if (epoll_ctl(data->epoll_fd, EPOLL_CTL_DEL, handle->fd, NULL) < 0) {
+        return -1;
+    }
+    // One callback may close another fd, e.g. a proxied client's, whose
+    // event is later in the same batch. Dropping that event is all it takes
+    // for the handle to be freed straight away
+    for (int i = data->next; i < data->ready; i++) {
+        if (data->events[i].data.ptr == handle) {
+            data->events[i].data.ptr = NULL;
+        }
+    }
+    return 0;
+}
+
+static int epoll_backend_wait(EventLoop *loop, int timeout_ms)
+{
+    EpollData *data = loop->backend_data;
+    int ready = epoll_wait(data->epoll_fd, data->events, EPOLL_MAX_EVENTS, timeout_ms);
+    if (ready < 0) {
+        return -1;
+    }
+    event_loop_update_time(loop);
+
+    // Only ready fds are visited, no matter how many are registered
+    data->ready = ready;
+    for (int i = 0; i < ready; i++) {
+        EventHandle *handle = data->events[i].data.ptr;
+        data->next = i + 1;
+        if (!handle) {
+            continue;
+        }
+        Event event = { .events = from_epoll_events(data->events[i].events) };
+        handle->callback(loop, handle, &event);
+    }
+    data->next = data->ready = 0;
+
+    return ready;
+}
+
+const EventLoopBackend EPOLL_BACKEND = {
+    .name = "epoll",
+    .init = epoll_backend_init,
+    .destroy = epoll_backend_destroy,
+    .add = epoll_backend_add,
+    .modify = epoll_backend_modify,
+    .remove = epoll_backend_remove,
+    .wait = epoll_backend_wait,
+};
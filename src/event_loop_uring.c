@@ -0,0 +1,652 @@
+#define _GNU_SOURCE
+#include "event_loop.h"
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define URING_ENTRIES 1024
+#define URING_CQ_ENTRIES (URING_ENTRIES * 8)
+#define URING_BUFFER_GROUP 0
+#define URING_BUFFER_COUNT 1024 // Must be a power of two
+#define URING_BUFFER_SIZE 4096
+
+// user_data is the handle pointer with the operation kind in the low bits,
+// handles are always at least 8 byte aligned
+#define OP_MASK 0x7UL
+#define OP_POLL 0x0UL
+#define OP_ACCEPT 0x1UL
+#define OP_RECV 0x2UL
+#define OP_SEND 0x3UL
+#define OP_INTERNAL 0x4UL // Cancellations, never reported
+#define OP_WRITABLE 0x5UL // One-shot POLLOUT
+
+typedef struct UringData {
+    int ring_fd;
+
+    // Submission queue
+    void *sq_ring;
+    size_t sq_ring_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned sqe_tail; // Prepared but not yet published to the kernel
+    // sendmsg headers, one per SQE slot. The kernel copies them on submission
+    struct msghdr *send_msgs;
+
+    // Completion queue
+    void *cq_ring;
+    size_t cq_ring_size;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+
+    // Provided buffer ring used by multishot recv
+    struct io_uring_buf_ring *buf_ring;
+    size_t buf_ring_size;
+    char *buffers;
+    unsigned short buf_tail;
+    unsigned buffers_lent; // Handed out in completions and not released yet
+
+    // Connections whose multishot recv stopped because the buffer ring ran dry
+    EventHandle **starved;
+    size_t num_starved;
+    size_t starved_cap;
+} UringData;
+
+static inline int sys_io_uring_setup(unsigned entries, struct io_uring_params *params)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static inline int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+    unsigned flags, void *arg, size_t arg_size)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, arg_size);
+}
+
+static inline int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static inline uint64_t make_user_data(EventHandle *handle, unsigned long op)
+{
+    return (uint64_t)(uintptr_t)handle | op;
+}
+
+// Hand every prepared SQE to the kernel, optionally waiting for completions
+static int uring_enter(UringData *data, unsigned min_complete, int timeout_ms)
+{
+    // Anything the kernel has not consumed yet, including leftovers from a
+    // previous partial submit
+    unsigned to_submit = data->sqe_tail - __atomic_load_n(data->sq_head, __ATOMIC_ACQUIRE);
+    __atomic_store_n(data->sq_tail, data->sqe_tail, __ATOMIC_RELEASE);
+
+    unsigned flags = min_complete > 0 ? IORING_ENTER_GETEVENTS : 0;
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg = { 0 };
+    void *enter_arg = NULL;
+    size_t enter_arg_size = 0;
+
+    if (min_complete > 0 && timeout_ms >= 0) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+        arg.sigmask_sz = _NSIG / 8;
+        flags |= IORING_ENTER_EXT_ARG;
+        enter_arg = &arg;
+        enter_arg_size = sizeof(arg);
+    }
+
+    int result = sys_io_uring_enter(data->ring_fd, to_submit, min_complete, flags,
+        enter_arg, enter_arg_size);
+    if (result < 0 && (errno == ETIME || errno == EBUSY)) {
+        // Timed out, or the CQ is full and needs reaping first
+        return 0;
+    }
+    return result;
+}
+
+static struct io_uring_sqe *get_sqe(UringData *data)
+{
+    unsigned head = __atomic_load_n(data->sq_head, __ATOMIC_ACQUIRE);
+    if (data->sqe_tail - head >= data->sq_entries) {
+        // Queue is full, flush it to make room
+        if (uring_enter(data, 0, 0) < 0) {
+            return NULL;
+        }
+        head = __atomic_load_n(data->sq_head, __ATOMIC_ACQUIRE);
+        if (data->sqe_tail - head >= data->sq_entries) {
+            return NULL;
+        }
+    }
+
+    struct io_uring_sqe *sqe = &data->sqes[data->sqe_tail & data->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    data->sqe_tail++;
+    return sqe;
+}
+
+static inline uint32_t to_poll_events(uint32_t events)
+{
+    uint32_t poll_events = POLLRDHUP;
+    if (events & EVENT_READABLE)
+        poll_events |= POLLIN;
+    if (events & EVENT_WRITABLE)
+        poll_events |= POLLOUT;
+    return poll_events;
+}
+
+static inline uint32_t from_poll_events(uint32_t poll_events)
+{
+    uint32_t events = 0;
+    if (poll_events & POLLIN)
+        events |= EVENT_READABLE;
+    if (poll_events & POLLOUT)
+        events |= EVENT_WRITABLE;
+    if (poll_events & (POLLHUP | POLLRDHUP))
+        events |= EVENT_HANGUP;
+    if (poll_events & POLLERR)
+        events |= EVENT_ERROR;
+    return events;
+}
+
+static int prep_poll(UringData *data, EventHandle *handle, uint32_t events)
+{
+    struct io_uring_sqe *sqe = get_sqe(data);
+    if (!sqe) {
+        errno = EBUSY;
+        return -1;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = handle->fd;
+    sqe->poll32_events = to_poll_events(events);
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = make_user_data(handle, OP_POLL);
+    handle->pending_ops++;
+    return 0;
+}
+
+static int prep_cancel(UringData *data, EventHandle *handle, unsigned long op)
+{
+    struct io_uring_sqe *sqe = get_sqe(data);
+    if (!sqe) {
+        errno = EBUSY;
+        return -1;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = make_user_data(handle, op);
+    sqe->user_data = make_user_data(handle, OP_INTERNAL);
+    return 0;
+}
+
+static int prep_accept(UringData *data, EventHandle *listener)
+{
+    struct io_uring_sqe *sqe = get_sqe(data);
+    if (!sqe) {
+        errno = EBUSY;
+        return -1;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listener->fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = make_user_data(listener, OP_ACCEPT);
+    listener->pending_ops++;
+    return 0;
+}
+
+static int prep_recv(UringData *data, EventHandle *handle)
+{
+    struct io_uring_sqe *sqe = get_sqe(data);
+    if (!sqe) {
+        errno = EBUSY;
+        return -1;
+    }
+    // The kernel picks a buffer from the ring for every completion
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = handle->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->user_data = make_user_data(handle, OP_RECV);
+    handle->pending_ops++;
+    return 0;
+}
+
+static void add_ring_buffer(UringData *data, uint16_t buffer_id)
+{
+    struct io_uring_buf *buf = &data->buf_ring->bufs[data->buf_tail & (URING_BUFFER_COUNT - 1)];
+    buf->addr = (uint64_t)(uintptr_t)(data->buffers + (size_t)buffer_id * URING_BUFFER_SIZE);
+    buf->len = URING_BUFFER_SIZE;
+    buf->bid = buffer_id;
+    data->buf_tail++;
+}
+
+static inline void publish_ring_buffers(UringData *data)
+{
+    __atomic_store_n(&data->buf_ring->tail, data->buf_tail, __ATOMIC_RELEASE);
+}
+
+static int setup_buffer_ring(EventLoop *loop)
+{
+    UringData *data = loop->backend_data;
+
+    data->buf_ring_size = URING_BUFFER_COUNT * sizeof(struct io_uring_buf);
+    data->buf_ring = mmap(NULL, data->buf_ring_size, PROT_READ | PROT_WRITE,
+        MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (data->buf_ring == MAP_FAILED) {
+        data->buf_ring = NULL;
+        return -1;
+    }
+
+    data->buffers = malloc((size_t)URING_BUFFER_COUNT * URING_BUFFER_SIZE);
+    if (!data->buffers) {
+        return -1;
+    }
+
+    struct io_uring_buf_reg reg = {
+        .ring_addr = (uint64_t)(uintptr_t)data->buf_ring,
+        .ring_entries = URING_BUFFER_COUNT,
+        .bgid = URING_BUFFER_GROUP,
+    };
+    if (sys_io_uring_register(data->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        perror("Registering io_uring buffer ring failed");
+        return -1;
+    }
+
+    data->buf_tail = 0;
+    for (uint16_t i = 0; i < URING_BUFFER_COUNT; i++) {
+        add_ring_buffer(data, i);
+    }
+    publish_ring_buffers(data);
+    return 0;
+}
+
+static void uring_backend_destroy(EventLoop *loop);
+
+static int uring_backend_init(EventLoop *loop)
+{
+    UringData *data = calloc(1, sizeof(UringData));
+    if (!data)
+        return -1;
+    data->ring_fd = -1;
+    loop->backend_data = data;
+
+    struct io_uring_params params = { 0 };
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_COOP_TASKRUN;
+    params.cq_entries = URING_CQ_ENTRIES;
+
+    data->ring_fd = sys_io_uring_setup(URING_ENTRIES, &params);
+    if (data->ring_fd < 0) {
+        perror("io_uring_setup failed");
+        uring_backend_destroy(loop);
+        return -1;
+    }
+
+    // Multishot accept/recv and provided buffer rings need a recent kernel
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG)
+        || !(params.features & IORING_FEAT_SUBMIT_STABLE)) {
+        fprintf(stderr, "io_uring backend needs a newer kernel\n");
+        uring_backend_destroy(loop);
+        return -1;
+    }
+
+    data->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    data->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (data->cq_ring_size > data->sq_ring_size) {
+        data->sq_ring_size = data->cq_ring_size;
+    }
+    data->cq_ring_size = data->sq_ring_size;
+
+    // One mapping holds both rings
+    data->sq_ring = mmap(NULL, data->sq_ring_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, data->ring_fd, IORING_OFF_SQ_RING);
+    if (data->sq_ring == MAP_FAILED) {
+        data->sq_ring = NULL;
+        perror("io_uring mmap failed");
+        uring_backend_destroy(loop);
+        return -1;
+    }
+    data->cq_ring = data->sq_ring;
+
+    data->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    data->sqes = mmap(NULL, data->sqes_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, data->ring_fd, IORING_OFF_SQES);
+    if (data->sqes == MAP_FAILED) {
+        data->sqes = NULL;
+        perror("io_uring mmap failed");
+        uring_backend_destroy(loop);
+        return -1;
+    }
+
+    char *sq = data->sq_ring;
+    data->sq_head = (unsigned *)(sq + params.sq_off.head);
+    data->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    data->sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+    data->sq_entries = *(unsigned *)(sq + params.sq_off.ring_entries);
+    data->sqe_tail = *data->sq_tail;
+
+    data->send_msgs = calloc(data->sq_entries, sizeof(struct msghdr));
+    if (!data->send_msgs) {
+        uring_backend_destroy(loop);
+        return -1;
+    }
+
+    // SQEs are always used in order, so the index array is the identity
+    unsigned *sq_array = (unsigned *)(sq + params.sq_off.array);
+    for (unsigned i = 0; i < data->sq_entries; i++) {
+        sq_array[i] = i;
+    }
+
+    char *cq = data->cq_ring;
+    data->cq_head = (unsigned *)(cq + params.cq_off.head);
+    data->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    data->cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+    data->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    if (setup_buffer_ring(loop) < 0) {
+        uring_backend_destroy(loop);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void uring_backend_destroy(EventLoop *loop)
+{
+    UringData *data = loop->backend_data;
+    if (data->sqes)
+        munmap(data->sqes, data->sqes_size);
+    if (data->sq_ring)
+        munmap(data->sq_ring, data->sq_ring_size);
+    if (data->ring_fd >= 0)
+        close(data->ring_fd);
+    if (data->buf_ring)
+        munmap(data->buf_ring, data->buf_ring_size);
+    free(data->buffers);
+    free(data->starved);
+    free(data->send_msgs);
+    free(data);
+}
+
+static int uring_backend_add(EventLoop *loop, EventHandle *handle, uint32_t events)
+{
+    return prep_poll(loop->backend_data, handle, events);
+}
+
+static int uring_backend_modify(EventLoop *loop, EventHandle *handle, uint32_t events)
+{
+    UringData *data = loop->backend_data;
+    if (prep_cancel(data, handle, OP_POLL) < 0) {
+        return -1;
+    }
+    return prep_poll(data, handle, events);
+}
+
+static void unstarve(UringData *data, EventHandle *handle)
+{
+    for (size_t i = 0; i < data->num_starved; i++) {
+        if (data->starved[i] == handle) {
+            data->starved[i] = data->starved[--data->num_starved];
+            return;
+        }
+    }
+}
+
+static int uring_backend_remove(EventLoop *loop, EventHandle *handle)
+{
+    UringData *data = loop->backend_data;
+    unstarve(data, handle);
+    handle->closing = true;
+    if (handle->pending_ops == 0) {
+        return 0;
+    }
+
+    // Stop the multishot operations, sends are left to finish on their own
+    if (prep_cancel(data, handle, OP_POLL) < 0 || prep_cancel(data, handle, OP_ACCEPT) < 0
+        || prep_cancel(data, handle, OP_RECV) < 0 || prep_cancel(data, handle, OP_WRITABLE) < 0) {
+        return -1;
+    }
+    return 1;
+}
+
+static int uring_backend_accept(EventLoop *loop, EventHandle *listener)
+{
+    return prep_accept(loop->backend_data, listener);
+}
+
+static int uring_backend_recv(EventLoop *loop, EventHandle *handle)
+{
+    return prep_recv(loop->backend_data, handle);
+}
+
+// The iovecs go out in a single sendmsg. Its header and the iovec array
+// are copied by the kernel when the SQE is submitted with the next wait
+static int uring_backend_send(EventLoop *loop, EventHandle *handle, const struct iovec *iov, int iovcnt)
+{
+    UringData *data = loop->backend_data;
+    struct io_uring_sqe *sqe = get_sqe(data);
+    if (!sqe) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    struct msghdr *msg = &data->send_msgs[sqe - data->sqes];
+    memset(msg, 0, sizeof(*msg));
+    msg->msg_iov = (struct iovec *)iov;
+    msg->msg_iovlen = iovcnt;
+
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = handle->fd;
+    sqe->addr = (uint64_t)(uintptr_t)msg;
+    sqe->len = 1;
+    // Retried in the kernel on short writes
+    sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+    sqe->user_data = make_user_data(handle, OP_SEND);
+    handle->pending_ops++;
+    return 0;
+}
+
+static int uring_backend_wait_writable(EventLoop *loop, EventHandle *handle)
+{
+    struct io_uring_sqe *sqe = get_sqe(loop->backend_data);
+    if (!sqe) {
+        errno = EBUSY;
+        return -1;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = handle->fd;
+    sqe->poll32_events = POLLOUT;
+    sqe->user_data = make_user_data(handle, OP_WRITABLE);
+    handle->pending_ops++;
+    return 0;
+}
+
+// Completions already on their way are still reported after the cancel
+static int uring_backend_pause_recv(EventLoop *loop, EventHandle *handle)
+{
+    UringData *data = loop->backend_data;
+    unstarve(data, handle);
+    return prep_cancel(data, handle, OP_RECV);
+}
+
+// The cancel is submitted before the new recv, so it can't catch it
+static int uring_backend_resume_recv(EventLoop *loop, EventHandle *handle)
+{
+    return prep_recv(loop->backend_data, handle);
+}
+
+static void uring_backend_release_buffer(EventLoop *loop, uint16_t buffer_id)
+{
+    UringData *data = loop->backend_data;
+    add_ring_buffer(data, buffer_id);
+    publish_ring_buffers(data);
+    data->buffers_lent--;
+
+    // A buffer is available again, restart one connection that ran out
+    if (data->num_starved > 0) {
+        EventHandle *handle = data->starved[--data->num_starved];
+        prep_recv(data, handle);
+    }
+}
+
+static void starve(UringData *data, EventHandle *handle)
+{
+    if (data->num_starved == data->starved_cap) {
+        size_t new_cap = data->starved_cap ? data->starved_cap * 2 : 64;
+        EventHandle **new_starved = realloc(data->starved, new_cap * sizeof(EventHandle *));
+        if (!new_starved) {
+            perror("realloc failed");
+            return;
+        }
+        data->starved = new_starved;
+        data->starved_cap = new_cap;
+    }
+    data->starved[data->num_starved++] = handle;
+}
+
+static void handle_completion(EventLoop *loop, struct io_uring_cqe *cqe)
+{
+    UringData *data = loop->backend_data;
+    unsigned long op = cqe->user_data & OP_MASK;
+    EventHandle *handle = (EventHandle *)(uintptr_t)(cqe->user_data & ~OP_MASK);
+    bool more = cqe->flags & IORING_CQE_F_MORE;
+    Event event = { .result = cqe->res };
+
+    if (op == OP_INTERNAL) {
+        return;
+    }
+
+    if (!more) {
+        handle->pending_ops--;
+    }
+
+    switch (op) {
+    case OP_POLL:
+        if (cqe->res >= 0) {
+            event.events = from_poll_events(cqe->res);
+        } else if (cqe->res != -ECANCELED) {
+            event.events = EVENT_ERROR;
+        }
+        if (!more && cqe->res != -ECANCELED && !handle->closing) {
+            prep_poll(data, handle, handle->events);
+        }
+        break;
+    case OP_ACCEPT:
+        if (cqe->res >= 0) {
+            event.events = EVENT_ACCEPTED;
+        }
+        if (!more && cqe->res != -ECANCELED && !handle->closing) {
+            prep_accept(data, handle);
+        }
+        break;
+    case OP_RECV:
+        if (cqe->flags & IORING_CQE_F_BUFFER) {
+            event.buffer_id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+            event.data = data->buffers + (size_t)event.buffer_id * URING_BUFFER_SIZE;
+            data->buffers_lent++;
+        }
+        if (cqe->res == -ENOBUFS) {
+            // Re-armed once a buffer is released, or right away if some
+            // were released before this completion was seen
+            if (handle->closing || handle->recv_paused) {
+                // Re-armed on resume, if at all
+            } else if (data->buffers_lent < URING_BUFFER_COUNT) {
+                prep_recv(data, handle);
+            } else {
+                starve(data, handle);
+            }
+        } else if (cqe->res != -ECANCELED) {
+            event.events = EVENT_RECEIVED;
+            if (!more && cqe->res > 0 && !handle->closing && !handle->recv_paused) {
+                prep_recv(data, handle);
+            }
+        }
+        break;
+    case OP_SEND:
+        event.events = EVENT_SENT;
+        break;
+    case OP_WRITABLE:
+        if (cqe->res >= 0) {
+            event.events = from_poll_events(cqe->res);
+        } else if (cqe->res != -ECANCELED) {
+            event.events = EVENT_ERROR;
+        }
+        break;
+    }
+
+    if (handle->closing) {
+        // Buffers handed out after removal would never be released
+        if (event.data) {
+            uring_backend_release_buffer(loop, event.buffer_id);
+        }
+        if (handle->pending_ops == 0) {
+            Event closed = { .events = EVENT_CLOSED };
+            handle->callback(loop, handle, &closed);
+        }
+        return;
+    }
+
+    if (event.events) {
+        handle->callback(loop, handle, &event);
+    }
+}
+
+static int uring_backend_wait(EventLoop *loop, int timeout_ms)
+{
+    UringData *data = loop->backend_data;
+
+    // Submit everything queued since the last wait and block in one syscall
+    unsigned ready = __atomic_load_n(data->cq_tail, __ATOMIC_ACQUIRE) - *data->cq_head;
+    if (uring_enter(data, ready > 0 ? 0 : 1, timeout_ms) < 0) {
+        return -1;
+    }
+    event_loop_update_time(loop);
+
+    int handled = 0;
+    unsigned head = *data->cq_head;
+    unsigned tail = __atomic_load_n(data->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        struct io_uring_cqe cqe = data->cqes[head & data->cq_mask];
+        // Free the slot before dispatching, callbacks may queue more work
+        __atomic_store_n(data->cq_head, ++head, __ATOMIC_RELEASE);
+        handle_completion(loop, &cqe);
+        handled++;
+        if (head == tail) {
+            tail = __atomic_load_n(data->cq_tail, __ATOMIC_ACQUIRE);
+        }
+    }
+
+    return handled;
+}
+
+const EventLoopBackend URING_BACKEND = {
+    .name = "io_uring",
+    .init = uring_backend_init,
+    .destroy = uring_backend_destroy,
+    .add = uring_backend_add,
+    .modify = uring_backend_modify,
+    .remove = uring_backend_remove,
+    .wait = uring_backend_wait,
+    .accept = uring_backend_accept,
+    .recv = uring_backend_recv,
+    .send = uring_backend_send,
+    .release_buffer = uring_backend_release_buffer,
+    .wait_writable = uring_backend_wait_writable,
+    .pause_recv = uring_backend_pause_recv,
+    .resume_recv = uring_backend_resume_recv,
+};
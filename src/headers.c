@@ -0,0 +1,142 @@
+#include "headers.h"
+#include <string.h>
+#include <strings.h>
+
+#define HEADER_TABLE_SIZE 64
+
+// Perfect hash over the length and the first and last characters, chosen so
+// no two well-known names collide. Collisions in KNOWN_HEADERS below show up
+// as -Woverride-init warnings, so adding a name that breaks it can't go unnoticed
+#define HEADER_SLOT(len, first, last) (((len) + 4 * (first) + (last)) & (HEADER_TABLE_SIZE - 1))
+#define KNOWN_HEADER(id, name, first, last) \
+    [HEADER_SLOT(sizeof(name) - 1, first, last)] = { name, sizeof(name) - 1, id }
+
+typedef struct KnownHeader {
+    const char *name;
+    size_t len;
+    HeaderId id;
+} KnownHeader;
+
+static const KnownHeader KNOWN_HEADERS[HEADER_TABLE_SIZE] = {
+    KNOWN_HEADER(HEADER_ACCEPT, "Accept", 'a', 't'),
+    KNOWN_HEADER(HEADER_ACCEPT_ENCODING, "Accept-Encoding", 'a', 'g'),
+    KNOWN_HEADER(HEADER_ACCEPT_LANGUAGE, "Accept-Language", 'a', 'e'),
+    KNOWN_HEADER(HEADER_AUTHORIZATION, "Authorization", 'a', 'n'),
+    KNOWN_HEADER(HEADER_CACHE_CONTROL, "Cache-Control", 'c', 'l'),
+    KNOWN_HEADER(HEADER_CONNECTION, "Connection", 'c', 'n'),
+    KNOWN_HEADER(HEADER_CONTENT_ENCODING, "Content-Encoding", 'c', 'g'),
+    KNOWN_HEADER(HEADER_CONTENT_LENGTH, "Content-Length", 'c', 'h'),
+    KNOWN_HEADER(HEADER_CONTENT_TYPE, "Content-Type", 'c', 'e'),
+    KNOWN_HEADER(HEADER_COOKIE, "Cookie", 'c', 'e'),
+    KNOWN_HEADER(HEADER_EXPECT, "Expect", 'e', 't'),
+    KNOWN_HEADER(HEADER_HOST, "Host", 'h', 't'),
+    KNOWN_HEADER(HEADER_IF_MATCH, "If-Match", 'i', 'h'),
+    KNOWN_HEADER(HEADER_IF_MODIFIED_SINCE, "If-Modified-Since", 'i', 'e'),
+    KNOWN_HEADER(HEADER_IF_NONE_MATCH, "If-None-Match", 'i', 'h'),
+    KNOWN_HEADER(HEADER_IF_RANGE, "If-Range", 'i', 'e'),
+    KNOWN_HEADER(HEADER_IF_UNMODIFIED_SINCE, "If-Unmodified-Since", 'i', 'e'),
+    KNOWN_HEADER(HEADER_ORIGIN, "Origin", 'o', 'n'),
+    KNOWN_HEADER(HEADER_RANGE, "Range", 'r', 'e'),
+    KNOWN_HEADER(HEADER_REFERER, "Referer", 'r', 'r'),
+    KNOWN_HEADER(HEADER_TRANSFER_ENCODING, "Transfer-Encoding", 't', 'g'),
+    KNOWN_HEADER(HEADER_UPGRADE, "Upgrade", 'u', 'e'),
+    KNOWN_HEADER(HEADER_USER_AGENT, "User-Agent", 'u', 't'),
+    KNOWN_HEADER(HEADER_X_FORWARDED_FOR, "X-Forwarded-For", 'x', 'r'),
+    KNOWN_HEADER(HEADER_X_FORWARDED_PROTO, "X-Forwarded-Proto", 'x', 'o'),
+    KNOWN_HEADER(HEADER_X_REQUEST_ID, "X-Request-Id", 'x', 'd'),
+};
+
+const char *HEADER_NAMES[HEADER_COUNT] = {
+    [HEADER_ACCEPT] = "Accept",
+    [HEADER_ACCEPT_ENCODING] = "Accept-Encoding",
+    [HEADER_ACCEPT_LANGUAGE] = "Accept-Language",
+    [HEADER_AUTHORIZATION] = "Authorization",
+    [HEADER_CACHE_CONTROL] = "Cache-Control",
+    [HEADER_CONNECTION] = "Connection",
+    [HEADER_CONTENT_ENCODING] = "Content-Encoding",
+    [HEADER_CONTENT_LENGTH] = "Content-Length",
+    [HEADER_CONTENT_TYPE] = "Content-Type",
+    [HEADER_COOKIE] = "Cookie",
+    [HEADER_EXPECT] = "Expect",
+    [HEADER_HOST] = "Host",
+    [HEADER_IF_MATCH] = "If-Match",
+    [HEADER_IF_MODIFIED_SINCE] = "If-Modified-Since",
+    [HEADER_IF_NONE_MATCH] = "If-None-Match",
+    [HEADER_IF_RANGE] = "If-Range",
+    [HEADER_IF_UNMODIFIED_SINCE] = "If-Unmodified-Since",
+    [HEADER_ORIGIN] = "Origin",
+    [HEADER_RANGE] = "Range",
+    [HEADER_REFERER] = "Referer",
+    [HEADER_TRANSFER_ENCODING] = "Transfer-Encoding",
+    [HEADER_UPGRADE] = "Upgrade",
+    [HEADER_USER_AGENT] = "User-Agent",
+    [HEADER_X_FORWARDED_FOR] = "X-Forwarded-For",
+    [HEADER_X_FORWARDED_PROTO] = "X-Forwarded-Proto",
+    [HEADER_X_REQUEST_ID] = "X-Request-Id",
+};
+
+/**
+ * Maps a header name to its well-known id, ignoring case
+ * @param name Header name, not NUL terminated
+ * @param len Length of the name
+ * @return The header's id, or HEADER_UNKNOWN
+ */
+HeaderId lookup_header_id(const char *name, size_t len)
+{
+    if (len == 0) {
+        return HEADER_UNKNOWN;
+    }
+
+    // Setting 0x20 lowercases letters and leaves '-' and digits alone
+    const KnownHeader *known = &KNOWN_HEADERS[HEADER_SLOT(len, name[0] | 0x20, name[len - 1] | 0x20)];
+    if (known->len == len && strncasecmp(known->name, name, len) == 0) {
+        return known->id;
+    }
+    return HEADER_UNKNOWN;
+}
+
+void clear_header_table(HeaderTable *table)
+{
+    memset(table->known, 0, sizeof(table->known));
+    table->num_others = 0;
+}
+
+// Store a header, returns false once the table is full
+bool add_header(HeaderTable *table, StringView name, StringView value, HeaderId id)
+{
+    if (id != HEADER_UNKNOWN && table->known[id].data == NULL) {
+        table->known[id] = value;
+        return true;
+    }
+
+    if (table->num_others == MAX_OTHER_HEADERS) {
+        return false;
+    }
+    table->others[table->num_others].name = name;
+    table->others[table->num_others].value = value;
+    table->num_others++;
+    return true;
+}
+
+// Value of a well-known header, NULL if the request doesn't have it
+const StringView *get_header(const HeaderTable *table, HeaderId id)
+{
+    return table->known[id].data ? &table->known[id] : NULL;
+}
+
+// Value of any header by case-insensitive name, NULL if it's missing
+const StringView *find_header(const HeaderTable *table, const char *name)
+{
+    size_t len = strlen(name);
+    HeaderId id = lookup_header_id(name, len);
+    if (id != HEADER_UNKNOWN) {
+        return get_header(table, id);
+    }
+
+    for (size_t i = 0; i < table->num_others; i++) {
+        if (sv_equals_ignore_case(table->others[i].name, name)) {
+            return &table->others[i].value;
+        }
+    }
+    return NULL;
+}
@@ -1,10 +1,62 @@
 #ifndef HEADERS_H
 #define HEADERS_H
 
-#define MAX_CONTENT_TYPE_LEN 30
+#include "common.h"
+#include <stddef.h>
 
-typedef struct CommonHeaders {
-    char content_type[MAX_CONTENT_TYPE_LEN];
-} CommonHeaders;
+#define MAX_OTHER_HEADERS 32
+
+// Headers the server and handlers branch on, looked up in O(1)
+typedef enum HeaderId {
+    HEADER_UNKNOWN = -1,
+    HEADER_ACCEPT,
+    HEADER_ACCEPT_ENCODING,
+    HEADER_ACCEPT_LANGUAGE,
+    HEADER_AUTHORIZATION,
+    HEADER_CACHE_CONTROL,
+    HEADER_CONNECTION,
+    HEADER_CONTENT_ENCODING,
+    HEADER_CONTENT_LENGTH,
+    HEADER_CONTENT_TYPE,
+    HEADER_COOKIE,
+    HEADER_EXPECT,
+    HEADER_HOST,
+    HEADER_IF_MATCH,
+    HEADER_IF_MODIFIED_SINCE,
+    HEADER_IF_NONE_MATCH,
+    HEADER_IF_RANGE,
+    HEADER_IF_UNMODIFIED_SINCE,
+    HEADER_ORIGIN,
+    HEADER_RANGE,
+    HEADER_REFERER,
+    HEADER_TRANSFER_ENCODING,
+    HEADER_UPGRADE,
+    HEADER_USER_AGENT,
+    HEADER_X_FORWARDED_FOR,
+    HEADER_X_FORWARDED_PROTO,
+    HEADER_X_REQUEST_ID,
+    HEADER_COUNT,
+} HeaderId;
+
+typedef struct HttpHeader {
+    StringView name;
+    StringView value;
+} HttpHeader;
+
+typedef struct HeaderTable {
+    // Values of well-known headers indexed by id, data is NULL when absent
+    StringView known[HEADER_COUNT];
+    // Headers without an id, and repeats of ones that have one
+    HttpHeader others[MAX_OTHER_HEADERS];
+    size_t num_others;
+} HeaderTable;
+
+extern const char *HEADER_NAMES[HEADER_COUNT];
+
+extern HeaderId lookup_header_id(const char *name, size_t len);
+extern void clear_header_table(HeaderTable *table);
+extern bool add_header(HeaderTable *table, StringView name, StringView value, HeaderId id);
+extern const StringView *get_header(const HeaderTable *table, HeaderId id);
+extern const StringView *find_header(const HeaderTable *table, const char *name);
 
 #endif // HEADERS_H
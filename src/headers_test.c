@@ -0,0 +1,84 @@
+#include "headers.h"
+#include "test.h"
+#include <ctype.h>
+#include <string.h>
+
+static StringView view(const char *str)
+{
+    return (StringView) { .data = str, .len = strlen(str) };
+}
+
+// Every well-known name maps to its own id in any case
+static void test_known_names()
+{
+    for (int id = 0; id < HEADER_COUNT; id++) {
+        const char *name = HEADER_NAMES[id];
+        size_t len = strlen(name);
+        char lower[32], upper[32];
+        for (size_t i = 0; i <= len; i++) {
+            lower[i] = tolower((unsigned char)name[i]);
+            upper[i] = toupper((unsigned char)name[i]);
+        }
+        CHECK(lookup_header_id(name, len) == (HeaderId)id);
+        CHECK(lookup_header_id(lower, len) == (HeaderId)id);
+        CHECK(lookup_header_id(upper, len) == (HeaderId)id);
+        // Only the name's own length matches
+        CHECK(lookup_header_id(name, len - 1) == HEADER_UNKNOWN);
+    }
+}
+
+// Names that land in a taken slot still have to match it in full
+static void test_unknown_names()
+{
+    CHECK(lookup_header_id("", 0) == HEADER_UNKNOWN);
+    CHECK(lookup_header_id("X-Custom", 8) == HEADER_UNKNOWN);
+    // Same length, first and last character as known names
+    CHECK(lookup_header_id("Axxxxt", 6) == HEADER_UNKNOWN);
+    CHECK(lookup_header_id("Cxxxxxxxxxxxxh", 14) == HEADER_UNKNOWN);
+    CHECK(lookup_header_id("Hxxt", 4) == HEADER_UNKNOWN);
+    CHECK(lookup_header_id("Host ", 5) == HEADER_UNKNOWN);
+    CHECK(lookup_header_id("Content_Length", 14) == HEADER_UNKNOWN);
+}
+
+static void test_header_table()
+{
+    HeaderTable table;
+    clear_header_table(&table);
+    CHECK(get_header(&table, HEADER_HOST) == NULL);
+
+    CHECK(add_header(&table, view("Host"), view("a.example"), HEADER_HOST));
+    CHECK(add_header(&table, view("host"), view("b.example"), HEADER_HOST));
+    CHECK(add_header(&table, view("X-Trace"), view("1"), HEADER_UNKNOWN));
+
+    // The first of a repeated header is the one looked up by id
+    const StringView *host = get_header(&table, HEADER_HOST);
+    CHECK(host && sv_equals(*host, "a.example"));
+    CHECK(table.num_others == 2);
+    CHECK(sv_equals(table.others[0].value, "b.example"));
+
+    const StringView *found = find_header(&table, "HOST");
+    CHECK(found == host);
+    found = find_header(&table, "x-trace");
+    CHECK(found && sv_equals(*found, "1"));
+    CHECK(find_header(&table, "X-Missing") == NULL);
+    CHECK(find_header(&table, "Cookie") == NULL);
+
+    while (table.num_others < MAX_OTHER_HEADERS) {
+        CHECK(add_header(&table, view("X-Fill"), view(""), HEADER_UNKNOWN));
+    }
+    CHECK(!add_header(&table, view("X-Fill"), view(""), HEADER_UNKNOWN));
+    // Known headers still have their own place
+    CHECK(add_header(&table, view("Cookie"), view("a=1"), HEADER_COOKIE));
+
+    clear_header_table(&table);
+    CHECK(get_header(&table, HEADER_HOST) == NULL);
+    CHECK(find_header(&table, "X-Trace") == NULL);
+}
+
+int main()
+{
+    test_known_names();
+    test_unknown_names();
+    test_header_table();
+    return TEST_RESULT();
+}
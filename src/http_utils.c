@@ -3,9 +3,76 @@
 #include "response.h"
 #include <stdbool.h>
 #include <stddef.h>
+#include <string.h>
+#include <strings.h>
+
+static inline const char *find_headers_end_scalar(const char *buffer, size_t length)
+{
+    for (size_t i = 0; i + 4 <= length; i++) {
+        if (buffer[i] == '\r' && buffer[i + 1] == '\n' && buffer[i + 2] == '\r' && buffer[i + 3] == '\n') {
+            return &buffer[i];
+        }
+    }
+    return NULL;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_SIMD
+#include <immintrin.h>
+
+// Compare four shifted loads against \r \n \r \n, so every bit left in the
+// combined mask is the start of a terminator
+static const char *find_headers_end_sse2(const char *buffer, size_t length)
+{
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i lf = _mm_set1_epi8('\n');
+    size_t i = 0;
+
+    for (; i + 16 + 3 <= length; i += 16) {
+        __m128i b0 = _mm_loadu_si128((const __m128i *)(buffer + i));
+        __m128i b1 = _mm_loadu_si128((const __m128i *)(buffer + i + 1));
+        __m128i b2 = _mm_loadu_si128((const __m128i *)(buffer + i + 2));
+        __m128i b3 = _mm_loadu_si128((const __m128i *)(buffer + i + 3));
+        __m128i match = _mm_and_si128(
+            _mm_and_si128(_mm_cmpeq_epi8(b0, cr), _mm_cmpeq_epi8(b1, lf)),
+            _mm_and_si128(_mm_cmpeq_epi8(b2, cr), _mm_cmpeq_epi8(b3, lf)));
+        unsigned mask = (unsigned)_mm_movemask_epi8(match);
+        if (mask) {
+            return buffer + i + __builtin_ctz(mask);
+        }
+    }
+
+    return find_headers_end_scalar(buffer + i, length - i);
+}
+
+__attribute__((target("avx2"))) static const char *find_headers_end_avx2(const char *buffer, size_t length)
+{
+    const __m256i cr = _mm256_set1_epi8('\r');
+    const __m256i lf = _mm256_set1_epi8('\n');
+    size_t i = 0;
+
+    for (; i + 32 + 3 <= length; i += 32) {
+        __m256i b0 = _mm256_loadu_si256((const __m256i *)(buffer + i));
+        __m256i b1 = _mm256_loadu_si256((const __m256i *)(buffer + i + 1));
+        __m256i b2 = _mm256_loadu_si256((const __m256i *)(buffer + i + 2));
+        __m256i b3 = _mm256_loadu_si256((const __m256i *)(buffer + i + 3));
+        __m256i match = _mm256_and_si256(
+            _mm256_and_si256(_mm256_cmpeq_epi8(b0, cr), _mm256_cmpeq_epi8(b1, lf)),
+            _mm256_and_si256(_mm256_cmpeq_epi8(b2, cr), _mm256_cmpeq_epi8(b3, lf)));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(match);
+        if (mask) {
+            return buffer + i + __builtin_ctz(mask);
+        }
+    }
+
+    // Finish the tail 16 bytes at a time
+    return find_headers_end_sse2(buffer + i, length - i);
+}
+#endif
 
 /**
- * Finds the first occurrence of CRLFCRLF in the buffer
+ * Finds the first occurrence of CRLFCRLF in the buffer, using AVX2 or SSE2
+ * where the CPU has them and a byte loop otherwise
  * @param buffer Pointer to the buffer to search
  * @param length Length of the buffer
  * @return Pointer to the start of CRLFCRLF or NULL if not found
@@ -16,12 +83,15 @@ inline const char *find_headers_end(const char *buffer, size_t length)
         return NULL;
     }
 
-    for (size_t i = 0; i <= length - 4; i++) {
-        if (buffer[i] == '\r' && buffer[i + 1] == '\n' && buffer[i + 2] == '\r' && buffer[i + 3] == '\n') {
-            return &buffer[i];
-        }
+#ifdef HAVE_X86_SIMD
+    static int has_avx2 = -1;
+    if (has_avx2 < 0) {
+        has_avx2 = __builtin_cpu_supports("avx2");
     }
-    return NULL;
+    return has_avx2 ? find_headers_end_avx2(buffer, length) : find_headers_end_sse2(buffer, length);
+#else
+    return find_headers_end_scalar(buffer, length);
+#endif
 }
 
 inline bool is_method_with_body(RequestMethod method)
@@ -32,49 +102,221 @@ inline bool is_method_with_body(RequestMethod method)
     return false;
 }
 
+// Longer values would overflow, no body gets anywhere near that
+#define MAX_CONTENT_LENGTH_DIGITS 18
+
+// Find the next header with a lowercase name from the line after from, with
+// the value's surrounding whitespace trimmed. Only used for the headers
+// framing needs, before parsing. Returns where to look for the next one, or
+// NULL once there are no more
+static const char *find_framing_header(const char *from, const char *end, const char *name, size_t name_len,
+    StringView *value)
+{
+    const char *line = memchr(from, '\n', end - from);
+
+    while (line && ++line + name_len < end) {
+        if (strncasecmp(line, name, name_len) == 0) {
+            const char *start = line + name_len;
+            while (start < end && (*start == ' ' || *start == '\t')) {
+                start++;
+            }
+            const char *line_end = memchr(start, '\r', end - start);
+            value->data = start;
+            value->len = (line_end ? line_end : end) - start;
+            while (value->len > 0 && (value->data[value->len - 1] == ' ' || value->data[value->len - 1] == '\t')) {
+                value->len--;
+            }
+            return line_end ? line_end : end;
+        }
+        line = memchr(line, '\n', end - line);
+    }
+    return NULL;
+}
+
 /**
- * Checks if an HTTP/1.1 request is complete
- * @param buffer Pointer to the buffer containing the request
- * @param length Length of the buffer
- * @return true if request is complete, false if more data needed
+ * Finds the value of the Content-Length header in a block of headers. The
+ * value has to be digits alone, and a repeated header has to repeat the
+ * same value, anything else may be framed differently by another hop
+ * @param headers Pointer to the start of the request
+ * @param length Length of the request line and headers
+ * @param content_len Set to the declared body length, 0 if there is none
+ * @return 1 if the header is there, 0 if not and -1 if it is malformed
  */
-inline bool check_http_end(ClientInfo *client)
+int find_content_length(const char *headers, size_t length, size_t *content_len)
 {
-    // Basic validation
-    if (client->buffer == NULL || client->buf_used < 4) {
-        return false;
+    static const char NAME[] = "content-length:";
+    const char *end = headers + length;
+    StringView value;
+    int found = 0;
+    *content_len = 0;
+    while ((headers = find_framing_header(headers, end, NAME, sizeof(NAME) - 1, &value))) {
+        if (value.len == 0 || value.len > MAX_CONTENT_LENGTH_DIGITS) {
+            return -1;
+        }
+        size_t parsed = 0;
+        for (size_t i = 0; i < value.len; i++) {
+            if (value.data[i] < '0' || value.data[i] > '9') {
+                return -1;
+            }
+            parsed = parsed * 10 + (value.data[i] - '0');
+        }
+        if (found && parsed != *content_len) {
+            return -1;
+        }
+        *content_len = parsed;
+        found = 1;
     }
+    return found;
+}
 
-    char *buffer = client->buffer;
-    size_t length = client->buf_used;
-
-    if (client->req != NULL) {
+// Whether the body is chunked. Any other final coding can't be framed, so
+// it makes the request malformed. Repeated headers add to one list, the
+// last of them has the final coding
+static bool find_chunked(const char *headers, size_t length, bool *malformed)
+{
+    static const char NAME[] = "transfer-encoding:";
+    static const char CHUNKED[] = "chunked";
+    const char *end = headers + length;
+    StringView value, next;
+    *malformed = false;
+    if (!(headers = find_framing_header(headers, end, NAME, sizeof(NAME) - 1, &value))) {
         return false;
     }
+    while ((headers = find_framing_header(headers, end, NAME, sizeof(NAME) - 1, &next))) {
+        value = next;
+    }
+    // Codings are listed in the order they were applied, chunked goes last
+    size_t chunked_len = sizeof(CHUNKED) - 1;
+    if (value.len < chunked_len
+        || strncasecmp(value.data + value.len - chunked_len, CHUNKED, chunked_len) != 0
+        || (value.len > chunked_len && value.data[value.len - chunked_len - 1] != ','
+            && value.data[value.len - chunked_len - 1] != ' ')) {
+        *malformed = true;
+        return false;
+    }
+    return true;
+}
 
-    Request *req = client->req;
+// Framing gave up on the request, it is answered with an error and the
+// connection closed, since where the next request starts is unknown
+static bool framing_failed(ClientInfo *client, FramingError error)
+{
+    client->framing_error = error;
+    return true;
+}
 
-    if (!is_method_with_body(req->method) && (buffer[length - 4] == '\r' && buffer[length - 3] == '\n' && buffer[length - 2] == '\r' && buffer[length - 1] == '\n')) {
-        return true;
+// Decode the chunked body in place as it arrives, so the buffer holds the
+// headers and the decoded body back to back, followed by whatever is left
+// once the body ends
+static bool decode_chunked_body(ClientInfo *client)
+{
+    char *body = client->buffer + client->buf_start + client->headers_len;
+    char *raw = body + client->body_len;
+    size_t available = client->buffer + client->buf_used - raw;
+    size_t used = 0;
+
+    while (used < available) {
+        size_t consumed;
+        const char *data;
+        size_t data_len;
+        ChunkedResult result = chunked_decode(&client->chunks, raw + used, available - used, &consumed,
+            &data, &data_len);
+        used += consumed;
+        if (result == CHUNKED_ERROR) {
+            return framing_failed(client, FRAMING_MALFORMED);
+        }
+        if (result == CHUNKED_DATA) {
+            if (client->body_len + data_len > client->max_body_size) {
+                return framing_failed(client, FRAMING_TOO_LARGE);
+            }
+            memmove(body + client->body_len, data, data_len);
+            client->body_len += data_len;
+        }
+        if (result != CHUNKED_DATA) {
+            break;
+        }
     }
 
-    // Find end of headers
-    const char *headers_end = find_headers_end(buffer, length);
-    if (!headers_end) {
+    // Raw bytes are only left over once the body has ended, they belong to
+    // the next request and move down behind the decoded body
+    char *decoded_end = body + client->body_len;
+    size_t rest = available - used;
+    memmove(decoded_end, raw + used, rest);
+    client->buf_used = decoded_end + rest - client->buffer;
+    if (client->chunks.state != CHUNK_DONE) {
         return false;
     }
+    client->req_len = client->headers_len + client->body_len;
+    return true;
+}
+
+/**
+ * Checks if an HTTP/1.1 request is complete. Framing state is kept on the
+ * client, so each call only scans bytes that arrived since the last one.
+ * Chunked bodies are decoded in place as they arrive
+ * @param client Client whose buffer holds the request
+ * @return true if request is complete, or framing failed, or the headers are
+ * in and the body is offered for streaming, false if more data needed
+ */
+inline bool check_http_end(ClientInfo *client)
+{
+    // The current request starts buf_start bytes into the buffer
+    const char *request = client->buffer + client->buf_start;
+    size_t available = client->buf_used - client->buf_start;
 
-    // Calculate body start and length
-    const char *body_start = headers_end + 4;
-    size_t headers_len = body_start - buffer;
-    size_t body_len = length - headers_len;
+    if (client->headers_len == 0) {
+        if (client->buffer == NULL || available < 4) {
+            return false;
+        }
 
-    // Check Content-Length if present
-    if (req->content_len != 0) {
-        return body_len >= req->content_len;
+        // Back up three bytes in case the terminator straddles two reads
+        size_t start = client->scan_offset > 3 ? client->scan_offset - 3 : 0;
+        const char *headers_end = find_headers_end(request + start, available - start);
+        if (!headers_end) {
+            client->scan_offset = available;
+            return available > MAX_REQUEST_HEADERS_LEN ? framing_failed(client, FRAMING_MALFORMED) : false;
+        }
+
+        // The body is either chunked or exactly Content-Length bytes long
+        client->headers_len = headers_end + 4 - request;
+        bool malformed;
+        client->chunked = find_chunked(request, client->headers_len, &malformed);
+        int has_length = find_content_length(request, client->headers_len, &client->body_len);
+        // A body framed both ways is how a request gets smuggled past a
+        // proxy that picks the other one
+        if (malformed || has_length < 0 || (client->chunked && has_length)) {
+            return framing_failed(client, FRAMING_MALFORMED);
+        }
+        if (client->chunked) {
+            chunked_decoder_init(&client->chunks);
+            client->body_len = 0;
+        }
+        client->req_len = client->headers_len + client->body_len;
+
+        // Let the handler choose to stream a body that is still on its way
+        if (client->offer_bodies && (client->chunked || available < client->req_len)) {
+            client->offer_body = true;
+            return true;
+        }
     }
 
-    // If no Content-Length or chunked encoding, assume request is complete
-    // (this is technically not valid for HTTP/1.1 requests with bodies)
-    return true;
+    if (client->chunked) {
+        return decode_chunked_body(client);
+    }
+    if (client->body_len > client->max_body_size) {
+        return framing_failed(client, FRAMING_TOO_LARGE);
+    }
+    return available >= client->req_len;
+}
+
+// Forget the framing state once the current request has been consumed
+void reset_http_framing(ClientInfo *client)
+{
+    client->scan_offset = 0;
+    client->headers_len = 0;
+    client->body_len = 0;
+    client->req_len = 0;
+    client->chunked = false;
+    client->framing_error = FRAMING_OK;
+    client->offer_body = false;
 }
@@ -5,8 +5,13 @@
 #include <stdbool.h>
 #include <stddef.h>
 
+// Requests whose headers don't end within this many bytes are rejected
+#define MAX_REQUEST_HEADERS_LEN (64 * 1024)
+
 extern inline const char *find_headers_end(const char *buffer, size_t length);
 extern inline bool is_method_with_body(RequestMethod method);
+extern int find_content_length(const char *headers, size_t length, size_t *content_len);
 extern inline bool check_http_end(ClientInfo *client);
+extern void reset_http_framing(ClientInfo *client);
 
 #endif // HTTP_UTILS_H
@@ -0,0 +1,234 @@
+#include "client_info.h"
+#include "http_utils.h"
+#include "test.h"
+#include <string.h>
+
+#define SCAN_BUFFER_SIZE 200
+
+// Every terminator position in every buffer length, so the AVX2 and SSE2
+// blocks and the byte loop after them each find it, including where it
+// straddles two blocks
+static void test_find_headers_end()
+{
+    char buf[SCAN_BUFFER_SIZE];
+    for (size_t at = 0; at + 4 <= sizeof(buf); at++) {
+        memset(buf, 'a', sizeof(buf));
+        memcpy(buf + at, "\r\n\r\n", 4);
+        for (size_t len = 0; len <= sizeof(buf); len++) {
+            const char *end = find_headers_end(buf, len);
+            CHECK(end == (at + 4 <= len ? buf + at : NULL));
+        }
+    }
+
+    // Near misses are not terminators, the first real one is found
+    memset(buf, 'a', sizeof(buf));
+    const char near_misses[] = "\r\n\ra\n\r\n\r\r\n\n\r\n\r\n";
+    memcpy(buf + 30, near_misses, sizeof(near_misses) - 1);
+    CHECK(find_headers_end(buf, sizeof(buf)) == buf + 30 + sizeof(near_misses) - 5);
+    CHECK(find_headers_end(NULL, 10) == NULL);
+    CHECK(find_headers_end("\r\n\r", 3) == NULL);
+    CHECK(find_headers_end("\r\n\r\n", 4) != NULL);
+}
+
+static void init_client(ClientInfo *client, char *buffer, size_t len)
+{
+    memset(client, 0, sizeof(*client));
+    client->buffer = buffer;
+    client->buf_size = len;
+    client->max_body_size = 1024;
+    reset_http_framing(client);
+}
+
+// Framing resumes where the last read ended, whatever the read sizes
+static void test_incremental_framing()
+{
+    char request[] = "POST /echo HTTP/1.1\r\nHost: a\r\nContent-Length: 5\r\n\r\nhello";
+    size_t len = sizeof(request) - 1;
+    for (size_t segment = 1; segment <= len; segment++) {
+        ClientInfo client;
+        init_client(&client, request, len);
+        bool complete = false;
+        for (client.buf_used = 0; client.buf_used < len && !complete;) {
+            client.buf_used = client.buf_used + segment < len ? client.buf_used + segment : len;
+            complete = check_http_end(&client);
+            CHECK(complete == (client.buf_used == len));
+        }
+        CHECK(complete);
+        CHECK(client.framing_error == FRAMING_OK);
+        CHECK(client.headers_len == len - 5);
+        CHECK(client.body_len == 5);
+        CHECK(client.req_len == len);
+    }
+}
+
+// The next request starts at buf_start once the first is consumed
+static void test_pipelined_framing()
+{
+    char requests[] = "GET / HTTP/1.1\r\n\r\nPOST / HTTP/1.1\r\nContent-Length: 2\r\n\r\nhiGET /x HTTP/1.1\r\n";
+    ClientInfo client;
+    init_client(&client, requests, sizeof(requests) - 1);
+    client.buf_used = sizeof(requests) - 1;
+
+    CHECK(check_http_end(&client));
+    CHECK(client.req_len == 18);
+    client.buf_start += client.req_len;
+    reset_http_framing(&client);
+
+    CHECK(check_http_end(&client));
+    CHECK(client.body_len == 2);
+    CHECK(memcmp(client.buffer + client.buf_start + client.headers_len, "hi", 2) == 0);
+    client.buf_start += client.req_len;
+    reset_http_framing(&client);
+
+    // Only part of the third has arrived
+    CHECK(!check_http_end(&client));
+    CHECK(client.framing_error == FRAMING_OK);
+}
+
+// Headers that never end, and bodies over the limit, fail framing rather
+// than waiting for more
+static void test_framing_limits()
+{
+    static char large[MAX_REQUEST_HEADERS_LEN + 64];
+    memset(large, 'a', sizeof(large));
+    memcpy(large, "GET / HTTP/1.1\r\nX: ", 19);
+    ClientInfo client;
+    init_client(&client, large, sizeof(large));
+    client.buf_used = MAX_REQUEST_HEADERS_LEN;
+    CHECK(!check_http_end(&client));
+    client.buf_used = sizeof(large);
+    CHECK(check_http_end(&client));
+    CHECK(client.framing_error == FRAMING_MALFORMED);
+
+    char too_large[] = "POST / HTTP/1.1\r\nContent-Length: 1025\r\n\r\n";
+    init_client(&client, too_large, sizeof(too_large) - 1);
+    client.buf_used = sizeof(too_large) - 1;
+    CHECK(check_http_end(&client));
+    CHECK(client.framing_error == FRAMING_TOO_LARGE);
+}
+
+static int content_length(const char *headers, size_t *len)
+{
+    return find_content_length(headers, strlen(headers), len);
+}
+
+// Content-Length has to be digits alone, and repeats have to agree
+static void test_content_length()
+{
+    size_t len;
+    CHECK(content_length("POST / HTTP/1.1\r\nHost: a\r\n\r\n", &len) == 0 && len == 0);
+    CHECK(content_length("POST / HTTP/1.1\r\nContent-Length: 42\r\n\r\n", &len) == 1 && len == 42);
+    CHECK(content_length("POST / HTTP/1.1\r\ncontent-length:\t7 \r\n\r\n", &len) == 1 && len == 7);
+    CHECK(content_length("POST / HTTP/1.1\r\nContent-Length: 999999999999999999\r\n\r\n", &len) == 1);
+    CHECK(content_length("POST / HTTP/1.1\r\nContent-Length: 5\r\nContent-Length: 5\r\n\r\n", &len) == 1
+        && len == 5);
+
+    const char *const malformed[] = {
+        "POST / HTTP/1.1\r\nContent-Length: \r\n\r\n",
+        "POST / HTTP/1.1\r\nContent-Length: 1000000000000000000\r\n\r\n",
+        "POST / HTTP/1.1\r\nContent-Length: 99999999999999999999999\r\n\r\n",
+        "POST / HTTP/1.1\r\nContent-Length: 12a\r\n\r\n",
+        "POST / HTTP/1.1\r\nContent-Length: +5\r\n\r\n",
+        "POST / HTTP/1.1\r\nContent-Length: -1\r\n\r\n",
+        "POST / HTTP/1.1\r\nContent-Length: 5, 5\r\n\r\n",
+        "POST / HTTP/1.1\r\nContent-Length: 0x10\r\n\r\n",
+        "POST / HTTP/1.1\r\nContent-Length: 5\r\nContent-Length: 6\r\n\r\n",
+    };
+    for (size_t i = 0; i < sizeof(malformed) / sizeof(malformed[0]); i++) {
+        CHECK(content_length(malformed[i], &len) == -1);
+    }
+}
+
+static FramingError framing_error(const char *request)
+{
+    char buf[256];
+    size_t len = strlen(request);
+    memcpy(buf, request, len);
+    ClientInfo client;
+    init_client(&client, buf, len);
+    client.buf_used = len;
+    check_http_end(&client);
+    return client.framing_error;
+}
+
+// Requests another hop could frame differently are refused outright
+static void test_ambiguous_framing()
+{
+    CHECK(framing_error("POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n0\r\n\r\n") == FRAMING_OK);
+    CHECK(framing_error("POST / HTTP/1.1\r\nTransfer-Encoding: gzip, chunked\r\n\r\n0\r\n\r\n") == FRAMING_OK);
+    CHECK(framing_error("POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\nContent-Length: 5\r\n\r\n0\r\n\r\n")
+        == FRAMING_MALFORMED);
+    CHECK(framing_error("POST / HTTP/1.1\r\nTransfer-Encoding: gzip\r\n\r\n") == FRAMING_MALFORMED);
+    CHECK(framing_error("POST / HTTP/1.1\r\nTransfer-Encoding: xchunked\r\n\r\n") == FRAMING_MALFORMED);
+    // The last Transfer-Encoding has the final coding
+    CHECK(framing_error("POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\nTransfer-Encoding: gzip\r\n\r\n")
+        == FRAMING_MALFORMED);
+    CHECK(framing_error("POST / HTTP/1.1\r\nContent-Length: 1\r\nContent-Length: 2\r\n\r\nab")
+        == FRAMING_MALFORMED);
+}
+
+// Chunked bodies are decoded in place, with the next request moved down
+// behind them
+static void test_chunked_framing()
+{
+    char request[] = "POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n"
+                     "3\r\nabc\r\n4\r\ndefg\r\n0\r\n\r\nGET / HTTP/1.1\r\n\r\n";
+    size_t len = sizeof(request) - 1;
+    size_t headers_len = strstr(request, "\r\n\r\n") + 4 - request;
+    for (size_t segment = 1; segment <= len; segment++) {
+        char buf[sizeof(request)];
+        memcpy(buf, request, len);
+        ClientInfo client;
+        init_client(&client, buf, len);
+        // Each read appends raw bytes behind what was decoded so far
+        size_t received = 0;
+        bool complete = false;
+        while (!complete && received < len) {
+            size_t part = len - received < segment ? len - received : segment;
+            memmove(buf + client.buf_used, request + received, part);
+            client.buf_used += part;
+            received += part;
+            complete = check_http_end(&client);
+        }
+        CHECK(complete);
+        CHECK(client.framing_error == FRAMING_OK);
+        CHECK(client.body_len == 7);
+        CHECK(memcmp(buf + headers_len, "abcdefg", 7) == 0);
+        CHECK(client.req_len == headers_len + 7);
+    }
+
+    char pipelined[sizeof(request)];
+    memcpy(pipelined, request, sizeof(request));
+    ClientInfo client;
+    init_client(&client, pipelined, len);
+    client.buf_used = len;
+    CHECK(check_http_end(&client));
+    CHECK(client.buf_used - client.req_len == strlen("GET / HTTP/1.1\r\n\r\n"));
+    CHECK(memcmp(pipelined + client.req_len, "GET / HTTP/1.1\r\n\r\n", client.buf_used - client.req_len) == 0);
+
+    // The decoded size counts against the limit, not the raw one
+    char large[] = "POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n401\r\n";
+    init_client(&client, large, sizeof(large) - 1);
+    client.buf_used = sizeof(large) - 1;
+    CHECK(!check_http_end(&client));
+    CHECK(client.framing_error == FRAMING_OK);
+    char data[2048];
+    memcpy(data, large, sizeof(large) - 1);
+    memset(data + sizeof(large) - 1, 'a', 1025);
+    init_client(&client, data, sizeof(data));
+    client.buf_used = sizeof(large) - 1 + 1025;
+    CHECK(check_http_end(&client));
+    CHECK(client.framing_error == FRAMING_TOO_LARGE);
+}
+
+int main()
+{
+    test_find_headers_end();
+    test_incremental_framing();
+    test_pipelined_framing();
+    test_framing_limits();
+    test_content_length();
+    test_ambiguous_framing();
+    test_chunked_framing();
+    return TEST_RESULT();
+}
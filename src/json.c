@@ -0,0 +1,825 @@
+#include "json.h"
+#include "client_info.h"
+#include "worker.h"
+#include <math.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Room for a chunk's size line in front of each buffer and its CRLF after,
+// JSON_BUFFER_SIZE takes at most four hex digits
+#define CHUNK_HEAD_LEN 6
+#define CHUNK_TAIL_LEN 2
+// The most any single token writes without going through append
+#define MAX_TOKEN_LEN 32
+
+static const char LAST_CHUNK[] = "0\r\n\r\n";
+
+// A buffer of a chunked body. These come from the worker's pool rather than
+// request memory so that they can be written into again once sent, and a
+// body of any size is held in a few of them. The chunk room and the buffer
+// follow the header
+typedef struct JsonBuffer {
+    struct JsonBuffer *next;
+    size_t size; // What buffer_alloc handed out
+} JsonBuffer;
+
+// Kept in request memory, which outlives the writer until the output queue
+// next drains
+typedef struct JsonStream {
+    BufferPool *pool;
+    JsonBuffer *current; // Being written into
+    JsonBuffer *queued; // Queued since the output queue last drained
+    JsonBuffer *spare; // Sent, free to write into again
+    bool ended; // No more buffers are needed
+} JsonStream;
+
+static const char DIGIT_PAIRS[] = "00010203040506070809"
+                                  "10111213141516171819"
+                                  "20212223242526272829"
+                                  "30313233343536373839"
+                                  "40414243444546474849"
+                                  "50515253545556575859"
+                                  "60616263646566676869"
+                                  "70717273747576777879"
+                                  "80818283848586878889"
+                                  "90919293949596979899";
+
+static const char HEX_DIGITS[] = "0123456789abcdef";
+
+#define DOUBLE_HIDDEN_BIT ((uint64_t)1 << 52)
+#define DOUBLE_EXPONENT_BIAS (0x3ff + 52)
+
+static void fail(JsonWriter *json)
+{
+    json->failed = true;
+}
+
+static char *alloc_buffer(ClientInfo *client, size_t size)
+{
+    char *memory = client_alloc(client, CHUNK_HEAD_LEN + size + CHUNK_TAIL_LEN);
+    return memory ? memory + CHUNK_HEAD_LEN : NULL;
+}
+
+static void free_buffers(BufferPool *pool, JsonBuffer *buffer)
+{
+    while (buffer) {
+        JsonBuffer *next = buffer->next;
+        buffer_free(pool, (char *)buffer, buffer->size);
+        buffer = next;
+    }
+}
+
+// Everything queued has been sent or dropped, so the buffers it pointed
+// into can be written into again, or let go of once the body is done
+static void recycle_buffers(void *data)
+{
+    JsonStream *stream = data;
+    while (stream->queued) {
+        JsonBuffer *buffer = stream->queued;
+        stream->queued = buffer->next;
+        buffer->next = stream->spare;
+        stream->spare = buffer;
+    }
+    if (stream->ended) {
+        free_buffers(stream->pool, stream->spare);
+        stream->spare = NULL;
+    }
+}
+
+// A sent buffer to write into, or a new one
+static char *stream_buffer(JsonWriter *json)
+{
+    JsonStream *stream = json->stream;
+    JsonBuffer *buffer = stream->spare;
+    if (buffer) {
+        stream->spare = buffer->next;
+    } else {
+        size_t size;
+        buffer = (JsonBuffer *)buffer_alloc(stream->pool,
+            sizeof(JsonBuffer) + CHUNK_HEAD_LEN + JSON_BUFFER_SIZE + CHUNK_TAIL_LEN, &size);
+        if (!buffer) {
+            return NULL;
+        }
+        buffer->size = size;
+    }
+    buffer->next = NULL;
+    stream->current = buffer;
+    return (char *)(buffer + 1) + CHUNK_HEAD_LEN;
+}
+
+// Buffers still queued go once the queue drains, the rest right away
+static void end_stream(JsonWriter *json)
+{
+    JsonStream *stream = json->stream;
+    stream->ended = true;
+    free_buffers(stream->pool, stream->current);
+    stream->current = NULL;
+    free_buffers(stream->pool, stream->spare);
+    stream->spare = NULL;
+    json->client->response_in_progress = false;
+}
+
+// The headers go out before the body is done, so its length can't be in
+// them. Request memory is kept from here on, the first chunk is in it
+static bool start_stream(JsonWriter *json)
+{
+    ClientInfo *client = json->client;
+    json->stream = client_alloc(client, sizeof(JsonStream));
+    if (!json->stream) {
+        return false;
+    }
+    memset(json->stream, 0, sizeof(JsonStream));
+    json->stream->pool = &client->worker->buffers;
+    client->response_in_progress = true;
+
+    Response res = { 0 };
+    res.status = json->status;
+    res.content_type = CONTENT_TYPE_JSON;
+    // HTTP/1.0 has no chunked coding, the body ends with the connection
+    if (client->http_1_0) {
+        client->keep_alive = false;
+        res.framing = BODY_UNTIL_CLOSE;
+    } else {
+        res.framing = BODY_CHUNKED;
+    }
+    json->framing = res.framing;
+    return write_response(client, &res);
+}
+
+// Queue the current buffer, framed as a chunk in the room left around it.
+// HEAD is answered with the headers alone, so nothing is queued for it
+static bool queue_buffer(JsonWriter *json)
+{
+    ClientInfo *client = json->client;
+    if (json->len == 0 || client->head_request) {
+        return true;
+    }
+    // The first buffer queued since the queue drained has its buffers
+    // handed back when it drains again
+    JsonStream *stream = json->stream;
+    if (stream->current) {
+        if (!stream->queued && !client_hold(client, recycle_buffers, stream)) {
+            return false;
+        }
+        stream->current->next = stream->queued;
+        stream->queued = stream->current;
+        stream->current = NULL;
+    }
+    char *start = json->buf;
+    size_t len = json->len;
+    if (json->framing == BODY_CHUNKED) {
+        size_t digits = 1;
+        while (len >> (4 * digits)) {
+            digits++;
+        }
+        start -= digits + 2;
+        for (size_t i = 0; i < digits; i++) {
+            start[i] = HEX_DIGITS[(len >> (4 * (digits - 1 - i))) & 0xf];
+        }
+        memcpy(start + digits, "\r\n", 2);
+        memcpy(json->buf + len, "\r\n", 2);
+        len += digits + 2 + CHUNK_TAIL_LEN;
+    }
+    return queue_client_output(client, start, len);
+}
+
+// The current buffer is full. A document that outgrows the small first
+// buffer moves to a full one once, before anything is sent; past that,
+// full buffers are sent as they are. A client that falls behind by twice
+// its high-water mark is given up on, a producer stops well before that
+static bool next_buffer(JsonWriter *json)
+{
+    ClientInfo *client = json->client;
+    if (json->framing == BODY_CONTENT_LENGTH && json->size < JSON_BUFFER_SIZE) {
+        char *buf = alloc_buffer(client, JSON_BUFFER_SIZE);
+        if (!buf) {
+            return false;
+        }
+        memcpy(buf, json->buf, json->len);
+        json->buf = buf;
+        json->size = JSON_BUFFER_SIZE;
+        return true;
+    }
+    if ((json->framing == BODY_CONTENT_LENGTH && !start_stream(json)) || !queue_buffer(json)) {
+        return false;
+    }
+    flush_client(client);
+    if (client->state == CLIENT_DONE || client->out_pending >= 2 * client->worker->config->output_high_water) {
+        return false;
+    }
+    // Nothing of a HEAD body is kept, the buffer is written over
+    if (client->head_request) {
+        json->len = 0;
+        return true;
+    }
+    json->buf = stream_buffer(json);
+    json->len = 0;
+    json->size = JSON_BUFFER_SIZE;
+    return json->buf != NULL;
+}
+
+// Where the next len bytes go, at most MAX_TOKEN_LEN, or NULL once failed
+static inline char *reserve(JsonWriter *json, size_t len)
+{
+    if (json->failed) {
+        return NULL;
+    }
+    if (json->size - json->len < len && !next_buffer(json)) {
+        fail(json);
+        return NULL;
+    }
+    return json->buf + json->len;
+}
+
+static void append(JsonWriter *json, const char *data, size_t len)
+{
+    while (len > 0 && !json->failed) {
+        size_t room = json->size - json->len;
+        if (room == 0) {
+            if (!next_buffer(json)) {
+                fail(json);
+            }
+            continue;
+        }
+        size_t part = len < room ? len : room;
+        memcpy(json->buf + json->len, data, part);
+        json->len += part;
+        data += part;
+        len -= part;
+    }
+}
+
+static inline void put_char(JsonWriter *json, char c)
+{
+    char *out = reserve(json, 1);
+    if (out) {
+        *out = c;
+        json->len++;
+    }
+}
+
+// A comma unless this is the first value in its container or follows a key
+static void begin_value(JsonWriter *json)
+{
+    if (json->after_key) {
+        json->after_key = false;
+        return;
+    }
+    if (json->depth > 0) {
+        uint64_t bit = 1ull << (json->depth - 1);
+        if (json->has_items & bit) {
+            put_char(json, ',');
+        }
+        json->has_items |= bit;
+    }
+}
+
+static void open_container(JsonWriter *json, char c)
+{
+    begin_value(json);
+    if (json->depth == JSON_MAX_DEPTH) {
+        fail(json);
+        return;
+    }
+    json->depth++;
+    json->has_items &= ~(1ull << (json->depth - 1));
+    put_char(json, c);
+}
+
+static void close_container(JsonWriter *json, char c)
+{
+    if (json->depth == 0 || json->after_key) {
+        fail(json);
+        return;
+    }
+    json->depth--;
+    put_char(json, c);
+}
+
+/**
+ * Start a JSON response body, the response is queued by json_end
+ * @param json Writer to set up, usually on the handler's stack
+ * @param client Client to answer, the body lives in its request memory
+ * @param status Status to answer with
+ */
+void json_begin(JsonWriter *json, ClientInfo *client, HttpStatus status)
+{
+    memset(json, 0, sizeof(*json));
+    json->client = client;
+    json->status = status;
+    json->framing = BODY_CONTENT_LENGTH;
+    json->buf = alloc_buffer(client, JSON_SMALL_BUFFER_SIZE);
+    json->size = JSON_SMALL_BUFFER_SIZE;
+    if (!json->buf) {
+        fail(json);
+    }
+}
+
+/**
+ * Finish the body and queue what is left of it. A body that fit one buffer
+ * is written as a whole response, so it can still be gzipped and cached
+ * @param json Writer from json_begin, with every container closed
+ * @return false if anything failed along the way, the client is given up on
+ */
+bool json_end(JsonWriter *json)
+{
+    ClientInfo *client = json->client;
+    if (json->failed || json->depth > 0 || json->after_key) {
+        if (json->stream) {
+            end_stream(json);
+        }
+        client->state = CLIENT_DONE;
+        return false;
+    }
+    if (json->framing == BODY_CONTENT_LENGTH) {
+        Response res = { 0 };
+        res.status = json->status;
+        res.content_type = CONTENT_TYPE_JSON;
+        res.content_body = json->buf;
+        res.content_len = json->len;
+        return write_response(client, &res);
+    }
+    bool queued = queue_buffer(json)
+        && (json->framing != BODY_CHUNKED || client->head_request
+            || queue_client_output(client, LAST_CHUNK, sizeof(LAST_CHUNK) - 1));
+    end_stream(json);
+    if (!queued) {
+        client->state = CLIENT_DONE;
+        return false;
+    }
+    return true;
+}
+
+// Write parts until the client has enough to take for now, and again each
+// time it has taken all of it
+static bool produce_json(ClientInfo *client, bool aborted, void *data)
+{
+    JsonWriter *json = data;
+    if (aborted) {
+        if (json->stream) {
+            end_stream(json);
+        }
+        return true;
+    }
+    while (!json->failed && !client_output_over_high_water(client)) {
+        if (!json->produce(json, json->produce_data)) {
+            json_end(json);
+            return true;
+        }
+    }
+    if (json->failed) {
+        json_end(json);
+        return true;
+    }
+    return false;
+}
+
+/**
+ * Write the rest of the body a part at a time, as the client takes what
+ * was written before, so that a document of any size is held in a few
+ * buffers. json_end is called after the last part
+ * @param json Writer from json_begin, copied into request memory
+ * @param produce Writes the next part, called until it returns false
+ * @param data Passed to produce, must live in request memory
+ */
+void json_stream(JsonWriter *json, JsonProducer produce, void *data)
+{
+    ClientInfo *client = json->client;
+    JsonWriter *kept = client_alloc(client, sizeof(JsonWriter));
+    if (!kept) {
+        fail(json);
+        json_end(json);
+        return;
+    }
+    *kept = *json;
+    kept->produce = produce;
+    kept->produce_data = data;
+    if (!produce_json(client, false, kept)) {
+        produce_client_response(client, produce_json, kept);
+    }
+}
+
+void json_object_begin(JsonWriter *json)
+{
+    open_container(json, '{');
+}
+
+void json_object_end(JsonWriter *json)
+{
+    close_container(json, '}');
+}
+
+void json_array_begin(JsonWriter *json)
+{
+    open_container(json, '[');
+}
+
+void json_array_end(JsonWriter *json)
+{
+    close_container(json, ']');
+}
+
+// Bytes up to the first one a JSON string can't hold as it is: a quote, a
+// backslash or a control character. Sixteen at a time where SSE2 is
+// available, most strings have nothing to escape
+static size_t plain_run(const char *str, size_t len)
+{
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i control = _mm_set1_epi8(0x1f);
+    for (; i + 16 <= len; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(str + i));
+        // Unsigned block <= 0x1f is the same as max(block, 0x1f) == 0x1f
+        __m128i special = _mm_or_si128(_mm_cmpeq_epi8(block, quote), _mm_cmpeq_epi8(block, backslash));
+        special = _mm_or_si128(special, _mm_cmpeq_epi8(_mm_max_epu8(block, control), control));
+        unsigned found = _mm_movemask_epi8(special);
+        if (found) {
+            return i + __builtin_ctz(found);
+        }
+    }
+#endif
+    for (; i < len; i++) {
+        unsigned char c = str[i];
+        if (c < 0x20 || c == '"' || c == '\\') {
+            break;
+        }
+    }
+    return i;
+}
+
+static void write_escaped(JsonWriter *json, const char *str, size_t len)
+{
+    put_char(json, '"');
+    size_t i = 0;
+    while (i < len && !json->failed) {
+        size_t run = plain_run(str + i, len - i);
+        append(json, str + i, run);
+        i += run;
+        if (i == len) {
+            break;
+        }
+
+        unsigned char c = str[i++];
+        char *out = reserve(json, 6);
+        if (!out) {
+            break;
+        }
+        out[0] = '\\';
+        switch (c) {
+        case '"':
+        case '\\':
+            out[1] = c;
+            break;
+        case '\n':
+            out[1] = 'n';
+            break;
+        case '\r':
+            out[1] = 'r';
+            break;
+        case '\t':
+            out[1] = 't';
+            break;
+        case '\b':
+            out[1] = 'b';
+            break;
+        case '\f':
+            out[1] = 'f';
+            break;
+        default:
+            memcpy(out + 1, "u00", 3);
+            out[4] = HEX_DIGITS[c >> 4];
+            out[5] = HEX_DIGITS[c & 0xf];
+            json->len += 4;
+            break;
+        }
+        json->len += 2;
+    }
+    put_char(json, '"');
+}
+
+/**
+ * Write an object key, the next value written is its value
+ * @param json Writer inside an object
+ * @param key NUL terminated, escaped as needed
+ */
+void json_key(JsonWriter *json, const char *key)
+{
+    if (json->after_key) {
+        fail(json);
+        return;
+    }
+    begin_value(json);
+    write_escaped(json, key, strlen(key));
+    put_char(json, ':');
+    json->after_key = true;
+}
+
+/**
+ * Write a string, escaping quotes, backslashes and control characters.
+ * Other bytes are copied as they are, so str should be UTF-8
+ * @param json Writer
+ * @param str String to write, need not be NUL terminated
+ * @param len Length of str
+ */
+void json_string(JsonWriter *json, const char *str, size_t len)
+{
+    begin_value(json);
+    write_escaped(json, str, len);
+}
+
+// Write n in decimal two digits at a time, returns the number of digits
+static size_t format_digits(char *out, unsigned long long n)
+{
+    char digits[20];
+    char *end = digits + sizeof(digits), *curr = end;
+    while (n >= 100) {
+        curr -= 2;
+        memcpy(curr, DIGIT_PAIRS + (n % 100) * 2, 2);
+        n /= 100;
+    }
+    if (n >= 10) {
+        curr -= 2;
+        memcpy(curr, DIGIT_PAIRS + n * 2, 2);
+    } else {
+        *--curr = '0' + n;
+    }
+    memcpy(out, curr, end - curr);
+    return end - curr;
+}
+
+void json_int(JsonWriter *json, long long value)
+{
+    begin_value(json);
+    char *out = reserve(json, 21);
+    if (!out) {
+        return;
+    }
+    size_t len = 0;
+    unsigned long long magnitude = value;
+    if (value < 0) {
+        out[len++] = '-';
+        magnitude = -magnitude;
+    }
+    json->len += len + format_digits(out + len, magnitude);
+}
+
+// A double as f * 2^e, with f wider than the double's significand
+typedef struct DiyFp {
+    uint64_t f;
+    int e;
+} DiyFp;
+
+// 10^k for k = -348, -340, ... 340, rounded to 64 bits with the top one set
+static const DiyFp CACHED_POWERS[] = {
+    { 0xfa8fd5a0081c0288ULL, -1220 }, { 0xbaaee17fa23ebf76ULL, -1193 },
+    { 0x8b16fb203055ac76ULL, -1166 }, { 0xcf42894a5dce35eaULL, -1140 },
+    { 0x9a6bb0aa55653b2dULL, -1113 }, { 0xe61acf033d1a45dfULL, -1087 },
+    { 0xab70fe17c79ac6caULL, -1060 }, { 0xff77b1fcbebcdc4fULL, -1034 },
+    { 0xbe5691ef416bd60cULL, -1007 }, { 0x8dd01fad907ffc3cULL, -980 },
+    { 0xd3515c2831559a83ULL, -954 }, { 0x9d71ac8fada6c9b5ULL, -927 },
+    { 0xea9c227723ee8bcbULL, -901 }, { 0xaecc49914078536dULL, -874 },
+    { 0x823c12795db6ce57ULL, -847 }, { 0xc21094364dfb5637ULL, -821 },
+    { 0x9096ea6f3848984fULL, -794 }, { 0xd77485cb25823ac7ULL, -768 },
+    { 0xa086cfcd97bf97f4ULL, -741 }, { 0xef340a98172aace5ULL, -715 },
+    { 0xb23867fb2a35b28eULL, -688 }, { 0x84c8d4dfd2c63f3bULL, -661 },
+    { 0xc5dd44271ad3cdbaULL, -635 }, { 0x936b9fcebb25c996ULL, -608 },
+    { 0xdbac6c247d62a584ULL, -582 }, { 0xa3ab66580d5fdaf6ULL, -555 },
+    { 0xf3e2f893dec3f126ULL, -529 }, { 0xb5b5ada8aaff80b8ULL, -502 },
+    { 0x87625f056c7c4a8bULL, -475 }, { 0xc9bcff6034c13053ULL, -449 },
+    { 0x964e858c91ba2655ULL, -422 }, { 0xdff9772470297ebdULL, -396 },
+    { 0xa6dfbd9fb8e5b88fULL, -369 }, { 0xf8a95fcf88747d94ULL, -343 },
+    { 0xb94470938fa89bcfULL, -316 }, { 0x8a08f0f8bf0f156bULL, -289 },
+    { 0xcdb02555653131b6ULL, -263 }, { 0x993fe2c6d07b7facULL, -236 },
+    { 0xe45c10c42a2b3b06ULL, -210 }, { 0xaa242499697392d3ULL, -183 },
+    { 0xfd87b5f28300ca0eULL, -157 }, { 0xbce5086492111aebULL, -130 },
+    { 0x8cbccc096f5088ccULL, -103 }, { 0xd1b71758e219652cULL, -77 },
+    { 0x9c40000000000000ULL, -50 }, { 0xe8d4a51000000000ULL, -24 },
+    { 0xad78ebc5ac620000ULL, 3 }, { 0x813f3978f8940984ULL, 30 },
+    { 0xc097ce7bc90715b3ULL, 56 }, { 0x8f7e32ce7bea5c70ULL, 83 },
+    { 0xd5d238a4abe98068ULL, 109 }, { 0x9f4f2726179a2245ULL, 136 },
+    { 0xed63a231d4c4fb27ULL, 162 }, { 0xb0de65388cc8ada8ULL, 189 },
+    { 0x83c7088e1aab65dbULL, 216 }, { 0xc45d1df942711d9aULL, 242 },
+    { 0x924d692ca61be758ULL, 269 }, { 0xda01ee641a708deaULL, 295 },
+    { 0xa26da3999aef774aULL, 322 }, { 0xf209787bb47d6b85ULL, 348 },
+    { 0xb454e4a179dd1877ULL, 375 }, { 0x865b86925b9bc5c2ULL, 402 },
+    { 0xc83553c5c8965d3dULL, 428 }, { 0x952ab45cfa97a0b3ULL, 455 },
+    { 0xde469fbd99a05fe3ULL, 481 }, { 0xa59bc234db398c25ULL, 508 },
+    { 0xf6c69a72a3989f5cULL, 534 }, { 0xb7dcbf5354e9beceULL, 561 },
+    { 0x88fcf317f22241e2ULL, 588 }, { 0xcc20ce9bd35c78a5ULL, 614 },
+    { 0x98165af37b2153dfULL, 641 }, { 0xe2a0b5dc971f303aULL, 667 },
+    { 0xa8d9d1535ce3b396ULL, 694 }, { 0xfb9b7cd9a4a7443cULL, 720 },
+    { 0xbb764c4ca7a44410ULL, 747 }, { 0x8bab8eefb6409c1aULL, 774 },
+    { 0xd01fef10a657842cULL, 800 }, { 0x9b10a4e5e9913129ULL, 827 },
+    { 0xe7109bfba19c0c9dULL, 853 }, { 0xac2820d9623bf429ULL, 880 },
+    { 0x80444b5e7aa7cf85ULL, 907 }, { 0xbf21e44003acdd2dULL, 933 },
+    { 0x8e679c2f5e44ff8fULL, 960 }, { 0xd433179d9c8cb841ULL, 986 },
+    { 0x9e19db92b4e31ba9ULL, 1013 }, { 0xeb96bf6ebadf77d9ULL, 1039 },
+    { 0xaf87023b9bf0ee6bULL, 1066 },
+};
+
+static const uint64_t POWERS_OF_TEN[] = { 1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+    10000000ULL, 100000000ULL, 1000000000ULL, 10000000000ULL, 100000000000ULL, 1000000000000ULL,
+    10000000000000ULL, 100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL, 100000000000000000ULL,
+    1000000000000000000ULL, 10000000000000000000ULL };
+
+static DiyFp diy_normalize(DiyFp x)
+{
+    int shift = __builtin_clzll(x.f);
+    return (DiyFp) { .f = x.f << shift, .e = x.e - shift };
+}
+
+// The high half of the product, rounded on the highest bit dropped
+static DiyFp diy_multiply(DiyFp a, DiyFp b)
+{
+    __uint128_t product = (__uint128_t)a.f * b.f;
+    uint64_t high = (uint64_t)(product >> 64) + ((uint64_t)product >> 63);
+    return (DiyFp) { .f = high, .e = a.e + b.e + 64 };
+}
+
+// Step the last digit down while that stays inside the interval and moves
+// closer to the exact value
+static void grisu_round(char *digits, int len, uint64_t delta, uint64_t rest, uint64_t ten_kappa, uint64_t distance)
+{
+    while (rest < distance && delta - rest >= ten_kappa
+        && (rest + ten_kappa < distance || distance - rest > rest + ten_kappa - distance)) {
+        digits[len - 1]--;
+        rest += ten_kappa;
+    }
+}
+
+// Generate digits of high until what is left falls inside the interval
+// delta wide below it
+static int digit_gen(DiyFp w, DiyFp high, uint64_t delta, char *digits, int *exponent)
+{
+    DiyFp one = { .f = (uint64_t)1 << -high.e, .e = high.e };
+    uint64_t distance = high.f - w.f;
+    uint32_t integral = (uint32_t)(high.f >> -one.e);
+    uint64_t fraction = high.f & (one.f - 1);
+    int kappa = 1;
+    while (kappa < 10 && integral >= POWERS_OF_TEN[kappa]) {
+        kappa++;
+    }
+
+    int len = 0;
+    while (kappa > 0) {
+        uint32_t digit = integral / POWERS_OF_TEN[kappa - 1];
+        integral %= POWERS_OF_TEN[kappa - 1];
+        if (digit || len) {
+            digits[len++] = '0' + digit;
+        }
+        kappa--;
+        uint64_t rest = ((uint64_t)integral << -one.e) + fraction;
+        if (rest <= delta) {
+            *exponent += kappa;
+            grisu_round(digits, len, delta, rest, POWERS_OF_TEN[kappa] << -one.e, distance);
+            return len;
+        }
+    }
+    for (;;) {
+        fraction *= 10;
+        delta *= 10;
+        char digit = (char)(fraction >> -one.e);
+        if (digit || len) {
+            digits[len++] = '0' + digit;
+        }
+        fraction &= one.f - 1;
+        kappa--;
+        if (fraction < delta) {
+            *exponent += kappa;
+            grisu_round(digits, len, delta, fraction, one.f, -kappa < 20 ? distance * POWERS_OF_TEN[-kappa] : 0);
+            return len;
+        }
+    }
+}
+
+// Grisu2: the digits of a positive finite value, which is them times
+// 10^exponent. They always read back as value, and are nearly always the
+// shortest digits that do
+static int grisu2(double value, char *digits, int *exponent)
+{
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    int biased = (int)(bits >> 52 & 0x7ff);
+    uint64_t significand = bits & (DOUBLE_HIDDEN_BIT - 1);
+    DiyFp v = biased ? (DiyFp) { .f = significand | DOUBLE_HIDDEN_BIT, .e = biased - DOUBLE_EXPONENT_BIAS }
+                     : (DiyFp) { .f = significand, .e = 1 - DOUBLE_EXPONENT_BIAS };
+
+    // Halfway to the neighbouring doubles, the one below is closer when v
+    // is a power of two
+    DiyFp plus = diy_normalize((DiyFp) { .f = (v.f << 1) + 1, .e = v.e - 1 });
+    DiyFp minus = v.f == DOUBLE_HIDDEN_BIT ? (DiyFp) { .f = (v.f << 2) - 1, .e = v.e - 2 }
+                                           : (DiyFp) { .f = (v.f << 1) - 1, .e = v.e - 1 };
+    minus.f <<= minus.e - plus.e;
+    minus.e = plus.e;
+
+    // A power of ten that brings the exponent into [-60, -32], so the
+    // integral part of the scaled value fits 32 bits
+    double dk = (-61 - plus.e) * 0.30102999566398114 + 347;
+    int k = (int)dk;
+    if (dk - k > 0.0) {
+        k++;
+    }
+    unsigned index = (unsigned)((k >> 3) + 1);
+    *exponent = 348 - (int)(index << 3);
+    DiyFp power = CACHED_POWERS[index];
+
+    DiyFp w = diy_multiply(diy_normalize(v), power);
+    DiyFp high = diy_multiply(plus, power);
+    DiyFp low = diy_multiply(minus, power);
+    // Stay inside the interval despite the rounding of the products
+    low.f++;
+    high.f--;
+    return digit_gen(w, high, high.f - low.f, digits, exponent);
+}
+
+// Lay out digits * 10^exponent the way JavaScript does: plain up to 21
+// integral digits or 6 leading zeros after the point, scientific otherwise
+static size_t format_decimal(char *out, const char *digits, int len, int exponent)
+{
+    int point = len + exponent; // Digits before the decimal point
+    if (exponent >= 0 && point <= 21) {
+        memcpy(out, digits, len);
+        memset(out + len, '0', exponent);
+        return point;
+    }
+    if (point > 0 && point <= 21) {
+        memcpy(out, digits, point);
+        out[point] = '.';
+        memcpy(out + point + 1, digits + point, len - point);
+        return len + 1;
+    }
+    if (point > -6 && point <= 0) {
+        out[0] = '0';
+        out[1] = '.';
+        memset(out + 2, '0', -point);
+        memcpy(out + 2 - point, digits, len);
+        return 2 - point + len;
+    }
+    size_t written = 0;
+    out[written++] = digits[0];
+    if (len > 1) {
+        out[written++] = '.';
+        memcpy(out + written, digits + 1, len - 1);
+        written += len - 1;
+    }
+    out[written++] = 'e';
+    int scientific = point - 1;
+    if (scientific < 0) {
+        out[written++] = '-';
+        scientific = -scientific;
+    }
+    return written + format_digits(out + written, scientific);
+}
+
+// Write value, which is finite, into out, which holds MAX_TOKEN_LEN
+static size_t format_double(char *out, double value)
+{
+    size_t len = 0;
+    if (signbit(value)) {
+        out[len++] = '-';
+        value = -value;
+    }
+    if (value == 0) {
+        out[len++] = '0';
+        return len;
+    }
+    char digits[18];
+    int exponent;
+    int digits_len = grisu2(value, digits, &exponent);
+    return len + format_decimal(out + len, digits, digits_len, exponent);
+}
+
+/**
+ * Write a number that reads back as the same double, in as few digits as
+ * Grisu2 finds. JSON has no infinities or NaN, those are written as null
+ * @param json Writer
+ * @param value Number to write
+ */
+void json_double(JsonWriter *json, double value)
+{
+    if (!isfinite(value)) {
+        json_null(json);
+        return;
+    }
+    begin_value(json);
+    char *out = reserve(json, MAX_TOKEN_LEN);
+    if (out) {
+        json->len += format_double(out, value);
+    }
+}
+
+void json_bool(JsonWriter *json, bool value)
+{
+    begin_value(json);
+    append(json, value ? "true" : "false", value ? 4 : 5);
+}
+
+void json_null(JsonWriter *json)
+{
+    begin_value(json);
+    append(json, "null", 4);
+}
@@ -0,0 +1,58 @@
+#ifndef JSON_H
+#define JSON_H
+
+#include "client_info.h"
+#include "response.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define JSON_SMALL_BUFFER_SIZE 1024 // First buffer, most documents fit in it
+#define JSON_BUFFER_SIZE (16 * 1024 - 64) // Anything larger goes out in chunks of this
+#define JSON_MAX_DEPTH 64
+
+struct JsonWriter;
+struct JsonStream;
+
+// Writes the next part of a streamed document, such as a batch of items.
+// Returns false once it has written the last part and closed the document
+typedef bool (*JsonProducer)(struct JsonWriter *json, void *data);
+
+// Serializes a response body straight into request memory, and queues it
+// without another copy. A document that fits one buffer is sent with a
+// Content-Length once it is done; a larger one is sent chunked, each buffer
+// flushed to the client as soon as it is full. Errors are kept until
+// json_end reports them
+typedef struct JsonWriter {
+    ClientInfo *client;
+    HttpStatus status;
+    char *buf; // Body bytes of the current buffer, with room for chunk framing around them
+    size_t len;
+    size_t size;
+    BodyFraming framing; // BODY_CONTENT_LENGTH until the first buffer is queued
+    unsigned depth;
+    uint64_t has_items; // Bit per open container that has something in it already
+    bool after_key; // The next value belongs to a key, no comma before it
+    bool failed;
+    struct JsonStream *stream; // Buffers of a chunked body, once it is sent
+    JsonProducer produce; // Set by json_stream
+    void *produce_data;
+} JsonWriter;
+
+extern void json_begin(JsonWriter *json, ClientInfo *client, HttpStatus status);
+extern bool json_end(JsonWriter *json);
+extern void json_stream(JsonWriter *json, JsonProducer produce, void *data);
+
+extern void json_object_begin(JsonWriter *json);
+extern void json_object_end(JsonWriter *json);
+extern void json_array_begin(JsonWriter *json);
+extern void json_array_end(JsonWriter *json);
+extern void json_key(JsonWriter *json, const char *key);
+
+extern void json_string(JsonWriter *json, const char *str, size_t len);
+extern void json_int(JsonWriter *json, long long value);
+extern void json_double(JsonWriter *json, double value);
+extern void json_bool(JsonWriter *json, bool value);
+extern void json_null(JsonWriter *json);
+
+#endif // JSON_H
@@ -0,0 +1,452 @@
+#include "chunked.h"
+#include "http_utils.h"
+#include "json.h"
+#include "test.h"
+#include "worker.h"
+#include <float.h>
+#include <limits.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define MAX_RESPONSE (4 * 1024 * 1024)
+#define DOUBLES_PER_DOCUMENT 1000
+#define RANDOM_DOCUMENTS 100
+#define STREAMED_ITEMS 200000
+#define ITEMS_PER_PART 100
+#define STREAM_HIGH_WATER (64 * 1024)
+
+static ServerConfig config;
+static ClientInfo *client;
+static int peer;
+
+static char response[MAX_RESPONSE];
+static size_t response_len;
+static char body[MAX_RESPONSE];
+static size_t body_len;
+
+// A client on one end of a socket pair, as json_bench sets it up. Responses
+// are read back from the other end
+static bool setup_client()
+{
+    init_server_config(&config);
+    Worker *worker = calloc(1, sizeof(Worker));
+    Connection *conn = calloc(1, sizeof(Connection));
+    client = calloc(1, sizeof(ClientInfo));
+    int fds[2];
+    if (!worker || !conn || !client || socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds) < 0) {
+        return false;
+    }
+    worker->config = &config;
+    worker->loop = create_event_loop("epoll");
+    conn->handle.fd = fds[0];
+    conn->worker = worker;
+    conn->client = client;
+    if (!worker->loop || event_loop_add(worker->loop, &conn->handle, EVENT_READABLE) < 0) {
+        return false;
+    }
+    peer = fds[1];
+    buffer_pool_init(&worker->buffers);
+    metrics_init(&worker->metrics, DEFAULT_METRICS_SAMPLE);
+    // Bodies are compared as written
+    worker->compressor.min_size = SIZE_MAX;
+    client->worker = worker;
+    client->conn = conn;
+    client->keep_alive = true;
+    arena_init(&client->arena, &worker->buffers);
+    return true;
+}
+
+static void begin(JsonWriter *json)
+{
+    client->state = CLIENT_READY;
+    response_len = 0;
+    json_begin(json, client, STATUS_OK);
+}
+
+// Send what is queued and append whatever the peer has been sent so far.
+// Reading makes room, so output waiting for that is resumed as the loop would
+static void receive()
+{
+    if (client->write_blocked) {
+        resume_client_output(client);
+    } else {
+        flush_client(client);
+    }
+    ssize_t len;
+    while (response_len < sizeof(response)
+        && (len = read(peer, response + response_len, sizeof(response) - response_len)) > 0) {
+        response_len += len;
+    }
+}
+
+// Take the body out of the response, by its Content-Length or dechunked
+static bool parse_body()
+{
+    const char *end = find_headers_end(response, response_len);
+    if (!end) {
+        return false;
+    }
+    size_t headers_len = end + 4 - response;
+    char headers[4096];
+    if (headers_len >= sizeof(headers)) {
+        return false;
+    }
+    memcpy(headers, response, headers_len);
+    headers[headers_len] = '\0';
+    body_len = 0;
+
+    const char *length = strstr(headers, "Content-Length: ");
+    if (length) {
+        body_len = strtoul(length + strlen("Content-Length: "), NULL, 10);
+        if (headers_len + body_len != response_len) {
+            return false;
+        }
+        memcpy(body, response + headers_len, body_len);
+        return true;
+    }
+    if (!strstr(headers, "Transfer-Encoding: chunked\r\n")) {
+        return false;
+    }
+    ChunkedDecoder decoder;
+    chunked_decoder_init(&decoder);
+    size_t used = headers_len;
+    ChunkedResult result;
+    do {
+        size_t step, data_len;
+        const char *data;
+        result = chunked_decode(&decoder, response + used, response_len - used, &step, &data, &data_len);
+        used += step;
+        if (result == CHUNKED_DATA) {
+            memcpy(body + body_len, data, data_len);
+            body_len += data_len;
+        }
+    } while (result == CHUNKED_DATA);
+    return result == CHUNKED_DONE && used == response_len;
+}
+
+// Finish the document and check it came out as expected
+static void check_body(JsonWriter *json, const char *expected)
+{
+    CHECK(json_end(json));
+    receive();
+    CHECK(parse_body());
+    CHECK(body_len == strlen(expected) && memcmp(body, expected, body_len) == 0);
+}
+
+static void check_double(double value, const char *expected)
+{
+    JsonWriter json;
+    begin(&json);
+    json_double(&json, value);
+    check_body(&json, expected);
+}
+
+// Numbers are laid out the way JavaScript prints them
+static void test_double_format()
+{
+    check_double(0, "0");
+    check_double(-0.0, "-0");
+    check_double(1, "1");
+    check_double(-42, "-42");
+    check_double(0.1, "0.1");
+    check_double(0.3, "0.3");
+    check_double(0.1 + 0.2, "0.30000000000000004");
+    check_double(1.5, "1.5");
+    check_double(123456.789, "123456.789");
+    check_double(1e20, "100000000000000000000");
+    check_double(1e21, "1e21");
+    check_double(1.5e300, "1.5e300");
+    check_double(0.000001, "0.000001");
+    check_double(1e-7, "1e-7");
+    check_double(-1.25e-10, "-1.25e-10");
+    check_double(5e-324, "5e-324");
+    check_double(DBL_MIN, "2.2250738585072014e-308");
+    check_double(DBL_MAX, "1.7976931348623157e308");
+    check_double(9007199254740993.0, "9007199254740992");
+
+    JsonWriter json;
+    begin(&json);
+    json_array_begin(&json);
+    json_double(&json, NAN);
+    json_double(&json, INFINITY);
+    json_double(&json, -INFINITY);
+    json_array_end(&json);
+    check_body(&json, "[null,null,null]");
+}
+
+static double random_double()
+{
+    uint64_t bits = (uint64_t)rand() << 62 ^ (uint64_t)rand() << 31 ^ rand();
+    double value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+// Every finite double reads back as the same bits, in both framings
+static void test_double_round_trip()
+{
+    static double values[DOUBLES_PER_DOCUMENT];
+    for (int doc = 0; doc < RANDOM_DOCUMENTS; doc++) {
+        // Any bit pattern, or the sizes prices and ratios have. Short
+        // documents fit one buffer, long ones go out chunked
+        size_t count = doc % 2 ? DOUBLES_PER_DOCUMENT : DOUBLES_PER_DOCUMENT / 10;
+        JsonWriter json;
+        begin(&json);
+        json_array_begin(&json);
+        for (size_t i = 0; i < count; i++) {
+            do {
+                values[i] = doc % 4 < 2 ? random_double() : (double)rand() / (rand() % 10000 + 1);
+            } while (!isfinite(values[i]));
+            json_double(&json, values[i]);
+        }
+        json_array_end(&json);
+        CHECK(json_end(&json));
+        receive();
+        CHECK(parse_body());
+
+        body[body_len] = '\0';
+        CHECK(body[0] == '[');
+        char *curr = body + 1;
+        for (size_t i = 0; i < count; i++) {
+            char *end;
+            double parsed = strtod(curr, &end);
+            CHECK(end > curr && *end == (i + 1 < count ? ',' : ']'));
+            CHECK(memcmp(&parsed, &values[i], sizeof(parsed)) == 0);
+            curr = end + 1;
+        }
+    }
+}
+
+static void test_int()
+{
+    JsonWriter json;
+    begin(&json);
+    json_array_begin(&json);
+    const long long values[] = { 0, 7, -1, 10, 99, 100, -12345, 1000000007, LLONG_MAX, LLONG_MIN };
+    for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+        json_int(&json, values[i]);
+    }
+    json_array_end(&json);
+    check_body(&json, "[0,7,-1,10,99,100,-12345,1000000007,9223372036854775807,-9223372036854775808]");
+}
+
+static void check_string(const char *str, size_t len, const char *expected)
+{
+    JsonWriter json;
+    begin(&json);
+    json_string(&json, str, len);
+    check_body(&json, expected);
+}
+
+// How one byte should come out
+static size_t escape_char(unsigned char c, char *out)
+{
+    switch (c) {
+    case '"':
+        return sprintf(out, "\\\"");
+    case '\\':
+        return sprintf(out, "\\\\");
+    case '\n':
+        return sprintf(out, "\\n");
+    case '\r':
+        return sprintf(out, "\\r");
+    case '\t':
+        return sprintf(out, "\\t");
+    case '\b':
+        return sprintf(out, "\\b");
+    case '\f':
+        return sprintf(out, "\\f");
+    default:
+        if (c < 0x20) {
+            return sprintf(out, "\\u%04x", c);
+        }
+        out[0] = c;
+        out[1] = '\0';
+        return 1;
+    }
+}
+
+static void test_string_escaping()
+{
+    check_string("", 0, "\"\"");
+    check_string("plain", 5, "\"plain\"");
+    check_string("say \"hi\"\\", 9, "\"say \\\"hi\\\"\\\\\"");
+    check_string("a\nb\rc\td\be\ff", 11, "\"a\\nb\\rc\\td\\be\\ff\"");
+    check_string("\x01\x1f\x7f", 3, "\"\\u0001\\u001f\x7f\"");
+    check_string("a\0b", 3, "\"a\\u0000b\"");
+    // UTF-8 is copied as it is
+    check_string("caf\xc3\xa9 \xe2\x82\xac \xf0\x9f\x98\x80", 14, "\"caf\xc3\xa9 \xe2\x82\xac \xf0\x9f\x98\x80\"");
+
+    // Every byte at every position of a string longer than the SSE2 blocks,
+    // so each is found in a block, across two and in the bytes after them
+    char str[40], expected[64 * 2 + 8];
+    for (unsigned c = 1; c < 256; c++) {
+        for (size_t at = 0; at < sizeof(str); at++) {
+            memset(str, 'a', sizeof(str));
+            str[at] = c;
+            size_t len = sprintf(expected, "\"%.*s", (int)at, str);
+            len += escape_char(c, expected + len);
+            sprintf(expected + len, "%.*s\"", (int)(sizeof(str) - at - 1), str + at + 1);
+            check_string(str, sizeof(str), expected);
+        }
+    }
+}
+
+// Commas go between values and never after a key
+static void test_nesting()
+{
+    JsonWriter json;
+    begin(&json);
+    json_object_begin(&json);
+    json_key(&json, "a");
+    json_array_begin(&json);
+    json_array_end(&json);
+    json_key(&json, "b\"");
+    json_object_begin(&json);
+    json_object_end(&json);
+    json_key(&json, "c");
+    json_array_begin(&json);
+    json_null(&json);
+    json_bool(&json, true);
+    json_array_begin(&json);
+    json_bool(&json, false);
+    json_array_end(&json);
+    json_object_begin(&json);
+    json_key(&json, "d");
+    json_int(&json, 1);
+    json_key(&json, "e");
+    json_string(&json, "x", 1);
+    json_object_end(&json);
+    json_array_end(&json);
+    json_object_end(&json);
+    check_body(&json, "{\"a\":[],\"b\\\"\":{},\"c\":[null,true,[false],{\"d\":1,\"e\":\"x\"}]}");
+
+    char deepest[JSON_MAX_DEPTH * 2 + 1];
+    memset(deepest, '[', JSON_MAX_DEPTH);
+    memset(deepest + JSON_MAX_DEPTH, ']', JSON_MAX_DEPTH);
+    deepest[JSON_MAX_DEPTH * 2] = '\0';
+    begin(&json);
+    for (int i = 0; i < JSON_MAX_DEPTH; i++) {
+        json_array_begin(&json);
+    }
+    for (int i = 0; i < JSON_MAX_DEPTH; i++) {
+        json_array_end(&json);
+    }
+    check_body(&json, deepest);
+}
+
+// Documents that aren't well formed are never sent
+static void test_invalid()
+{
+    JsonWriter json;
+    begin(&json);
+    for (int i = 0; i <= JSON_MAX_DEPTH; i++) {
+        json_array_begin(&json);
+    }
+    CHECK(!json_end(&json));
+    CHECK(client->state == CLIENT_DONE);
+
+    begin(&json);
+    json_array_begin(&json);
+    CHECK(!json_end(&json));
+
+    begin(&json);
+    json_array_end(&json);
+    CHECK(!json_end(&json));
+
+    begin(&json);
+    json_object_begin(&json);
+    json_key(&json, "a");
+    json_object_end(&json);
+    CHECK(!json_end(&json));
+
+    begin(&json);
+    json_object_begin(&json);
+    json_key(&json, "a");
+    json_key(&json, "b");
+    json_int(&json, 1);
+    json_object_end(&json);
+    CHECK(!json_end(&json));
+
+    begin(&json);
+    json_object_begin(&json);
+    json_key(&json, "a");
+    CHECK(!json_end(&json));
+
+    receive();
+    CHECK(response_len == 0);
+}
+
+typedef struct Items {
+    long next;
+} Items;
+
+static bool write_items(JsonWriter *json, void *data)
+{
+    Items *items = data;
+    for (int i = 0; i < ITEMS_PER_PART && items->next < STREAMED_ITEMS; i++) {
+        json_int(json, items->next++);
+    }
+    if (items->next < STREAMED_ITEMS) {
+        return true;
+    }
+    json_array_end(json);
+    return false;
+}
+
+// A produced document is written only as fast as the client takes it, and
+// arrives whole
+static void test_stream()
+{
+    config.output_high_water = STREAM_HIGH_WATER;
+    client->keep_alive = false;
+    JsonWriter json;
+    begin(&json);
+    Items *items = client_alloc(client, sizeof(Items));
+    items->next = 0;
+    json_array_begin(&json);
+    json_stream(&json, write_items, items);
+    CHECK(client->state == CLIENT_PRODUCING);
+    CHECK(items->next < STREAMED_ITEMS);
+
+    while (client->state == CLIENT_PRODUCING || client_has_pending_output(client)) {
+        CHECK(client->out_pending < STREAM_HIGH_WATER + JSON_BUFFER_SIZE + 64);
+        receive();
+        resume_client_response(client);
+    }
+    receive();
+    CHECK(client->state == CLIENT_DONE);
+    CHECK(parse_body());
+
+    body[body_len] = '\0';
+    char *curr = body;
+    CHECK(*curr++ == '[');
+    for (long i = 0; i < STREAMED_ITEMS; i++) {
+        char *end;
+        CHECK(strtol(curr, &end, 10) == i);
+        CHECK(*end == (i + 1 < STREAMED_ITEMS ? ',' : ']'));
+        curr = end + 1;
+    }
+    CHECK(*curr == '\0');
+}
+
+int main()
+{
+    if (!setup_client()) {
+        return 1;
+    }
+    srand(1);
+    test_double_format();
+    test_double_round_trip();
+    test_int();
+    test_string_escaping();
+    test_nesting();
+    test_invalid();
+    test_stream();
+    return TEST_RESULT();
+}
@@ -1,235 +1,355 @@
 #include "client_info.h"
+#include "json.h"
+#include "metrics.h"
+#include "offload.h"
+#include "proxy.h"
 #include "request.h"
-#include "request_parser.h"
+#include "request_body.h"
 #include "response.h"
-#include <errno.h>
-#include <netinet/in.h>
-#include <poll.h>
+#include "response_cache.h"
+#include "router.h"
+#include "server.h"
+#include "static_files.h"
+#include "url.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/socket.h>
-#include <unistd.h>
 
-#define PORT 8080
-#define BACKLOG 5
-#define MAX_CLIENTS 10
-
-const char INDEX_PATH[] = "/";
-
-static char BAD_REQUEST_BODY[] = "Bad Request";
-static Response BAD_REQUEST_RES = {
+static const char BAD_REQUEST_BODY[] = "Bad Request";
+static const Response BAD_REQUEST_TEMPLATE = {
     .content_len = sizeof(BAD_REQUEST_BODY) - 1,
-    .content_body = BAD_REQUEST_BODY,
+    .content_body = (char *)BAD_REQUEST_BODY,
     .content_type = CONTENT_TYPE_PLAINTEXT,
     .status = STATUS_BAD_REQUEST,
 };
 
-static char NOT_FOUND_BODY[] = "Not Found";
-static Response NOT_FOUND_RES = {
+static const char NOT_FOUND_BODY[] = "Not Found";
+static const Response NOT_FOUND_TEMPLATE = {
     .content_len = sizeof(NOT_FOUND_BODY) - 1,
-    .content_body = NOT_FOUND_BODY,
+    .content_body = (char *)NOT_FOUND_BODY,
     .content_type = CONTENT_TYPE_PLAINTEXT,
     .status = STATUS_NOT_FOUND,
 };
 
-static char DEFAULT_RES_ROOT_BODY[] = "Hello, World!";
-static Response DEFAULT_RES_ROOT = {
+static const char CONTENT_TOO_LARGE_BODY[] = "Content Too Large";
+static const Response CONTENT_TOO_LARGE_TEMPLATE = {
+    .content_len = sizeof(CONTENT_TOO_LARGE_BODY) - 1,
+    .content_body = (char *)CONTENT_TOO_LARGE_BODY,
+    .content_type = CONTENT_TYPE_PLAINTEXT,
+    .status = STATUS_CONTENT_TOO_LARGE,
+};
+
+static const char METHOD_NOT_ALLOWED_BODY[] = "Method Not Allowed";
+
+static const char DEFAULT_RES_ROOT_BODY[] = "Hello, World!";
+static const Response DEFAULT_ROOT_TEMPLATE = {
     .content_len = sizeof(DEFAULT_RES_ROOT_BODY) - 1,
-    .content_body = DEFAULT_RES_ROOT_BODY,
+    .content_body = (char *)DEFAULT_RES_ROOT_BODY,
     .content_type = CONTENT_TYPE_PLAINTEXT,
     .status = STATUS_OK,
 };
 
-void handle_root_post(Request *req, Response *res)
+// Fixed responses are serialized once per worker, see register_static_responses
+static StaticResponseId BAD_REQUEST_RES;
+static StaticResponseId NOT_FOUND_RES;
+static StaticResponseId CONTENT_TOO_LARGE_RES;
+static StaticResponseId DEFAULT_RES_ROOT;
+
+static int register_static_responses()
 {
-    res->content_body = req->body;
-    res->content_len = req->content_len;
-    res->content_type = req->content_type;
-    res->status = STATUS_CREATED;
-    res->content_body = req->body;
+    BAD_REQUEST_RES = register_static_response(&BAD_REQUEST_TEMPLATE);
+    NOT_FOUND_RES = register_static_response(&NOT_FOUND_TEMPLATE);
+    CONTENT_TOO_LARGE_RES = register_static_response(&CONTENT_TOO_LARGE_TEMPLATE);
+    DEFAULT_RES_ROOT = register_static_response(&DEFAULT_ROOT_TEMPLATE);
+    return BAD_REQUEST_RES < 0 || NOT_FOUND_RES < 0 || CONTENT_TOO_LARGE_RES < 0 || DEFAULT_RES_ROOT < 0 ? -1 : 0;
 }
 
-void handle_http_request(ClientInfo *client, RequestOrError *req_or_err)
-{
-    Response res;
+// Built once before the workers start, then only read. Routes that take
+// their body as a stream have their own table
+static Router router;
+static Router stream_router;
 
-    if (req_or_err->has_error) {
-        // Handle parsing error
-        switch (req_or_err->data.err) {
-        case ERR_MALFORMED_REQUEST:
-            // Copy bad request res
-            res = BAD_REQUEST_RES;
-            break;
-        }
-    } else {
-        Request *req = &req_or_err->data.req;
-
-        char *path = req->has_external_path ? req->path.path_ptr : req->path.inline_path;
-
-        if (strcmp(path, INDEX_PATH) == 0) {
-            switch (req->method) {
-            case METHOD_GET:
-                res = DEFAULT_RES_ROOT;
-                break;
-            case METHOD_POST:
-                handle_root_post(req, &res);
-                break;
-            default:
-                res = NOT_FOUND_RES;
-            }
-        } else {
-            res = NOT_FOUND_RES;
-        }
-    }
+static void handle_root_get(ClientInfo *client, Request *req, const RouteMatch *match)
+{
+    (void)req;
+    (void)match;
+    write_static_response(client, DEFAULT_RES_ROOT);
+}
 
-    // Timestamp request before writing
-    clock_gettime(CLOCK_REALTIME, &res.time);
-    // Write response to socket
+static void handle_root_post(ClientInfo *client, Request *req, const RouteMatch *match)
+{
+    (void)match;
+    Response res = { 0 };
+    res.content_body = (char *)req->body.data;
+    res.content_len = req->body.len;
+    res.content_type = req->content_type;
+    res.status = STATUS_CREATED;
+    // Queue response, the worker sends it once the batch is done
     write_response(client, &res);
-    // Signal we are done with client
-    client->state = CLIENT_DONE;
 }
 
-int main()
+// Upper-cases the body, standing in for work too slow to do on a worker,
+// such as transforming a large JSON document
+static void handle_transform(const Request *req, const RouteMatch *match, OffloadResult *result)
 {
-    int server_fd;
-    struct sockaddr_in address;
-    int opt = 1;
-
-    // Create socket
-    if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        perror("socket failed");
-        exit(EXIT_FAILURE);
+    (void)match;
+    Response *res = &result->response;
+    res->status = STATUS_OK;
+    res->content_type = req->content_type;
+    res->content_body = offload_alloc(result, req->body.len);
+    if (!res->content_body) {
+        res->status = STATUS_CONTENT_TOO_LARGE;
+        return;
     }
+    for (size_t i = 0; i < req->body.len; i++) {
+        char c = req->body.data[i];
+        res->content_body[i] = c >= 'a' && c <= 'z' ? c - 'a' + 'A' : c;
+    }
+    res->content_len = req->body.len;
+}
 
-    // Set socket options
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt))) {
-        perror("setsockopt failed");
-        exit(EXIT_FAILURE);
+// Greetings are built per name and ?greeting=, then served from the
+// response cache
+static const CachePolicy GREETING_CACHE = { .ttl_ms = 0, .vary = { NULL } };
+
+static void handle_greeting(ClientInfo *client, Request *req, const RouteMatch *match)
+{
+    const StringView *name = route_param(match, "name");
+    char greeting[64] = "hello";
+    if (req->query.len > 0 && query_get(req->query, "greeting", greeting, sizeof(greeting)) < 0) {
+        strcpy(greeting, "hello");
     }
+    JsonWriter json;
+    json_begin(&json, client, STATUS_OK);
+    json_object_begin(&json);
+    json_key(&json, greeting);
+    json_string(&json, name->data, name->len);
+    json_object_end(&json);
+    json_end(&json);
+}
 
-    // Configure address
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(PORT);
+// A catalogue page of ?count= items, 10 by default. Large pages are
+// written a batch of items at a time, as the client takes them
+#define DEFAULT_ITEMS 10
+#define MAX_ITEMS 1000000
+#define ITEMS_PER_PART 64
 
-    // Bind socket
-    if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
-        perror("bind failed");
-        exit(EXIT_FAILURE);
+typedef struct ItemsPage {
+    long next;
+    long count;
+} ItemsPage;
+
+static bool write_items(JsonWriter *json, void *data)
+{
+    static const char *const TAGS[] = { "new", "sale", "popular" };
+    ItemsPage *page = data;
+    long end = page->count - page->next > ITEMS_PER_PART ? page->next + ITEMS_PER_PART : page->count;
+    for (long i = page->next; i < end; i++) {
+        char name[32];
+        int name_len = snprintf(name, sizeof(name), "Item \"%ld\"", i);
+        json_object_begin(json);
+        json_key(json, "id");
+        json_int(json, i);
+        json_key(json, "name");
+        json_string(json, name, name_len);
+        json_key(json, "price");
+        json_double(json, (i % 1000) * 0.25 + 0.99);
+        json_key(json, "in_stock");
+        json_bool(json, i % 7 != 0);
+        json_key(json, "tags");
+        json_array_begin(json);
+        json_string(json, TAGS[i % 3], strlen(TAGS[i % 3]));
+        json_array_end(json);
+        json_object_end(json);
     }
+    page->next = end;
+    if (page->next < page->count) {
+        return true;
+    }
+    json_array_end(json);
+    json_object_end(json);
+    return false;
+}
 
-    // Listen for connections
-    if (listen(server_fd, BACKLOG) < 0) {
-        perror("listen failed");
-        exit(EXIT_FAILURE);
+static void handle_items(ClientInfo *client, Request *req, const RouteMatch *match)
+{
+    (void)match;
+    char count_arg[16];
+    long count = DEFAULT_ITEMS;
+    if (req->query.len > 0 && query_get(req->query, "count", count_arg, sizeof(count_arg)) > 0) {
+        char *end;
+        count = strtol(count_arg, &end, 10);
+        if (*end != '\0' || count < 0 || count > MAX_ITEMS) {
+            write_static_response(client, BAD_REQUEST_RES);
+            return;
+        }
     }
 
-    printf("Server listening on port %d...\n", PORT);
+    ItemsPage *page = client_alloc(client, sizeof(ItemsPage));
+    if (!page) {
+        client->state = CLIENT_DONE;
+        return;
+    }
+    page->next = 0;
+    page->count = count;
+    JsonWriter json;
+    json_begin(&json, client, STATUS_OK);
+    json_object_begin(&json);
+    json_key(&json, "count");
+    json_int(&json, count);
+    json_key(&json, "items");
+    json_array_begin(&json);
+    json_stream(&json, write_items, page);
+}
 
-    // Set up polling
-    struct pollfd fds[MAX_CLIENTS + 1]; // +1 for the server socket
-    ClientInfo *clients[MAX_CLIENTS] = { NULL };
-    int nfds = 1;
+// Uploads are counted and dropped, whatever their size
+static void write_upload_response(ClientInfo *client, size_t received)
+{
+    JsonWriter json;
+    json_begin(&json, client, STATUS_CREATED);
+    json_object_begin(&json);
+    json_key(&json, "received");
+    json_int(&json, received);
+    json_object_end(&json);
+    json_end(&json);
+}
 
-    // Initialize server fd
-    fds[0].fd = server_fd;
-    fds[0].events = POLLIN;
+// Small uploads that arrived whole with their headers
+static void handle_upload(ClientInfo *client, Request *req, const RouteMatch *match)
+{
+    (void)match;
+    write_upload_response(client, req->body.len);
+}
 
-    while (1) {
-        int poll_result = poll(fds, nfds, -1);
+static void on_upload_body(ClientInfo *client, StringView fragment, BodyStatus status, void *data)
+{
+    (void)fragment;
+    (void)data;
+    if (status == BODY_COMPLETE) {
+        write_upload_response(client, client->body_delivered);
+    }
+}
 
-        if (poll_result < 0) {
-            if (errno == EINTR)
-                continue;
-            perror("poll failed");
-            exit(EXIT_FAILURE);
-        }
+static void handle_upload_stream(ClientInfo *client, Request *req, const RouteMatch *match)
+{
+    (void)req;
+    (void)match;
+    stream_request_body(client, on_upload_body, NULL);
+}
 
-        // Check server socket for new connections
-        if (fds[0].revents & POLLIN) {
-            struct sockaddr_in client_addr;
-            socklen_t client_len = sizeof(client_addr);
-            int client_fd = accept(server_fd, (struct sockaddr *)&client_addr, &client_len);
-
-            if (client_fd < 0) {
-                perror("accept failed");
-                continue;
-            }
-
-            // Find a free slot
-            int slot;
-            for (slot = 0; slot < MAX_CLIENTS; slot++) {
-                if (clients[slot] == NULL)
-                    break;
-            }
-
-            if (slot >= MAX_CLIENTS) {
-                printf("Too many clients. Rejecting connection.\n");
-                close(client_fd);
-                continue;
-            }
-
-            // Create new client structure
-            clients[slot] = create_client(client_fd);
-            if (!clients[slot]) {
-                perror("Failed to create client structure");
-                close(client_fd);
-                continue;
-            }
-
-            // Add to poll set
-            fds[nfds].fd = client_fd;
-            fds[nfds].events = POLLIN;
-            nfds++;
-
-            printf("New connection accepted on fd %d\n", client_fd);
-        }
+static int register_routes()
+{
+    if (router_init(&router) < 0) {
+        return -1;
+    }
+    if (router_init(&stream_router) < 0) {
+        router_destroy(&router);
+        return -1;
+    }
+    if (router_add(&router, METHOD_GET, "/", handle_root_get) < 0
+        || router_add(&router, METHOD_POST, "/", handle_root_post) < 0
+        || router_add_cached(&router, METHOD_GET, "/hello/:name", handle_greeting, &GREETING_CACHE) < 0
+        || router_add(&router, METHOD_GET, "/items", handle_items) < 0
+        || router_add(&router, METHOD_PUT, "/upload", handle_upload) < 0
+        || router_add_offloaded(&router, METHOD_POST, "/transform", handle_transform) < 0
+        || router_add(&stream_router, METHOD_PUT, "/upload", handle_upload_stream) < 0) {
+        router_destroy(&router);
+        router_destroy(&stream_router);
+        return -1;
+    }
+    return 0;
+}
+
+// 405s have to list what the path does allow, so they aren't static
+static void write_method_not_allowed(ClientInfo *client, unsigned allowed_methods)
+{
+    char allow[128];
+    Response res = { 0 };
+    res.status = STATUS_METHOD_NOT_ALLOWED;
+    res.content_type = CONTENT_TYPE_PLAINTEXT;
+    res.content_body = (char *)METHOD_NOT_ALLOWED_BODY;
+    res.content_len = sizeof(METHOD_NOT_ALLOWED_BODY) - 1;
+    res.extra_headers = allow;
+    res.extra_headers_len = format_allow_header(allowed_methods, allow, sizeof(allow));
+    write_response(client, &res);
+}
 
-        // Check client sockets
-        for (int i = 1; i < nfds; i++) {
-            if (fds[i].revents & (POLLIN | POLLHUP)) {
-                int client_idx = i - 1;
-                handle_client_data(clients[client_idx]);
-
-                switch (clients[client_idx]->state) {
-                case CLIENT_WRITING:
-                    continue;
-                case CLIENT_READY: {
-                    RequestOrError *req_or_err = parse_request(clients[client_idx]);
-                    handle_http_request(clients[client_idx], req_or_err);
-                    free_request_or_error(req_or_err);
-                }
-                }
-
-                // If handle_client_data reached end of stream or encountered error
-                if (clients[client_idx]->state == CLIENT_DONE || clients[client_idx]->buf_used == 0 || errno != 0) {
-                    // Signal that we're done sending
-                    shutdown(clients[client_idx]->fd, SHUT_WR);
-
-                    // Free the client
-                    free_client(clients[client_idx]);
-                    clients[client_idx] = NULL;
-
-                    // Remove from poll set
-                    if (i < nfds - 1) {
-                        fds[i] = fds[nfds - 1];
-                        clients[client_idx] = clients[nfds - 2];
-                    }
-                    nfds--;
-                    i--; // Recheck this slot since we moved another fd here
-                }
-            }
+void handle_http_request(ClientInfo *client, RequestOrError *req_or_err)
+{
+    if (req_or_err->has_error) {
+        // Handle parsing error
+        switch (req_or_err->data.err) {
+        case ERR_MALFORMED_REQUEST:
+            write_static_response(client, BAD_REQUEST_RES);
+            break;
+        case ERR_BODY_TOO_LARGE:
+            write_static_response(client, CONTENT_TOO_LARGE_RES);
+            break;
         }
+        return;
     }
 
-    // Cleanup
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (clients[i]) {
-            free_client(clients[i]);
+    Request *req = &req_or_err->data.req;
+    if (serve_metrics(client, req) || serve_proxy(client, req, false)) {
+        return;
+    }
+    switch (serve_static_file(client, req)) {
+    case STATIC_FILE_SERVED:
+        return;
+    case STATIC_FILE_NOT_FOUND:
+        write_static_response(client, NOT_FOUND_RES);
+        return;
+    case STATIC_FILE_SKIPPED:
+        break;
+    }
+
+    RouteMatch match;
+    RouteHandler handler;
+    switch (router_lookup(&router, req->method, req->path, &match, &handler)) {
+    case ROUTE_FOUND:
+        if (match.offload) {
+            offload_request(client, req, &match);
+        } else if (match.cache) {
+            serve_cacheable(client, req, &match, handler);
+        } else {
+            handler(client, req, &match);
         }
+        break;
+    case ROUTE_METHOD_NOT_ALLOWED:
+        write_method_not_allowed(client, match.allowed_methods);
+        break;
+    case ROUTE_NOT_FOUND:
+        write_static_response(client, NOT_FOUND_RES);
+        break;
     }
-    close(server_fd);
-    return 0;
+}
+
+// Bodies still on their way go to a streaming route if there is one
+bool handle_http_stream(ClientInfo *client, Request *req)
+{
+    if (serve_proxy(client, req, true)) {
+        return true;
+    }
+    RouteMatch match;
+    RouteHandler handler;
+    if (router_lookup(&stream_router, req->method, req->path, &match, &handler) != ROUTE_FOUND) {
+        return false;
+    }
+    handler(client, req, &match);
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    ServerConfig config;
+    init_server_config(&config);
+    config.handler = handle_http_request;
+    config.stream_handler = handle_http_stream;
+
+    if (parse_server_args(&config, argc, argv) < 0 || register_static_responses() < 0
+        || register_routes() < 0) {
+        return EXIT_FAILURE;
+    }
+
+    return run_server(&config) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
 }
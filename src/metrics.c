@@ -0,0 +1,285 @@
+#include "metrics.h"
+#include "response.h"
+#include "worker.h"
+#include <inttypes.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+// Exported bucket bounds, powers of two from 64ns to about 69s. The finer
+// buckets are kept for precision but would make every scrape huge
+#define EXPORT_MIN_SHIFT 6
+#define EXPORT_MAX_SHIFT 36
+#define MAX_METRICS_LINE 128
+
+// Nanoseconds per clock tick, as 32.32 fixed point
+static uint64_t tick_ns_mult = 1ULL << 32;
+static pthread_once_t calibrate_once = PTHREAD_ONCE_INIT;
+
+// Every live worker's metrics, only walked by /metrics
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static Metrics *registry;
+
+static const char *const STAGE_NAMES[STAGE_COUNT] = {
+    [STAGE_FIRST_BYTE] = "first_byte",
+    [STAGE_READ] = "read",
+    [STAGE_PARSE] = "parse",
+    [STAGE_HANDLER] = "handler",
+    [STAGE_WRITE] = "write",
+};
+
+static uint64_t monotonic_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Time the TSC against the monotonic clock once, for all workers
+static void calibrate_clock()
+{
+#if defined(__x86_64__)
+    uint64_t start_ns = monotonic_ns();
+    uint64_t start_ticks = metrics_clock();
+    uint64_t elapsed_ns;
+    do {
+        elapsed_ns = monotonic_ns() - start_ns;
+    } while (elapsed_ns < 10000000);
+    uint64_t ticks = metrics_clock() - start_ticks;
+    if (ticks > 0) {
+        tick_ns_mult = (elapsed_ns << 32) / ticks;
+    }
+#endif
+}
+
+void metrics_init(Metrics *metrics, unsigned sample_every)
+{
+    pthread_once(&calibrate_once, calibrate_clock);
+
+    memset(metrics, 0, sizeof(Metrics));
+    metrics->sample_every = sample_every > 0 ? sample_every : 1;
+    for (int i = 0; i < STAGE_COUNT; i++) {
+        metrics->countdown[i] = metrics->sample_every;
+    }
+
+    pthread_mutex_lock(&registry_lock);
+    metrics->next = registry;
+    registry = metrics;
+    pthread_mutex_unlock(&registry_lock);
+}
+
+void metrics_destroy(Metrics *metrics)
+{
+    pthread_mutex_lock(&registry_lock);
+    for (Metrics **link = &registry; *link; link = &(*link)->next) {
+        if (*link == metrics) {
+            *link = metrics->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&registry_lock);
+}
+
+static size_t bucket_index(uint64_t ns)
+{
+    if (ns < HISTOGRAM_SUB_BUCKETS) {
+        return ns;
+    }
+    unsigned shift = 63 - __builtin_clzll(ns);
+    if (shift > HISTOGRAM_MAX_SHIFT) {
+        return HISTOGRAM_BUCKETS - 1;
+    }
+    return (size_t)(shift - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS
+        + ((ns >> (shift - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+// First bucket whose values are all at least 2^shift ns
+static size_t power_of_two_index(unsigned shift)
+{
+    return shift < HISTOGRAM_SUB_BITS ? (size_t)1 << shift
+                                      : (size_t)(shift - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS;
+}
+
+/**
+ * Add a duration to a histogram, on the thread that owns it
+ * @param histogram Histogram to add to
+ * @param ticks Duration in metrics_clock ticks
+ */
+void histogram_record(Histogram *histogram, uint64_t ticks)
+{
+    uint64_t ns = (uint64_t)(((unsigned __int128)ticks * tick_ns_mult) >> 32);
+    metrics_add(&histogram->buckets[bucket_index(ns)], 1);
+    metrics_add(&histogram->count, 1);
+    metrics_add(&histogram->sum, ns);
+}
+
+static uint64_t load(const uint64_t *value)
+{
+    return __atomic_load_n(value, __ATOMIC_RELAXED);
+}
+
+// Sum every worker's numbers. Each value is read atomically, but a
+// histogram's buckets, sum and count may each be a few samples apart
+static void collect_metrics(Metrics *total)
+{
+    memset(total, 0, sizeof(Metrics));
+    pthread_mutex_lock(&registry_lock);
+    for (Metrics *metrics = registry; metrics; metrics = metrics->next) {
+        total->connections_accepted += load(&metrics->connections_accepted);
+        total->connections_active += load(&metrics->connections_active);
+        total->connections_shed += load(&metrics->connections_shed);
+        total->admission_limit += load(&metrics->admission_limit);
+        total->requests += load(&metrics->requests);
+        total->parse_errors += load(&metrics->parse_errors);
+        total->bytes_received += load(&metrics->bytes_received);
+        total->bytes_sent += load(&metrics->bytes_sent);
+        total->access_log_dropped += load(&metrics->access_log_dropped);
+        total->cache_hits += load(&metrics->cache_hits);
+        total->cache_misses += load(&metrics->cache_misses);
+        total->compressed_in += load(&metrics->compressed_in);
+        total->compressed_out += load(&metrics->compressed_out);
+        total->proxy_requests += load(&metrics->proxy_requests);
+        total->proxy_connects += load(&metrics->proxy_connects);
+        total->proxy_errors += load(&metrics->proxy_errors);
+        total->offload_jobs += load(&metrics->offload_jobs);
+        total->offload_rejected += load(&metrics->offload_rejected);
+        total->sample_every = metrics->sample_every;
+        for (int stage = 0; stage < STAGE_COUNT; stage++) {
+            Histogram *from = &metrics->stages[stage];
+            Histogram *to = &total->stages[stage];
+            for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+                to->buckets[i] += load(&from->buckets[i]);
+            }
+            to->count += load(&from->count);
+            to->sum += load(&from->sum);
+        }
+    }
+    pthread_mutex_unlock(&registry_lock);
+}
+
+typedef struct MetricDescription {
+    const char *name;
+    const char *type;
+    const char *help;
+    size_t offset;
+} MetricDescription;
+
+static const MetricDescription SCALAR_METRICS[] = {
+    { "haitchteep_connections_accepted_total", "counter", "Connections accepted",
+        offsetof(Metrics, connections_accepted) },
+    { "haitchteep_connections_active", "gauge", "Connections open", offsetof(Metrics, connections_active) },
+    { "haitchteep_connections_shed_total", "counter", "Connections turned away with a 503 by admission control",
+        offsetof(Metrics, connections_shed) },
+    { "haitchteep_admission_limit", "gauge", "Open connections admission control currently allows",
+        offsetof(Metrics, admission_limit) },
+    { "haitchteep_requests_total", "counter", "Requests parsed, malformed ones included", offsetof(Metrics, requests) },
+    { "haitchteep_parse_errors_total", "counter", "Requests that could not be parsed or framed",
+        offsetof(Metrics, parse_errors) },
+    { "haitchteep_received_bytes_total", "counter", "Bytes read from clients", offsetof(Metrics, bytes_received) },
+    { "haitchteep_sent_bytes_total", "counter", "Bytes written to clients", offsetof(Metrics, bytes_sent) },
+    { "haitchteep_access_log_dropped_total", "counter", "Access log records dropped because the flusher fell behind",
+        offsetof(Metrics, access_log_dropped) },
+    { "haitchteep_response_cache_hits_total", "counter", "Requests answered from the response cache",
+        offsetof(Metrics, cache_hits) },
+    { "haitchteep_response_cache_misses_total", "counter", "Cacheable requests passed on to their handler",
+        offsetof(Metrics, cache_misses) },
+    { "haitchteep_compression_in_bytes_total", "counter", "Response body bytes gzipped on the fly",
+        offsetof(Metrics, compressed_in) },
+    { "haitchteep_compression_out_bytes_total", "counter", "Bytes those bodies were compressed to",
+        offsetof(Metrics, compressed_out) },
+    { "haitchteep_proxy_requests_total", "counter", "Requests forwarded to a backend",
+        offsetof(Metrics, proxy_requests) },
+    { "haitchteep_proxy_connections_total", "counter", "Backend connections opened",
+        offsetof(Metrics, proxy_connects) },
+    { "haitchteep_proxy_errors_total", "counter", "Proxied requests that failed at the backend",
+        offsetof(Metrics, proxy_errors) },
+    { "haitchteep_offload_jobs_total", "counter", "Requests whose handler ran on an offload thread",
+        offsetof(Metrics, offload_jobs) },
+    { "haitchteep_offload_rejected_total", "counter", "Offloaded requests turned away with a full queue",
+        offsetof(Metrics, offload_rejected) },
+};
+
+// Render in the Prometheus text exposition format, returns the length or 0
+// if buf is too small
+static size_t render_metrics(const Metrics *total, char *buf, size_t size)
+{
+    size_t len = 0;
+#define APPEND(...)                                                    \
+    do {                                                               \
+        int written = snprintf(buf + len, size - len, __VA_ARGS__);    \
+        if (written < 0 || (size_t)written >= size - len) {            \
+            return 0;                                                  \
+        }                                                              \
+        len += written;                                                \
+    } while (0)
+
+    for (size_t i = 0; i < sizeof(SCALAR_METRICS) / sizeof(SCALAR_METRICS[0]); i++) {
+        const MetricDescription *metric = &SCALAR_METRICS[i];
+        uint64_t value = *(const uint64_t *)((const char *)total + metric->offset);
+        APPEND("# HELP %s %s\n# TYPE %s %s\n%s %" PRIu64 "\n", metric->name, metric->help, metric->name, metric->type,
+            metric->name, value);
+    }
+
+    APPEND("# HELP haitchteep_stage_duration_seconds Time spent in each stage of serving a request, "
+           "one call in %u sampled\n"
+           "# TYPE haitchteep_stage_duration_seconds histogram\n",
+        total->sample_every);
+    for (int stage = 0; stage < STAGE_COUNT; stage++) {
+        const Histogram *histogram = &total->stages[stage];
+        uint64_t cumulative = 0;
+        size_t next = 0;
+        for (unsigned shift = EXPORT_MIN_SHIFT; shift <= EXPORT_MAX_SHIFT; shift++) {
+            for (size_t end = power_of_two_index(shift); next < end; next++) {
+                cumulative += histogram->buckets[next];
+            }
+            APPEND("haitchteep_stage_duration_seconds_bucket{stage=\"%s\",le=\"%.9g\"} %" PRIu64 "\n", STAGE_NAMES[stage],
+                (double)(1ULL << shift) / 1e9, cumulative);
+        }
+        APPEND("haitchteep_stage_duration_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %" PRIu64 "\n"
+               "haitchteep_stage_duration_seconds_sum{stage=\"%s\"} %.9f\n"
+               "haitchteep_stage_duration_seconds_count{stage=\"%s\"} %" PRIu64 "\n",
+            STAGE_NAMES[stage], histogram->count, STAGE_NAMES[stage], histogram->sum / 1e9, STAGE_NAMES[stage],
+            histogram->count);
+    }
+#undef APPEND
+    return len;
+}
+
+/**
+ * Answer a GET for the configured metrics path with every worker's
+ * numbers added up
+ * @param client Client that sent the request
+ * @param req Parsed request
+ * @return Whether the request was for the metrics, and answered
+ */
+bool serve_metrics(ClientInfo *client, const Request *req)
+{
+    const char *path = client->worker->config->metrics_path;
+    if (!path || req->method != METHOD_GET || !sv_equals(req->path, path)) {
+        return false;
+    }
+
+    size_t lines = sizeof(SCALAR_METRICS) / sizeof(SCALAR_METRICS[0]) * 3 + 2
+        + STAGE_COUNT * (EXPORT_MAX_SHIFT - EXPORT_MIN_SHIFT + 4);
+    size_t size = lines * MAX_METRICS_LINE;
+    char *body = client_alloc(client, size);
+    if (!body) {
+        client->state = CLIENT_DONE;
+        return true;
+    }
+    Metrics total;
+    collect_metrics(&total);
+
+    Response res = { 0 };
+    res.status = STATUS_OK;
+    res.content_type = CONTENT_TYPE_PROMETHEUS;
+    res.content_body = body;
+    res.content_len = render_metrics(&total, body, size);
+    if (res.content_len == 0) {
+        client->state = CLIENT_DONE;
+        return true;
+    }
+    write_response(client, &res);
+    return true;
+}
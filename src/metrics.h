@@ -0,0 +1,111 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "client_info.h"
+#include "request.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#define DEFAULT_METRICS_PATH "/metrics"
+#define DEFAULT_METRICS_SAMPLE 16
+
+// Log-linear buckets in the style of HdrHistogram: every power of two is
+// split into HISTOGRAM_SUB_BUCKETS, so a value is never more than 12.5% off
+// its bucket's bounds. Nanoseconds up to 2^HISTOGRAM_MAX_SHIFT, about 18
+// minutes, anything longer lands in the last bucket
+#define HISTOGRAM_SUB_BITS 3
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_MAX_SHIFT 40
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_SHIFT - HISTOGRAM_SUB_BITS + 2) * HISTOGRAM_SUB_BUCKETS)
+
+typedef enum MetricStage {
+    STAGE_FIRST_BYTE, // Accept to the connection's first byte
+    STAGE_READ, // check_http_end on newly received bytes
+    STAGE_PARSE, // parse_request
+    STAGE_HANDLER, // The request handler, writing its response included
+    STAGE_WRITE, // Serializing and queueing a response
+    STAGE_COUNT,
+} MetricStage;
+
+typedef struct Histogram {
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+    uint64_t count;
+    uint64_t sum; // Nanoseconds
+} Histogram;
+
+// One worker's numbers. Only the worker writes them, so updates are a plain
+// load and store, and /metrics reads every worker's with relaxed loads.
+// Stage timings are sampled, one call in sample_every per stage
+typedef struct Metrics {
+    uint64_t connections_accepted;
+    uint64_t connections_active;
+    uint64_t connections_shed; // Answered with a 503 and closed by admission control
+    uint64_t admission_limit; // Connections admission control currently allows, 0 without a cap
+    uint64_t requests;
+    uint64_t parse_errors;
+    uint64_t bytes_received;
+    uint64_t bytes_sent;
+    uint64_t access_log_dropped; // Records lost to a full access log ring
+    uint64_t cache_hits; // Requests answered from the response cache
+    uint64_t cache_misses; // Cacheable requests the handler had to answer
+    uint64_t compressed_in; // Body bytes gzipped on the fly
+    uint64_t compressed_out; // What they came out as
+    uint64_t proxy_requests; // Requests forwarded to a backend
+    uint64_t proxy_connects; // Backend connections opened, the rest reused pooled ones
+    uint64_t proxy_errors; // Proxied requests answered with a 502 or 504, or cut short
+    uint64_t offload_jobs; // Requests handed to the offload threads
+    uint64_t offload_rejected; // Offloaded requests answered with a 503, the queue being full
+    unsigned sample_every;
+    unsigned countdown[STAGE_COUNT]; // Calls until a stage is timed next
+    Histogram stages[STAGE_COUNT];
+    struct Metrics *next; // Every live worker's metrics, for /metrics
+} Metrics;
+
+extern void metrics_init(Metrics *metrics, unsigned sample_every);
+extern void metrics_destroy(Metrics *metrics);
+extern void histogram_record(Histogram *histogram, uint64_t ticks);
+extern bool serve_metrics(ClientInfo *client, const Request *req);
+
+// Raw timestamps, TSC ticks on x86-64 and nanoseconds elsewhere, converted
+// to nanoseconds when recorded
+static inline uint64_t metrics_clock()
+{
+#if defined(__x86_64__)
+    return __builtin_ia32_rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static inline void metrics_add(uint64_t *counter, uint64_t n)
+{
+    // A single writer needs no locked instruction, only tear-free stores
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+static inline void metrics_set(uint64_t *gauge, uint64_t value)
+{
+    __atomic_store_n(gauge, value, __ATOMIC_RELAXED);
+}
+
+// Start timing a stage, returns 0 if this call isn't sampled
+static inline uint64_t metrics_start(Metrics *metrics, MetricStage stage)
+{
+    if (--metrics->countdown[stage] != 0) {
+        return 0;
+    }
+    metrics->countdown[stage] = metrics->sample_every;
+    return metrics_clock();
+}
+
+static inline void metrics_end(Metrics *metrics, MetricStage stage, uint64_t start)
+{
+    if (start) {
+        histogram_record(&metrics->stages[stage], metrics_clock() - start);
+    }
+}
+
+#endif // METRICS_H
@@ -0,0 +1,437 @@
+#include "offload.h"
+#include "worker.h"
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+static const char SERVICE_UNAVAILABLE_BODY[] = "Service Unavailable";
+
+// Memory an offloaded handler asked for, freed once its response is sent
+typedef struct OffloadBlock {
+    struct OffloadBlock *next;
+    max_align_t data[];
+} OffloadBlock;
+
+// The threads and every worker's queue. Queues are registered once, before
+// their worker serves anything, and stay until the pool is stopped
+typedef struct OffloadPool {
+    pthread_t *threads;
+    size_t num_threads; // 0 runs offloaded handlers inline on the worker
+    OffloadQueue **queues; // Slot per worker, NULL until it registers
+    size_t num_queues;
+    sem_t pending; // Posted once per job submitted
+    bool running;
+} OffloadPool;
+
+static OffloadPool pool_state;
+
+// Claim the oldest job of one worker's ring, racing other offload threads
+static OffloadJob *take_job(OffloadQueue *queue)
+{
+    size_t head = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+    while (1) {
+        size_t tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+        if (head == tail) {
+            return NULL;
+        }
+        // The slot can only be refilled once head has moved past it, and
+        // then the claim below fails
+        OffloadJob *job = __atomic_load_n(&queue->ring[head & (queue->capacity - 1)], __ATOMIC_RELAXED);
+        if (__atomic_compare_exchange_n(&queue->head, &head, head + 1, false, __ATOMIC_ACQ_REL,
+                __ATOMIC_RELAXED)) {
+            return job;
+        }
+    }
+}
+
+// Start at the thread's own worker and steal from the others, so one
+// worker's burst of heavy requests spreads over every thread
+static OffloadJob *find_job(OffloadPool *pool, size_t home)
+{
+    for (size_t i = 0; i < pool->num_queues; i++) {
+        OffloadQueue *queue = __atomic_load_n(&pool->queues[(home + i) % pool->num_queues], __ATOMIC_ACQUIRE);
+        OffloadJob *job = queue ? take_job(queue) : NULL;
+        if (job) {
+            return job;
+        }
+    }
+    return NULL;
+}
+
+// Hand a finished job back to its worker
+static void complete_job(OffloadJob *job)
+{
+    OffloadQueue *queue = job->queue;
+    OffloadJob *head = __atomic_load_n(&queue->completed, __ATOMIC_RELAXED);
+    do {
+        job->next = head;
+    } while (!__atomic_compare_exchange_n(&queue->completed, &head, job, true, __ATOMIC_RELEASE,
+        __ATOMIC_RELAXED));
+
+    // Later pushes are picked up along with the first
+    if (!head) {
+        uint64_t one = 1;
+        if (write(queue->handle.fd, &one, sizeof(one)) < 0) {
+            perror("Failed to signal offload completion");
+        }
+    }
+}
+
+static void *offload_main(void *arg)
+{
+    OffloadPool *pool = &pool_state;
+    size_t home = (uintptr_t)arg;
+    while (1) {
+        while (sem_wait(&pool->pending) < 0 && errno == EINTR) {
+        }
+        if (!__atomic_load_n(&pool->running, __ATOMIC_ACQUIRE)) {
+            return NULL;
+        }
+        // Each post stands for a job nobody has claimed for it, another
+        // thread may only have taken this one's in exchange for its own
+        OffloadJob *job;
+        while (!(job = find_job(pool, home))) {
+        }
+        job->handler(&job->req, &job->match, &job->result);
+        complete_job(job);
+    }
+}
+
+/**
+ * Start the threads offloaded handlers run on, before any worker
+ * @param threads Number of threads, 0 runs offloaded handlers inline
+ * @param workers Number of workers that will register a queue
+ * @return 0 on success, -1 on failure
+ */
+int offload_start(size_t threads, size_t workers)
+{
+    OffloadPool *pool = &pool_state;
+    if (threads == 0) {
+        return 0;
+    }
+    pool->queues = calloc(workers, sizeof(OffloadQueue *));
+    pool->threads = calloc(threads, sizeof(pthread_t));
+    if (!pool->queues || !pool->threads || sem_init(&pool->pending, 0, 0) < 0) {
+        perror("Failed to set up offload threads");
+        free(pool->queues);
+        free(pool->threads);
+        return -1;
+    }
+    pool->num_queues = workers;
+    pool->running = true;
+
+    for (size_t i = 0; i < threads; i++) {
+        int err = pthread_create(&pool->threads[i], NULL, offload_main, (void *)(uintptr_t)i);
+        if (err != 0) {
+            errno = err;
+            perror("Failed to start offload thread");
+            offload_stop();
+            return -1;
+        }
+        pool->num_threads++;
+    }
+    return 0;
+}
+
+// Stop the threads once they finish the handler they are running. Jobs
+// still queued are dropped
+void offload_stop(void)
+{
+    OffloadPool *pool = &pool_state;
+    if (!pool->threads) {
+        return;
+    }
+    __atomic_store_n(&pool->running, false, __ATOMIC_RELEASE);
+    for (size_t i = 0; i < pool->num_threads; i++) {
+        sem_post(&pool->pending);
+    }
+    for (size_t i = 0; i < pool->num_threads; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    sem_destroy(&pool->pending);
+    free(pool->threads);
+    free(pool->queues);
+    memset(pool, 0, sizeof(OffloadPool));
+}
+
+static void free_blocks(void *data)
+{
+    OffloadBlock *block = data;
+    while (block) {
+        OffloadBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+}
+
+// The job's response has been sent or dropped, it can take another request
+static void release_job(void *data)
+{
+    OffloadJob *job = data;
+    OffloadQueue *queue = job->queue;
+    free_blocks(job->result.blocks);
+    job->result.blocks = NULL;
+    buffer_free(&queue->worker->buffers, job->input, job->input_size);
+    job->input = NULL;
+    job->next = queue->free_jobs;
+    queue->free_jobs = job;
+}
+
+// Queue the handler's response. The job is kept until it is sent, so the
+// response goes out without a copy
+static void write_result(ClientInfo *client, OffloadJob *job)
+{
+    if (!client_hold(client, release_job, job)) {
+        release_job(job);
+        client->state = CLIENT_DONE;
+        return;
+    }
+    write_response(client, &job->result.response);
+    if (client->state == CLIENT_OFFLOADED) {
+        client->state = CLIENT_READY;
+    }
+    if (client->state == CLIENT_READY) {
+        finish_client_request(client, client->worker->loop);
+    }
+}
+
+// Answer the connections whose jobs are done, in the order they finished
+static void on_offload_completions(EventLoop *loop, EventHandle *handle, const Event *event)
+{
+    (void)loop;
+    (void)event;
+    OffloadQueue *queue = (OffloadQueue *)handle;
+    uint64_t count;
+    while (read(handle->fd, &count, sizeof(count)) < 0 && errno == EINTR) {
+    }
+
+    // Taken whole, newest first
+    OffloadJob *done = __atomic_exchange_n(&queue->completed, NULL, __ATOMIC_ACQUIRE);
+    OffloadJob *ordered = NULL;
+    while (done) {
+        OffloadJob *next = done->next;
+        done->next = ordered;
+        ordered = done;
+        done = next;
+    }
+
+    while (ordered) {
+        OffloadJob *job = ordered;
+        ordered = job->next;
+        ClientInfo *client = job->client;
+        if (!client) {
+            release_job(job);
+            continue;
+        }
+        job->client = NULL;
+        client->offload = NULL;
+        write_result(client, job);
+        flush_client(client);
+        // Pipelined requests behind this one
+        service_client(queue->worker, client);
+    }
+}
+
+/**
+ * Set up a worker's queue and have the offload threads take from it
+ * @param queue Queue to set up
+ * @param worker Worker that owns it, whose loop watches for completions
+ * @param capacity Most jobs queued or running at once, rounded up to a
+ * power of two
+ * @return 0 on success, -1 on failure
+ */
+int offload_queue_init(OffloadQueue *queue, Worker *worker, size_t capacity)
+{
+    OffloadPool *pool = &pool_state;
+    memset(queue, 0, sizeof(OffloadQueue));
+    queue->worker = worker;
+    queue->handle.fd = -1;
+    if (pool->num_threads == 0) {
+        return 0;
+    }
+
+    queue->capacity = 1;
+    while (queue->capacity < capacity) {
+        queue->capacity <<= 1;
+    }
+    queue->jobs = calloc(queue->capacity, sizeof(OffloadJob));
+    queue->ring = calloc(queue->capacity, sizeof(OffloadJob *));
+    queue->handle.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    queue->handle.callback = on_offload_completions;
+    if (!queue->jobs || !queue->ring || queue->handle.fd < 0
+        || event_loop_add(worker->loop, &queue->handle, EVENT_READABLE) < 0) {
+        perror("Failed to set up offload queue");
+        offload_queue_destroy(queue);
+        return -1;
+    }
+    for (size_t i = queue->capacity; i > 0; i--) {
+        OffloadJob *job = &queue->jobs[i - 1];
+        job->queue = queue;
+        job->next = queue->free_jobs;
+        queue->free_jobs = job;
+    }
+
+    __atomic_store_n(&pool->queues[worker->id], queue, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Only once the offload threads have stopped, and after the worker's clients
+// are closed
+void offload_queue_destroy(OffloadQueue *queue)
+{
+    if (queue->jobs) {
+        for (size_t i = 0; i < queue->capacity; i++) {
+            free_blocks(queue->jobs[i].result.blocks);
+            buffer_free(&queue->worker->buffers, queue->jobs[i].input, queue->jobs[i].input_size);
+        }
+    }
+    if (queue->handle.fd >= 0) {
+        close(queue->handle.fd);
+    }
+    free(queue->jobs);
+    free(queue->ring);
+    memset(queue, 0, sizeof(OffloadQueue));
+    queue->handle.fd = -1;
+}
+
+// Point a view that was inside the request's bytes at the copy of them
+static void rebase_view(StringView *view, const char *from, size_t len, const char *to)
+{
+    uintptr_t start = (uintptr_t)from, data = (uintptr_t)view->data;
+    if (view->data && data >= start && data + view->len <= start + len) {
+        view->data = to + (data - start);
+    }
+}
+
+// The connection buffer can move or go away while a handler runs, so the
+// job gets the request's bytes and views of its own. A path that had to be
+// decoded lives in the client's arena, it is copied in after them
+static bool copy_request(OffloadJob *job, ClientInfo *client, const Request *req, const RouteMatch *match)
+{
+    const char *from = client->buffer + client->buf_start;
+    size_t len = client->req_len;
+    size_t path_len = req->path.data >= from && req->path.data < from + len ? 0 : req->path.len;
+    job->input = buffer_alloc(&client->worker->buffers, len + path_len, &job->input_size);
+    if (!job->input) {
+        return false;
+    }
+    memcpy(job->input, from, len);
+    memcpy(job->input + len, req->path.data, path_len);
+
+    job->req = *req;
+    job->match = *match;
+    Request *copy = &job->req;
+    rebase_view(&copy->method_name, from, len, job->input);
+    rebase_view(&copy->target, from, len, job->input);
+    rebase_view(&copy->path, from, len, job->input);
+    rebase_view(&copy->path, req->path.data, path_len, job->input + len);
+    rebase_view(&copy->query, from, len, job->input);
+    rebase_view(&copy->body, from, len, job->input);
+    for (size_t i = 0; i < HEADER_COUNT; i++) {
+        rebase_view(&copy->headers.known[i], from, len, job->input);
+    }
+    for (size_t i = 0; i < copy->headers.num_others; i++) {
+        rebase_view(&copy->headers.others[i].name, from, len, job->input);
+        rebase_view(&copy->headers.others[i].value, from, len, job->input);
+    }
+    for (size_t i = 0; i < job->match.num_params; i++) {
+        rebase_view(&job->match.params[i].value, from, len, job->input);
+        rebase_view(&job->match.params[i].value, req->path.data, path_len, job->input + len);
+    }
+    return true;
+}
+
+// Every job is taken, so the worker is as far behind as it may get
+static void write_service_unavailable(ClientInfo *client)
+{
+    Response res = { 0 };
+    res.status = STATUS_SERVICE_UNAVAILABLE;
+    res.content_type = CONTENT_TYPE_PLAINTEXT;
+    res.content_body = (char *)SERVICE_UNAVAILABLE_BODY;
+    res.content_len = sizeof(SERVICE_UNAVAILABLE_BODY) - 1;
+    write_response(client, &res);
+}
+
+/**
+ * Run a handler on an offload thread, so it can't hold up the worker's other
+ * connections. The connection waits in CLIENT_OFFLOADED, reading nothing and
+ * with no timer, until the response comes back. A 503 is written instead
+ * when the worker already has as many jobs as its queue holds. Without
+ * offload threads the handler runs right away
+ * @param client Client being answered
+ * @param req Parsed request, copied for the handler
+ * @param match Lookup result of an offloaded route, copied for the handler
+ */
+void offload_request(ClientInfo *client, Request *req, const RouteMatch *match)
+{
+    OffloadHandler handler = match->offload;
+    Worker *worker = client->worker;
+    OffloadQueue *queue = &worker->offload;
+    if (!queue->jobs) {
+        OffloadResult result = { 0 };
+        handler(req, match, &result);
+        if (client_hold(client, free_blocks, result.blocks)) {
+            write_response(client, &result.response);
+        } else {
+            free_blocks(result.blocks);
+            client->state = CLIENT_DONE;
+        }
+        return;
+    }
+
+    OffloadJob *job = queue->free_jobs;
+    if (!job) {
+        metrics_add(&worker->metrics.offload_rejected, 1);
+        write_service_unavailable(client);
+        return;
+    }
+    if (!copy_request(job, client, req, match)) {
+        client->state = CLIENT_DONE;
+        return;
+    }
+    queue->free_jobs = job->next;
+    job->handler = handler;
+    memset(&job->result, 0, sizeof(OffloadResult));
+    job->client = client;
+    client->offload = job;
+    client->state = CLIENT_OFFLOADED;
+    metrics_add(&worker->metrics.offload_jobs, 1);
+
+    // Only this worker writes tail, and a free job means a free slot
+    __atomic_store_n(&queue->ring[queue->tail & (queue->capacity - 1)], job, __ATOMIC_RELAXED);
+    __atomic_store_n(&queue->tail, queue->tail + 1, __ATOMIC_RELEASE);
+    sem_post(&pool_state.pending);
+}
+
+// The connection is closing, its job's result is thrown away when it comes
+void abort_offload(ClientInfo *client)
+{
+    if (client->offload) {
+        client->offload->client = NULL;
+        client->offload = NULL;
+    }
+}
+
+/**
+ * Allocate memory for an offloaded handler's response, on the offload
+ * thread. It is freed on the worker once the response has been sent
+ * @param result The result passed to the handler
+ * @param size Bytes needed
+ * @return The memory, or NULL if out of memory
+ */
+void *offload_alloc(OffloadResult *result, size_t size)
+{
+    OffloadBlock *block = malloc(sizeof(OffloadBlock) + size);
+    if (!block) {
+        return NULL;
+    }
+    block->next = result->blocks;
+    result->blocks = block;
+    return block->data;
+}
@@ -0,0 +1,62 @@
+#ifndef OFFLOAD_H
+#define OFFLOAD_H
+
+#include "client_info.h"
+#include "event_loop.h"
+#include "request.h"
+#include "response.h"
+#include "router.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+#define DEFAULT_OFFLOAD_THREADS 4
+#define DEFAULT_OFFLOAD_QUEUE 256 // Jobs each worker may have queued or running
+
+struct OffloadBlock;
+
+// What an offloaded handler answers with. The response may point into the
+// request or into memory from offload_alloc, both live until it is sent
+typedef struct OffloadResult {
+    Response response;
+    struct OffloadBlock *blocks; // Everything offload_alloc handed out
+} OffloadResult;
+
+// One request on its way through the pool. Jobs belong to a worker, only
+// the handler call happens on an offload thread
+typedef struct OffloadJob {
+    struct OffloadJob *next; // In the completed stack, or the free list
+    OffloadHandler handler;
+    Request req; // Views into input
+    RouteMatch match;
+    char *input; // The request's bytes, copied out of the connection buffer
+    size_t input_size;
+    OffloadResult result;
+    ClientInfo *client; // NULL once the connection is gone
+    struct OffloadQueue *queue;
+} OffloadJob;
+
+// A worker's side of the pool. Only the worker adds to ring and only
+// offload threads take from it, by claiming head. Finished jobs come back on
+// the completed stack, and the first one pushed onto an empty stack writes
+// the eventfd, so the worker never takes a lock
+typedef struct OffloadQueue {
+    EventHandle handle; // eventfd, must stay first
+    OffloadJob *jobs; // capacity of them, NULL when handlers run inline
+    OffloadJob *free_jobs;
+    OffloadJob **ring;
+    size_t capacity; // A power of two
+    struct Worker *worker;
+    _Alignas(64) size_t tail; // Next slot the worker fills
+    _Alignas(64) size_t head; // Next slot an offload thread takes
+    _Alignas(64) OffloadJob *completed; // Pushed by offload threads, taken whole by the worker
+} OffloadQueue;
+
+extern int offload_start(size_t threads, size_t workers);
+extern void offload_stop(void);
+extern int offload_queue_init(OffloadQueue *queue, struct Worker *worker, size_t capacity);
+extern void offload_queue_destroy(OffloadQueue *queue);
+extern void offload_request(ClientInfo *client, Request *req, const RouteMatch *match);
+extern void abort_offload(ClientInfo *client);
+extern void *offload_alloc(OffloadResult *result, size_t size);
+
+#endif // OFFLOAD_H
@@ -0,0 +1,404 @@
+#define _GNU_SOURCE
+#include "offload.h"
+#include "response.h"
+#include "router.h"
+#include "server.h"
+#include "test.h"
+#include "worker.h"
+#include <netinet/in.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#define MAX_MESSAGE 4096
+#define SMALL_QUEUE 4
+#define STALL_MS 300
+#define MAX_LOG 64
+#define RACE_THREADS 4
+#define RACE_CLIENTS 8
+#define RACE_REQUESTS 200
+#define RACE_QUEUE 64
+
+static Router router;
+static sem_t gate; // Held shut by /block until /stall opens it
+
+// Ids in the order offload threads ran them, and in the order the worker
+// got to requests queued behind them
+static int run_log[MAX_LOG], mark_log[MAX_LOG];
+static int run_count, mark_count;
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_int race_runs[RACE_CLIENTS * RACE_REQUESTS];
+
+static void append(int *log, int *count, int id)
+{
+    pthread_mutex_lock(&log_lock);
+    if (*count < MAX_LOG) {
+        log[(*count)++] = id;
+    }
+    pthread_mutex_unlock(&log_lock);
+}
+
+static int param_id(const RouteMatch *match)
+{
+    const StringView *id = route_param(match, "id");
+    return atoi(id->data);
+}
+
+// Answers with the id, which the result's own memory holds
+static void echo_id(const RouteMatch *match, OffloadResult *result)
+{
+    const StringView *id = route_param(match, "id");
+    Response *res = &result->response;
+    res->status = STATUS_OK;
+    res->content_type = CONTENT_TYPE_PLAINTEXT;
+    res->content_body = offload_alloc(result, id->len);
+    if (res->content_body) {
+        memcpy(res->content_body, id->data, id->len);
+        res->content_len = id->len;
+    }
+}
+
+static void handle_offloaded(const Request *req, const RouteMatch *match, OffloadResult *result)
+{
+    (void)req;
+    append(run_log, &run_count, param_id(match));
+    echo_id(match, result);
+}
+
+static void handle_blocking(const Request *req, const RouteMatch *match, OffloadResult *result)
+{
+    while (sem_wait(&gate) < 0) {
+    }
+    handle_offloaded(req, match, result);
+}
+
+static void handle_race(const Request *req, const RouteMatch *match, OffloadResult *result)
+{
+    (void)req;
+    int id = param_id(match);
+    if (id >= 0 && id < RACE_CLIENTS * RACE_REQUESTS) {
+        atomic_fetch_add(&race_runs[id], 1);
+    }
+    echo_id(match, result);
+}
+
+static void write_empty(ClientInfo *client)
+{
+    Response res = { 0 };
+    res.status = STATUS_OK;
+    res.content_type = CONTENT_TYPE_PLAINTEXT;
+    write_response(client, &res);
+}
+
+// Runs on the worker, which handles nothing else meanwhile, so the jobs
+// that finish in the meantime all come back in one batch
+static void handle_stall(ClientInfo *client, Request *req, const RouteMatch *match)
+{
+    (void)req;
+    (void)match;
+    sem_post(&gate);
+    usleep(STALL_MS * 1000);
+    write_empty(client);
+}
+
+static void handle_mark(ClientInfo *client, Request *req, const RouteMatch *match)
+{
+    (void)req;
+    append(mark_log, &mark_count, param_id(match));
+    write_empty(client);
+}
+
+static void handle_request(ClientInfo *client, RequestOrError *req_or_err)
+{
+    RouteMatch match;
+    RouteHandler handler;
+    if (!req_or_err->has_error
+        && router_lookup(&router, req_or_err->data.req.method, req_or_err->data.req.path, &match, &handler)
+            == ROUTE_FOUND) {
+        if (match.offload) {
+            offload_request(client, &req_or_err->data.req, &match);
+        } else {
+            handler(client, &req_or_err->data.req, &match);
+        }
+        return;
+    }
+    Response res = { 0 };
+    res.status = req_or_err->has_error ? STATUS_BAD_REQUEST : STATUS_NOT_FOUND;
+    res.content_type = CONTENT_TYPE_PLAINTEXT;
+    write_response(client, &res);
+}
+
+// A keep-alive connection and whatever has been read past the last response
+typedef struct Conn {
+    int fd;
+    char buf[MAX_MESSAGE];
+    size_t used;
+} Conn;
+
+static void open_conn(Conn *conn, int port)
+{
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port) };
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    conn->fd = socket(AF_INET, SOCK_STREAM, 0);
+    conn->used = 0;
+    struct timeval timeout = { .tv_sec = 5 };
+    setsockopt(conn->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (connect(conn->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(conn->fd);
+        conn->fd = -1;
+    }
+}
+
+static void send_request(Conn *conn, const char *path)
+{
+    char request[256];
+    int len = snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: a\r\n\r\n", path);
+    CHECK(send(conn->fd, request, len, MSG_NOSIGNAL) == len);
+}
+
+// Two requests in one write, so the worker finds the second buffered
+// behind the first rather than still in the socket
+static void send_pipelined(Conn *conn, const char *first, const char *second)
+{
+    char request[512];
+    int len = snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: a\r\n\r\nGET %s HTTP/1.1\r\nHost: a\r\n\r\n",
+        first, second);
+    CHECK(send(conn->fd, request, len, MSG_NOSIGNAL) == len);
+}
+
+// Status of the next response, its body copied to body. 0 if none came
+static int read_response(Conn *conn, char *body)
+{
+    while (1) {
+        char *end = memmem(conn->buf, conn->used, "\r\n\r\n", 4);
+        if (end) {
+            size_t head_len = end + 4 - conn->buf;
+            *end = '\0';
+            const char *length = strcasestr(conn->buf, "\r\nContent-Length:");
+            size_t body_len = length ? strtoul(length + 17, NULL, 10) : 0;
+            *end = '\r';
+            if (conn->used >= head_len + body_len) {
+                int status = atoi(conn->buf + 9);
+                memcpy(body, conn->buf + head_len, body_len);
+                body[body_len] = '\0';
+                memmove(conn->buf, conn->buf + head_len + body_len, conn->used - head_len - body_len);
+                conn->used -= head_len + body_len;
+                return status;
+            }
+        }
+        ssize_t n = recv(conn->fd, conn->buf + conn->used, sizeof(conn->buf) - conn->used, 0);
+        if (n <= 0) {
+            return 0;
+        }
+        conn->used += n;
+    }
+}
+
+// Whether the response ready next is the one expected
+static bool answered(Conn *conn, int status, const char *body)
+{
+    char got[MAX_MESSAGE];
+    return read_response(conn, got) == status && strcmp(got, body) == 0;
+}
+
+// Wait for the worker to have handed count jobs to its queue in all
+static void wait_for_tail(const OffloadQueue *queue, size_t count)
+{
+    for (int i = 0; i < 5000 && __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE) < count; i++) {
+        usleep(1000);
+    }
+    CHECK(__atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE) == count);
+}
+
+static int start_test_worker(ServerConfig *config, int id, Worker **worker)
+{
+    *worker = create_worker(config, id, -1);
+    if (!*worker) {
+        return -1;
+    }
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    getsockname((*worker)->listen_handle.fd, (struct sockaddr *)&addr, &addr_len);
+    if (start_worker(*worker) < 0) {
+        return -1;
+    }
+    return ntohs(addr.sin_port);
+}
+
+// One thread takes jobs oldest first. A full queue means a 503, and jobs
+// finished together are answered in the order they finished
+static void test_order(Worker *worker, int port, int round)
+{
+    pthread_mutex_lock(&log_lock);
+    run_count = mark_count = 0;
+    pthread_mutex_unlock(&log_lock);
+    size_t queued = round * SMALL_QUEUE;
+    char path[32], mark[32];
+
+    Conn conns[SMALL_QUEUE];
+    for (int i = 0; i < SMALL_QUEUE; i++) {
+        open_conn(&conns[i], port);
+        snprintf(path, sizeof(path), i == 0 ? "/block/%d" : "/o/%d", i);
+        snprintf(mark, sizeof(mark), "/mark/%d", i);
+        send_pipelined(&conns[i], path, mark);
+        wait_for_tail(&worker->offload, queued + i + 1);
+    }
+
+    Conn extra;
+    open_conn(&extra, port);
+    send_request(&extra, "/o/99");
+    CHECK(answered(&extra, 503, "Service Unavailable"));
+    send_request(&extra, "/stall");
+    CHECK(answered(&extra, 200, ""));
+    close(extra.fd);
+
+    for (int i = 0; i < SMALL_QUEUE; i++) {
+        char id[16];
+        snprintf(id, sizeof(id), "%d", i);
+        CHECK(answered(&conns[i], 200, id));
+        CHECK(answered(&conns[i], 200, ""));
+        close(conns[i].fd);
+    }
+    pthread_mutex_lock(&log_lock);
+    CHECK(run_count == SMALL_QUEUE && mark_count == SMALL_QUEUE);
+    for (int i = 0; i < run_count && i < mark_count; i++) {
+        CHECK(run_log[i] == i);
+        CHECK(mark_log[i] == i);
+    }
+    pthread_mutex_unlock(&log_lock);
+}
+
+// A job that finishes first is answered first, whatever was queued before it
+static void test_overtaking(int port)
+{
+    Conn slow, fast;
+    open_conn(&slow, port);
+    open_conn(&fast, port);
+    send_request(&slow, "/block/1");
+    send_request(&fast, "/o/2");
+    CHECK(answered(&fast, 200, "2"));
+    sem_post(&gate);
+    CHECK(answered(&slow, 200, "1"));
+    close(slow.fd);
+    close(fast.fd);
+}
+
+// Threads with another worker as their home still take its jobs
+static void test_stealing(int port)
+{
+    Conn conn;
+    open_conn(&conn, port);
+    for (int i = 0; i < 3; i++) {
+        send_request(&conn, "/o/7");
+        CHECK(answered(&conn, 200, "7"));
+    }
+    close(conn.fd);
+}
+
+static int race_port;
+
+static void *race_client(void *arg)
+{
+    int client = (int)(intptr_t)arg;
+    Conn *conn = malloc(sizeof(Conn));
+    open_conn(conn, race_port);
+    int failures = 0;
+    for (int i = 0; i < RACE_REQUESTS; i++) {
+        char path[32], id[16];
+        int n = client * RACE_REQUESTS + i;
+        snprintf(path, sizeof(path), "/race/%d", n);
+        snprintf(id, sizeof(id), "%d", n);
+        send_request(conn, path);
+        failures += !answered(conn, 200, id);
+    }
+    close(conn->fd);
+    free(conn);
+    return (void *)(intptr_t)failures;
+}
+
+// Threads racing for the same ring run every job exactly once
+static void test_claim_race(int port)
+{
+    race_port = port;
+    for (int i = 0; i < RACE_CLIENTS * RACE_REQUESTS; i++) {
+        atomic_store(&race_runs[i], 0);
+    }
+    pthread_t clients[RACE_CLIENTS];
+    for (int i = 0; i < RACE_CLIENTS; i++) {
+        CHECK(pthread_create(&clients[i], NULL, race_client, (void *)(intptr_t)i) == 0);
+    }
+    for (int i = 0; i < RACE_CLIENTS; i++) {
+        void *failures;
+        pthread_join(clients[i], &failures);
+        CHECK(failures == NULL);
+    }
+    int runs_off = 0;
+    for (int i = 0; i < RACE_CLIENTS * RACE_REQUESTS; i++) {
+        runs_off += atomic_load(&race_runs[i]) != 1;
+    }
+    CHECK(runs_off == 0);
+}
+
+int main()
+{
+    if (sem_init(&gate, 0, 0) < 0 || router_init(&router) < 0
+        || router_add_offloaded(&router, METHOD_GET, "/o/:id", handle_offloaded) < 0
+        || router_add_offloaded(&router, METHOD_GET, "/block/:id", handle_blocking) < 0
+        || router_add_offloaded(&router, METHOD_GET, "/race/:id", handle_race) < 0
+        || router_add(&router, METHOD_GET, "/stall", handle_stall) < 0
+        || router_add(&router, METHOD_GET, "/mark/:id", handle_mark) < 0) {
+        return 1;
+    }
+
+    const char *backends[] = { "epoll", "io_uring" };
+    for (size_t b = 0; b < sizeof(backends) / sizeof(backends[0]); b++) {
+        // Workers run until the process exits, the pool is started afresh
+        // for each set of them
+        static ServerConfig config;
+        init_server_config(&config);
+        config.port = 0;
+        config.backend = backends[b];
+        config.handler = handle_request;
+        config.metrics_path = NULL;
+        config.offload_threads = 1;
+        config.offload_queue = SMALL_QUEUE;
+        if (offload_start(config.offload_threads, 2) < 0) {
+            return 1;
+        }
+        Worker *worker, *other;
+        int port = start_test_worker(&config, 0, &worker);
+        if (port < 0) {
+            // io_uring may not be available here
+            offload_stop();
+            continue;
+        }
+        int other_port = start_test_worker(&config, 1, &other);
+        CHECK(other_port > 0);
+        // Twice, so the ring wraps
+        test_order(worker, port, 0);
+        test_order(worker, port, 1);
+        if (other_port > 0) {
+            test_stealing(other_port);
+        }
+        offload_stop();
+
+        config.offload_threads = RACE_THREADS;
+        config.offload_queue = RACE_QUEUE;
+        if (offload_start(config.offload_threads, 1) < 0) {
+            return 1;
+        }
+        port = start_test_worker(&config, 0, &worker);
+        CHECK(port > 0);
+        if (port > 0) {
+            test_overtaking(port);
+            test_claim_race(port);
+        }
+        offload_stop();
+    }
+    return TEST_RESULT();
+}
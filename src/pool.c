@@ -0,0 +1,179 @@
+#include "pool.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define ARENA_ALIGN 16
+
+// Objects have to be able to hold the freelist link
+void slab_pool_init(SlabPool *pool, size_t obj_size, size_t objs_per_slab)
+{
+    size_t align = sizeof(void *);
+    if (obj_size < sizeof(void *)) {
+        obj_size = sizeof(void *);
+    }
+    pool->obj_size = (obj_size + align - 1) & ~(align - 1);
+    pool->objs_per_slab = objs_per_slab;
+    pool->free_list = NULL;
+    pool->slabs = NULL;
+}
+
+// Frees every slab, including objects that are still handed out
+void slab_pool_destroy(SlabPool *pool)
+{
+    while (pool->slabs) {
+        void *next = *(void **)pool->slabs;
+        free(pool->slabs);
+        pool->slabs = next;
+    }
+    pool->free_list = NULL;
+}
+
+void *slab_alloc(SlabPool *pool)
+{
+    if (!pool->free_list) {
+        // The first object slot of a slab holds the link to the next slab
+        char *slab = malloc(pool->obj_size * (pool->objs_per_slab + 1));
+        if (!slab) {
+            perror("malloc failed");
+            return NULL;
+        }
+        *(void **)slab = pool->slabs;
+        pool->slabs = slab;
+
+        for (size_t i = pool->objs_per_slab; i > 0; i--) {
+            void *obj = slab + i * pool->obj_size;
+            *(void **)obj = pool->free_list;
+            pool->free_list = obj;
+        }
+    }
+
+    void *obj = pool->free_list;
+    pool->free_list = *(void **)obj;
+    return obj;
+}
+
+void slab_free(SlabPool *pool, void *obj)
+{
+    *(void **)obj = pool->free_list;
+    pool->free_list = obj;
+}
+
+void buffer_pool_init(BufferPool *pool)
+{
+    for (size_t i = 0; i < BUFFER_CLASSES; i++) {
+        pool->free_lists[i] = NULL;
+        pool->num_free[i] = 0;
+    }
+}
+
+void buffer_pool_destroy(BufferPool *pool)
+{
+    for (size_t i = 0; i < BUFFER_CLASSES; i++) {
+        while (pool->free_lists[i]) {
+            void *next = *(void **)pool->free_lists[i];
+            free(pool->free_lists[i]);
+            pool->free_lists[i] = next;
+        }
+        pool->num_free[i] = 0;
+    }
+}
+
+// Smallest buffer size that can hold min_size bytes
+size_t buffer_size_for(size_t min_size)
+{
+    size_t size = (size_t)1 << BUFFER_MIN_SHIFT;
+    while (size < min_size) {
+        size *= 2;
+    }
+    return size;
+}
+
+static inline int buffer_class(size_t size)
+{
+    return __builtin_ctzl(size) - BUFFER_MIN_SHIFT;
+}
+
+/**
+ * Get a buffer of at least min_size bytes
+ * @param pool Pool to take the buffer from
+ * @param min_size Bytes needed
+ * @param size Set to the size of the buffer, which is what has to be passed
+ * back to buffer_free
+ * @return The buffer, or NULL if memory ran out
+ */
+char *buffer_alloc(BufferPool *pool, size_t min_size, size_t *size)
+{
+    *size = buffer_size_for(min_size);
+    if (*size <= BUFFER_MAX_SIZE) {
+        int class = buffer_class(*size);
+        char *buf = pool->free_lists[class];
+        if (buf) {
+            pool->free_lists[class] = *(void **)buf;
+            pool->num_free[class]--;
+            return buf;
+        }
+    }
+
+    char *buf = malloc(*size);
+    if (!buf) {
+        perror("malloc failed");
+    }
+    return buf;
+}
+
+void buffer_free(BufferPool *pool, char *buf, size_t size)
+{
+    if (!buf) {
+        return;
+    }
+
+    if (size > BUFFER_MAX_SIZE || pool->num_free[buffer_class(size)] == BUFFER_MAX_FREE) {
+        free(buf);
+        return;
+    }
+
+    int class = buffer_class(size);
+    *(void **)buf = pool->free_lists[class];
+    pool->free_lists[class] = buf;
+    pool->num_free[class]++;
+}
+
+void arena_init(Arena *arena, BufferPool *pool)
+{
+    arena->pool = pool;
+    arena->blocks = NULL;
+}
+
+// Memory aligned for any type, valid until the next arena_reset
+void *arena_alloc(Arena *arena, size_t size)
+{
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+    ArenaBlock *block = arena->blocks;
+    if (!block || block->size - block->used < size) {
+        size_t header = (sizeof(ArenaBlock) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+        size_t block_size;
+        size_t min_size = header + size > ARENA_BLOCK_SIZE ? header + size : ARENA_BLOCK_SIZE;
+        block = (ArenaBlock *)buffer_alloc(arena->pool, min_size, &block_size);
+        if (!block) {
+            return NULL;
+        }
+        block->next = arena->blocks;
+        block->size = block_size;
+        block->used = header;
+        arena->blocks = block;
+    }
+
+    void *ptr = (char *)block + block->used;
+    block->used += size;
+    return ptr;
+}
+
+void arena_reset(Arena *arena)
+{
+    while (arena->blocks) {
+        ArenaBlock *next = arena->blocks->next;
+        buffer_free(arena->pool, (char *)arena->blocks, arena->blocks->size);
+        arena->blocks = next;
+    }
+}
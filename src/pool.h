@@ -0,0 +1,60 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Buffers come in power of two classes from 1 KB to 64 KB, bigger ones go
+// straight to malloc
+#define BUFFER_MIN_SHIFT 10
+#define BUFFER_CLASSES 7
+#define BUFFER_MAX_SIZE ((size_t)1 << (BUFFER_MIN_SHIFT + BUFFER_CLASSES - 1))
+// Free buffers kept per class, anything past this is given back to malloc
+#define BUFFER_MAX_FREE 1024
+
+#define ARENA_BLOCK_SIZE 4096
+
+// Fixed size objects carved out of larger slabs. Freed objects go on an
+// intrusive freelist and are handed out again before a new slab is allocated
+typedef struct SlabPool {
+    size_t obj_size;
+    size_t objs_per_slab;
+    void *free_list;
+    void *slabs; // Every slab, chained through its first word
+} SlabPool;
+
+// Per class freelists of buffers, chained through their first word
+typedef struct BufferPool {
+    void *free_lists[BUFFER_CLASSES];
+    size_t num_free[BUFFER_CLASSES];
+} BufferPool;
+
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t size; // Including this header
+    size_t used;
+} ArenaBlock;
+
+// Bump allocator for memory that lives as long as a request. Blocks come
+// from a buffer pool and all go back to it at once on reset
+typedef struct Arena {
+    BufferPool *pool;
+    ArenaBlock *blocks; // Current block first
+} Arena;
+
+extern void slab_pool_init(SlabPool *pool, size_t obj_size, size_t objs_per_slab);
+extern void slab_pool_destroy(SlabPool *pool);
+extern void *slab_alloc(SlabPool *pool);
+extern void slab_free(SlabPool *pool, void *obj);
+
+extern void buffer_pool_init(BufferPool *pool);
+extern void buffer_pool_destroy(BufferPool *pool);
+extern size_t buffer_size_for(size_t min_size);
+extern char *buffer_alloc(BufferPool *pool, size_t min_size, size_t *size);
+extern void buffer_free(BufferPool *pool, char *buf, size_t size);
+
+extern void arena_init(Arena *arena, BufferPool *pool);
+extern void *arena_alloc(Arena *arena, size_t size);
+extern void arena_reset(Arena *arena);
+
+#endif // POOL_H
@@ -0,0 +1,348 @@
+#include "pool.h"
+#include "response.h"
+#include "server.h"
+#include "test.h"
+#include "worker.h"
+#include <netinet/in.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define WARMUP_REQUESTS 1000
+#define MEASURED_REQUESTS 5000
+#define PIPELINE_DEPTH 8
+#define REQUEST "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n"
+
+static atomic_size_t alloc_calls;
+
+#ifdef __SANITIZE_ADDRESS__
+// The sanitizer owns malloc in test builds, it calls these for every block.
+// Declared here, from sanitizer/allocator_interface.h, which is not always installed
+extern int __sanitizer_install_malloc_and_free_hooks(
+    void (*malloc_hook)(const volatile void *ptr, size_t size), void (*free_hook)(const volatile void *ptr));
+
+static void count_malloc(const volatile void *ptr, size_t size)
+{
+    (void)ptr;
+    (void)size;
+    atomic_fetch_add_explicit(&alloc_calls, 1, memory_order_relaxed);
+}
+
+static void count_free(const volatile void *ptr)
+{
+    (void)ptr;
+    atomic_fetch_add_explicit(&alloc_calls, 1, memory_order_relaxed);
+}
+
+static void count_allocations(void)
+{
+    __sanitizer_install_malloc_and_free_hooks(count_malloc, count_free);
+}
+#else
+// Count every call into the allocator by interposing on glibc's
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+void *malloc(size_t size)
+{
+    atomic_fetch_add_explicit(&alloc_calls, 1, memory_order_relaxed);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    atomic_fetch_add_explicit(&alloc_calls, 1, memory_order_relaxed);
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    atomic_fetch_add_explicit(&alloc_calls, 1, memory_order_relaxed);
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr)
+{
+    if (ptr) {
+        atomic_fetch_add_explicit(&alloc_calls, 1, memory_order_relaxed);
+    }
+    __libc_free(ptr);
+}
+
+static void count_allocations(void)
+{
+}
+#endif
+
+// Freed objects are handed out again, most recent first
+static void test_slab_pool(void)
+{
+    SlabPool pool;
+    slab_pool_init(&pool, 3, 4);
+    CHECK(pool.obj_size == sizeof(void *));
+
+    void *objs[9];
+    for (int i = 0; i < 9; i++) {
+        objs[i] = slab_alloc(&pool);
+        CHECK(objs[i] != NULL);
+        CHECK((uintptr_t)objs[i] % sizeof(void *) == 0);
+        for (int j = 0; j < i; j++) {
+            CHECK(objs[i] != objs[j]);
+        }
+    }
+    slab_free(&pool, objs[2]);
+    slab_free(&pool, objs[7]);
+    size_t before = atomic_load(&alloc_calls);
+    CHECK(slab_alloc(&pool) == objs[7]);
+    CHECK(slab_alloc(&pool) == objs[2]);
+    CHECK(atomic_load(&alloc_calls) == before);
+    slab_pool_destroy(&pool);
+}
+
+static void test_buffer_pool(void)
+{
+    CHECK(buffer_size_for(0) == 1024);
+    CHECK(buffer_size_for(1024) == 1024);
+    CHECK(buffer_size_for(1025) == 2048);
+    CHECK(buffer_size_for(BUFFER_MAX_SIZE) == BUFFER_MAX_SIZE);
+    CHECK(buffer_size_for(BUFFER_MAX_SIZE + 1) == BUFFER_MAX_SIZE * 2);
+
+    BufferPool pool;
+    buffer_pool_init(&pool);
+    size_t size;
+    char *buf = buffer_alloc(&pool, 3000, &size);
+    CHECK(buf != NULL && size == 4096);
+    buffer_free(&pool, buf, size);
+    CHECK(pool.num_free[2] == 1);
+
+    // Reused for any request in the same class, and only that class
+    size_t before = atomic_load(&alloc_calls);
+    CHECK(buffer_alloc(&pool, 2049, &size) == buf && size == 4096);
+    CHECK(atomic_load(&alloc_calls) == before);
+    CHECK(pool.num_free[2] == 0);
+    char *small = buffer_alloc(&pool, 10, &size);
+    CHECK(small != buf && size == 1024);
+    buffer_free(&pool, small, size);
+    buffer_free(&pool, buf, 4096);
+
+    // Bigger than any class, never kept
+    char *big = buffer_alloc(&pool, BUFFER_MAX_SIZE + 1, &size);
+    CHECK(big != NULL && size == BUFFER_MAX_SIZE * 2);
+    buffer_free(&pool, big, size);
+    for (int i = 0; i < BUFFER_CLASSES; i++) {
+        CHECK(pool.num_free[i] == (i == 0 || i == 2));
+    }
+    buffer_pool_destroy(&pool);
+}
+
+// Allocations are aligned, spill into new blocks and all go back on reset
+static void test_arena(void)
+{
+    BufferPool pool;
+    buffer_pool_init(&pool);
+    Arena arena;
+    arena_init(&arena, &pool);
+
+    char *prev = NULL;
+    for (int i = 0; i < 1000; i++) {
+        char *ptr = arena_alloc(&arena, 1 + i % 37);
+        CHECK(ptr != NULL);
+        CHECK((uintptr_t)ptr % 16 == 0);
+        CHECK(ptr != prev);
+        memset(ptr, i, 1 + i % 37);
+        prev = ptr;
+    }
+    char *large = arena_alloc(&arena, 3 * ARENA_BLOCK_SIZE);
+    CHECK(large != NULL);
+    memset(large, 0, 3 * ARENA_BLOCK_SIZE);
+    size_t blocks = 0;
+    for (ArenaBlock *block = arena.blocks; block; block = block->next) {
+        blocks++;
+    }
+    CHECK(blocks > 2);
+
+    arena_reset(&arena);
+    CHECK(arena.blocks == NULL);
+    size_t kept = 0;
+    for (int i = 0; i < BUFFER_CLASSES; i++) {
+        kept += pool.num_free[i];
+    }
+    CHECK(kept == blocks);
+
+    // A second round of the same work is served from the pool alone
+    size_t before = atomic_load(&alloc_calls);
+    for (int i = 0; i < 1000; i++) {
+        arena_alloc(&arena, 1 + i % 37);
+    }
+    arena_alloc(&arena, 3 * ARENA_BLOCK_SIZE);
+    CHECK(atomic_load(&alloc_calls) == before);
+    arena_reset(&arena);
+    buffer_pool_destroy(&pool);
+}
+
+// Answers with a body built in the request arena, so arena reuse is covered
+static void handle_request(ClientInfo *client, RequestOrError *req_or_err)
+{
+    static const char greeting[] = "Hello, World!";
+    Response res = { 0 };
+    res.status = req_or_err->has_error ? STATUS_BAD_REQUEST : STATUS_OK;
+    res.content_type = CONTENT_TYPE_PLAINTEXT;
+    res.content_len = sizeof(greeting) - 1;
+    res.content_body = client_alloc(client, res.content_len);
+    if (!res.content_body) {
+        client->state = CLIENT_DONE;
+        return;
+    }
+    memcpy(res.content_body, greeting, res.content_len);
+    write_response(client, &res);
+}
+
+static int connect_to(int port)
+{
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port) };
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("connect failed");
+        exit(1);
+    }
+    return fd;
+}
+
+// Read until count responses, each ending in the greeting, have arrived
+static void read_responses(int fd, int count)
+{
+    static const char tail[] = "Hello, World!";
+    char buf[16384];
+    size_t match = 0;
+    while (count > 0) {
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n <= 0) {
+            fprintf(stderr, "connection lost\n");
+            exit(1);
+        }
+        for (ssize_t i = 0; i < n; i++) {
+            match = buf[i] == tail[match] ? match + 1 : buf[i] == tail[0];
+            if (match == sizeof(tail) - 1) {
+                count--;
+                match = 0;
+            }
+        }
+    }
+}
+
+static void send_all(int fd, const char *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n <= 0) {
+            perror("send failed");
+            exit(1);
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+// Sequential requests on one keep-alive connection
+static void run_keep_alive(int port, int requests)
+{
+    int fd = connect_to(port);
+    for (int i = 0; i < requests; i++) {
+        send_all(fd, REQUEST, sizeof(REQUEST) - 1);
+        read_responses(fd, 1);
+    }
+    close(fd);
+}
+
+// Batches of pipelined requests on one connection
+static void run_pipelined(int port, int requests)
+{
+    static char batch[(sizeof(REQUEST) - 1) * PIPELINE_DEPTH];
+    for (int i = 0; i < PIPELINE_DEPTH; i++) {
+        memcpy(batch + i * (sizeof(REQUEST) - 1), REQUEST, sizeof(REQUEST) - 1);
+    }
+
+    int fd = connect_to(port);
+    for (int i = 0; i < requests; i += PIPELINE_DEPTH) {
+        send_all(fd, batch, sizeof(batch));
+        read_responses(fd, PIPELINE_DEPTH);
+    }
+    close(fd);
+}
+
+// A new connection for every request
+static void run_connection_per_request(int port, int requests)
+{
+    for (int i = 0; i < requests; i++) {
+        int fd = connect_to(port);
+        send_all(fd, REQUEST, sizeof(REQUEST) - 1);
+        read_responses(fd, 1);
+        close(fd);
+    }
+}
+
+// Once warmed up, a worker serves requests without calling the allocator
+static void test_steady_load(void)
+{
+    const char *backends[] = { "epoll", "io_uring" };
+    const struct {
+        const char *name;
+        void (*run)(int port, int requests);
+        int requests;
+    } scenarios[] = {
+        { "keep-alive", run_keep_alive, MEASURED_REQUESTS },
+        { "pipelined", run_pipelined, MEASURED_REQUESTS },
+        { "conn/request", run_connection_per_request, MEASURED_REQUESTS / 10 },
+    };
+
+    for (size_t b = 0; b < sizeof(backends) / sizeof(char *); b++) {
+        static ServerConfig config;
+        init_server_config(&config);
+        config.port = 0;
+        config.backlog = 128;
+        config.backend = backends[b];
+        config.handler = handle_request;
+
+        // Workers run until the process exits
+        Worker *worker = create_worker(&config, b, -1);
+        if (!worker) {
+            // io_uring may not be available here
+            continue;
+        }
+        struct sockaddr_in addr;
+        socklen_t addr_len = sizeof(addr);
+        getsockname(worker->listen_handle.fd, (struct sockaddr *)&addr, &addr_len);
+        int port = ntohs(addr.sin_port);
+        CHECK(start_worker(worker) >= 0);
+
+        for (size_t s = 0; s < sizeof(scenarios) / sizeof(scenarios[0]); s++) {
+            // Let pools and stdio buffers reach their steady state first
+            scenarios[s].run(port, WARMUP_REQUESTS);
+
+            size_t before = atomic_load(&alloc_calls);
+            scenarios[s].run(port, scenarios[s].requests);
+            size_t calls = atomic_load(&alloc_calls) - before;
+            if (calls > 0) {
+                fprintf(stderr, "%s %s: %zu allocator calls for %d requests\n", backends[b], scenarios[s].name,
+                    calls, scenarios[s].requests);
+            }
+            CHECK(calls == 0);
+        }
+    }
+}
+
+int main()
+{
+    count_allocations();
+    test_slab_pool();
+    test_buffer_pool();
+    test_arena();
+    test_steady_load();
+    return TEST_RESULT();
+}
@@ -0,0 +1,1346 @@
+#define _GNU_SOURCE
+#include "proxy.h"
+#include "http_utils.h"
+#include "request_body.h"
+#include "response.h"
+#include "worker.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define UPSTREAM_BUFFER_SIZE (16 * 1024) // Largest response head, then the size of chunked body reads
+#define SPLICE_CHUNK (64 * 1024) // A default pipe's capacity
+#define CHUNK_FRAMING_LEN 32 // Size line and CRLFs around a re-chunked fragment
+
+typedef enum ExchangePhase {
+    PHASE_IDLE, // In the pool, or between exchanges
+    PHASE_HEAD, // Waiting for the response's status line and headers
+    PHASE_LENGTH, // Body with a Content-Length, spliced through
+    PHASE_CHUNKED, // Chunked body, read to find where it ends
+    PHASE_UNTIL_CLOSE, // Body that ends when the backend closes, spliced through
+} ExchangePhase;
+
+// Response bodies are spliced from the backend into this and from here to
+// the client. The bytes in it belong to the queued output entry until it
+// is released, which can come after the connection is gone
+typedef struct ProxyPipe {
+    int fds[2];
+    bool queued; // An output entry still has to send what's in it
+    bool orphaned; // The connection let go of it, close once released
+} ProxyPipe;
+
+// A connection to a backend, reused for one exchange after another
+typedef struct UpstreamConn {
+    EventHandle handle; // Must be first
+    ProxyPool *pool;
+    Upstream *upstream;
+    struct UpstreamConn *idle_next;
+    struct UpstreamConn *prev; // Neighbours in the pool's list of every connection
+    struct UpstreamConn *next;
+    Timer timer; // The backend taking too long, or idle for too long
+    ProxyPipe *pipe;
+    bool connecting; // Non-blocking connect not finished yet
+    bool write_waiting; // Asked for EVENT_WRITABLE
+    bool reused; // Came from the idle pool, so the backend may have closed it since
+    bool closed; // Removed from the loop, waiting for EVENT_CLOSED
+    // The exchange in progress, client is NULL while there is none
+    ClientInfo *client;
+    ExchangePhase phase;
+    bool streamed; // The request body comes through the body callback
+    bool rechunk; // Streamed body is sent chunked, as it arrived
+    bool body_complete; // Every request byte is in send_buf or sent
+    bool head_request; // The response has no body, whatever its headers say
+    bool idempotent; // The request may be sent again, see is_idempotent
+    bool request_written; // Some of the request has reached the backend
+    bool decode_chunks; // HTTP/1.0 client, a chunked body is forwarded decoded
+    bool keep_alive; // The backend keeps the connection open after the response
+    bool responded; // Part of the response is queued on the client
+    bool waiting; // Stopped until the client takes more output
+    char *send_buf; // Request head, then streamed body bytes not sent yet
+    size_t send_size;
+    size_t send_len;
+    size_t send_off;
+    size_t body_offset; // Buffered request body, from the client's buf_start
+    size_t body_len;
+    size_t body_off; // Sent so far
+    char *buf; // Response head, then chunked body reads
+    size_t buf_size;
+    size_t buf_used;
+    uint64_t remaining; // Body bytes still to come in PHASE_LENGTH
+    ChunkedDecoder chunks;
+} UpstreamConn;
+
+static const char BAD_GATEWAY_BODY[] = "Bad Gateway";
+static const char GATEWAY_TIMEOUT_BODY[] = "Gateway Timeout";
+
+// Headers that only describe one hop, the proxy frames each side itself
+static const char *const HOP_BY_HOP_HEADERS[] = {
+    "Connection",
+    "Keep-Alive",
+    "Proxy-Connection",
+    "TE",
+    "Trailer",
+    "Transfer-Encoding",
+    "Upgrade",
+};
+
+static void on_upstream_event(EventLoop *loop, EventHandle *handle, const Event *event);
+static void on_upstream_timeout(Timer *timer);
+static bool send_request(UpstreamConn *conn);
+
+/**
+ * Resolve a comma separated list of backends, each host:port or
+ * unix:/path. Hosts are resolved once, here
+ * @param spec The list, split in place
+ * @param addresses Filled in with the backends
+ * @param max Room in addresses
+ * @return Number of backends, or -1 if one is invalid or there are too many
+ */
+int parse_upstreams(char *spec, UpstreamAddress *addresses, size_t max)
+{
+    size_t count = 0;
+    char *save = NULL;
+    for (char *item = strtok_r(spec, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+        if (count == max) {
+            return -1;
+        }
+        UpstreamAddress *address = &addresses[count];
+        memset(address, 0, sizeof(*address));
+        snprintf(address->name, sizeof(address->name), "%s", item);
+
+        if (strncmp(item, "unix:", 5) == 0) {
+            struct sockaddr_un *un = (struct sockaddr_un *)&address->addr;
+            const char *path = item + 5;
+            if (path[0] == '\0' || strlen(path) >= sizeof(un->sun_path)) {
+                return -1;
+            }
+            un->sun_family = AF_UNIX;
+            strcpy(un->sun_path, path);
+            address->addr_len = sizeof(*un);
+            count++;
+            continue;
+        }
+
+        // host:port, with IPv6 hosts in brackets
+        char *colon = strrchr(item, ':');
+        if (!colon || colon == item || colon[1] == '\0') {
+            return -1;
+        }
+        *colon = '\0';
+        char *host = item;
+        if (host[0] == '[' && colon[-1] == ']') {
+            host++;
+            colon[-1] = '\0';
+        }
+        struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+        struct addrinfo *result;
+        int err = getaddrinfo(host, colon + 1, &hints, &result);
+        if (err != 0) {
+            fprintf(stderr, "Failed to resolve %s: %s\n", address->name, gai_strerror(err));
+            return -1;
+        }
+        memcpy(&address->addr, result->ai_addr, result->ai_addrlen);
+        address->addr_len = result->ai_addrlen;
+        freeaddrinfo(result);
+        count++;
+    }
+    return count > 0 ? (int)count : -1;
+}
+
+void proxy_pool_init(ProxyPool *pool, Worker *worker)
+{
+    const ServerConfig *config = worker->config;
+    memset(pool, 0, sizeof(*pool));
+    pool->worker = worker;
+    pool->prefix = config->proxy_prefix;
+    pool->prefix_len = config->proxy_prefix ? strlen(config->proxy_prefix) : 0;
+    pool->num_upstreams = config->num_proxy_upstreams;
+    for (size_t i = 0; i < pool->num_upstreams; i++) {
+        pool->upstreams[i].address = &config->proxy_upstreams[i];
+    }
+    pool->max_idle = config->proxy_idle_connections;
+    pool->timeout_ms = config->proxy_timeout_ms;
+}
+
+static void close_pipe(ProxyPipe *pipe)
+{
+    close(pipe->fds[0]);
+    close(pipe->fds[1]);
+    free(pipe);
+}
+
+// Output release callback, the pipe has been drained or dropped
+static void release_pipe(void *data)
+{
+    ProxyPipe *pipe = data;
+    pipe->queued = false;
+    if (pipe->orphaned) {
+        close_pipe(pipe);
+    }
+}
+
+static void drop_pipe(UpstreamConn *conn)
+{
+    if (!conn->pipe) {
+        return;
+    }
+    if (conn->pipe->queued) {
+        conn->pipe->orphaned = true;
+    } else {
+        close_pipe(conn->pipe);
+    }
+    conn->pipe = NULL;
+}
+
+static void free_exchange_buffers(UpstreamConn *conn)
+{
+    BufferPool *buffers = &conn->pool->worker->buffers;
+    if (conn->send_buf) {
+        buffer_free(buffers, conn->send_buf, conn->send_size);
+        conn->send_buf = NULL;
+        conn->send_size = 0;
+    }
+    if (conn->buf) {
+        buffer_free(buffers, conn->buf, conn->buf_size);
+        conn->buf = NULL;
+        conn->buf_size = 0;
+    }
+    conn->send_len = 0;
+    conn->send_off = 0;
+    conn->body_len = 0;
+    conn->body_off = 0;
+    conn->buf_used = 0;
+}
+
+static void free_conn(UpstreamConn *conn)
+{
+    ProxyPool *pool = conn->pool;
+    if (conn->prev) {
+        conn->prev->next = conn->next;
+    } else {
+        pool->conns = conn->next;
+    }
+    if (conn->next) {
+        conn->next->prev = conn->prev;
+    }
+    drop_pipe(conn);
+    free_exchange_buffers(conn);
+    close(conn->handle.fd);
+    free(conn);
+}
+
+// Only for connections that are neither idle nor in an exchange
+static void close_conn(UpstreamConn *conn)
+{
+    EventLoop *loop = conn->pool->worker->loop;
+    timer_cancel(&loop->timers, &conn->timer);
+    if (event_loop_remove(loop, &conn->handle) > 0) {
+        // Freed on EVENT_CLOSED, once the loop's operations are done with it
+        conn->closed = true;
+        return;
+    }
+    free_conn(conn);
+}
+
+void proxy_pool_destroy(ProxyPool *pool)
+{
+    // The loop is going away, connections still waiting for EVENT_CLOSED included
+    while (pool->conns) {
+        free_conn(pool->conns);
+    }
+    for (size_t i = 0; i < pool->num_upstreams; i++) {
+        pool->upstreams[i].idle = NULL;
+        pool->upstreams[i].num_idle = 0;
+    }
+}
+
+static UpstreamConn *connect_upstream(ProxyPool *pool, Upstream *upstream)
+{
+    const UpstreamAddress *address = upstream->address;
+    int fd = socket(address->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("socket failed");
+        return NULL;
+    }
+    if (address->addr.ss_family != AF_UNIX) {
+        // Request heads go out in one write, Nagle would only delay them
+        int opt = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+    }
+
+    bool connecting = false;
+    if (connect(fd, (struct sockaddr *)&address->addr, address->addr_len) < 0) {
+        if (errno != EINPROGRESS) {
+            fprintf(stderr, "Failed to connect to %s: %s\n", address->name, strerror(errno));
+            close(fd);
+            return NULL;
+        }
+        connecting = true;
+    }
+
+    UpstreamConn *conn = calloc(1, sizeof(UpstreamConn));
+    if (!conn) {
+        close(fd);
+        return NULL;
+    }
+    conn->handle.fd = fd;
+    conn->handle.callback = on_upstream_event;
+    conn->pool = pool;
+    conn->upstream = upstream;
+    conn->connecting = connecting;
+    timer_init(&conn->timer, on_upstream_timeout, conn);
+
+    EventLoop *loop = pool->worker->loop;
+    if (event_loop_add(loop, &conn->handle, EVENT_READABLE) < 0) {
+        perror("Failed to watch upstream connection");
+        close(fd);
+        free(conn);
+        return NULL;
+    }
+    conn->next = pool->conns;
+    if (pool->conns) {
+        pool->conns->prev = conn;
+    }
+    pool->conns = conn;
+
+    // Connecting is done once the socket is writable. Once added, the loop
+    // may have an operation armed on the handle, so it is closed like any
+    // other connection rather than freed here
+    if (connecting && event_loop_wait_writable(loop, &conn->handle) < 0) {
+        perror("Failed to watch upstream connection");
+        close_conn(conn);
+        return NULL;
+    }
+    conn->write_waiting = connecting;
+    metrics_add(&pool->worker->metrics.proxy_connects, 1);
+    return conn;
+}
+
+// The backend with the fewest requests in progress. Ties go to whichever
+// comes first from a starting point that moves on every pick, so idle
+// backends are used in turn
+static Upstream *pick_upstream(ProxyPool *pool)
+{
+    Upstream *best = NULL;
+    for (size_t i = 0; i < pool->num_upstreams; i++) {
+        Upstream *upstream = &pool->upstreams[(pool->next + i) % pool->num_upstreams];
+        if (!best || upstream->outstanding < best->outstanding) {
+            best = upstream;
+        }
+    }
+    pool->next = (pool->next + 1) % pool->num_upstreams;
+    return best;
+}
+
+static UpstreamConn *take_idle(Upstream *upstream)
+{
+    UpstreamConn *conn = upstream->idle;
+    if (conn) {
+        upstream->idle = conn->idle_next;
+        upstream->num_idle--;
+        conn->idle_next = NULL;
+        conn->reused = true;
+        timer_cancel(&conn->pool->worker->loop->timers, &conn->timer);
+    }
+    return conn;
+}
+
+static void remove_idle(UpstreamConn *conn)
+{
+    Upstream *upstream = conn->upstream;
+    for (UpstreamConn **link = &upstream->idle; *link; link = &(*link)->idle_next) {
+        if (*link == conn) {
+            *link = conn->idle_next;
+            upstream->num_idle--;
+            conn->idle_next = NULL;
+            return;
+        }
+    }
+}
+
+// Back into the pool after a clean exchange, or closed if the pool is full
+static void make_idle(UpstreamConn *conn)
+{
+    Upstream *upstream = conn->upstream;
+    ProxyPool *pool = conn->pool;
+    if (upstream->num_idle >= pool->max_idle) {
+        close_conn(conn);
+        return;
+    }
+    conn->phase = PHASE_IDLE;
+    conn->idle_next = upstream->idle;
+    upstream->idle = conn;
+    upstream->num_idle++;
+    if (pool->timeout_ms > 0) {
+        timer_schedule(&pool->worker->loop->timers, &conn->timer, pool->timeout_ms);
+    }
+}
+
+static void attach_exchange(UpstreamConn *conn, ClientInfo *client)
+{
+    conn->client = client;
+    client->upstream = conn;
+    conn->upstream->outstanding++;
+    conn->phase = PHASE_HEAD;
+    conn->buf_used = 0;
+    conn->responded = false;
+    conn->waiting = false;
+    conn->keep_alive = false;
+    conn->request_written = false;
+}
+
+static void detach_exchange(UpstreamConn *conn)
+{
+    conn->client->upstream = NULL;
+    conn->client = NULL;
+    conn->upstream->outstanding--;
+    conn->waiting = false;
+    free_exchange_buffers(conn);
+    timer_cancel(&conn->pool->worker->loop->timers, &conn->timer);
+}
+
+static bool request_pending(const UpstreamConn *conn)
+{
+    return conn->send_off < conn->send_len || conn->body_off < conn->body_len;
+}
+
+// Make room for len more bytes at the end of send_buf, dropping what was sent
+static bool reserve_send_buffer(UpstreamConn *conn, size_t len)
+{
+    if (conn->send_off > 0) {
+        memmove(conn->send_buf, conn->send_buf + conn->send_off, conn->send_len - conn->send_off);
+        conn->send_len -= conn->send_off;
+        conn->send_off = 0;
+    }
+    if (conn->send_len + len <= conn->send_size) {
+        return true;
+    }
+    BufferPool *buffers = &conn->pool->worker->buffers;
+    size_t new_size;
+    char *new_buf = buffer_alloc(buffers, conn->send_len + len, &new_size);
+    if (!new_buf) {
+        return false;
+    }
+    if (conn->send_buf) {
+        memcpy(new_buf, conn->send_buf, conn->send_len);
+        buffer_free(buffers, conn->send_buf, conn->send_size);
+    }
+    conn->send_buf = new_buf;
+    conn->send_size = new_size;
+    return true;
+}
+
+static void append_send(UpstreamConn *conn, const char *data, size_t len)
+{
+    memcpy(conn->send_buf + conn->send_len, data, len);
+    conn->send_len += len;
+}
+
+static StringView trim_value(const char *start, const char *end)
+{
+    while (start < end && (*start == ' ' || *start == '\t')) {
+        start++;
+    }
+    while (end > start && (end[-1] == ' ' || end[-1] == '\t')) {
+        end--;
+    }
+    return (StringView) { .data = start, .len = end - start };
+}
+
+// Methods a request can be repeated for without asking, RFC 9110 section
+// 9.2.2. Anything else the backend may have acted on is never sent twice
+static bool is_idempotent(RequestMethod method)
+{
+    return method != METHOD_POST && method != METHOD_PATCH;
+}
+
+static bool is_hop_by_hop(StringView name)
+{
+    for (size_t i = 0; i < sizeof(HOP_BY_HOP_HEADERS) / sizeof(HOP_BY_HOP_HEADERS[0]); i++) {
+        if (sv_equals_ignore_case(name, HOP_BY_HOP_HEADERS[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Whether a Connection header value names the header, which makes it hop-by-hop too
+static bool listed_in_connection(StringView name, const StringView *connection)
+{
+    if (!connection) {
+        return false;
+    }
+    const char *c = connection->data, *end = connection->data + connection->len;
+    while (c < end) {
+        while (c < end && (*c == ' ' || *c == '\t' || *c == ',')) {
+            c++;
+        }
+        const char *token = c;
+        while (c < end && *c != ',' && *c != ' ' && *c != '\t') {
+            c++;
+        }
+        StringView listed = { .data = token, .len = c - token };
+        if (listed.len == name.len && strncasecmp(listed.data, name.data, name.len) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// The request as the backend gets it: the same request line over HTTP/1.1,
+// the end-to-end headers as they came, and framing of our own
+static bool build_request(UpstreamConn *conn, ClientInfo *client, const Request *req)
+{
+    const char *start = client->buffer + client->buf_start;
+    const char *headers_end = start + client->headers_len - 2;
+    if (!reserve_send_buffer(conn, req->method_name.len + req->target.len + client->headers_len + 64)) {
+        return false;
+    }
+
+    append_send(conn, req->method_name.data, req->method_name.len);
+    append_send(conn, " ", 1);
+    append_send(conn, req->target.data, req->target.len);
+    append_send(conn, " HTTP/1.1\r\n", sizeof(" HTTP/1.1\r\n") - 1);
+
+    // The parser already checked every line ends in CRLF and has a colon
+    const StringView *connection = request_header(req, HEADER_CONNECTION);
+    const char *line = (const char *)memchr(start, '\n', headers_end - start) + 1;
+    while (line < headers_end) {
+        const char *next = (const char *)memchr(line, '\n', headers_end - line) + 1;
+        const char *colon = memchr(line, ':', next - line);
+        StringView name = { .data = line, .len = colon - line };
+        if (!is_hop_by_hop(name) && !sv_equals_ignore_case(name, "Content-Length")
+            && !sv_equals_ignore_case(name, "Expect") && !listed_in_connection(name, connection)) {
+            append_send(conn, line, next - line);
+        }
+        line = next;
+    }
+
+    char framing[64];
+    int framing_len = 0;
+    if (conn->streamed) {
+        framing_len = conn->rechunk ? snprintf(framing, sizeof(framing), "Transfer-Encoding: chunked\r\n")
+                                    : snprintf(framing, sizeof(framing), "Content-Length: %zu\r\n", req->content_len);
+    } else if (req->body.len > 0 || req->chunked || request_header(req, HEADER_CONTENT_LENGTH)) {
+        framing_len = snprintf(framing, sizeof(framing), "Content-Length: %zu\r\n", req->body.len);
+    }
+    append_send(conn, framing, framing_len);
+    append_send(conn, "\r\n", 2);
+
+    // A buffered body is sent from the client's buffer, where it stays until
+    // the request is finished
+    conn->body_offset = req->body.data - start;
+    conn->body_len = conn->streamed ? 0 : req->body.len;
+    conn->body_off = 0;
+    return true;
+}
+
+// Write as much of the request as the backend takes. Returns false on errors
+static bool send_request(UpstreamConn *conn)
+{
+    ClientInfo *client = conn->client;
+    while (request_pending(conn)) {
+        struct iovec iov[2];
+        int count = 0;
+        if (conn->send_off < conn->send_len) {
+            iov[count++] = (struct iovec) { conn->send_buf + conn->send_off, conn->send_len - conn->send_off };
+        }
+        if (conn->body_off < conn->body_len) {
+            char *body = client->buffer + client->buf_start + conn->body_offset;
+            iov[count++] = (struct iovec) { body + conn->body_off, conn->body_len - conn->body_off };
+        }
+
+        struct msghdr msg = { .msg_iov = iov, .msg_iovlen = count };
+        ssize_t written = sendmsg(conn->handle.fd, &msg, MSG_NOSIGNAL);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                return false;
+            }
+            if (!conn->write_waiting) {
+                if (event_loop_wait_writable(conn->pool->worker->loop, &conn->handle) < 0) {
+                    return false;
+                }
+                conn->write_waiting = true;
+            }
+            return true;
+        }
+
+        conn->request_written = conn->request_written || written > 0;
+        size_t from_buf = conn->send_len - conn->send_off;
+        if ((size_t)written < from_buf) {
+            conn->send_off += written;
+        } else {
+            conn->send_off = conn->send_len;
+            conn->body_off += written - from_buf;
+        }
+    }
+
+    // The head is kept for a retry, streamed bytes are done with
+    if (conn->streamed) {
+        conn->send_off = 0;
+        conn->send_len = 0;
+    }
+    if (conn->handle.events & EVENT_WRITABLE) {
+        event_loop_modify(conn->pool->worker->loop, &conn->handle, EVENT_READABLE);
+        conn->write_waiting = false;
+    }
+    return true;
+}
+
+// Copy bytes read from the backend into request memory and queue them
+static bool queue_copy(ClientInfo *client, const char *data, size_t len)
+{
+    if (len == 0) {
+        return true;
+    }
+    char *copy = client_alloc(client, len);
+    if (!copy) {
+        return false;
+    }
+    memcpy(copy, data, len);
+    return queue_client_output(client, copy, len);
+}
+
+static void write_gateway_error(ClientInfo *client, HttpStatus status)
+{
+    Response res = { 0 };
+    res.status = status;
+    res.content_type = CONTENT_TYPE_PLAINTEXT;
+    if (status == STATUS_GATEWAY_TIMEOUT) {
+        res.content_body = (char *)GATEWAY_TIMEOUT_BODY;
+        res.content_len = sizeof(GATEWAY_TIMEOUT_BODY) - 1;
+    } else {
+        res.content_body = (char *)BAD_GATEWAY_BODY;
+        res.content_len = sizeof(BAD_GATEWAY_BODY) - 1;
+    }
+    write_response(client, &res);
+}
+
+// The response is all queued, the client moves on to its next request.
+// A streamed body that hasn't all arrived would have to be read to find
+// that request, so the connection closes instead
+static void finish_client(ClientInfo *client)
+{
+    if (client->state == CLIENT_UPSTREAM) {
+        client->state = CLIENT_READY;
+        finish_client_request(client, client->worker->loop);
+    } else if (client->state == CLIENT_BODY) {
+        client->keep_alive = false;
+        abort_request_body(client);
+    }
+}
+
+static void finish_exchange(UpstreamConn *conn)
+{
+    ClientInfo *client = conn->client;
+    bool reusable = conn->keep_alive && !request_pending(conn) && (!conn->streamed || conn->body_complete);
+    detach_exchange(conn);
+    if (reusable) {
+        make_idle(conn);
+    } else {
+        close_conn(conn);
+    }
+    finish_client(client);
+}
+
+// Move the exchange to a fresh connection to the same backend
+static bool retry_exchange(UpstreamConn *conn)
+{
+    UpstreamConn *fresh = connect_upstream(conn->pool, conn->upstream);
+    if (!fresh) {
+        return false;
+    }
+    ClientInfo *client = conn->client;
+    fresh->streamed = conn->streamed;
+    fresh->rechunk = conn->rechunk;
+    fresh->body_complete = conn->body_complete;
+    fresh->head_request = conn->head_request;
+    fresh->idempotent = conn->idempotent;
+    fresh->decode_chunks = conn->decode_chunks;
+    fresh->send_buf = conn->send_buf;
+    fresh->send_size = conn->send_size;
+    fresh->send_len = conn->send_len;
+    fresh->body_offset = conn->body_offset;
+    fresh->body_len = conn->body_len;
+    conn->send_buf = NULL;
+    conn->send_size = 0;
+    detach_exchange(conn);
+    close_conn(conn);
+
+    attach_exchange(fresh, client);
+    ProxyPool *pool = fresh->pool;
+    if (pool->timeout_ms > 0) {
+        timer_schedule(&pool->worker->loop->timers, &fresh->timer, pool->timeout_ms);
+    }
+    return fresh->connecting || send_request(fresh);
+}
+
+// Whether a request that failed can go to another connection. Only one the
+// backend can't have acted on, either none of it was written or doing it
+// twice is the same as doing it once
+static bool can_retry(const UpstreamConn *conn)
+{
+    return conn->idempotent || !conn->request_written;
+}
+
+// Give up on the exchange. Before any of the response is out the client
+// gets a 502 or 504, after that all that's left is cutting it short. A
+// reused connection that fails before the backend said anything was most
+// likely closed by the backend while idle, so a buffered request that is
+// safe to repeat is sent again on a fresh one
+static void fail_exchange(UpstreamConn *conn, HttpStatus status)
+{
+    ClientInfo *client = conn->client;
+    if (status == STATUS_BAD_GATEWAY && conn->reused && !conn->streamed && conn->phase == PHASE_HEAD
+        && conn->buf_used == 0 && can_retry(conn)) {
+        if (retry_exchange(conn)) {
+            return;
+        }
+        // The exchange moved even if the fresh connection failed
+        conn = client->upstream;
+    }
+
+    metrics_add(&client->worker->metrics.proxy_errors, 1);
+    bool responded = conn->responded;
+    detach_exchange(conn);
+    close_conn(conn);
+    if (responded) {
+        client->keep_alive = false;
+        if (client->state == CLIENT_BODY) {
+            abort_request_body(client);
+        }
+        client->state = CLIENT_DONE;
+        return;
+    }
+    write_gateway_error(client, status);
+    finish_client(client);
+}
+
+static ProxyPipe *conn_pipe(UpstreamConn *conn)
+{
+    if (!conn->pipe) {
+        ProxyPipe *pipe = calloc(1, sizeof(ProxyPipe));
+        if (!pipe) {
+            return NULL;
+        }
+        if (pipe2(pipe->fds, O_NONBLOCK | O_CLOEXEC) < 0) {
+            perror("pipe2 failed");
+            free(pipe);
+            return NULL;
+        }
+        conn->pipe = pipe;
+    }
+    return conn->pipe;
+}
+
+// "chunked" as the last coding means the body is chunked
+static bool is_chunked(StringView value)
+{
+    while (value.len > 0 && (value.data[value.len - 1] == ' ' || value.data[value.len - 1] == '\t')) {
+        value.len--;
+    }
+    return value.len >= 7 && strncasecmp(value.data + value.len - 7, "chunked", 7) == 0
+        && (value.len == 7 || value.data[value.len - 8] == ',' || value.data[value.len - 8] == ' ');
+}
+
+// Transfer-Encoding frames a response whatever its Content-Length says, RFC
+// 9112 section 6.3, so it is looked for before any header is forwarded and
+// a Content-Length beside it can be left out. Returns whether there is one,
+// and whether the last one ends in chunked
+static bool find_transfer_encoding(const char *line, const char *end, bool *chunked)
+{
+    bool found = false;
+    *chunked = false;
+    while (line < end) {
+        const char *next = memchr(line, '\n', end + 2 - line);
+        next = next ? next + 1 : end + 2;
+        const char *colon = memchr(line, ':', next - line);
+        if (colon && sv_equals_ignore_case((StringView) { .data = line, .len = colon - line }, "Transfer-Encoding")) {
+            found = true;
+            *chunked = is_chunked(trim_value(colon + 1, next[-2] == '\r' ? next - 2 : next - 1));
+        }
+        line = next;
+    }
+    return found;
+}
+
+static bool parse_content_length(StringView value, uint64_t *length)
+{
+    if (value.len == 0 || value.len > 18) {
+        return false;
+    }
+    uint64_t result = 0;
+    for (size_t i = 0; i < value.len; i++) {
+        if (value.data[i] < '0' || value.data[i] > '9') {
+            return false;
+        }
+        result = result * 10 + (value.data[i] - '0');
+    }
+    *length = result;
+    return true;
+}
+
+// Bytes of the body that came with the head or with a chunked read. Chunk
+// framing is forwarded as is to HTTP/1.1 clients and stripped for HTTP/1.0
+static bool forward_chunks(UpstreamConn *conn, const char *data, size_t len)
+{
+    ClientInfo *client = conn->client;
+    size_t used = 0;
+    while (used < len && conn->chunks.state != CHUNK_DONE) {
+        size_t consumed;
+        const char *run;
+        size_t run_len;
+        ChunkedResult result = chunked_decode(&conn->chunks, data + used, len - used, &consumed, &run, &run_len);
+        if (result == CHUNKED_ERROR) {
+            return false;
+        }
+        if (result == CHUNKED_DATA && conn->decode_chunks && !queue_copy(client, run, run_len)) {
+            return false;
+        }
+        used += consumed;
+        if (result == CHUNKED_MORE) {
+            break;
+        }
+    }
+    if (!conn->decode_chunks && !queue_copy(client, data, used)) {
+        return false;
+    }
+    if (conn->chunks.state == CHUNK_DONE) {
+        // Anything after the body wasn't asked for
+        if (used < len) {
+            conn->keep_alive = false;
+        }
+        finish_exchange(conn);
+    }
+    return true;
+}
+
+// Body bytes read along with the head
+static bool forward_body_start(UpstreamConn *conn, const char *data, size_t len)
+{
+    switch (conn->phase) {
+    case PHASE_CHUNKED:
+        return forward_chunks(conn, data, len);
+    case PHASE_UNTIL_CLOSE:
+        return queue_copy(conn->client, data, len);
+    case PHASE_LENGTH: {
+        size_t take = len < conn->remaining ? len : conn->remaining;
+        if (!queue_copy(conn->client, data, take)) {
+            return false;
+        }
+        conn->remaining -= take;
+        if (take < len) {
+            conn->keep_alive = false;
+        }
+        if (conn->remaining == 0) {
+            finish_exchange(conn);
+        }
+        return true;
+    }
+    default:
+        if (len > 0) {
+            conn->keep_alive = false;
+        }
+        finish_exchange(conn);
+        return true;
+    }
+}
+
+// Turn the backend's response head into the client's: the status line
+// over HTTP/1.1, its end-to-end headers and our own Connection line. Then
+// work out how the body is framed. Returns the head's length, 0 if it
+// isn't complete yet and -1 if it is invalid
+static ssize_t forward_response_head(UpstreamConn *conn)
+{
+    ClientInfo *client = conn->client;
+    const char *buf = conn->buf;
+    const char *end = find_headers_end(buf, conn->buf_used);
+    if (!end) {
+        return conn->buf_used == conn->buf_size ? -1 : 0;
+    }
+    size_t head_len = end + 4 - buf;
+
+    // "HTTP/1.x NNN reason"
+    const char *line_end = memchr(buf, '\n', head_len);
+    if (line_end - buf < 13 || memcmp(buf, "HTTP/1.", 7) != 0 || buf[8] != ' ' || buf[9] < '1' || buf[9] > '5'
+        || buf[10] < '0' || buf[10] > '9' || buf[11] < '0' || buf[11] > '9') {
+        return -1;
+    }
+    int status = (buf[9] - '0') * 100 + (buf[10] - '0') * 10 + (buf[11] - '0');
+    bool http_1_0 = buf[7] == '0';
+
+    // Interim responses are dropped, the final one follows
+    if (status < 200) {
+        if (status == 101) {
+            return -1;
+        }
+        return head_len;
+    }
+
+    // Room for the head, a different Connection line and nothing else
+    char *out = client_alloc(client, head_len + 32);
+    if (!out) {
+        return -1;
+    }
+    size_t out_len = 0;
+    memcpy(out, "HTTP/1.1", 8);
+    memcpy(out + 8, buf + 8, line_end + 1 - (buf + 8));
+    out_len = line_end + 1 - buf;
+
+    bool chunked;
+    bool encoded = find_transfer_encoding(line_end + 1, end, &chunked);
+    bool has_length = false, connection_close = false, connection_keep_alive = false;
+    uint64_t length = 0;
+    StringView connection = { 0 };
+    const char *line = line_end + 1;
+    while (line < end) {
+        const char *next = memchr(line, '\n', end + 2 - line);
+        next = next ? next + 1 : end + 2;
+        const char *colon = memchr(line, ':', next - line);
+        if (!colon) {
+            return -1;
+        }
+        StringView name = { .data = line, .len = colon - line };
+        StringView value = trim_value(colon + 1, next[-2] == '\r' ? next - 2 : next - 1);
+        if (sv_equals_ignore_case(name, "Content-Length")) {
+            // Stale beside a Transfer-Encoding, and wrong once it is decoded
+            if (encoded) {
+                line = next;
+                continue;
+            }
+            uint64_t parsed;
+            if (!parse_content_length(value, &parsed) || (has_length && parsed != length)) {
+                return -1;
+            }
+            has_length = true;
+            length = parsed;
+        } else if (sv_equals_ignore_case(name, "Connection")) {
+            connection = value;
+            connection_close = connection_close || listed_in_connection((StringView) { .data = "close", .len = 5 }, &value);
+            connection_keep_alive = listed_in_connection((StringView) { .data = "keep-alive", .len = 10 }, &value);
+        }
+        bool keep = !is_hop_by_hop(name) || (sv_equals_ignore_case(name, "Transfer-Encoding") && !conn->decode_chunks);
+        if (keep && !listed_in_connection(name, connection.data ? &connection : NULL)) {
+            memcpy(out + out_len, line, next - line);
+            out_len += next - line;
+        }
+        line = next;
+    }
+
+    conn->keep_alive = http_1_0 ? connection_keep_alive : !connection_close;
+    if (conn->head_request || status == 204 || status == 304) {
+        conn->phase = PHASE_IDLE;
+        // Framing headers were forwarded, they describe what a GET would get
+        if (chunked && conn->decode_chunks) {
+            client->keep_alive = false;
+        }
+    } else if (chunked) {
+        chunked_decoder_init(&conn->chunks);
+        conn->phase = PHASE_CHUNKED;
+        if (conn->decode_chunks) {
+            // The decoded body ends when the connection does
+            client->keep_alive = false;
+        }
+    } else if (has_length) {
+        conn->remaining = length;
+        conn->phase = PHASE_LENGTH;
+    } else {
+        // Including any other final coding, which only closing can end
+        conn->phase = PHASE_UNTIL_CLOSE;
+        conn->keep_alive = false;
+        client->keep_alive = false;
+    }
+
+    size_t connection_len;
+    const char *connection_line = connection_header_line(client, &connection_len);
+    memcpy(out + out_len, connection_line, connection_len);
+    out_len += connection_len;
+    memcpy(out + out_len, "\r\n", 2);
+    out_len += 2;
+
+    client->status_code = status;
+    if (!queue_client_output(client, out, out_len)) {
+        return -1;
+    }
+    conn->responded = true;
+    return head_len;
+}
+
+// Read until the response head is in, and forward it with whatever of the
+// body came along. Returns 1 on progress, 0 to wait and -1 on errors
+static int read_response_head(UpstreamConn *conn)
+{
+    if (!conn->buf) {
+        conn->buf = buffer_alloc(&conn->pool->worker->buffers, UPSTREAM_BUFFER_SIZE, &conn->buf_size);
+        if (!conn->buf) {
+            return -1;
+        }
+    }
+    ssize_t bytes_read = read(conn->handle.fd, conn->buf + conn->buf_used, conn->buf_size - conn->buf_used);
+    if (bytes_read < 0) {
+        if (errno == EINTR)
+            return 1;
+        return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+    }
+    if (bytes_read == 0) {
+        return -1;
+    }
+    conn->buf_used += bytes_read;
+
+    while (conn->phase == PHASE_HEAD) {
+        ssize_t head_len = forward_response_head(conn);
+        if (head_len <= 0) {
+            return head_len < 0 ? -1 : 1;
+        }
+        size_t rest = conn->buf_used - head_len;
+        memmove(conn->buf, conn->buf + head_len, rest);
+        conn->buf_used = rest;
+    }
+    // Body bytes are forwarded from here on, not buffered
+    size_t rest = conn->buf_used;
+    conn->buf_used = 0;
+    return forward_body_start(conn, conn->buf, rest) ? 1 : -1;
+}
+
+// Move body bytes from the backend's socket into the pipe and queue them,
+// the client's socket takes them from there. One pipe's worth is queued at
+// a time
+static int splice_body(UpstreamConn *conn)
+{
+    ClientInfo *client = conn->client;
+    ProxyPipe *pipe = conn_pipe(conn);
+    if (!pipe) {
+        return -1;
+    }
+    size_t want = SPLICE_CHUNK;
+    if (conn->phase == PHASE_LENGTH && conn->remaining < want) {
+        want = conn->remaining;
+    }
+    ssize_t moved = splice(conn->handle.fd, NULL, pipe->fds[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (moved < 0) {
+        if (errno == EINTR)
+            return 1;
+        return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+    }
+    if (moved == 0) {
+        if (conn->phase == PHASE_LENGTH) {
+            // Closed before the promised length
+            return -1;
+        }
+        finish_exchange(conn);
+        return 1;
+    }
+
+    pipe->queued = true;
+    if (!queue_client_pipe(client, pipe->fds[0], moved, release_pipe, pipe)) {
+        // What's in the pipe can't be sent, so it can't be reused either
+        pipe->queued = false;
+        drop_pipe(conn);
+        return -1;
+    }
+    flush_client(client);
+    if (conn->phase == PHASE_LENGTH) {
+        conn->remaining -= moved;
+        if (conn->remaining == 0) {
+            finish_exchange(conn);
+        }
+    }
+    return 1;
+}
+
+static int read_chunked_body(UpstreamConn *conn)
+{
+    if (!conn->buf) {
+        conn->buf = buffer_alloc(&conn->pool->worker->buffers, UPSTREAM_BUFFER_SIZE, &conn->buf_size);
+        if (!conn->buf) {
+            return -1;
+        }
+    }
+    ssize_t bytes_read = read(conn->handle.fd, conn->buf, conn->buf_size);
+    if (bytes_read < 0) {
+        if (errno == EINTR)
+            return 1;
+        return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+    }
+    if (bytes_read == 0) {
+        return -1;
+    }
+    return forward_chunks(conn, conn->buf, bytes_read) ? 1 : -1;
+}
+
+// Send what the backend can take and forward what it answered, until
+// either side has to be waited for. The exchange may be over, and conn
+// gone, when this returns
+static void pump_exchange(UpstreamConn *conn)
+{
+    ClientInfo *client = conn->client;
+    if (!send_request(conn)) {
+        fail_exchange(conn, STATUS_BAD_GATEWAY);
+        flush_client(client);
+        return;
+    }
+
+    conn->waiting = false;
+    while (client->upstream == conn && client->state != CLIENT_DONE) {
+        // The client's output is the only buffer, stop when it is full
+        if (conn->phase != PHASE_HEAD
+            && (client_output_over_high_water(client) || (conn->pipe && conn->pipe->queued))) {
+            conn->waiting = true;
+            break;
+        }
+
+        int result;
+        switch (conn->phase) {
+        case PHASE_HEAD:
+            result = read_response_head(conn);
+            break;
+        case PHASE_CHUNKED:
+            result = read_chunked_body(conn);
+            break;
+        default:
+            result = splice_body(conn);
+            break;
+        }
+        if (result == 0) {
+            break;
+        }
+        if (result < 0) {
+            fail_exchange(conn, STATUS_BAD_GATEWAY);
+            break;
+        }
+    }
+    flush_client(client);
+}
+
+static bool finish_connect(UpstreamConn *conn)
+{
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(conn->handle.fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) {
+        err = errno;
+    }
+    if (err != 0) {
+        fprintf(stderr, "Failed to connect to %s: %s\n", conn->upstream->address->name, strerror(err));
+        return false;
+    }
+    conn->connecting = false;
+    return true;
+}
+
+// After the exchange made progress: restart its timeout, and let a paused
+// request body continue once the backend took what was held back
+static void after_upstream_progress(ClientInfo *client)
+{
+    Worker *worker = client->worker;
+    UpstreamConn *conn = client->upstream;
+    if (conn && worker->proxy.timeout_ms > 0) {
+        timer_schedule(&worker->loop->timers, &conn->timer, worker->proxy.timeout_ms);
+    }
+    if (client->state == CLIENT_BODY && client->body_paused && conn && !request_pending(conn)) {
+        resume_request_body(client);
+    } else {
+        service_client(worker, client);
+    }
+}
+
+static void on_upstream_event(EventLoop *loop, EventHandle *handle, const Event *event)
+{
+    (void)loop;
+    UpstreamConn *conn = (UpstreamConn *)handle;
+    if (event->events & EVENT_CLOSED) {
+        free_conn(conn);
+        return;
+    }
+    if (conn->closed) {
+        return;
+    }
+    if (event->events & EVENT_WRITABLE) {
+        conn->write_waiting = false;
+    }
+
+    ClientInfo *client = conn->client;
+    if (!client) {
+        // An idle backend only speaks up to close, but a readiness report
+        // from before the last exchange ended can still come in
+        char byte;
+        ssize_t peeked = recv(handle->fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+        if (peeked >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            remove_idle(conn);
+            close_conn(conn);
+        }
+        return;
+    }
+
+    if (conn->connecting) {
+        if (!(event->events & (EVENT_WRITABLE | EVENT_ERROR | EVENT_HANGUP))) {
+            return;
+        }
+        if (!finish_connect(conn)) {
+            fail_exchange(conn, STATUS_BAD_GATEWAY);
+            flush_client(client);
+            after_upstream_progress(client);
+            return;
+        }
+    }
+    pump_exchange(conn);
+    after_upstream_progress(client);
+}
+
+static void on_upstream_timeout(Timer *timer)
+{
+    UpstreamConn *conn = timer->data;
+    ProxyPool *pool = conn->pool;
+    ClientInfo *client = conn->client;
+    if (!client) {
+        remove_idle(conn);
+        close_conn(conn);
+        return;
+    }
+    // A client slow to take the response has its own write timeout
+    if (conn->waiting) {
+        timer_schedule(&pool->worker->loop->timers, &conn->timer, pool->timeout_ms);
+        return;
+    }
+    fprintf(stderr, "Timed out waiting for %s\n", conn->upstream->address->name);
+    fail_exchange(conn, STATUS_GATEWAY_TIMEOUT);
+    flush_client(client);
+    service_client(pool->worker, client);
+}
+
+// Body callback of streamed requests: each fragment is appended to what
+// the backend still has to take, and the body pauses while any is left
+static void on_request_body(ClientInfo *client, StringView fragment, BodyStatus status, void *data)
+{
+    (void)data;
+    UpstreamConn *conn = client->upstream;
+    // Aborted bodies leave the rest to close_client, which ends the exchange
+    if (!conn || status == BODY_ABORTED) {
+        return;
+    }
+
+    bool last = status == BODY_COMPLETE;
+    if (!reserve_send_buffer(conn, fragment.len + CHUNK_FRAMING_LEN)) {
+        fail_exchange(conn, STATUS_BAD_GATEWAY);
+        return;
+    }
+    if (conn->rechunk && fragment.len > 0) {
+        char size_line[24];
+        int size_len = snprintf(size_line, sizeof(size_line), "%zx\r\n", fragment.len);
+        append_send(conn, size_line, size_len);
+        append_send(conn, fragment.data, fragment.len);
+        append_send(conn, "\r\n", 2);
+    } else {
+        append_send(conn, fragment.data, fragment.len);
+    }
+    if (last && conn->rechunk) {
+        append_send(conn, "0\r\n\r\n", 5);
+    }
+    conn->body_complete = last;
+
+    if (!conn->connecting && !send_request(conn)) {
+        fail_exchange(conn, STATUS_BAD_GATEWAY);
+        return;
+    }
+    if (last) {
+        // The request is finished once the response is
+        client->state = CLIENT_UPSTREAM;
+    } else if (request_pending(conn)) {
+        pause_request_body(client);
+    }
+}
+
+/**
+ * Forward the request to a backend if its path is under the proxy prefix.
+ * The response is relayed as it arrives, the client stays in
+ * CLIENT_UPSTREAM (or CLIENT_BODY while its body is still being streamed)
+ * until it is all queued
+ * @param client Client whose request is being answered
+ * @param req The request, only read during the call
+ * @param streamed Called from the StreamHandler, the body is still arriving
+ * @return false if the path isn't proxied, true if the request was taken
+ */
+bool serve_proxy(ClientInfo *client, Request *req, bool streamed)
+{
+    ProxyPool *pool = &client->worker->proxy;
+    if (!pool->prefix || req->path.len < pool->prefix_len
+        || memcmp(req->path.data, pool->prefix, pool->prefix_len) != 0
+        || (req->path.len > pool->prefix_len && pool->prefix[pool->prefix_len - 1] != '/'
+            && req->path.data[pool->prefix_len] != '/')) {
+        return false;
+    }
+    metrics_add(&client->worker->metrics.proxy_requests, 1);
+
+    // A reused connection the backend has closed fails the first send,
+    // that one is retried on a fresh connection if it is safe to
+    Upstream *upstream = pick_upstream(pool);
+    UpstreamConn *conn = take_idle(upstream);
+    for (int attempt = 0; attempt < 2; attempt++) {
+        if (!conn && !(conn = connect_upstream(pool, upstream))) {
+            break;
+        }
+        attach_exchange(conn, client);
+        conn->streamed = streamed;
+        conn->rechunk = streamed && req->chunked;
+        conn->body_complete = !streamed;
+        conn->head_request = req->method == METHOD_HEAD;
+        conn->idempotent = is_idempotent(req->method);
+        conn->decode_chunks = client->http_1_0;
+        if (build_request(conn, client, req) && (conn->connecting || send_request(conn))) {
+            if (pool->timeout_ms > 0) {
+                timer_schedule(&client->worker->loop->timers, &conn->timer, pool->timeout_ms);
+            }
+            if (streamed) {
+                stream_request_body(client, on_request_body, NULL);
+            } else {
+                client->state = CLIENT_UPSTREAM;
+            }
+            return true;
+        }
+        bool retry = can_retry(conn);
+        detach_exchange(conn);
+        close_conn(conn);
+        conn = NULL;
+        if (!retry) {
+            break;
+        }
+    }
+
+    // The handler's caller finishes the request
+    metrics_add(&client->worker->metrics.proxy_errors, 1);
+    write_gateway_error(client, STATUS_BAD_GATEWAY);
+    return true;
+}
+
+// The client took some output, pick up where forwarding the response stopped
+void resume_proxy(ClientInfo *client)
+{
+    UpstreamConn *conn = client->upstream;
+    if (!conn->waiting || client_output_over_high_water(client) || (conn->pipe && conn->pipe->queued)) {
+        return;
+    }
+    pump_exchange(conn);
+    UpstreamConn *current = client->upstream;
+    if (current && client->worker->proxy.timeout_ms > 0) {
+        timer_schedule(&client->worker->loop->timers, &current->timer, client->worker->proxy.timeout_ms);
+    }
+}
+
+// The client is going away, the backend connection can't be reused mid-exchange
+void abort_proxy(ClientInfo *client)
+{
+    UpstreamConn *conn = client->upstream;
+    if (!conn) {
+        return;
+    }
+    detach_exchange(conn);
+    close_conn(conn);
+}
@@ -0,0 +1,57 @@
+#ifndef PROXY_H
+#define PROXY_H
+
+#include "chunked.h"
+#include "client_info.h"
+#include "event_loop.h"
+#include "request.h"
+#include "timer_wheel.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#define MAX_UPSTREAMS 16
+#define DEFAULT_PROXY_TIMEOUT_MS 30000
+#define DEFAULT_PROXY_IDLE_CONNECTIONS 32
+#define UPSTREAM_NAME_LEN 128
+
+// A backend as --proxy names it, resolved once at startup
+typedef struct UpstreamAddress {
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    char name[UPSTREAM_NAME_LEN]; // host:port or unix:/path, for error messages
+} UpstreamAddress;
+
+struct UpstreamConn;
+
+// A worker's view of one backend
+typedef struct Upstream {
+    const UpstreamAddress *address;
+    struct UpstreamConn *idle; // Keep-alive connections, most recently used first
+    size_t num_idle;
+    unsigned outstanding; // Requests forwarded and not answered yet
+} Upstream;
+
+// One worker's connections to the backends, never shared between workers,
+// so picking and reusing them needs no locks
+typedef struct ProxyPool {
+    const char *prefix; // NULL when proxying is off
+    size_t prefix_len;
+    Upstream upstreams[MAX_UPSTREAMS];
+    size_t num_upstreams;
+    size_t next; // Where ties in outstanding requests are broken, rotated per pick
+    size_t max_idle; // Idle connections kept per backend
+    unsigned timeout_ms; // Longest wait on a backend, and longest idle time
+    struct UpstreamConn *conns; // Every open connection, for cleanup
+    struct Worker *worker;
+} ProxyPool;
+
+extern int parse_upstreams(char *spec, UpstreamAddress *addresses, size_t max);
+extern void proxy_pool_init(ProxyPool *pool, struct Worker *worker);
+extern void proxy_pool_destroy(ProxyPool *pool);
+extern bool serve_proxy(ClientInfo *client, Request *req, bool streamed);
+extern void resume_proxy(ClientInfo *client);
+extern void abort_proxy(ClientInfo *client);
+
+#endif // PROXY_H
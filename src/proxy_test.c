@@ -0,0 +1,376 @@
+#define _GNU_SOURCE
+#include "response.h"
+#include "server.h"
+#include "test.h"
+#include "worker.h"
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#define MAX_MESSAGE (64 * 1024)
+#define LOG_SIZE (256 * 1024)
+#define PROXY_TIMEOUT_MS 300
+#define CLIENT_TIMEOUT_SECONDS 5
+
+// What the backend stand-in answers, by path
+static const char PLAIN_RESPONSE[] = "HTTP/1.1 200 OK\r\nContent-Length: 5\r\nConnection: X-Drop\r\nX-Drop: 1\r\n"
+                                     "Keep-Alive: timeout=5\r\nX-Keep: 1\r\n\r\nhello";
+static const char CHUNKED_RESPONSE[] = "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n"
+                                       "5\r\nhello\r\n6\r\n world\r\n0\r\n\r\n";
+static const char BOTH_RESPONSE[] = "HTTP/1.1 200 OK\r\nContent-Length: 100\r\nTransfer-Encoding: chunked\r\n\r\n"
+                                    "5\r\nhello\r\n0\r\n\r\n";
+static const char STALE_RESPONSE[] = "HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\nstale";
+static const char GARBAGE_RESPONSE[] = "nonsense\r\n\r\n";
+
+// Every request head the backend has been sent, in order
+static char request_log[LOG_SIZE + 1];
+static size_t request_log_len;
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void handle_request(ClientInfo *client, RequestOrError *req_or_err)
+{
+    if (!req_or_err->has_error && serve_proxy(client, &req_or_err->data.req, false)) {
+        return;
+    }
+    Response res = { 0 };
+    res.status = req_or_err->has_error ? STATUS_BAD_REQUEST : STATUS_NOT_FOUND;
+    res.content_type = CONTENT_TYPE_PLAINTEXT;
+    write_response(client, &res);
+}
+
+static void send_all(int fd, const char *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t sent = send(fd, data, len, MSG_NOSIGNAL);
+        if (sent <= 0) {
+            return;
+        }
+        data += sent;
+        len -= sent;
+    }
+}
+
+// Read one request, head and Content-Length body, returns its length or 0
+// once the proxy has closed the connection
+static size_t read_request(int fd, char *buf, size_t *used)
+{
+    while (1) {
+        char *end = memmem(buf, *used, "\r\n\r\n", 4);
+        if (end) {
+            size_t head_len = end + 4 - buf;
+            const char *length = strcasestr(buf, "\r\nContent-Length:");
+            size_t body_len = length && length < end ? strtoul(length + 17, NULL, 10) : 0;
+            if (*used >= head_len + body_len) {
+                return head_len + body_len;
+            }
+        }
+        ssize_t n = read(fd, buf + *used, MAX_MESSAGE - *used);
+        if (n <= 0) {
+            return 0;
+        }
+        *used += n;
+    }
+}
+
+// One connection from the proxy. Requests after the first are refused by
+// closing when they are for /p/stale, as a backend closing an idle
+// connection just as it is reused would
+static void *serve_backend_connection(void *data)
+{
+    int fd = (int)(intptr_t)data;
+    char *buf = malloc(MAX_MESSAGE);
+    size_t used = 0;
+    int answered = 0;
+    size_t len;
+    while (buf && (len = read_request(fd, buf, &used)) > 0) {
+        pthread_mutex_lock(&log_lock);
+        size_t head_len = (char *)memmem(buf, len, "\r\n\r\n", 4) + 4 - buf;
+        if (request_log_len + head_len <= LOG_SIZE) {
+            memcpy(request_log + request_log_len, buf, head_len);
+            request_log_len += head_len;
+        }
+        pthread_mutex_unlock(&log_lock);
+
+        const char *path = strchr(buf, ' ') + 1;
+        if (strncmp(path, "/p/plain ", 9) == 0) {
+            send_all(fd, PLAIN_RESPONSE, sizeof(PLAIN_RESPONSE) - 1);
+        } else if (strncmp(path, "/p/chunked ", 11) == 0) {
+            send_all(fd, CHUNKED_RESPONSE, sizeof(CHUNKED_RESPONSE) - 1);
+        } else if (strncmp(path, "/p/both ", 8) == 0) {
+            send_all(fd, BOTH_RESPONSE, sizeof(BOTH_RESPONSE) - 1);
+        } else if (strncmp(path, "/p/garbage ", 11) == 0) {
+            send_all(fd, GARBAGE_RESPONSE, sizeof(GARBAGE_RESPONSE) - 1);
+        } else if (strncmp(path, "/p/stale ", 9) == 0 && answered == 0) {
+            send_all(fd, STALE_RESPONSE, sizeof(STALE_RESPONSE) - 1);
+        } else if (strncmp(path, "/p/slow ", 8) != 0) {
+            // /p/hangup, and /p/stale on a reused connection
+            break;
+        }
+        answered++;
+        memmove(buf, buf + len, used - len);
+        used -= len;
+    }
+    close(fd);
+    free(buf);
+    return NULL;
+}
+
+static void *run_backend(void *data)
+{
+    int listen_fd = (int)(intptr_t)data;
+    while (1) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            continue;
+        }
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, serve_backend_connection, (void *)(intptr_t)fd) == 0) {
+            pthread_detach(thread);
+        } else {
+            close(fd);
+        }
+    }
+    return NULL;
+}
+
+static int listen_on_loopback(int *port)
+{
+    struct sockaddr_in addr = { .sin_family = AF_INET };
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addr_len = sizeof(addr);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 64) < 0
+        || getsockname(fd, (struct sockaddr *)&addr, &addr_len) < 0) {
+        return -1;
+    }
+    *port = ntohs(addr.sin_port);
+    return fd;
+}
+
+static int server_port;
+
+// Send a request on a new connection and read until the proxy closes it
+static size_t exchange(const char *request, char *response)
+{
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(server_port) };
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct timeval timeout = { .tv_sec = CLIENT_TIMEOUT_SECONDS };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    size_t len = 0;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+        send_all(fd, request, strlen(request));
+        ssize_t n;
+        while (len < MAX_MESSAGE - 1 && (n = recv(fd, response + len, MAX_MESSAGE - 1 - len, 0)) > 0) {
+            len += n;
+        }
+    }
+    close(fd);
+    response[len] = '\0';
+    return len;
+}
+
+static const char *body_of(const char *response)
+{
+    const char *end = strstr(response, "\r\n\r\n");
+    return end ? end + 4 : "";
+}
+
+// Whether the head, not the body, has a line starting with header
+static bool has_header(const char *response, const char *header)
+{
+    const char *end = strstr(response, "\r\n\r\n");
+    for (const char *found = response; (found = strcasestr(found + 1, header)) && found < end;) {
+        if (found[-1] == '\n') {
+            return true;
+        }
+    }
+    return false;
+}
+
+// How many times the backend was sent a request line
+static int times_sent(const char *request_line)
+{
+    int count = 0;
+    pthread_mutex_lock(&log_lock);
+    request_log[request_log_len] = '\0';
+    for (const char *at = request_log; (at = strstr(at, request_line)); at++) {
+        count += at == request_log || at[-1] == '\n';
+    }
+    pthread_mutex_unlock(&log_lock);
+    return count;
+}
+
+// The last request head the backend got, copied out
+static void last_sent(char *out)
+{
+    pthread_mutex_lock(&log_lock);
+    request_log[request_log_len] = '\0';
+    const char *start = request_log, *at;
+    while ((at = strstr(start, "\r\n\r\n")) && at + 4 < request_log + request_log_len) {
+        start = at + 4;
+    }
+    size_t len = request_log + request_log_len - start;
+    len = len < MAX_MESSAGE ? len : MAX_MESSAGE - 1;
+    memcpy(out, start, len);
+    out[len] = '\0';
+    pthread_mutex_unlock(&log_lock);
+}
+
+// Headers about one hop go no further, either way, and neither do the ones
+// a Connection header names
+static void test_hop_by_hop(char *response, char *sent)
+{
+    exchange("GET /p/plain HTTP/1.0\r\nHost: a\r\nConnection: X-Private\r\nX-Private: 1\r\n"
+             "Keep-Alive: 5\r\nProxy-Connection: keep-alive\r\nTE: trailers\r\nUpgrade: h2c\r\nX-Public: 1\r\n\r\n",
+        response);
+    last_sent(sent);
+    CHECK(strncmp(sent, "GET /p/plain HTTP/1.1\r\n", 23) == 0);
+    CHECK(has_header(sent, "Host: a\r\n"));
+    CHECK(has_header(sent, "X-Public: 1\r\n"));
+    CHECK(!has_header(sent, "X-Private:"));
+    CHECK(!has_header(sent, "Connection:"));
+    CHECK(!has_header(sent, "Keep-Alive:"));
+    CHECK(!has_header(sent, "Proxy-Connection:"));
+    CHECK(!has_header(sent, "TE:"));
+    CHECK(!has_header(sent, "Upgrade:"));
+
+    CHECK(strncmp(response, "HTTP/1.1 200 OK\r\n", 17) == 0);
+    CHECK(has_header(response, "X-Keep: 1\r\n"));
+    CHECK(has_header(response, "Content-Length: 5\r\n"));
+    CHECK(has_header(response, "Connection: close\r\n"));
+    CHECK(!has_header(response, "X-Drop:"));
+    CHECK(!has_header(response, "Keep-Alive:"));
+    CHECK(strcmp(body_of(response), "hello") == 0);
+}
+
+// Chunked bodies go through as they are to HTTP/1.1 clients, and decoded
+// to HTTP/1.0 ones. A Content-Length beside the chunking is never passed on
+static void test_chunked(char *response)
+{
+    exchange("GET /p/chunked HTTP/1.1\r\nHost: a\r\nConnection: close\r\n\r\n", response);
+    CHECK(strncmp(response, "HTTP/1.1 200 OK\r\n", 17) == 0);
+    CHECK(has_header(response, "Transfer-Encoding: chunked\r\n"));
+    CHECK(strcmp(body_of(response), "5\r\nhello\r\n6\r\n world\r\n0\r\n\r\n") == 0);
+
+    exchange("GET /p/chunked HTTP/1.0\r\n\r\n", response);
+    CHECK(strncmp(response, "HTTP/1.1 200 OK\r\n", 17) == 0);
+    CHECK(!has_header(response, "Transfer-Encoding:"));
+    CHECK(strcmp(body_of(response), "hello world") == 0);
+
+    exchange("GET /p/both HTTP/1.1\r\nHost: a\r\nConnection: close\r\n\r\n", response);
+    CHECK(has_header(response, "Transfer-Encoding: chunked\r\n"));
+    CHECK(!has_header(response, "Content-Length:"));
+    CHECK(strcmp(body_of(response), "5\r\nhello\r\n0\r\n\r\n") == 0);
+
+    exchange("GET /p/both HTTP/1.0\r\n\r\n", response);
+    CHECK(!has_header(response, "Transfer-Encoding:"));
+    CHECK(!has_header(response, "Content-Length:"));
+    CHECK(strcmp(body_of(response), "hello") == 0);
+}
+
+static void test_gateway_errors(char *response)
+{
+    exchange("GET /p/hangup HTTP/1.1\r\nHost: a\r\nConnection: close\r\n\r\n", response);
+    CHECK(strncmp(response, "HTTP/1.1 502 ", 13) == 0);
+    exchange("GET /p/garbage HTTP/1.1\r\nHost: a\r\nConnection: close\r\n\r\n", response);
+    CHECK(strncmp(response, "HTTP/1.1 502 ", 13) == 0);
+    exchange("GET /p/slow HTTP/1.1\r\nHost: a\r\nConnection: close\r\n\r\n", response);
+    CHECK(strncmp(response, "HTTP/1.1 504 ", 13) == 0);
+}
+
+// A pooled connection the backend closes as it is reused is retried on a
+// fresh one, but only for requests that are safe to send twice
+static void test_retry(char *response)
+{
+    exchange("GET /p/plain HTTP/1.1\r\nHost: a\r\nConnection: close\r\n\r\n", response);
+    CHECK(strncmp(response, "HTTP/1.1 200 OK\r\n", 17) == 0);
+    exchange("GET /p/stale HTTP/1.1\r\nHost: a\r\nConnection: close\r\n\r\n", response);
+    CHECK(strncmp(response, "HTTP/1.1 200 OK\r\n", 17) == 0);
+    CHECK(strcmp(body_of(response), "stale") == 0);
+    CHECK(times_sent("GET /p/stale HTTP/1.1\r\n") == 2);
+
+    exchange("GET /p/plain HTTP/1.1\r\nHost: a\r\nConnection: close\r\n\r\n", response);
+    exchange("POST /p/stale HTTP/1.1\r\nHost: a\r\nConnection: close\r\nContent-Length: 4\r\n\r\ndata", response);
+    CHECK(strncmp(response, "HTTP/1.1 502 ", 13) == 0);
+    CHECK(times_sent("POST /p/stale HTTP/1.1\r\n") == 1);
+}
+
+// A header name another hop could read differently never reaches a backend
+static void test_header_names(char *response)
+{
+    int before = times_sent("POST /p/plain HTTP/1.1\r\n");
+    exchange("POST /p/plain HTTP/1.1\r\nHost: a\r\nTransfer-Encoding : chunked\r\nContent-Length: 5\r\n\r\n"
+             "0\r\n\r\n",
+        response);
+    CHECK(strncmp(response, "HTTP/1.1 400 ", 13) == 0);
+    exchange("POST /p/plain HTTP/1.1\r\nHost: a\r\nX Y: 1\r\nContent-Length: 0\r\n\r\n", response);
+    CHECK(strncmp(response, "HTTP/1.1 400 ", 13) == 0);
+    exchange("POST /p/plain HTTP/1.1\r\nHost: a\r\nX\"Y: 1\r\nContent-Length: 0\r\n\r\n", response);
+    CHECK(strncmp(response, "HTTP/1.1 400 ", 13) == 0);
+    CHECK(times_sent("POST /p/plain HTTP/1.1\r\n") == before);
+
+    exchange("POST /p/plain HTTP/1.1\r\nHost: a\r\nX-Y_z.1~: 1\r\nContent-Length: 0\r\nConnection: close\r\n\r\n",
+        response);
+    CHECK(strncmp(response, "HTTP/1.1 200 OK\r\n", 17) == 0);
+    CHECK(times_sent("POST /p/plain HTTP/1.1\r\n") == before + 1);
+}
+
+int main()
+{
+    int backend_port;
+    int backend_fd = listen_on_loopback(&backend_port);
+    pthread_t backend;
+    if (backend_fd < 0 || pthread_create(&backend, NULL, run_backend, (void *)(intptr_t)backend_fd) != 0) {
+        return 1;
+    }
+
+    static ServerConfig config;
+    init_server_config(&config);
+    char upstream[32];
+    snprintf(upstream, sizeof(upstream), "127.0.0.1:%d", backend_port);
+    config.port = 0;
+    config.handler = handle_request;
+    config.metrics_path = NULL;
+    config.proxy_prefix = "/p";
+    config.proxy_timeout_ms = PROXY_TIMEOUT_MS;
+    if (parse_upstreams(upstream, config.proxy_upstreams, MAX_UPSTREAMS) != 1) {
+        return 1;
+    }
+    config.num_proxy_upstreams = 1;
+
+    const char *backends[] = { "epoll", "io_uring" };
+    char *response = malloc(MAX_MESSAGE), *sent = malloc(MAX_MESSAGE);
+    for (size_t b = 0; b < sizeof(backends) / sizeof(backends[0]); b++) {
+        config.backend = backends[b];
+        // Workers run until the process exits
+        Worker *worker = create_worker(&config, b, -1);
+        if (!worker) {
+            // io_uring may not be available here
+            continue;
+        }
+        struct sockaddr_in addr;
+        socklen_t addr_len = sizeof(addr);
+        getsockname(worker->listen_handle.fd, (struct sockaddr *)&addr, &addr_len);
+        server_port = ntohs(addr.sin_port);
+        if (start_worker(worker) < 0) {
+            return 1;
+        }
+        pthread_mutex_lock(&log_lock);
+        request_log_len = 0;
+        pthread_mutex_unlock(&log_lock);
+        test_hop_by_hop(response, sent);
+        test_chunked(response);
+        test_gateway_errors(response);
+        test_retry(response);
+        test_header_names(response);
+    }
+    free(response);
+    free(sent);
+    return TEST_RESULT();
+}
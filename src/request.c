@@ -4,16 +4,14 @@
 const char *VALID_METHODS_LITERALS[] = { "GET", "POST", "PUT", "OPTIONS", "HEAD", "DELETE", "TRACE", "PATCH" };
 const RequestMethod VALID_METHODS[] = { METHOD_GET, METHOD_POST, METHOD_PUT, METHOD_OPTIONS, METHOD_HEAD, METHOD_DELETE, METHOD_TRACE, METHOD_PATCH };
 
-RequestOrError *create_request_or_error()
+// Value of a well-known header in O(1), NULL if it's missing
+const StringView *request_header(const Request *req, HeaderId id)
 {
-    RequestOrError *req_or_err = malloc(sizeof(RequestOrError));
-    return req_or_err;
+    return get_header(&req->headers, id);
 }
 
-void free_request_or_error(RequestOrError *req_or_err)
+// Find the value of a header by case-insensitive name, NULL if it's missing
+const StringView *find_request_header(const Request *req, const char *name)
 {
-    if (!req_or_err->has_error && req_or_err->data.req.has_external_path) {
-        free(req_or_err->data.req.path.path_ptr);
-    }
-    free(req_or_err);
+    return find_header(&req->headers, name);
 }
@@ -2,11 +2,10 @@
 #define REQUEST_H
 
 #include "common.h"
+#include "headers.h"
 #include <stdbool.h>
 #include <stddef.h>
 
-#define MAX_INLINE_PATH_BYTES 64
-
 typedef enum RequestMethod {
     METHOD_GET,
     METHOD_POST,
@@ -16,22 +15,30 @@ typedef enum RequestMethod {
     METHOD_DELETE,
     METHOD_TRACE,
     METHOD_PATCH,
+    METHOD_COUNT,
 } RequestMethod;
 
+// Every view points into the connection buffer, and stays valid until the
+// response to this request has been written. The path is the exception when
+// it had to be normalized, it then lives in the client's arena
 typedef struct Request {
-    bool has_external_path;
-    union path {
-        char inline_path[MAX_INLINE_PATH_BYTES];
-        char *path_ptr;
-    } path;
-    char *body;
-    size_t content_len;
+    StringView method_name;
+    StringView target; // As the client sent it, path and query
+    StringView path; // Target up to the '?', percent-decoded and normalized
+    StringView query; // After the '?', empty if there is none, still encoded
+    StringView body;
+    HeaderTable headers;
+    size_t content_len; // Declared length, or the decoded length of a chunked body
     RequestMethod method;
     ContentType content_type;
+    int minor_version; // HTTP/1.x
+    bool keep_alive; // Whether the client wants the connection kept open
+    bool chunked; // Body was sent with chunked transfer coding
 } Request;
 
 typedef enum ErrorEnum {
     ERR_MALFORMED_REQUEST,
+    ERR_BODY_TOO_LARGE,
 } ErrorEnum;
 
 typedef struct RequestOrError {
@@ -42,8 +49,8 @@ typedef struct RequestOrError {
     } data;
 } RequestOrError;
 
-extern RequestOrError *create_request_or_error();
-extern void free_request_or_error(RequestOrError *req_or_err);
+extern const StringView *request_header(const Request *req, HeaderId id);
+extern const StringView *find_request_header(const Request *req, const char *name);
 
 extern const char *VALID_METHODS_LITERALS[8];
 extern const RequestMethod VALID_METHODS[8];
@@ -0,0 +1,128 @@
+#include "request_body.h"
+#include "worker.h"
+#include <string.h>
+
+/**
+ * Take the body of the current request as a stream instead of having it
+ * buffered. Only valid from a StreamHandler, the callback then gets every
+ * fragment as it arrives and BODY_COMPLETE with the last one, after which
+ * the connection moves on to the next request
+ * @param client Client whose request is being answered
+ * @param callback Called for each fragment, on the worker's thread
+ * @param data Passed to callback, e.g. state from client_alloc
+ */
+void stream_request_body(ClientInfo *client, BodyCallback callback, void *data)
+{
+    client->body_callback = callback;
+    client->body_data = data;
+    client->body_delivered = 0;
+    client->body_paused = false;
+    client->state = CLIENT_BODY;
+}
+
+// Stop delivering fragments, and reading once the buffer is full, until
+// resume_request_body. Safe to call from the body callback
+void pause_request_body(ClientInfo *client)
+{
+    client->body_paused = true;
+}
+
+// Deliver again, e.g. once work the handler handed off has caught up. Not
+// from the body callback, and the client may be closed before this returns
+void resume_request_body(ClientInfo *client)
+{
+    if (!client->body_paused) {
+        return;
+    }
+    client->body_paused = false;
+    service_client(client->worker, client);
+}
+
+// Tell the handler the body won't complete and give up on the connection
+void abort_request_body(ClientInfo *client)
+{
+    BodyCallback callback = client->body_callback;
+    if (!callback) {
+        return;
+    }
+    client->body_callback = NULL;
+    client->state = CLIENT_DONE;
+    callback(client, (StringView) { .data = NULL, .len = 0 }, BODY_ABORTED, client->body_data);
+}
+
+// The body is complete: the next request, if any was pipelined, was moved
+// right behind the headers, so the request ends with them. A proxied
+// request is only finished once the backend's response is in
+static void finish_request_body(ClientInfo *client)
+{
+    client->body_callback = NULL;
+    client->body_paused = false;
+    client->req_len = client->headers_len;
+    if (client->state == CLIENT_UPSTREAM) {
+        return;
+    }
+    client->state = CLIENT_READY;
+    finish_client_request(client, client->worker->loop);
+}
+
+/**
+ * Hand the body bytes buffered behind the headers to the body callback and
+ * drop them, so the buffer never holds more than the headers and one read
+ * @param client Client in CLIENT_BODY
+ */
+void deliver_request_body(ClientInfo *client)
+{
+    size_t used = 0;
+    bool complete = false;
+
+    while (client->state == CLIENT_BODY && !client->body_paused && !complete) {
+        // Offsets stay valid if the callback's output moves the buffer
+        char *raw = client->buffer + client->buf_start + client->headers_len + used;
+        size_t available = client->buf_used - client->buf_start - client->headers_len - used;
+        StringView fragment = { .data = NULL, .len = 0 };
+
+        if (client->chunked) {
+            size_t consumed;
+            ChunkedResult result = chunked_decode(&client->chunks, raw, available, &consumed, &fragment.data,
+                &fragment.len);
+            used += consumed;
+            if (result == CHUNKED_MORE) {
+                break;
+            }
+            if (result == CHUNKED_ERROR) {
+                abort_request_body(client);
+                return;
+            }
+            complete = result == CHUNKED_DONE;
+        } else {
+            size_t left = client->body_len - client->body_delivered;
+            fragment.data = raw;
+            fragment.len = available < left ? available : left;
+            if (fragment.len == 0 && left > 0) {
+                break;
+            }
+            used += fragment.len;
+            complete = fragment.len == left;
+        }
+
+        client->body_delivered += fragment.len;
+        client->body_callback(client, fragment, complete ? BODY_COMPLETE : BODY_MORE, client->body_data);
+    }
+
+    // Gone or aborted, unless the last fragment left the request waiting on a backend
+    if (client->state != CLIENT_BODY && !(complete && client->state == CLIENT_UPSTREAM)) {
+        return;
+    }
+
+    // Delivered bytes are gone, the headers and anything not delivered yet stay
+    char *body = client->buffer + client->buf_start + client->headers_len;
+    size_t rest = client->buf_used - client->buf_start - client->headers_len - used;
+    memmove(body, body + used, rest);
+    client->buf_used -= used;
+
+    if (complete) {
+        finish_request_body(client);
+    } else if (client->peer_closed && !client->body_paused) {
+        abort_request_body(client);
+    }
+}
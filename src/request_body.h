@@ -0,0 +1,13 @@
+#ifndef REQUEST_BODY_H
+#define REQUEST_BODY_H
+
+#include "client_info.h"
+#include <stdbool.h>
+
+extern void stream_request_body(ClientInfo *client, BodyCallback callback, void *data);
+extern void pause_request_body(ClientInfo *client);
+extern void resume_request_body(ClientInfo *client);
+extern void deliver_request_body(ClientInfo *client);
+extern void abort_request_body(ClientInfo *client);
+
+#endif // REQUEST_BODY_H
@@ -1,125 +1,217 @@
 #include "client_info.h"
 #include "request.h"
+#include "url.h"
 #include <assert.h>
 #include <memory.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-// TODO: Account for unexpected EOF
+static void malformed_request(RequestOrError *result)
+{
+    result->has_error = true;
+    result->data.err = ERR_MALFORMED_REQUEST;
+}
+
+// Bytes a header name may hold, tchar in RFC 9110 section 5.6.2
+static const bool TOKEN_CHARS[256] = {
+    ['0' ... '9'] = true,
+    ['A' ... 'Z'] = true,
+    ['a' ... 'z'] = true,
+    ['!'] = true,
+    ['#'] = true,
+    ['$'] = true,
+    ['%'] = true,
+    ['&'] = true,
+    ['\''] = true,
+    ['*'] = true,
+    ['+'] = true,
+    ['-'] = true,
+    ['.'] = true,
+    ['^'] = true,
+    ['_'] = true,
+    ['`'] = true,
+    ['|'] = true,
+    ['~'] = true,
+};
+
+static bool is_token(const char *data, size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+        if (!TOKEN_CHARS[(unsigned char)data[i]]) {
+            return false;
+        }
+    }
+    return true;
+}
 
-RequestOrError *parse_request(ClientInfo *client)
+static inline StringView trim_whitespace(const char *start, const char *end)
+{
+    while (start < end && (*start == ' ' || *start == '\t')) {
+        start++;
+    }
+    while (end > start && (end[-1] == ' ' || end[-1] == '\t')) {
+        end--;
+    }
+    return (StringView) { .data = start, .len = end - start };
+}
+
+// Parse the request at buf_start in the client's buffer into views over that
+// buffer. Nothing is copied or allocated unless the path has to be decoded,
+// result is filled in place
+void parse_request(ClientInfo *client, RequestOrError *result)
 {
     assert(client->state == CLIENT_READY);
-    size_t offset = 0;
-    size_t curr = 0;
+
+    // Framing already found the request unusable
+    if (client->framing_error != FRAMING_OK) {
+        result->has_error = true;
+        result->data.err = client->framing_error == FRAMING_TOO_LARGE ? ERR_BODY_TOO_LARGE : ERR_MALFORMED_REQUEST;
+        return;
+    }
+
+    const char *buffer = client->buffer + client->buf_start;
+    // Framing already found the end of headers, and anything after the body
+    // is a pipelined request
+    const char *headers_end = buffer + client->headers_len - 2;
+    const char *curr = buffer;
     size_t i;
 
-    // Find the first word in the buffer
-    while (client->buffer[curr] != ' ') {
-        curr++;
+    result->has_error = false;
+    Request *req = &result->data.req;
+    clear_header_table(&req->headers);
+    req->content_type = CONTENT_TYPE_PLAINTEXT;
+
+    // Request line is "METHOD target HTTP/1.x\r\n"
+    const char *line_end = memchr(curr, '\n', headers_end - curr);
+    if (!line_end || line_end == curr || line_end[-1] != '\r') {
+        malformed_request(result);
+        return;
     }
+    line_end--;
 
-    RequestOrError *result = create_request_or_error();
-    bool valid_method = false;
+    // Find the first word in the buffer
+    const char *space = memchr(curr, ' ', line_end - curr);
+    if (!space) {
+        malformed_request(result);
+        return;
+    }
+    req->method_name = (StringView) { .data = curr, .len = space - curr };
 
     // Compare to all possible valid methods
+    bool valid_method = false;
     for (i = 0; i < sizeof(VALID_METHODS_LITERALS) / sizeof(char *); i++) {
-        if (memcmp(&client->buffer[offset], VALID_METHODS_LITERALS[i], curr) == 0) {
-            result->data.req.method = VALID_METHODS[i];
+        if (sv_equals(req->method_name, VALID_METHODS_LITERALS[i])) {
+            req->method = VALID_METHODS[i];
             valid_method = true;
+            break;
         }
     }
 
-    // If we haven't created a request in the loop above,
-    // That means that there was no valid method
-    // We need to flag the request as malformed and return
+    // We need to flag the request as malformed if there was no valid method
     if (!valid_method) {
-        result->has_error = true;
-        result->data.err = ERR_MALFORMED_REQUEST;
-        return result;
+        malformed_request(result);
+        return;
     }
 
-    // If we made it here, we can continue parsing
-    // First, reset curr and set offset to just after new space
-    offset = ++curr;
-
     // Test to see if path is valid (starts with /)
-    if (client->buffer[curr] != '/') {
-        // This is a malformed request
-        result->has_error = true;
-        result->data.err = ERR_MALFORMED_REQUEST;
-        return result;
+    curr = space + 1;
+    space = memchr(curr, ' ', line_end - curr);
+    if (!space || *curr != '/') {
+        malformed_request(result);
+        return;
     }
 
-    while (client->buffer[curr] != ' ') {
-        curr++;
+    // Split the target into path and query
+    req->target = (StringView) { .data = curr, .len = space - curr };
+    const char *question = memchr(curr, '?', space - curr);
+    if (question) {
+        req->path = (StringView) { .data = curr, .len = question - curr };
+        req->query = (StringView) { .data = question + 1, .len = space - question - 1 };
+    } else {
+        req->path = (StringView) { .data = curr, .len = space - curr };
+        req->query = (StringView) { .data = space, .len = 0 };
     }
 
-    if (curr - offset > MAX_INLINE_PATH_BYTES) {
-        result->data.req.has_external_path = true;
-        // Alloc a new buffer for path if it won't fit in the struct
-        result->data.req.path.path_ptr = malloc(curr - offset);
-        memcpy(result->data.req.path.path_ptr, &client->buffer[offset], curr - offset);
-        result->data.req.path.path_ptr[curr - offset] = '\0';
-    } else {
-        memcpy(&result->data.req.path.inline_path, &client->buffer[offset], curr - offset);
-        result->data.req.path.inline_path[curr - offset] = '\0';
+    // Routing and files see the decoded path. Most paths need nothing done,
+    // the rest are fixed up in a copy so the target stays as it was sent for
+    // the access log and proxying
+    if (!url_path_is_normal(req->path.data, req->path.len)) {
+        char *path = client_alloc(client, req->path.len);
+        size_t len = req->path.len;
+        if (!path) {
+            malformed_request(result);
+            return;
+        }
+        memcpy(path, req->path.data, len);
+        if (!url_normalize_path(path, &len)) {
+            malformed_request(result);
+            return;
+        }
+        req->path = (StringView) { .data = path, .len = len };
     }
 
-    // TODO Assert it's actually there first
-    // Skip HTTP version
-    curr += strlen(" HTTP/1.1\r\n");
+    // Check the HTTP version, HTTP/1.0 only keeps connections alive on request
+    curr = space + 1;
+    if (line_end - curr != sizeof("HTTP/1.x") - 1 || memcmp(curr, "HTTP/1.", sizeof("HTTP/1.") - 1) != 0
+        || curr[7] < '0' || curr[7] > '9') {
+        malformed_request(result);
+        return;
+    }
+    req->minor_version = curr[7] - '0';
+    req->keep_alive = req->minor_version >= 1;
 
     // Parse headers
-    char *header_end;
-    size_t content_length = 0;
-
-    char header_name[64] = { 0 };
-    char header_value[512] = { 0 };
-
-    while (true) {
-        header_end = strstr(&client->buffer[curr], "\r\n");
-        if (!header_end || header_end == &client->buffer[curr]) {
-            break; // End of headers
+    curr = line_end + 2;
+    while (curr < headers_end) {
+        line_end = memchr(curr, '\n', headers_end - curr);
+        if (!line_end || line_end[-1] != '\r') {
+            malformed_request(result);
+            return;
         }
-
-        // Parse header name
-        char *colon = strchr(&client->buffer[curr], ':');
-        if (!colon || colon > header_end) {
-            result->has_error = true;
-            result->data.err = ERR_MALFORMED_REQUEST;
-            return result;
+        line_end--;
+
+        // Parse header name. Whitespace before the colon is refused rather
+        // than trimmed, framing and the proxy would not see the name it is
+        const char *colon = memchr(curr, ':', line_end - curr);
+        if (!colon || colon == curr || !is_token(curr, colon - curr)) {
+            malformed_request(result);
+            return;
         }
 
-        size_t name_len = colon - &client->buffer[curr];
-        size_t value_len = header_end - (colon + 2); // +2 to skip ": "
-
-        memcpy(header_name, &client->buffer[curr], name_len);
-        header_name[name_len] = '\0';
-        memcpy(header_value, colon + 2, value_len);
-        header_value[value_len] = '\0';
+        StringView name = { .data = curr, .len = colon - curr };
+        StringView value = trim_whitespace(colon + 1, line_end);
+        HeaderId id = lookup_header_id(name.data, name.len);
+        if (!add_header(&req->headers, name, value, id)) {
+            malformed_request(result);
+            return;
+        }
 
         // Check for special headers
-        if (strcasecmp(header_name, "Content-Length") == 0) {
-            content_length = atoi(header_value);
-        } else if (strcasecmp(header_name, "Transfer-Encoding") == 0 && strcasecmp(header_value, "chunked") == 0) {
-            // TODO: Support chunked encoding
-            assert(1 != 1);
+        switch (id) {
+        case HEADER_CONNECTION:
+            if (sv_equals_ignore_case(value, "close")) {
+                req->keep_alive = false;
+            } else if (sv_equals_ignore_case(value, "keep-alive")) {
+                req->keep_alive = true;
+            }
+            break;
+        case HEADER_CONTENT_TYPE:
+            if (sv_equals_ignore_case(value, "application/json")) {
+                req->content_type = CONTENT_TYPE_JSON;
+            }
+            break;
+        default:
+            break;
         }
 
-        curr = header_end - client->buffer + 2; // +2 to skip \r\n
-    }
-
-    // Skip the final \r\n that separates headers from body
-    curr += 2;
-
-    if (content_length > 0) {
-        // Content-Length header present
-        result->data.req.body = malloc(content_length);
-        memcpy(result->data.req.body, &client->buffer[curr], content_length);
-        result->data.req.content_len = content_length;
+        curr = line_end + 2; // +2 to skip \r\n
     }
 
-    return result;
+    // Framing already read Content-Length or decoded the chunked body, either
+    // way the body directly follows the blank line that ends the headers.
+    // A body offered for streaming hasn't arrived yet
+    req->content_len = client->body_len;
+    req->chunked = client->chunked;
+    req->body = (StringView) { .data = buffer + client->headers_len, .len = client->offer_body ? 0 : client->body_len };
 }
@@ -4,6 +4,6 @@
 #include "client_info.h"
 #include "request.h"
 
-extern RequestOrError *parse_request(ClientInfo *client);
+extern void parse_request(ClientInfo *client, RequestOrError *result);
 
 #endif // REQUEST_PARSER_H
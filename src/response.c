@@ -1,128 +1,391 @@
 #include "response.h"
 #include "client_info.h"
 #include "common.h"
-#include <memory.h>
-#include <stdio.h>
+#include "compression.h"
+#include "response_cache.h"
+#include "worker.h"
 #include <stdlib.h>
 #include <string.h>
-#include <sys/socket.h>
 
-const char *CONTENT_TYPE_LITERALS[] = { "text/plain; charset=us-ascii", "application/json" };
-const ContentType CONTENT_TYPES[] = { CONTENT_TYPE_PLAINTEXT, CONTENT_TYPE_JSON };
+typedef struct Literal {
+    const char *data;
+    size_t len;
+} Literal;
 
-const char *STATUS_LITERALS[] = { "200 OK", "201 Created", "400 Bad Request", "404 Not Found" };
-const HttpStatus STATUSES[] = { STATUS_OK, STATUS_CREATED, STATUS_BAD_REQUEST, STATUS_NOT_FOUND };
+#define LITERAL(str) { str, sizeof(str) - 1 }
 
-const char HTTP_VERSION[] = "HTTP/1.1";
+// Whole header lines, indexed by enum so nothing has to be searched for
+static const Literal STATUS_LINES[STATUS_COUNT] = {
+    [STATUS_OK] = LITERAL("HTTP/1.1 200 OK\r\n"),
+    [STATUS_CREATED] = LITERAL("HTTP/1.1 201 Created\r\n"),
+    [STATUS_PARTIAL_CONTENT] = LITERAL("HTTP/1.1 206 Partial Content\r\n"),
+    [STATUS_NOT_MODIFIED] = LITERAL("HTTP/1.1 304 Not Modified\r\n"),
+    [STATUS_BAD_REQUEST] = LITERAL("HTTP/1.1 400 Bad Request\r\n"),
+    [STATUS_NOT_FOUND] = LITERAL("HTTP/1.1 404 Not Found\r\n"),
+    [STATUS_METHOD_NOT_ALLOWED] = LITERAL("HTTP/1.1 405 Method Not Allowed\r\n"),
+    [STATUS_CONTENT_TOO_LARGE] = LITERAL("HTTP/1.1 413 Content Too Large\r\n"),
+    [STATUS_RANGE_NOT_SATISFIABLE] = LITERAL("HTTP/1.1 416 Range Not Satisfiable\r\n"),
+    [STATUS_BAD_GATEWAY] = LITERAL("HTTP/1.1 502 Bad Gateway\r\n"),
+    [STATUS_SERVICE_UNAVAILABLE] = LITERAL("HTTP/1.1 503 Service Unavailable\r\n"),
+    [STATUS_GATEWAY_TIMEOUT] = LITERAL("HTTP/1.1 504 Gateway Timeout\r\n"),
+};
 
-Response *create_response()
+// The same statuses as numbers, for the access log
+static const int STATUS_CODES[STATUS_COUNT] = {
+    [STATUS_OK] = 200,
+    [STATUS_CREATED] = 201,
+    [STATUS_PARTIAL_CONTENT] = 206,
+    [STATUS_NOT_MODIFIED] = 304,
+    [STATUS_BAD_REQUEST] = 400,
+    [STATUS_NOT_FOUND] = 404,
+    [STATUS_METHOD_NOT_ALLOWED] = 405,
+    [STATUS_CONTENT_TOO_LARGE] = 413,
+    [STATUS_RANGE_NOT_SATISFIABLE] = 416,
+    [STATUS_BAD_GATEWAY] = 502,
+    [STATUS_SERVICE_UNAVAILABLE] = 503,
+    [STATUS_GATEWAY_TIMEOUT] = 504,
+};
+
+static const Literal CONTENT_TYPE_LINES[CONTENT_TYPE_COUNT] = {
+    [CONTENT_TYPE_PLAINTEXT] = LITERAL("Content-Type: text/plain; charset=us-ascii\r\n"),
+    [CONTENT_TYPE_JSON] = LITERAL("Content-Type: application/json\r\n"),
+    [CONTENT_TYPE_HTML] = LITERAL("Content-Type: text/html; charset=utf-8\r\n"),
+    [CONTENT_TYPE_CSS] = LITERAL("Content-Type: text/css; charset=utf-8\r\n"),
+    [CONTENT_TYPE_JAVASCRIPT] = LITERAL("Content-Type: text/javascript; charset=utf-8\r\n"),
+    [CONTENT_TYPE_PNG] = LITERAL("Content-Type: image/png\r\n"),
+    [CONTENT_TYPE_JPEG] = LITERAL("Content-Type: image/jpeg\r\n"),
+    [CONTENT_TYPE_GIF] = LITERAL("Content-Type: image/gif\r\n"),
+    [CONTENT_TYPE_SVG] = LITERAL("Content-Type: image/svg+xml\r\n"),
+    [CONTENT_TYPE_ICO] = LITERAL("Content-Type: image/x-icon\r\n"),
+    [CONTENT_TYPE_WEBP] = LITERAL("Content-Type: image/webp\r\n"),
+    [CONTENT_TYPE_WOFF2] = LITERAL("Content-Type: font/woff2\r\n"),
+    [CONTENT_TYPE_PDF] = LITERAL("Content-Type: application/pdf\r\n"),
+    [CONTENT_TYPE_OCTET_STREAM] = LITERAL("Content-Type: application/octet-stream\r\n"),
+    [CONTENT_TYPE_PROMETHEUS] = LITERAL("Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"),
+};
+
+static const Literal CONTENT_ENCODING_LINES[CONTENT_ENCODING_COUNT] = {
+    [CONTENT_ENCODING_NONE] = LITERAL(""),
+    [CONTENT_ENCODING_IDENTITY] = LITERAL("Vary: Accept-Encoding\r\n"),
+    [CONTENT_ENCODING_GZIP] = LITERAL("Content-Encoding: gzip\r\nVary: Accept-Encoding\r\n"),
+    [CONTENT_ENCODING_BR] = LITERAL("Content-Encoding: br\r\nVary: Accept-Encoding\r\n"),
+};
+
+static const Literal CONNECTION_LINES[CONNECTION_HEADER_COUNT] = {
+    [CONNECTION_DEFAULT] = LITERAL(""),
+    [CONNECTION_CLOSE] = LITERAL("Connection: close\r\n"),
+    [CONNECTION_KEEP_ALIVE] = LITERAL("Connection: keep-alive\r\n"),
+};
+
+// The length follows Content-Length, the others are whole lines
+static const Literal FRAMING_LINES[] = {
+    [BODY_CONTENT_LENGTH] = LITERAL("Content-Length: "),
+    [BODY_CHUNKED] = LITERAL("Transfer-Encoding: chunked\r\n"),
+    [BODY_UNTIL_CLOSE] = LITERAL(""),
+};
+
+static const Literal DATE_PREFIX = LITERAL("Date: ");
+
+// Responses registered at startup, before any worker runs
+static const Response *static_responses[MAX_STATIC_RESPONSES];
+static size_t num_static_responses;
+
+/**
+ * Get the current Date header value, reformatted only when the second changes
+ * @param cache The calling worker's cache
+ * @return The formatted date, valid until the next update
+ */
+const char *update_date_cache(DateCache *cache)
 {
-    Response *res = malloc(sizeof(Response));
-    return res;
+    // Coarse time is plenty for one second resolution and much cheaper
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME_COARSE, &now);
+    if (now.tv_sec != cache->second) {
+        format_http_date(cache->value, now.tv_sec);
+        cache->second = now.tv_sec;
+    }
+    return cache->value;
 }
 
-void free_response(Response *res)
+/**
+ * Format a time the way HTTP dates are written, RFC 9110 IMF-fixdate
+ * @param buf Room for HTTP_DATE_LEN characters and a NUL
+ * @param time Seconds since the epoch
+ */
+void format_http_date(char *buf, time_t time)
 {
-    if (res->content_body != NULL) {
-        free(res->content_body);
-    }
-    free(res);
+    struct tm tm_info;
+    gmtime_r(&time, &tm_info);
+    strftime(buf, HTTP_DATE_LEN + 1, "%a, %d %b %Y %H:%M:%S GMT", &tm_info);
 }
 
 inline size_t add_header_to_buf(char *buf, size_t buf_size, size_t offset,
     const char *header_name, const char *header_val)
 {
-    int written = snprintf(buf + offset, buf_size - offset, "%s: %s\r\n",
-        header_name, header_val);
-    return (written > 0 && (size_t)written < buf_size - offset) ? (size_t)written : 0;
+    size_t name_len = strlen(header_name);
+    size_t val_len = strlen(header_val);
+    if (offset + name_len + val_len + 4 >= buf_size) {
+        return 0;
+    }
+    char *out = buf + offset;
+    memcpy(out, header_name, name_len);
+    out += name_len;
+    *out++ = ':';
+    *out++ = ' ';
+    memcpy(out, header_val, val_len);
+    out += val_len;
+    *out++ = '\r';
+    *out++ = '\n';
+    return out - (buf + offset);
+}
+
+// Write n in decimal, returns the number of digits
+static size_t format_size(char *buf, size_t n)
+{
+    char digits[20];
+    size_t len = 0;
+    do {
+        digits[len++] = '0' + n % 10;
+        n /= 10;
+    } while (n > 0);
+    for (size_t i = 0; i < len; i++) {
+        buf[i] = digits[len - 1 - i];
+    }
+    return len;
 }
 
-inline size_t marshal_response(char *buf, size_t buf_size, Response *res)
+/**
+ * Write the status line and headers, the body is sent from where it is
+ * @param buf Buffer to write into
+ * @param buf_size Size of buf
+ * @param res Response to serialize
+ * @param date Value for the Date header, HTTP_DATE_LEN characters
+ * @return Bytes written, or 0 if the status is unknown or buf is too small
+ */
+inline size_t marshal_response(char *buf, size_t buf_size, const Response *res, const char *date)
 {
-    if (!buf || !res || buf_size == 0) {
+    if (!buf || !res || (unsigned)res->status >= STATUS_COUNT || (unsigned)res->content_type >= CONTENT_TYPE_COUNT
+        || (unsigned)res->content_encoding >= CONTENT_ENCODING_COUNT
+        || (unsigned)res->framing >= sizeof(FRAMING_LINES) / sizeof(FRAMING_LINES[0])) {
         return 0;
     }
 
-    size_t pos = 0;
-    int written;
-    char temp_buf[128]; // For formatting numbers and dates
+    // Everything but the length is known up front, so check the size once
+    char length[22];
+    size_t length_len = 0;
+    if (res->framing == BODY_CONTENT_LENGTH) {
+        length_len = format_size(length, res->content_len);
+        length[length_len++] = '\r';
+        length[length_len++] = '\n';
+    }
+    const Literal *framing = &FRAMING_LINES[res->framing];
+    const Literal *status = &STATUS_LINES[res->status];
+    const Literal *content_type = &CONTENT_TYPE_LINES[res->content_type];
+    const Literal *content_encoding = &CONTENT_ENCODING_LINES[res->content_encoding];
+    const Literal *connection = &CONNECTION_LINES[res->connection];
+    size_t total = status->len + DATE_PREFIX.len + HTTP_DATE_LEN + 2 + content_type->len + content_encoding->len
+        + res->extra_headers_len + connection->len + framing->len + length_len + 2;
+    if (total > buf_size) {
+        return 0;
+    }
 
-    // Write status line (HTTP version and status)
-    const char *status_literal = NULL;
-    for (size_t i = 0; i < sizeof(STATUSES) / sizeof(HttpStatus); i++) {
-        if (STATUSES[i] == res->status) {
-            status_literal = STATUS_LITERALS[i];
-            break;
-        }
+    char *out = buf;
+    memcpy(out, status->data, status->len);
+    out += status->len;
+    memcpy(out, DATE_PREFIX.data, DATE_PREFIX.len);
+    out += DATE_PREFIX.len;
+    memcpy(out, date, HTTP_DATE_LEN);
+    out += HTTP_DATE_LEN;
+    *out++ = '\r';
+    *out++ = '\n';
+    memcpy(out, content_type->data, content_type->len);
+    out += content_type->len;
+    memcpy(out, content_encoding->data, content_encoding->len);
+    out += content_encoding->len;
+    if (res->extra_headers_len > 0) {
+        memcpy(out, res->extra_headers, res->extra_headers_len);
+        out += res->extra_headers_len;
     }
-    if (!status_literal) {
-        return 0; // Invalid status
+    memcpy(out, connection->data, connection->len);
+    out += connection->len;
+    memcpy(out, framing->data, framing->len);
+    out += framing->len;
+    memcpy(out, length, length_len);
+    out += length_len;
+    *out++ = '\r';
+    *out++ = '\n';
+
+    return out - buf;
+}
+
+/**
+ * Register a response that never changes, to be serialized once per worker
+ * instead of per request. Only valid before the server is started
+ * @param res Response to send, its body is copied
+ * @return Id to pass to write_static_response, or -1 if there are too many
+ */
+StaticResponseId register_static_response(const Response *res)
+{
+    if (num_static_responses == MAX_STATIC_RESPONSES) {
+        return -1;
     }
+    static_responses[num_static_responses] = res;
+    return num_static_responses++;
+}
 
-    written = snprintf(buf + pos, buf_size - pos, "%s %s\r\n",
-        HTTP_VERSION, status_literal);
-    if (written < 0 || (size_t)written >= buf_size - pos) {
-        return 0;
+// Serialize every registered response for one worker
+int prepare_static_responses(StaticResponses *set, DateCache *date)
+{
+    set->count = num_static_responses * CONNECTION_HEADER_COUNT;
+    set->responses = calloc(set->count ? set->count : 1, sizeof(PreparedResponse));
+    if (!set->responses) {
+        return -1;
     }
-    pos += written;
 
-    struct tm *tm_info = gmtime(&res->time.tv_sec);
-    if (!tm_info) {
-        return 0;
+    const char *now = update_date_cache(date);
+    char headers[MAX_RESPONSE_HEADERS_LEN];
+    for (size_t i = 0; i < num_static_responses; i++) {
+        for (int connection = 0; connection < CONNECTION_HEADER_COUNT; connection++) {
+            Response res = *static_responses[i];
+            res.connection = connection;
+            size_t headers_len = marshal_response(headers, sizeof(headers), &res, now);
+            if (headers_len == 0) {
+                free_static_responses(set);
+                return -1;
+            }
+
+            PreparedResponse *prepared = &set->responses[i * CONNECTION_HEADER_COUNT + connection];
+            prepared->len = headers_len + res.content_len;
+            prepared->headers_len = headers_len;
+            prepared->data = malloc(prepared->len);
+            if (!prepared->data) {
+                free_static_responses(set);
+                return -1;
+            }
+            memcpy(prepared->data, headers, headers_len);
+            if (res.content_len > 0) {
+                memcpy(prepared->data + headers_len, res.content_body, res.content_len);
+            }
+            // The Date value directly follows the status line and "Date: "
+            prepared->date_offset = STATUS_LINES[res.status].len + DATE_PREFIX.len;
+            prepared->date_second = date->second;
+            prepared->status_code = STATUS_CODES[res.status];
+        }
     }
+    return 0;
+}
 
-    // Format RFC 2822 date
-    strftime(temp_buf, sizeof(temp_buf),
-        "%a, %d %b %Y %H:%M:%S GMT", tm_info);
-    written = add_header_to_buf(buf, buf_size, pos, "Date", temp_buf);
-    if (!written)
-        return 0;
-    pos += written;
-
-    // Add the Content-Type header if present
-    const char *content_type_literal = NULL;
-    for (size_t i = 0; i < sizeof(STATUSES) / sizeof(HttpStatus); i++) {
-        if (CONTENT_TYPES[i] == res->content_type) {
-            content_type_literal = CONTENT_TYPE_LITERALS[i];
-            break;
+void free_static_responses(StaticResponses *set)
+{
+    if (set->responses) {
+        for (size_t i = 0; i < set->count; i++) {
+            free(set->responses[i].data);
         }
+        free(set->responses);
     }
-    written = add_header_to_buf(buf, buf_size, pos,
-        "Content-Type", content_type_literal);
-    if (!written)
-        return 0;
-    pos += written;
+    set->responses = NULL;
+    set->count = 0;
+}
 
-    // Add the Content-Length header
-    snprintf(temp_buf, sizeof(temp_buf), "%zu", res->content_len);
-    written = add_header_to_buf(buf, buf_size, pos,
-        "Content-Length", temp_buf);
-    if (!written)
-        return 0;
-    pos += written;
+static ConnectionHeader connection_header_for(ClientInfo *client)
+{
+    if (!client->keep_alive) {
+        return CONNECTION_CLOSE;
+    }
+    return client->http_1_0 ? CONNECTION_KEEP_ALIVE : CONNECTION_DEFAULT;
+}
 
-    // End of headers
-    written = snprintf(buf + pos, buf_size - pos, "\r\n");
-    if (written < 0 || (size_t)written >= buf_size - pos) {
-        return 0;
+/**
+ * The Connection header line a response to the client needs, for responses
+ * serialized ahead of time without one
+ * @param client Client being answered
+ * @param len Set to the line's length, 0 when no header is needed
+ * @return The whole line, static
+ */
+const char *connection_header_line(ClientInfo *client, size_t *len)
+{
+    const Literal *line = &CONNECTION_LINES[connection_header_for(client)];
+    *len = line->len;
+    return line->data;
+}
+
+/**
+ * Queue a response on the client, it goes out with the next flush. Without
+ * a content_body only the headers are queued, for a body the caller queues
+ * itself. A HEAD request gets the headers alone either way, Content-Length
+ * still giving the length of the body it would have had
+ * @param client Client to answer
+ * @param res Response to send, its connection is filled in for the client
+ * @return false if the client had to be given up on
+ */
+bool write_response(ClientInfo *client, Response *res)
+{
+    Metrics *metrics = &client->worker->metrics;
+    uint64_t start = metrics_start(metrics, STAGE_WRITE);
+    compress_response(client, res);
+    // A cacheable route's response is stored first and queued from the cache
+    if (client->cache_fill && cache_response(client, res)) {
+        metrics_end(metrics, STAGE_WRITE, start);
+        return client->state != CLIENT_DONE;
     }
-    pos += written;
+    res->connection = connection_header_for(client);
 
-    // Add the body if present
-    if (res->content_body && res->content_len > 0) {
-        if (pos + res->content_len >= buf_size) {
-            return 0; // Buffer too small
-        }
-        memcpy(buf + pos, res->content_body, res->content_len);
-        pos += res->content_len;
+    char headers[MAX_RESPONSE_HEADERS_LEN];
+    const char *date = update_date_cache(&client->worker->date);
+    size_t headers_len = marshal_response(headers, sizeof(headers), res, date);
+    if (headers_len == 0) {
+        client->state = CLIENT_DONE;
+        return false;
     }
 
-    return pos;
+    // Headers are copied into request memory, the body is queued as is
+    char *queued = client_alloc(client, headers_len);
+    if (!queued) {
+        client->state = CLIENT_DONE;
+        return false;
+    }
+    memcpy(queued, headers, headers_len);
+    client->status_code = STATUS_CODES[res->status];
+    if (!queue_client_output(client, queued, headers_len)
+        || (res->content_body && !client->head_request
+            && !queue_client_output(client, res->content_body, res->content_len))) {
+        client->state = CLIENT_DONE;
+        return false;
+    }
+    metrics_end(metrics, STAGE_WRITE, start);
+    return true;
 }
 
-void write_response(ClientInfo *client, Response *res)
+/**
+ * One of the worker's prepared responses, only patching its Date when the
+ * second has changed. A copy still queued from the previous second just goes
+ * out with the newer date, which has the same length
+ * @param worker Worker whose copy to use
+ * @param id Id from register_static_response
+ * @param connection Connection header variant
+ * @return The serialized response
+ */
+const PreparedResponse *current_static_response(Worker *worker, StaticResponseId id, ConnectionHeader connection)
 {
-    char *buf = malloc(res->content_len + 1024); // TODO: Adjust this to be more reasonable for header sizes
-    size_t res_len = marshal_response(buf, res->content_len + 1024, res);
-    send(client->fd, buf, res_len, 0);
+    PreparedResponse *prepared = &worker->static_responses.responses[id * CONNECTION_HEADER_COUNT + connection];
+    const char *date = update_date_cache(&worker->date);
+    if (prepared->date_second != worker->date.second) {
+        memcpy(prepared->data + prepared->date_offset, date, HTTP_DATE_LEN);
+        prepared->date_second = worker->date.second;
+    }
+    return prepared;
+}
+
+// Queue one of the worker's prepared responses, without its body for HEAD
+void write_static_response(ClientInfo *client, StaticResponseId id)
+{
+    Worker *worker = client->worker;
+    uint64_t start = metrics_start(&worker->metrics, STAGE_WRITE);
+    const PreparedResponse *prepared = current_static_response(worker, id, connection_header_for(client));
+
+    client->status_code = prepared->status_code;
+    if (!queue_client_output(client, prepared->data, client->head_request ? prepared->headers_len : prepared->len)) {
+        client->state = CLIENT_DONE;
+    }
+    metrics_end(&worker->metrics, STAGE_WRITE, start);
 }
@@ -5,27 +5,102 @@
 #include "common.h"
 #include <time.h>
 
+#define MAX_RESPONSE_HEADERS_LEN 1024
+#define MAX_STATIC_RESPONSES 64
+#define HTTP_DATE_LEN (sizeof("Sun, 06 Nov 1994 08:49:37 GMT") - 1)
+
 typedef enum HttpStatus {
     STATUS_OK,
     STATUS_CREATED,
+    STATUS_PARTIAL_CONTENT,
+    STATUS_NOT_MODIFIED,
     STATUS_BAD_REQUEST,
     STATUS_NOT_FOUND,
+    STATUS_METHOD_NOT_ALLOWED,
+    STATUS_CONTENT_TOO_LARGE,
+    STATUS_RANGE_NOT_SATISFIABLE,
+    STATUS_BAD_GATEWAY,
+    STATUS_SERVICE_UNAVAILABLE,
+    STATUS_GATEWAY_TIMEOUT,
+    STATUS_COUNT,
 } HttpStatus;
 
+typedef enum ConnectionHeader {
+    CONNECTION_DEFAULT, // No header, the protocol's default applies
+    CONNECTION_CLOSE,
+    CONNECTION_KEEP_ALIVE,
+    CONNECTION_HEADER_COUNT,
+} ConnectionHeader;
+
+// How a body is encoded, and whether that was negotiated at all. Anything
+// but CONTENT_ENCODING_NONE adds a Vary: Accept-Encoding line
+typedef enum ContentEncoding {
+    CONTENT_ENCODING_NONE, // Not negotiable, no headers
+    CONTENT_ENCODING_IDENTITY, // Negotiable, sent as is
+    CONTENT_ENCODING_GZIP,
+    CONTENT_ENCODING_BR,
+    CONTENT_ENCODING_COUNT,
+} ContentEncoding;
+
+// How the client finds the end of the body
+typedef enum BodyFraming {
+    BODY_CONTENT_LENGTH, // content_len bytes
+    BODY_CHUNKED, // Chunks the caller queues after the headers
+    BODY_UNTIL_CLOSE, // Whatever the caller queues, then the connection closes
+} BodyFraming;
+
 typedef struct Response {
-    struct timespec time;
     HttpStatus status;
     ContentType content_type;
     size_t content_len;
-    char *content_body;
+    char *content_body; // Sent in place, must stay valid until the response is sent
+    BodyFraming framing;
+    ConnectionHeader connection;
+    ContentEncoding content_encoding;
+    const char *extra_headers; // Whole "Name: value\r\n" lines, copied when marshaled
+    size_t extra_headers_len;
 } Response;
 
-extern Response *create_response();
-extern void write_response(ClientInfo *client, Response *res);
-extern void free_response(Response *res);
+// The Date header value, formatted at most once per second
+typedef struct DateCache {
+    time_t second;
+    char value[HTTP_DATE_LEN + 1];
+} DateCache;
+
+// A fully serialized response, only its Date is ever rewritten
+typedef struct PreparedResponse {
+    char *data;
+    size_t len;
+    size_t headers_len; // Up to and including the blank line, what HEAD is answered with
+    size_t date_offset;
+    time_t date_second; // Second the Date in data was formatted for
+    int status_code;
+} PreparedResponse;
+
+// A worker's own copies of every registered static response, one per
+// Connection header variant
+typedef struct StaticResponses {
+    PreparedResponse *responses;
+    size_t count;
+} StaticResponses;
+
+typedef int StaticResponseId;
+
+extern const char *update_date_cache(DateCache *cache);
+extern void format_http_date(char *buf, time_t time);
+
+extern StaticResponseId register_static_response(const Response *res);
+extern int prepare_static_responses(StaticResponses *set, DateCache *date);
+extern void free_static_responses(StaticResponses *set);
+
+extern bool write_response(ClientInfo *client, Response *res);
+extern const char *connection_header_line(ClientInfo *client, size_t *len);
+extern void write_static_response(ClientInfo *client, StaticResponseId id);
+extern const PreparedResponse *current_static_response(struct Worker *worker, StaticResponseId id,
+    ConnectionHeader connection);
 
 extern inline size_t add_header_to_buf(char *buf, size_t buf_size, size_t offset,
     const char *header_name, const char *header_val);
-extern inline size_t marshal_response(char *buf, size_t buf_size, Response *res);
+extern inline size_t marshal_response(char *buf, size_t buf_size, const Response *res, const char *date);
 
 #endif // RESPONSE_H
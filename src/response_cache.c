@@ -0,0 +1,406 @@
+#include "response_cache.h"
+#include "worker.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MIN_CACHE_BUCKETS 64
+#define MAX_CACHE_BUCKETS 65536
+#define BYTES_PER_BUCKET 4096 // Expected size of an entry, to size the table
+#define MAX_ENTRY_SHARE 4 // No entry may take more than 1/4 of the budget
+
+// What cache_response needs to store the response a handler writes on a miss
+typedef struct CacheFill {
+    const CachePolicy *policy;
+    const Request *req;
+    uint64_t hash;
+    const char *key;
+    size_t key_len;
+} CacheFill;
+
+static const char DATE_LINE[] = "\r\nDate: ";
+
+static uint64_t hash_bytes(uint64_t hash, const char *data, size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char)data[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/**
+ * Set up a worker's shard of the response cache
+ * @param cache Cache to initialize
+ * @param max_bytes Budget for every entry together, 0 leaves the cache off
+ * @param ttl_ms Freshness of routes that don't set their own
+ * @return 0 on success, -1 on failure
+ */
+int response_cache_init(ResponseCache *cache, size_t max_bytes, unsigned ttl_ms)
+{
+    memset(cache, 0, sizeof(*cache));
+    cache->ttl_ms = ttl_ms;
+    if (max_bytes == 0) {
+        return 0;
+    }
+
+    cache->num_buckets = MIN_CACHE_BUCKETS;
+    while (cache->num_buckets < MAX_CACHE_BUCKETS && cache->num_buckets * BYTES_PER_BUCKET < max_bytes) {
+        cache->num_buckets <<= 1;
+    }
+    cache->buckets = calloc(cache->num_buckets, sizeof(CachedResponse *));
+    if (!cache->buckets) {
+        perror("Failed to allocate response cache");
+        return -1;
+    }
+    cache->max_bytes = max_bytes;
+    return 0;
+}
+
+static void unref_entry(CachedResponse *entry)
+{
+    if (--entry->refs == 0) {
+        free(entry);
+    }
+}
+
+// Called once a queued send of the entry is done
+static void release_entry(void *data)
+{
+    unref_entry(data);
+}
+
+// Make the entry unfindable, sends still queued keep it alive
+static void evict_entry(ResponseCache *cache, CachedResponse *entry)
+{
+    CachedResponse **link = &cache->buckets[entry->hash & (cache->num_buckets - 1)];
+    while (*link != entry) {
+        link = &(*link)->hash_next;
+    }
+    *link = entry->hash_next;
+
+    if (entry->lru_prev) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    } else {
+        cache->lru_head = entry->lru_next;
+    }
+    if (entry->lru_next) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        cache->lru_tail = entry->lru_prev;
+    }
+    cache->bytes -= entry->size;
+    entry->cached = false;
+    unref_entry(entry);
+}
+
+void response_cache_destroy(ResponseCache *cache)
+{
+    while (cache->lru_head) {
+        evict_entry(cache, cache->lru_head);
+    }
+    free(cache->buckets);
+    cache->buckets = NULL;
+    cache->max_bytes = 0;
+}
+
+static void move_to_front(ResponseCache *cache, CachedResponse *entry)
+{
+    if (cache->lru_head == entry) {
+        return;
+    }
+    entry->lru_prev->lru_next = entry->lru_next;
+    if (entry->lru_next) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        cache->lru_tail = entry->lru_prev;
+    }
+    entry->lru_prev = NULL;
+    entry->lru_next = cache->lru_head;
+    cache->lru_head->lru_prev = entry;
+    cache->lru_head = entry;
+}
+
+// A fresh entry for the key, expired ones are dropped on the way
+static CachedResponse *find_entry(ResponseCache *cache, uint64_t hash, const char *key, size_t key_len,
+    uint64_t now_ms)
+{
+    CachedResponse *entry = cache->buckets[hash & (cache->num_buckets - 1)];
+    while (entry && !(entry->hash == hash && entry->key_len == key_len && memcmp(entry->key, key, key_len) == 0)) {
+        entry = entry->hash_next;
+    }
+    if (!entry) {
+        return NULL;
+    }
+    if (now_ms >= entry->expires_ms) {
+        evict_entry(cache, entry);
+        return NULL;
+    }
+    move_to_front(cache, entry);
+    return entry;
+}
+
+// The encodings the client accepts, which decide whether the handler's
+// response is gzipped, the decoded path and the query, then the value of
+// every header the route varies on. Returns the length, or 0 if the key
+// doesn't fit
+static size_t build_key(const ClientInfo *client, const Request *req, const CachePolicy *policy, char *key)
+{
+    if (req->path.len + req->query.len + 2 >= MAX_CACHE_KEY_LEN) {
+        return 0;
+    }
+    key[0] = client->accepted_encodings;
+    memcpy(key + 1, req->path.data, req->path.len);
+    size_t len = req->path.len + 1;
+    key[len++] = '\0';
+    memcpy(key + len, req->query.data, req->query.len);
+    len += req->query.len;
+    for (const char *const *name = policy->vary; *name; name++) {
+        const StringView *value = find_request_header(req, *name);
+        size_t value_len = value ? value->len : 0;
+        if (len + 1 + value_len > MAX_CACHE_KEY_LEN) {
+            return 0;
+        }
+        // NUL can't appear in a path, a query or a header value, so keys
+        // can't collide
+        key[len++] = '\0';
+        if (value_len > 0) {
+            memcpy(key + len, value->data, value_len);
+            len += value_len;
+        }
+    }
+    return len;
+}
+
+// If-None-Match holds "*" or a list of entity tags, matched with the weak
+// comparison RFC 9110 asks for, so a W/ prefix is ignored
+static bool etag_matches(const Request *req, const CachedResponse *entry)
+{
+    const StringView *header = request_header(req, HEADER_IF_NONE_MATCH);
+    if (!header) {
+        return false;
+    }
+    const char *c = header->data, *end = header->data + header->len;
+    while (c < end) {
+        while (c < end && (*c == ' ' || *c == '\t' || *c == ',')) {
+            c++;
+        }
+        if (c < end && *c == '*') {
+            return true;
+        }
+        if (end - c >= 2 && c[0] == 'W' && c[1] == '/') {
+            c += 2;
+        }
+        const char *tag = c;
+        while (c < end && *c != ',') {
+            c++;
+        }
+        const char *tag_end = c;
+        while (tag_end > tag && (tag_end[-1] == ' ' || tag_end[-1] == '\t')) {
+            tag_end--;
+        }
+        if ((size_t)(tag_end - tag) == ETAG_LEN && memcmp(tag, entry->etag, ETAG_LEN) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Queue the entry's 200, or its 304, without copying any of it. HEAD gets
+// the 200's headers alone
+static void send_entry(ClientInfo *client, CachedResponse *entry, bool not_modified)
+{
+    Worker *worker = client->worker;
+    const char *date = update_date_cache(&worker->date);
+    if (entry->date_second != worker->date.second) {
+        memcpy(entry->head + entry->head_date_offset, date, HTTP_DATE_LEN);
+        memcpy(entry->not_modified + entry->not_modified_date_offset, date, HTTP_DATE_LEN);
+        entry->date_second = worker->date.second;
+    }
+
+    entry->refs++;
+    if (!client_hold(client, release_entry, entry)) {
+        unref_entry(entry);
+        client->state = CLIENT_DONE;
+        return;
+    }
+    size_t connection_len;
+    const char *connection = connection_header_line(client, &connection_len);
+    bool queued = not_modified
+        ? queue_client_output(client, entry->not_modified, entry->not_modified_len)
+            && queue_client_output(client, connection, connection_len) && queue_client_output(client, "\r\n", 2)
+        : queue_client_output(client, entry->head, entry->head_len)
+            && queue_client_output(client, connection, connection_len)
+            && queue_client_output(client, entry->rest, client->head_request ? entry->rest_headers_len : entry->rest_len);
+    if (!queued) {
+        client->state = CLIENT_DONE;
+    }
+    client->status_code = not_modified ? 304 : 200;
+}
+
+/**
+ * Answer a request for a cacheable route from the worker's cache if there
+ * is a fresh entry, or run the handler and keep the 200 it writes. Entries
+ * carry a strong ETag, and requests whose If-None-Match matches get a 304
+ * @param client Client that sent the request
+ * @param req Parsed request
+ * @param match Route the request matched, its cache policy decides
+ * @param handler The route's handler, called on misses
+ */
+void serve_cacheable(ClientInfo *client, Request *req, const RouteMatch *match, RouteHandler handler)
+{
+    Worker *worker = client->worker;
+    ResponseCache *cache = &worker->response_cache;
+    char key[MAX_CACHE_KEY_LEN];
+    size_t key_len = 0;
+    if (match->cache && cache->max_bytes > 0 && (req->method == METHOD_GET || req->method == METHOD_HEAD)) {
+        key_len = build_key(client, req, match->cache, key);
+    }
+    if (key_len == 0) {
+        handler(client, req, match);
+        return;
+    }
+
+    uint64_t hash = hash_bytes(0xcbf29ce484222325ULL, key, key_len);
+    CachedResponse *entry = find_entry(cache, hash, key, key_len, worker->loop->timers.now_ms);
+    if (entry) {
+        metrics_add(&worker->metrics.cache_hits, 1);
+        send_entry(client, entry, etag_matches(req, entry));
+        return;
+    }
+
+    metrics_add(&worker->metrics.cache_misses, 1);
+    CacheFill fill = { .policy = match->cache, .req = req, .hash = hash, .key = key, .key_len = key_len };
+    client->cache_fill = &fill;
+    handler(client, req, match);
+    client->cache_fill = NULL;
+}
+
+// ETag, then Vary if the route has variants, after the handler's own headers
+static size_t build_extra_headers(char *buf, size_t size, const Response *res, const CachePolicy *policy,
+    const char *etag)
+{
+    if (res->extra_headers_len + ETAG_LEN + 8 > size) {
+        return 0;
+    }
+    size_t len = res->extra_headers_len;
+    memcpy(buf, res->extra_headers, len);
+    len += snprintf(buf + len, size - len, "ETag: %s\r\n", etag);
+    for (size_t i = 0; policy->vary[i]; i++) {
+        int written = snprintf(buf + len, size - len, "%s%s", i == 0 ? "Vary: " : ", ", policy->vary[i]);
+        if (written < 0 || (size_t)written + 2 >= size - len) {
+            return 0;
+        }
+        len += written;
+        if (!policy->vary[i + 1]) {
+            buf[len++] = '\r';
+            buf[len++] = '\n';
+        }
+    }
+    return len;
+}
+
+/**
+ * Store the response a cacheable route's handler wrote, and queue it from
+ * the new entry. Called by write_response while a miss is being filled
+ * @param client Client being answered
+ * @param res The handler's response
+ * @return Whether the response was stored and queued, if not it is written
+ * as usual
+ */
+bool cache_response(ClientInfo *client, const Response *res)
+{
+    CacheFill *fill = client->cache_fill;
+    // Only the first response of the request is the route's
+    client->cache_fill = NULL;
+    Worker *worker = client->worker;
+    ResponseCache *cache = &worker->response_cache;
+    if (res->status != STATUS_OK || !res->content_body) {
+        return false;
+    }
+
+    char etag[ETAG_LEN + 1];
+    uint64_t body_hash = hash_bytes(0xcbf29ce484222325ULL ^ res->content_type, res->content_body, res->content_len);
+    snprintf(etag, sizeof(etag), "\"%016llx\"", (unsigned long long)body_hash);
+
+    // Serialized without a Connection line, which is queued per client
+    char extra[MAX_RESPONSE_HEADERS_LEN];
+    Response stored = *res;
+    stored.connection = CONNECTION_DEFAULT;
+    stored.extra_headers = extra;
+    stored.extra_headers_len = build_extra_headers(extra, sizeof(extra), res, fill->policy, etag);
+    if (stored.extra_headers_len == 0) {
+        return false;
+    }
+    char headers[MAX_RESPONSE_HEADERS_LEN];
+    const char *date = update_date_cache(&worker->date);
+    size_t headers_len = marshal_response(headers, sizeof(headers), &stored, date);
+    char length[32];
+    size_t tail_len = snprintf(length, sizeof(length), "Content-Length: %zu\r\n\r\n", res->content_len);
+    if (headers_len == 0 || headers_len < tail_len) {
+        return false;
+    }
+    size_t head_len = headers_len - tail_len;
+
+    // The 304 repeats the validators and Vary, the body's headers are left out
+    char not_modified[MAX_RESPONSE_HEADERS_LEN];
+    int not_modified_len = snprintf(not_modified, sizeof(not_modified),
+        "HTTP/1.1 304 Not Modified\r\nDate: %s\r\n%.*s%s", date,
+        (int)(stored.extra_headers_len - res->extra_headers_len), extra + res->extra_headers_len,
+        res->content_encoding != CONTENT_ENCODING_NONE ? "Vary: Accept-Encoding\r\n" : "");
+    if (not_modified_len < 0 || (size_t)not_modified_len >= sizeof(not_modified)) {
+        return false;
+    }
+
+    size_t size = sizeof(CachedResponse) + fill->key_len + headers_len + res->content_len + not_modified_len;
+    if (size > cache->max_bytes / MAX_ENTRY_SHARE) {
+        return false;
+    }
+    CachedResponse *entry = malloc(size);
+    if (!entry) {
+        return false;
+    }
+    entry->hash = fill->hash;
+    unsigned ttl_ms = fill->policy->ttl_ms ? fill->policy->ttl_ms : cache->ttl_ms;
+    entry->expires_ms = worker->loop->timers.now_ms + ttl_ms;
+    entry->size = size;
+    entry->refs = 1;
+    entry->cached = true;
+    entry->date_second = worker->date.second;
+    memcpy(entry->etag, etag, sizeof(etag));
+    entry->key_len = fill->key_len;
+    memcpy(entry->key, fill->key, fill->key_len);
+
+    entry->head = entry->key + fill->key_len;
+    entry->head_len = head_len;
+    memcpy(entry->head, headers, head_len);
+    entry->head_date_offset = strstr(headers, DATE_LINE) - headers + sizeof(DATE_LINE) - 1;
+    entry->rest = entry->head + head_len;
+    entry->rest_len = tail_len + res->content_len;
+    entry->rest_headers_len = tail_len;
+    memcpy(entry->rest, length, tail_len);
+    memcpy(entry->rest + tail_len, res->content_body, res->content_len);
+    entry->not_modified = entry->rest + entry->rest_len;
+    entry->not_modified_len = not_modified_len;
+    memcpy(entry->not_modified, not_modified, not_modified_len);
+    entry->not_modified_date_offset = strstr(not_modified, DATE_LINE) - not_modified + sizeof(DATE_LINE) - 1;
+
+    // Make room, least recently used first
+    while (cache->lru_tail && cache->bytes + size > cache->max_bytes) {
+        evict_entry(cache, cache->lru_tail);
+    }
+    CachedResponse **bucket = &cache->buckets[entry->hash & (cache->num_buckets - 1)];
+    entry->hash_next = *bucket;
+    *bucket = entry;
+    entry->lru_prev = NULL;
+    entry->lru_next = cache->lru_head;
+    if (cache->lru_head) {
+        cache->lru_head->lru_prev = entry;
+    } else {
+        cache->lru_tail = entry;
+    }
+    cache->lru_head = entry;
+    cache->bytes += size;
+
+    send_entry(client, entry, etag_matches(fill->req, entry));
+    return true;
+}
@@ -0,0 +1,71 @@
+#ifndef RESPONSE_CACHE_H
+#define RESPONSE_CACHE_H
+
+#include "client_info.h"
+#include "request.h"
+#include "response.h"
+#include "router.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#define DEFAULT_RESPONSE_CACHE_SIZE (16 * 1024 * 1024)
+#define DEFAULT_RESPONSE_CACHE_TTL_MS 60000
+#define MAX_CACHE_VARY 4
+#define MAX_CACHE_KEY_LEN 1024
+#define ETAG_LEN 18 // 16 hex digits in quotes
+
+// How a route's responses may be cached, registered with router_add_cached
+typedef struct CachePolicy {
+    unsigned ttl_ms; // How long a response stays fresh, 0 for the server's default
+    // Request headers that select between variants, e.g. "Accept-Encoding",
+    // NULL after the last. They are part of the key and listed in Vary
+    const char *vary[MAX_CACHE_VARY + 1];
+} CachePolicy;
+
+// A handler's 200 response, serialized once and then queued straight from
+// here. The Connection line differs per client, so it is queued on its own
+// between head and rest
+typedef struct CachedResponse {
+    struct CachedResponse *hash_next;
+    struct CachedResponse *lru_prev; // Towards the most recently used
+    struct CachedResponse *lru_next;
+    uint64_t hash;
+    uint64_t expires_ms; // Loop time after which the entry is refetched
+    size_t size; // Bytes counted against the cache's budget
+    int refs; // The cache's own reference plus one per queued send
+    bool cached; // Still findable, otherwise freed once the last send is done
+    time_t date_second; // Second the Date lines were formatted for
+    char *head; // Status line through the extra headers
+    size_t head_len;
+    size_t head_date_offset;
+    char *rest; // Content-Length, the blank line and the body
+    size_t rest_len;
+    size_t rest_headers_len; // rest without the body, for HEAD
+    char *not_modified; // The 304 up to the Connection line
+    size_t not_modified_len;
+    size_t not_modified_date_offset;
+    char etag[ETAG_LEN + 1];
+    size_t key_len;
+    char key[]; // Followed by head, rest and not_modified
+} CachedResponse;
+
+// One worker's shard of the cache, never shared between workers, so
+// lookups and updates need no locks
+typedef struct ResponseCache {
+    CachedResponse **buckets;
+    size_t num_buckets; // Power of two
+    CachedResponse *lru_head; // Most recently used
+    CachedResponse *lru_tail;
+    size_t bytes; // Sum of the entries' sizes
+    size_t max_bytes; // 0 when the cache is off
+    unsigned ttl_ms; // Default freshness
+} ResponseCache;
+
+extern int response_cache_init(ResponseCache *cache, size_t max_bytes, unsigned ttl_ms);
+extern void response_cache_destroy(ResponseCache *cache);
+extern void serve_cacheable(ClientInfo *client, Request *req, const RouteMatch *match, RouteHandler handler);
+extern bool cache_response(ClientInfo *client, const Response *res);
+
+#endif // RESPONSE_CACHE_H
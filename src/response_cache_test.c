@@ -0,0 +1,238 @@
+#include "response.h"
+#include "response_cache.h"
+#include "router.h"
+#include "server.h"
+#include "test.h"
+#include "worker.h"
+#include <netinet/in.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#define MAX_MESSAGE 8192
+#define BODY_LEN 1000
+#define CACHE_SIZE (16 * 1024)
+#define SHORT_TTL_MS 200
+#define LRU_FILL 30
+
+static const CachePolicy DEFAULT_POLICY = { .ttl_ms = 0, .vary = { NULL } };
+static const CachePolicy SHORT_POLICY = { .ttl_ms = SHORT_TTL_MS, .vary = { NULL } };
+
+static Router router;
+static atomic_int handler_calls;
+static int server_port;
+
+// A body of BODY_LEN bytes that differs per name, so every entry is the
+// same size and has its own ETag
+static void handle_cached(ClientInfo *client, Request *req, const RouteMatch *match)
+{
+    (void)req;
+    atomic_fetch_add(&handler_calls, 1);
+    const StringView *name = route_param(match, "name");
+    Response res = { 0 };
+    res.status = STATUS_OK;
+    res.content_type = CONTENT_TYPE_PLAINTEXT;
+    res.content_len = BODY_LEN;
+    res.content_body = client_alloc(client, BODY_LEN);
+    if (!res.content_body) {
+        client->state = CLIENT_DONE;
+        return;
+    }
+    for (size_t i = 0; i < BODY_LEN; i++) {
+        res.content_body[i] = name->data[i % name->len];
+    }
+    write_response(client, &res);
+}
+
+static void handle_request(ClientInfo *client, RequestOrError *req_or_err)
+{
+    RouteMatch match;
+    RouteHandler handler;
+    if (!req_or_err->has_error
+        && router_lookup(&router, req_or_err->data.req.method, req_or_err->data.req.path, &match, &handler)
+            == ROUTE_FOUND) {
+        serve_cacheable(client, &req_or_err->data.req, &match, handler);
+        return;
+    }
+    Response res = { 0 };
+    res.status = req_or_err->has_error ? STATUS_BAD_REQUEST : STATUS_NOT_FOUND;
+    res.content_type = CONTENT_TYPE_PLAINTEXT;
+    write_response(client, &res);
+}
+
+// GET path with the extra header lines on a new connection, read until the
+// server closes it
+static size_t get(const char *path, const char *headers, char *response)
+{
+    char request[512];
+    int request_len = snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: a\r\n%sConnection: close\r\n\r\n",
+        path, headers);
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(server_port) };
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct timeval timeout = { .tv_sec = 5 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    size_t len = 0;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0
+        && send(fd, request, request_len, MSG_NOSIGNAL) == request_len) {
+        ssize_t n;
+        while (len < MAX_MESSAGE - 1 && (n = recv(fd, response + len, MAX_MESSAGE - 1 - len, 0)) > 0) {
+            len += n;
+        }
+    }
+    close(fd);
+    response[len] = '\0';
+    return len;
+}
+
+// Status of a GET, and how many times the handler ran for it
+static int get_status(const char *path, const char *headers, char *response, int *calls)
+{
+    int before = atomic_load(&handler_calls);
+    get(path, headers, response);
+    *calls = atomic_load(&handler_calls) - before;
+    return strncmp(response, "HTTP/1.1 ", 9) == 0 ? atoi(response + 9) : 0;
+}
+
+static const char *body_of(const char *response)
+{
+    const char *end = strstr(response, "\r\n\r\n");
+    return end ? end + 4 : "";
+}
+
+// Entity tags are compared weakly, in a list or as "*", on hits and misses
+static void test_etag(char *response)
+{
+    int calls;
+    CHECK(get_status("/c/etag", "", response, &calls) == 200 && calls == 1);
+    CHECK(strlen(body_of(response)) == BODY_LEN);
+    const char *found = strstr(response, "\r\nETag: ");
+    CHECK(found != NULL);
+    if (!found) {
+        return;
+    }
+    char etag[ETAG_LEN + 1];
+    memcpy(etag, found + 8, ETAG_LEN);
+    etag[ETAG_LEN] = '\0';
+    CHECK(etag[0] == '"' && etag[ETAG_LEN - 1] == '"');
+
+    char header[256];
+    const char *matching[] = { "%s", "W/%s", "*", "\"0000000000000000\", W/%s", "\"0000000000000000\",%s ", "\t%s" };
+    for (size_t i = 0; i < sizeof(matching) / sizeof(matching[0]); i++) {
+        char value[128];
+        snprintf(value, sizeof(value), matching[i], etag);
+        snprintf(header, sizeof(header), "If-None-Match: %s\r\n", value);
+        CHECK(get_status("/c/etag", header, response, &calls) == 304 && calls == 0);
+        CHECK(strstr(response, etag) != NULL);
+        CHECK(*body_of(response) == '\0');
+    }
+
+    const char *other[] = { "\"0000000000000000\"", "W/\"0000000000000000\"", "%.16s", "w/%s" };
+    for (size_t i = 0; i < sizeof(other) / sizeof(other[0]); i++) {
+        char value[128];
+        snprintf(value, sizeof(value), other[i], etag + 1);
+        snprintf(header, sizeof(header), "If-None-Match: %s\r\n", value);
+        CHECK(get_status("/c/etag", header, response, &calls) == 200 && calls == 0);
+        CHECK(strlen(body_of(response)) == BODY_LEN);
+    }
+
+    // The response just stored is matched too
+    CHECK(get_status("/c/fresh", "If-None-Match: *\r\n", response, &calls) == 304 && calls == 1);
+}
+
+static size_t cached_entries(const ResponseCache *cache)
+{
+    size_t count = 0;
+    for (const CachedResponse *entry = cache->lru_head; entry; entry = entry->lru_next) {
+        count++;
+    }
+    return count;
+}
+
+// The budget holds, and the entry used longest ago is the one evicted
+static void test_lru(Worker *worker, char *response)
+{
+    char path[32];
+    int calls;
+    for (int i = 0; i < LRU_FILL; i++) {
+        snprintf(path, sizeof(path), "/c/l%02d", i);
+        CHECK(get_status(path, "", response, &calls) == 200 && calls == 1);
+    }
+    // The worker is idle once the responses are in
+    size_t count = cached_entries(&worker->response_cache);
+    CHECK(worker->response_cache.bytes <= CACHE_SIZE);
+    CHECK(count >= 3 && count < LRU_FILL);
+    if (count < 3 || count >= LRU_FILL) {
+        return;
+    }
+
+    int oldest = LRU_FILL - count;
+    snprintf(path, sizeof(path), "/c/l%02d", oldest - 1);
+    CHECK(get_status(path, "", response, &calls) == 200 && calls == 1);
+    // That evicted oldest, using the next one keeps it ahead of the one after
+    oldest++;
+    snprintf(path, sizeof(path), "/c/l%02d", oldest);
+    CHECK(get_status(path, "", response, &calls) == 200 && calls == 0);
+    snprintf(path, sizeof(path), "/c/l%02d", LRU_FILL);
+    CHECK(get_status(path, "", response, &calls) == 200 && calls == 1);
+    CHECK(cached_entries(&worker->response_cache) == count);
+
+    snprintf(path, sizeof(path), "/c/l%02d", oldest);
+    CHECK(get_status(path, "", response, &calls) == 200 && calls == 0);
+    snprintf(path, sizeof(path), "/c/l%02d", oldest + 1);
+    CHECK(get_status(path, "", response, &calls) == 200 && calls == 1);
+}
+
+// Entries are refetched once their route's TTL has passed
+static void test_ttl(char *response)
+{
+    int calls;
+    CHECK(get_status("/ttl/a", "", response, &calls) == 200 && calls == 1);
+    CHECK(get_status("/ttl/a", "", response, &calls) == 200 && calls == 0);
+    usleep((SHORT_TTL_MS + 100) * 1000);
+    CHECK(get_status("/ttl/a", "", response, &calls) == 200 && calls == 1);
+    CHECK(get_status("/ttl/a", "", response, &calls) == 200 && calls == 0);
+}
+
+int main()
+{
+    if (router_init(&router) < 0
+        || router_add_cached(&router, METHOD_GET, "/c/:name", handle_cached, &DEFAULT_POLICY) < 0
+        || router_add_cached(&router, METHOD_GET, "/ttl/:name", handle_cached, &SHORT_POLICY) < 0) {
+        return 1;
+    }
+
+    const char *backends[] = { "epoll", "io_uring" };
+    char *response = malloc(MAX_MESSAGE);
+    for (size_t b = 0; b < sizeof(backends) / sizeof(backends[0]); b++) {
+        static ServerConfig config;
+        init_server_config(&config);
+        config.port = 0;
+        config.backend = backends[b];
+        config.handler = handle_request;
+        config.metrics_path = NULL;
+        config.response_cache_size = CACHE_SIZE;
+
+        // Workers run until the process exits
+        Worker *worker = create_worker(&config, b, -1);
+        if (!worker) {
+            // io_uring may not be available here
+            continue;
+        }
+        struct sockaddr_in addr;
+        socklen_t addr_len = sizeof(addr);
+        getsockname(worker->listen_handle.fd, (struct sockaddr *)&addr, &addr_len);
+        server_port = ntohs(addr.sin_port);
+        if (start_worker(worker) < 0) {
+            return 1;
+        }
+        test_etag(response);
+        test_lru(worker, response);
+        test_ttl(response);
+    }
+    free(response);
+    return TEST_RESULT();
+}
@@ -0,0 +1,112 @@
+#include "response.h"
+#include "test.h"
+#include "worker.h"
+#include <string.h>
+
+static const char BODY[] = "Not Found";
+static const char EXTRA_HEADERS[] = "Retry-After: 1\r\n";
+static const Response NOT_FOUND = {
+    .status = STATUS_NOT_FOUND,
+    .content_type = CONTENT_TYPE_PLAINTEXT,
+    .content_body = (char *)BODY,
+    .content_len = sizeof(BODY) - 1,
+};
+static const Response UNAVAILABLE = {
+    .status = STATUS_SERVICE_UNAVAILABLE,
+    .content_type = CONTENT_TYPE_PLAINTEXT,
+    .extra_headers = EXTRA_HEADERS,
+    .extra_headers_len = sizeof(EXTRA_HEADERS) - 1,
+};
+
+// Only what the prepared responses need of a worker
+static Worker worker;
+
+static void test_http_date()
+{
+    char date[HTTP_DATE_LEN + 1];
+    format_http_date(date, 784111777);
+    CHECK(strcmp(date, "Sun, 06 Nov 1994 08:49:37 GMT") == 0);
+    format_http_date(date, 0);
+    CHECK(strcmp(date, "Thu, 01 Jan 1970 00:00:00 GMT") == 0);
+    CHECK(strlen(date) == HTTP_DATE_LEN);
+}
+
+// Every variant is the whole response, with today's Date where date_offset says
+static void test_prepared(StaticResponseId id, const char *status_line, const char *body)
+{
+    static const char *connection_lines[CONNECTION_HEADER_COUNT] = {
+        [CONNECTION_DEFAULT] = NULL,
+        [CONNECTION_CLOSE] = "Connection: close\r\n",
+        [CONNECTION_KEEP_ALIVE] = "Connection: keep-alive\r\n",
+    };
+    for (int connection = 0; connection < CONNECTION_HEADER_COUNT; connection++) {
+        const PreparedResponse *prepared = current_static_response(&worker, id, connection);
+        char copy[1024];
+        CHECK(prepared->len < sizeof(copy));
+        memcpy(copy, prepared->data, prepared->len);
+        copy[prepared->len] = '\0';
+
+        CHECK(strncmp(copy, status_line, strlen(status_line)) == 0);
+        CHECK(strncmp(copy + prepared->date_offset - 6, "Date: ", 6) == 0);
+        CHECK(memcmp(copy + prepared->date_offset, worker.date.value, HTTP_DATE_LEN) == 0);
+        CHECK(prepared->date_second == worker.date.second);
+        CHECK(prepared->headers_len >= 4 && memcmp(copy + prepared->headers_len - 4, "\r\n\r\n", 4) == 0);
+        CHECK(strcmp(copy + prepared->headers_len, body) == 0);
+        copy[prepared->headers_len] = '\0';
+        CHECK(connection_lines[connection] ? strstr(copy, connection_lines[connection]) != NULL
+                                           : strstr(copy, "Connection:") == NULL);
+    }
+}
+
+// A prepared response from an earlier second gets the current Date, and
+// nothing else about it changes
+static void test_date_patched(StaticResponseId id)
+{
+    PreparedResponse *prepared = &worker.static_responses.responses[id * CONNECTION_HEADER_COUNT + CONNECTION_CLOSE];
+    char before[1024];
+    memcpy(before, prepared->data, prepared->len);
+    size_t len = prepared->len;
+
+    memset(prepared->data + prepared->date_offset, 'x', HTTP_DATE_LEN);
+    prepared->date_second--;
+    const PreparedResponse *current = current_static_response(&worker, id, CONNECTION_CLOSE);
+    CHECK(current == prepared);
+    CHECK(current->len == len);
+    CHECK(current->date_second == worker.date.second);
+    CHECK(memcmp(current->data + current->date_offset, worker.date.value, HTTP_DATE_LEN) == 0);
+    CHECK(memcmp(current->data, before, current->date_offset) == 0);
+    CHECK(memcmp(current->data + current->date_offset + HTTP_DATE_LEN, before + current->date_offset + HTTP_DATE_LEN,
+              len - current->date_offset - HTTP_DATE_LEN)
+        == 0);
+
+    // Within the same second it is left alone, so a marker survives unless
+    // the clock ticked meanwhile
+    for (int attempt = 0; attempt < 3; attempt++) {
+        time_t second = prepared->date_second;
+        prepared->data[prepared->date_offset] = '#';
+        current_static_response(&worker, id, CONNECTION_CLOSE);
+        if (worker.date.second == second) {
+            CHECK(prepared->data[prepared->date_offset] == '#');
+            prepared->date_second--;
+            current_static_response(&worker, id, CONNECTION_CLOSE);
+            CHECK(prepared->data[prepared->date_offset] == worker.date.value[0]);
+            break;
+        }
+    }
+}
+
+int main()
+{
+    StaticResponseId not_found = register_static_response(&NOT_FOUND);
+    StaticResponseId unavailable = register_static_response(&UNAVAILABLE);
+    CHECK(not_found >= 0 && unavailable >= 0);
+    CHECK(prepare_static_responses(&worker.static_responses, &worker.date) == 0);
+
+    test_http_date();
+    test_prepared(not_found, "HTTP/1.1 404 Not Found\r\nDate: ", BODY);
+    test_prepared(unavailable, "HTTP/1.1 503 Service Unavailable\r\nDate: ", "");
+    test_date_patched(not_found);
+    test_date_patched(unavailable);
+    free_static_responses(&worker.static_responses);
+    return TEST_RESULT();
+}
@@ -0,0 +1,407 @@
+#include "router.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef enum NodeType {
+    NODE_STATIC, // Matches its label exactly
+    NODE_PARAM, // ":name", matches one non-empty segment
+    NODE_WILDCARD, // "*name", matches the rest of the path
+} NodeType;
+
+// A node of the compressed tree. Static children never share a first byte,
+// so picking one costs a memchr over at most 256 bytes whatever the number
+// of routes
+struct RouteNode {
+    NodeType type;
+    char *label; // Static text, or the parameter's name
+    size_t label_len;
+    char *indices; // First byte of each static child
+    RouteNode **children;
+    size_t num_children;
+    RouteNode *param; // At most one of each, their names must agree
+    RouteNode *wildcard;
+    unsigned methods; // Bit per method with a handler
+    RouteHandler handlers[METHOD_COUNT];
+    const struct CachePolicy *cache[METHOD_COUNT]; // NULL where responses aren't cacheable
+    OffloadHandler offload[METHOD_COUNT]; // Set instead of the handler for offloaded routes
+};
+
+static RouteNode *create_node(NodeType type, const char *label, size_t label_len)
+{
+    RouteNode *node = calloc(1, sizeof(RouteNode));
+    if (!node) {
+        return NULL;
+    }
+    node->type = type;
+    node->label = malloc(label_len + 1);
+    if (!node->label) {
+        free(node);
+        return NULL;
+    }
+    memcpy(node->label, label, label_len);
+    node->label[label_len] = '\0';
+    node->label_len = label_len;
+    return node;
+}
+
+static void free_node(RouteNode *node)
+{
+    if (!node) {
+        return;
+    }
+    for (size_t i = 0; i < node->num_children; i++) {
+        free_node(node->children[i]);
+    }
+    free_node(node->param);
+    free_node(node->wildcard);
+    free(node->children);
+    free(node->indices);
+    free(node->label);
+    free(node);
+}
+
+int router_init(Router *router)
+{
+    router->root = create_node(NODE_STATIC, "", 0);
+    return router->root ? 0 : -1;
+}
+
+void router_destroy(Router *router)
+{
+    free_node(router->root);
+    router->root = NULL;
+}
+
+static int add_child(RouteNode *node, RouteNode *child)
+{
+    RouteNode **children = realloc(node->children, (node->num_children + 1) * sizeof(RouteNode *));
+    if (!children) {
+        return -1;
+    }
+    node->children = children;
+    char *indices = realloc(node->indices, node->num_children + 1);
+    if (!indices) {
+        return -1;
+    }
+    node->indices = indices;
+    node->children[node->num_children] = child;
+    node->indices[node->num_children] = child->label[0];
+    node->num_children++;
+    return 0;
+}
+
+// Split a static child so its label is only the first len bytes, with the
+// rest moved into a new node below it
+static RouteNode *split_child(RouteNode *node, size_t index, size_t len)
+{
+    RouteNode *child = node->children[index];
+    RouteNode *head = create_node(NODE_STATIC, child->label, len);
+    if (!head) {
+        return NULL;
+    }
+    memmove(child->label, child->label + len, child->label_len - len + 1);
+    child->label_len -= len;
+    if (add_child(head, child) < 0) {
+        // Put the label back, the tree must stay as it was
+        memmove(child->label + len, child->label, child->label_len + 1);
+        memcpy(child->label, head->label, len);
+        child->label_len += len;
+        free_node(head);
+        return NULL;
+    }
+    node->children[index] = head;
+    return head;
+}
+
+// Find or make the param or wildcard child called name
+static RouteNode *dynamic_child(RouteNode **slot, NodeType type, const char *name, size_t len, const char *pattern)
+{
+    if (*slot) {
+        if ((*slot)->label_len != len || memcmp((*slot)->label, name, len) != 0) {
+            fprintf(stderr, "Route %s conflicts with parameter %s\n", pattern, (*slot)->label);
+            return NULL;
+        }
+        return *slot;
+    }
+    *slot = create_node(type, name, len);
+    return *slot;
+}
+
+// Insert the rest of a pattern below node, whose own label is already matched
+static RouteNode *insert_route(RouteNode *node, const char *rest, const char *pattern)
+{
+    while (*rest) {
+        if (*rest == ':' || *rest == '*') {
+            NodeType type = *rest == ':' ? NODE_PARAM : NODE_WILDCARD;
+            const char *name = rest + 1;
+            size_t len = type == NODE_PARAM ? strcspn(name, "/") : strlen(name);
+            if (len == 0 || (type == NODE_WILDCARD && strchr(name, '/'))) {
+                fprintf(stderr, "Route %s has an unnamed or misplaced parameter\n", pattern);
+                return NULL;
+            }
+            node = dynamic_child(type == NODE_PARAM ? &node->param : &node->wildcard, type, name, len, pattern);
+            if (!node) {
+                return NULL;
+            }
+            rest = name + len;
+            continue;
+        }
+
+        // Static text runs up to the next parameter
+        size_t len = strcspn(rest, ":*");
+        const char *found = node->num_children ? memchr(node->indices, *rest, node->num_children) : NULL;
+        if (!found) {
+            RouteNode *child = create_node(NODE_STATIC, rest, len);
+            if (!child || add_child(node, child) < 0) {
+                free_node(child);
+                return NULL;
+            }
+            node = child;
+            rest += len;
+            continue;
+        }
+
+        size_t index = found - node->indices;
+        RouteNode *child = node->children[index];
+        size_t common = 0;
+        while (common < len && common < child->label_len && rest[common] == child->label[common]) {
+            common++;
+        }
+        if (common < child->label_len) {
+            child = split_child(node, index, common);
+            if (!child) {
+                return NULL;
+            }
+        }
+        node = child;
+        rest += common;
+    }
+    return node;
+}
+
+// The node a new route's handler goes in, NULL if the route can't be added
+static RouteNode *add_route(Router *router, RequestMethod method, const char *pattern)
+{
+    size_t params = 0;
+    for (const char *c = pattern; *c; c++) {
+        params += *c == ':' || *c == '*';
+    }
+    if (pattern[0] != '/' || params > MAX_ROUTE_PARAMS || (unsigned)method >= METHOD_COUNT) {
+        fprintf(stderr, "Invalid route %s\n", pattern);
+        return NULL;
+    }
+
+    RouteNode *node = insert_route(router->root, pattern, pattern);
+    if (!node) {
+        return NULL;
+    }
+    if (node->methods & (1u << method)) {
+        fprintf(stderr, "Route %s is already registered\n", pattern);
+        return NULL;
+    }
+    node->methods |= 1u << method;
+    return node;
+}
+
+/**
+ * Register a handler for a method and path pattern. Patterns are literal
+ * paths in which ":name" captures one segment and a final "*name" captures
+ * the rest of the path, e.g. "/users/:id" or "/files/" followed by "*path"
+ * @param router Router to add to
+ * @param method Method the handler answers
+ * @param pattern Pattern starting with '/', copied
+ * @param handler Called for matching requests
+ * @return 0 on success, -1 if the pattern is invalid, conflicts or is taken
+ */
+int router_add(Router *router, RequestMethod method, const char *pattern, RouteHandler handler)
+{
+    return router_add_cached(router, method, pattern, handler, NULL);
+}
+
+/**
+ * Register a handler whose responses may be kept in the response cache, see
+ * serve_cacheable
+ * @param router Router to add to
+ * @param method Method the handler answers
+ * @param pattern Pattern starting with '/', copied
+ * @param handler Called for matching requests that aren't answered from the cache
+ * @param cache How responses are cached, must outlive the router. NULL is
+ * the same as router_add
+ * @return 0 on success, -1 if the pattern is invalid, conflicts or is taken
+ */
+int router_add_cached(Router *router, RequestMethod method, const char *pattern, RouteHandler handler,
+    const struct CachePolicy *cache)
+{
+    RouteNode *node = add_route(router, method, pattern);
+    if (!node) {
+        return -1;
+    }
+    node->handlers[method] = handler;
+    node->cache[method] = cache;
+    return 0;
+}
+
+/**
+ * Register a handler that runs on an offload thread, for work that would
+ * hold up every other connection of the worker, see offload_request
+ * @param router Router to add to
+ * @param method Method the handler answers
+ * @param pattern Pattern starting with '/', copied
+ * @param handler Called on an offload thread for matching requests
+ * @return 0 on success, -1 if the pattern is invalid, conflicts or is taken
+ */
+int router_add_offloaded(Router *router, RequestMethod method, const char *pattern, OffloadHandler handler)
+{
+    RouteNode *node = add_route(router, method, pattern);
+    if (!node) {
+        return -1;
+    }
+    node->offload[method] = handler;
+    return 0;
+}
+
+// Depth first, preferring static children over parameters over wildcards,
+// and backtracking when a branch dead ends. wanted is the method bits a
+// node needs to be accepted
+static const RouteNode *find_route(const RouteNode *node, const char *path, size_t len, unsigned wanted,
+    RouteMatch *match)
+{
+    if (len == 0 && (node->methods & wanted)) {
+        return node;
+    }
+
+    if (len > 0 && node->num_children) {
+        const char *found = memchr(node->indices, *path, node->num_children);
+        if (found) {
+            const RouteNode *child = node->children[found - node->indices];
+            if (child->label_len <= len && memcmp(child->label, path, child->label_len) == 0) {
+                const RouteNode *result = find_route(child, path + child->label_len, len - child->label_len,
+                    wanted, match);
+                if (result) {
+                    return result;
+                }
+            }
+        }
+    }
+
+    if (node->param && len > 0 && *path != '/' && match->num_params < MAX_ROUTE_PARAMS) {
+        const char *end = memchr(path, '/', len);
+        size_t segment = end ? (size_t)(end - path) : len;
+        RouteParam *param = &match->params[match->num_params++];
+        param->name = (StringView) { .data = node->param->label, .len = node->param->label_len };
+        param->value = (StringView) { .data = path, .len = segment };
+        const RouteNode *result = find_route(node->param, path + segment, len - segment, wanted, match);
+        if (result) {
+            return result;
+        }
+        match->num_params--;
+    }
+
+    if (node->wildcard && (node->wildcard->methods & wanted) && match->num_params < MAX_ROUTE_PARAMS) {
+        RouteParam *param = &match->params[match->num_params++];
+        param->name = (StringView) { .data = node->wildcard->label, .len = node->wildcard->label_len };
+        param->value = (StringView) { .data = path, .len = len };
+        return node->wildcard;
+    }
+
+    return NULL;
+}
+
+/**
+ * Find the handler for a request. Parameters are views into path, nothing
+ * is allocated. HEAD runs the GET route of a path that has no HEAD route of
+ * its own, write_response leaves the body out
+ * @param router Router to search
+ * @param method Request method
+ * @param path Request path, without the query
+ * @param match Filled with the captured parameters, and the allowed
+ * methods when the path only matched for other methods
+ * @param handler Set to the handler when the route is found, NULL if it is
+ * offloaded and match->offload is set instead
+ * @return Whether a handler was found, and if not why
+ */
+RouteResult router_lookup(const Router *router, RequestMethod method, StringView path,
+    RouteMatch *match, RouteHandler *handler)
+{
+    match->num_params = 0;
+    match->allowed_methods = 0;
+    match->cache = NULL;
+    match->offload = NULL;
+
+    unsigned wanted = 1u << method;
+    if (method == METHOD_HEAD) {
+        wanted |= 1u << METHOD_GET;
+    }
+    const RouteNode *node = find_route(router->root, path.data, path.len, wanted, match);
+    if (node) {
+        if (!(node->methods & (1u << method))) {
+            method = METHOD_GET;
+        }
+        *handler = node->handlers[method];
+        match->cache = node->cache[method];
+        match->offload = node->offload[method];
+        return ROUTE_FOUND;
+    }
+
+    // Only paths that exist for some other method get a 405
+    match->num_params = 0;
+    node = find_route(router->root, path.data, path.len, ~0u, match);
+    if (!node) {
+        return ROUTE_NOT_FOUND;
+    }
+    match->allowed_methods = node->methods;
+    return ROUTE_METHOD_NOT_ALLOWED;
+}
+
+// Value of a captured parameter, NULL if the route has none by that name
+const StringView *route_param(const RouteMatch *match, const char *name)
+{
+    for (size_t i = 0; i < match->num_params; i++) {
+        if (sv_equals(match->params[i].name, name)) {
+            return &match->params[i].value;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Write the Allow header line for a 405, HEAD is listed wherever GET is
+ * @param methods Bit per RequestMethod
+ * @param buf Buffer to write into
+ * @param buf_size Size of buf
+ * @return Bytes written, 0 if buf is too small
+ */
+size_t format_allow_header(unsigned methods, char *buf, size_t buf_size)
+{
+    static const char NAME[] = "Allow: ";
+    size_t len = sizeof(NAME) - 1;
+    if (len >= buf_size) {
+        return 0;
+    }
+    memcpy(buf, NAME, len);
+    if (methods & (1u << METHOD_GET)) {
+        methods |= 1u << METHOD_HEAD;
+    }
+
+    bool first = true;
+    for (size_t i = 0; i < sizeof(VALID_METHODS) / sizeof(VALID_METHODS[0]); i++) {
+        if (!(methods & (1u << VALID_METHODS[i]))) {
+            continue;
+        }
+        size_t name_len = strlen(VALID_METHODS_LITERALS[i]);
+        if (len + name_len + 4 > buf_size) {
+            return 0;
+        }
+        if (!first) {
+            buf[len++] = ',';
+            buf[len++] = ' ';
+        }
+        memcpy(buf + len, VALID_METHODS_LITERALS[i], name_len);
+        len += name_len;
+        first = false;
+    }
+    buf[len++] = '\r';
+    buf[len++] = '\n';
+    return len;
+}
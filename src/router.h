@@ -0,0 +1,60 @@
+#ifndef ROUTER_H
+#define ROUTER_H
+
+#include "client_info.h"
+#include "common.h"
+#include "request.h"
+#include <stddef.h>
+
+#define MAX_ROUTE_PARAMS 8
+
+struct CachePolicy;
+struct OffloadResult;
+
+typedef struct RouteParam {
+    StringView name; // Owned by the router
+    StringView value; // Points into the request path
+} RouteParam;
+
+struct RouteMatch;
+
+// Runs on an offload thread, away from the connection, see offload_request
+typedef void (*OffloadHandler)(const Request *req, const struct RouteMatch *match, struct OffloadResult *result);
+
+// Path parameters captured by a lookup, in pattern order
+typedef struct RouteMatch {
+    RouteParam params[MAX_ROUTE_PARAMS];
+    size_t num_params;
+    unsigned allowed_methods; // Bit per RequestMethod, filled in for ROUTE_METHOD_NOT_ALLOWED
+    const struct CachePolicy *cache; // Set for ROUTE_FOUND if the route's responses may be cached
+    OffloadHandler offload; // Set for ROUTE_FOUND if the route's handler runs on an offload thread
+} RouteMatch;
+
+typedef void (*RouteHandler)(ClientInfo *client, Request *req, const RouteMatch *match);
+
+typedef enum RouteResult {
+    ROUTE_FOUND,
+    ROUTE_NOT_FOUND,
+    ROUTE_METHOD_NOT_ALLOWED, // The path matched, but not for this method
+} RouteResult;
+
+typedef struct RouteNode RouteNode;
+
+// Routes are added before the server starts, lookups never modify the
+// tree, so every worker can share one router
+typedef struct Router {
+    RouteNode *root;
+} Router;
+
+extern int router_init(Router *router);
+extern void router_destroy(Router *router);
+extern int router_add(Router *router, RequestMethod method, const char *pattern, RouteHandler handler);
+extern int router_add_cached(Router *router, RequestMethod method, const char *pattern, RouteHandler handler,
+    const struct CachePolicy *cache);
+extern int router_add_offloaded(Router *router, RequestMethod method, const char *pattern, OffloadHandler handler);
+extern RouteResult router_lookup(const Router *router, RequestMethod method, StringView path,
+    RouteMatch *match, RouteHandler *handler);
+extern const StringView *route_param(const RouteMatch *match, const char *name);
+extern size_t format_allow_header(unsigned methods, char *buf, size_t buf_size);
+
+#endif // ROUTER_H
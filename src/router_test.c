@@ -0,0 +1,164 @@
+#include "router.h"
+#include "test.h"
+#include <string.h>
+
+// Handlers only stand for their routes, lookups are checked by which one
+// comes back
+static void get_user(ClientInfo *client, Request *req, const RouteMatch *match)
+{
+    (void)client, (void)req, (void)match;
+}
+
+static void put_user(ClientInfo *client, Request *req, const RouteMatch *match)
+{
+    (void)client, (void)req, (void)match;
+}
+
+static void head_user(ClientInfo *client, Request *req, const RouteMatch *match)
+{
+    (void)client, (void)req, (void)match;
+}
+
+static void get_me(ClientInfo *client, Request *req, const RouteMatch *match)
+{
+    (void)client, (void)req, (void)match;
+}
+
+static void get_post(ClientInfo *client, Request *req, const RouteMatch *match)
+{
+    (void)client, (void)req, (void)match;
+}
+
+static void get_file(ClientInfo *client, Request *req, const RouteMatch *match)
+{
+    (void)client, (void)req, (void)match;
+}
+
+static void get_root(ClientInfo *client, Request *req, const RouteMatch *match)
+{
+    (void)client, (void)req, (void)match;
+}
+
+static StringView view(const char *str)
+{
+    return (StringView) { .data = str, .len = strlen(str) };
+}
+
+static RouteResult lookup(const Router *router, RequestMethod method, const char *path, RouteMatch *match,
+    RouteHandler *handler)
+{
+    *handler = NULL;
+    return router_lookup(router, method, view(path), match, handler);
+}
+
+static bool param_is(const RouteMatch *match, const char *name, const char *value)
+{
+    const StringView *found = route_param(match, name);
+    return found && sv_equals(*found, value);
+}
+
+static void test_lookup(const Router *router)
+{
+    RouteMatch match;
+    RouteHandler handler;
+
+    CHECK(lookup(router, METHOD_GET, "/", &match, &handler) == ROUTE_FOUND);
+    CHECK(handler == get_root);
+    CHECK(match.num_params == 0);
+
+    CHECK(lookup(router, METHOD_GET, "/users/42", &match, &handler) == ROUTE_FOUND);
+    CHECK(handler == get_user);
+    CHECK(match.num_params == 1);
+    CHECK(param_is(&match, "id", "42"));
+    CHECK(route_param(&match, "post") == NULL);
+
+    // Static segments win over a parameter in the same place
+    CHECK(lookup(router, METHOD_GET, "/users/me", &match, &handler) == ROUTE_FOUND);
+    CHECK(handler == get_me);
+    CHECK(match.num_params == 0);
+
+    CHECK(lookup(router, METHOD_GET, "/users/42/posts/7", &match, &handler) == ROUTE_FOUND);
+    CHECK(handler == get_post);
+    CHECK(param_is(&match, "id", "42"));
+    CHECK(param_is(&match, "post", "7"));
+
+    // A wildcard takes the rest of the path, slashes and all
+    CHECK(lookup(router, METHOD_GET, "/files/a/b/c.txt", &match, &handler) == ROUTE_FOUND);
+    CHECK(handler == get_file);
+    CHECK(param_is(&match, "path", "a/b/c.txt"));
+
+    // Parameters match one non-empty segment
+    CHECK(lookup(router, METHOD_GET, "/users/", &match, &handler) == ROUTE_NOT_FOUND);
+    CHECK(lookup(router, METHOD_GET, "/users/42/extra", &match, &handler) == ROUTE_NOT_FOUND);
+    CHECK(lookup(router, METHOD_GET, "/user", &match, &handler) == ROUTE_NOT_FOUND);
+    CHECK(lookup(router, METHOD_GET, "/nowhere", &match, &handler) == ROUTE_NOT_FOUND);
+}
+
+// A path that exists for other methods is a 405 listing them
+static void test_method_not_allowed(const Router *router)
+{
+    RouteMatch match;
+    RouteHandler handler;
+    char allow[128];
+
+    CHECK(lookup(router, METHOD_DELETE, "/users/42", &match, &handler) == ROUTE_METHOD_NOT_ALLOWED);
+    CHECK(match.allowed_methods == (1u << METHOD_GET | 1u << METHOD_PUT | 1u << METHOD_HEAD));
+    size_t len = format_allow_header(match.allowed_methods, allow, sizeof(allow));
+    CHECK(len == strlen("Allow: GET, PUT, HEAD\r\n"));
+    CHECK(strncmp(allow, "Allow: GET, PUT, HEAD\r\n", len) == 0);
+
+    // HEAD is allowed wherever GET is, even without a route of its own
+    CHECK(lookup(router, METHOD_POST, "/users/me", &match, &handler) == ROUTE_METHOD_NOT_ALLOWED);
+    len = format_allow_header(match.allowed_methods, allow, sizeof(allow));
+    CHECK(strncmp(allow, "Allow: GET, HEAD\r\n", len) == 0);
+
+    CHECK(format_allow_header(1u << METHOD_POST, allow, sizeof(allow)) == strlen("Allow: POST\r\n"));
+    CHECK(format_allow_header(1u << METHOD_GET, allow, 10) == 0);
+}
+
+// HEAD runs a path's own HEAD route, or its GET route
+static void test_head(const Router *router)
+{
+    RouteMatch match;
+    RouteHandler handler;
+
+    CHECK(lookup(router, METHOD_HEAD, "/users/42", &match, &handler) == ROUTE_FOUND);
+    CHECK(handler == head_user);
+    CHECK(lookup(router, METHOD_HEAD, "/users/42/posts/7", &match, &handler) == ROUTE_FOUND);
+    CHECK(handler == get_post);
+    CHECK(param_is(&match, "post", "7"));
+    CHECK(lookup(router, METHOD_HEAD, "/files/x", &match, &handler) == ROUTE_FOUND);
+    CHECK(handler == get_file);
+    CHECK(lookup(router, METHOD_HEAD, "/nowhere", &match, &handler) == ROUTE_NOT_FOUND);
+}
+
+static void test_invalid_routes(Router *router)
+{
+    CHECK(router_add(router, METHOD_GET, "/users/:id", get_user) < 0);
+    CHECK(router_add(router, METHOD_GET, "/users/:name/friends", get_user) < 0);
+    CHECK(router_add(router, METHOD_GET, "no-slash", get_user) < 0);
+    CHECK(router_add(router, METHOD_GET, "/a/:", get_user) < 0);
+    CHECK(router_add(router, METHOD_GET, "/a/*rest/more", get_user) < 0);
+}
+
+int main()
+{
+    Router router;
+    if (router_init(&router) < 0) {
+        return 1;
+    }
+    CHECK(router_add(&router, METHOD_GET, "/", get_root) == 0);
+    CHECK(router_add(&router, METHOD_GET, "/users/:id", get_user) == 0);
+    CHECK(router_add(&router, METHOD_PUT, "/users/:id", put_user) == 0);
+    CHECK(router_add(&router, METHOD_HEAD, "/users/:id", head_user) == 0);
+    CHECK(router_add(&router, METHOD_GET, "/users/me", get_me) == 0);
+    CHECK(router_add(&router, METHOD_GET, "/users/:id/posts/:post", get_post) == 0);
+    CHECK(router_add(&router, METHOD_GET, "/files/*path", get_file) == 0);
+
+    test_lookup(&router);
+    test_method_not_allowed(&router);
+    test_head(&router);
+    test_invalid_routes(&router);
+    router_destroy(&router);
+    return TEST_RESULT();
+}
@@ -0,0 +1,376 @@
+#define _GNU_SOURCE
+#include "server.h"
+#include "static_files.h"
+#include "worker.h"
+#include <getopt.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+
+void init_server_config(ServerConfig *config)
+{
+    config->port = DEFAULT_PORT;
+    config->backlog = DEFAULT_BACKLOG;
+    config->defer_accept_seconds = 0;
+    config->workers = 1;
+    config->pin_workers = true;
+    config->backend = NULL;
+    config->output_high_water = DEFAULT_OUTPUT_HIGH_WATER;
+    config->static_prefix = NULL;
+    config->static_root = NULL;
+    config->file_cache_size = DEFAULT_FILE_CACHE_SIZE;
+    config->max_body_size = DEFAULT_MAX_BODY_SIZE;
+    config->header_timeout_ms = DEFAULT_HEADER_TIMEOUT_MS;
+    config->body_timeout_ms = DEFAULT_BODY_TIMEOUT_MS;
+    config->keep_alive_timeout_ms = DEFAULT_KEEP_ALIVE_TIMEOUT_MS;
+    config->write_timeout_ms = DEFAULT_WRITE_TIMEOUT_MS;
+    config->metrics_path = DEFAULT_METRICS_PATH;
+    config->metrics_sample = DEFAULT_METRICS_SAMPLE;
+    config->access_log_path = NULL;
+    config->access_log_max_size = DEFAULT_ACCESS_LOG_MAX_SIZE;
+    config->response_cache_size = DEFAULT_RESPONSE_CACHE_SIZE;
+    config->response_cache_ttl_ms = DEFAULT_RESPONSE_CACHE_TTL_MS;
+    default_compression_levels(config->compression_levels);
+    config->compress_min_size = DEFAULT_COMPRESS_MIN_SIZE;
+    config->proxy_prefix = NULL;
+    config->num_proxy_upstreams = 0;
+    config->proxy_timeout_ms = DEFAULT_PROXY_TIMEOUT_MS;
+    config->proxy_idle_connections = DEFAULT_PROXY_IDLE_CONNECTIONS;
+    config->offload_threads = DEFAULT_OFFLOAD_THREADS;
+    config->offload_queue = DEFAULT_OFFLOAD_QUEUE;
+    config->max_connections = DEFAULT_MAX_CONNECTIONS;
+    config->admission_latency_ms = DEFAULT_ADMISSION_LATENCY_MS;
+    config->handler = NULL;
+    config->stream_handler = NULL;
+}
+
+static void print_usage(const char *program)
+{
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  -p, --port PORT       Port to listen on (default %d)\n"
+        "  -w, --workers N       Number of worker threads (default 1)\n"
+        "  -b, --backend NAME    Event loop backend, epoll or io_uring (default epoll)\n"
+        "      --no-pin          Do not pin workers to CPUs\n"
+        "      --backlog N       Connections each worker's listener queues (default %d)\n"
+        "      --defer-accept SECONDS\n"
+        "                        Only accept connections once their request arrives, waiting at most\n"
+        "                        this long, 0 accepts on connect (default 0)\n"
+        "      --max-connections N\n"
+        "                        Open connections per worker before new ones get a 503, 0 for no cap (default %d)\n"
+        "      --admission-latency SECONDS\n"
+        "                        Lower the cap while event loop turns take longer than this,\n"
+        "                        0 keeps it fixed (default %g)\n"
+        "      --output-high-water BYTES\n"
+        "                        Queued output per connection before it stops being read (default %d)\n"
+        "      --static PREFIX=DIR\n"
+        "                        Serve the files in DIR under the URL prefix PREFIX\n"
+        "      --file-cache N    Open static files cached per worker (default %d)\n"
+        "      --max-body-size BYTES\n"
+        "                        Largest request body buffered whole (default %d)\n"
+        "      --header-timeout SECONDS\n"
+        "                        Time allowed for a request's headers (default %g)\n"
+        "      --body-timeout SECONDS\n"
+        "                        Longest wait for more of a request body (default %g)\n"
+        "      --keep-alive-timeout SECONDS\n"
+        "                        Longest wait for the next request (default %g)\n"
+        "      --write-timeout SECONDS\n"
+        "                        Longest wait for the client to take more output (default %g)\n"
+        "                        A timeout of 0 waits forever\n"
+        "      --metrics-path PATH\n"
+        "                        Serve Prometheus metrics at PATH, empty for none (default %s)\n"
+        "      --metrics-sample N\n"
+        "                        Time one call in N of each request stage (default %d)\n"
+        "      --access-log PATH Log every request to PATH, written by a background thread\n"
+        "      --access-log-max-size BYTES\n"
+        "                        Rotate the access log at this size, 0 never rotates (default %d)\n"
+        "      --response-cache BYTES\n"
+        "                        Cached responses per worker, 0 turns the cache off (default %d)\n"
+        "      --response-cache-ttl SECONDS\n"
+        "                        How long cached responses stay fresh (default %g)\n"
+        "      --gzip-level TYPE=LEVEL\n"
+        "                        gzip level 0-9 for a media type, or * for all, 0 turns it off\n"
+        "                        (default %d for text, JSON and SVG)\n"
+        "      --gzip-min-size BYTES\n"
+        "                        Smallest response body gzipped on the fly (default %d)\n"
+        "      --proxy PREFIX=BACKEND[,BACKEND...]\n"
+        "                        Forward requests under PREFIX to the backends, each host:port\n"
+        "                        or unix:/path, the one with the fewest requests in progress first\n"
+        "      --proxy-timeout SECONDS\n"
+        "                        Longest wait on a backend, and for a pooled connection to be reused (default %g)\n"
+        "      --proxy-idle N    Idle connections each worker keeps per backend (default %d)\n"
+        "      --offload-threads N\n"
+        "                        Threads for handlers too slow for the workers, 0 runs them inline (default %d)\n"
+        "      --offload-queue N Offloaded requests per worker before answering 503 (default %d)\n",
+        program, DEFAULT_PORT, DEFAULT_BACKLOG, DEFAULT_MAX_CONNECTIONS, DEFAULT_ADMISSION_LATENCY_MS / 1000.0,
+        DEFAULT_OUTPUT_HIGH_WATER, DEFAULT_FILE_CACHE_SIZE, DEFAULT_MAX_BODY_SIZE,
+        DEFAULT_HEADER_TIMEOUT_MS / 1000.0, DEFAULT_BODY_TIMEOUT_MS / 1000.0, DEFAULT_KEEP_ALIVE_TIMEOUT_MS / 1000.0,
+        DEFAULT_WRITE_TIMEOUT_MS / 1000.0, DEFAULT_METRICS_PATH, DEFAULT_METRICS_SAMPLE,
+        DEFAULT_ACCESS_LOG_MAX_SIZE, DEFAULT_RESPONSE_CACHE_SIZE, DEFAULT_RESPONSE_CACHE_TTL_MS / 1000.0,
+        DEFAULT_COMPRESSION_LEVEL, DEFAULT_COMPRESS_MIN_SIZE, DEFAULT_PROXY_TIMEOUT_MS / 1000.0,
+        DEFAULT_PROXY_IDLE_CONNECTIONS, DEFAULT_OFFLOAD_THREADS, DEFAULT_OFFLOAD_QUEUE);
+}
+
+// Seconds, fractions allowed, as milliseconds
+static unsigned parse_seconds(const char *arg)
+{
+    double seconds = strtod(arg, NULL);
+    return seconds > 0 ? (unsigned)(seconds * 1000 + 0.5) : 0;
+}
+
+// Fill config from the command line, returns -1 on invalid arguments
+int parse_server_args(ServerConfig *config, int argc, char **argv)
+{
+    static const struct option OPTIONS[] = {
+        { "port", required_argument, NULL, 'p' },
+        { "workers", required_argument, NULL, 'w' },
+        { "backend", required_argument, NULL, 'b' },
+        { "no-pin", no_argument, NULL, 'P' },
+        { "backlog", required_argument, NULL, 'l' },
+        { "defer-accept", required_argument, NULL, 'D' },
+        { "max-connections", required_argument, NULL, 'c' },
+        { "admission-latency", required_argument, NULL, 'a' },
+        { "output-high-water", required_argument, NULL, 'H' },
+        { "static", required_argument, NULL, 'S' },
+        { "file-cache", required_argument, NULL, 'C' },
+        { "max-body-size", required_argument, NULL, 'M' },
+        { "header-timeout", required_argument, NULL, 'T' },
+        { "body-timeout", required_argument, NULL, 'B' },
+        { "keep-alive-timeout", required_argument, NULL, 'K' },
+        { "write-timeout", required_argument, NULL, 'W' },
+        { "metrics-path", required_argument, NULL, 'm' },
+        { "metrics-sample", required_argument, NULL, 'N' },
+        { "access-log", required_argument, NULL, 'L' },
+        { "access-log-max-size", required_argument, NULL, 'R' },
+        { "response-cache", required_argument, NULL, 'Z' },
+        { "response-cache-ttl", required_argument, NULL, 'E' },
+        { "gzip-level", required_argument, NULL, 'G' },
+        { "gzip-min-size", required_argument, NULL, 'g' },
+        { "proxy", required_argument, NULL, 'X' },
+        { "proxy-timeout", required_argument, NULL, 'Y' },
+        { "proxy-idle", required_argument, NULL, 'I' },
+        { "offload-threads", required_argument, NULL, 'O' },
+        { "offload-queue", required_argument, NULL, 'Q' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 },
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "p:w:b:h", OPTIONS, NULL)) != -1) {
+        switch (opt) {
+        case 'p':
+            config->port = atoi(optarg);
+            break;
+        case 'w':
+            config->workers = atoi(optarg);
+            break;
+        case 'b':
+            config->backend = optarg;
+            break;
+        case 'P':
+            config->pin_workers = false;
+            break;
+        case 'l':
+            config->backlog = atoi(optarg);
+            break;
+        case 'D':
+            config->defer_accept_seconds = atoi(optarg);
+            break;
+        case 'c':
+            config->max_connections = strtoul(optarg, NULL, 10);
+            break;
+        case 'a':
+            config->admission_latency_ms = parse_seconds(optarg);
+            break;
+        case 'H':
+            config->output_high_water = strtoul(optarg, NULL, 10);
+            break;
+        case 'S': {
+            // Split PREFIX=DIR in place, argv outlives the server
+            char *equals = strchr(optarg, '=');
+            if (!equals || optarg[0] != '/' || equals[1] == '\0') {
+                print_usage(argv[0]);
+                return -1;
+            }
+            *equals = '\0';
+            config->static_prefix = optarg;
+            config->static_root = equals + 1;
+            break;
+        }
+        case 'C':
+            config->file_cache_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'M':
+            config->max_body_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'T':
+            config->header_timeout_ms = parse_seconds(optarg);
+            break;
+        case 'B':
+            config->body_timeout_ms = parse_seconds(optarg);
+            break;
+        case 'K':
+            config->keep_alive_timeout_ms = parse_seconds(optarg);
+            break;
+        case 'W':
+            config->write_timeout_ms = parse_seconds(optarg);
+            break;
+        case 'm':
+            if (optarg[0] != '\0' && optarg[0] != '/') {
+                print_usage(argv[0]);
+                return -1;
+            }
+            config->metrics_path = optarg[0] ? optarg : NULL;
+            break;
+        case 'N':
+            config->metrics_sample = strtoul(optarg, NULL, 10);
+            break;
+        case 'L':
+            config->access_log_path = optarg[0] ? optarg : NULL;
+            break;
+        case 'R':
+            config->access_log_max_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'Z':
+            config->response_cache_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'E':
+            config->response_cache_ttl_ms = parse_seconds(optarg);
+            break;
+        case 'G':
+            if (set_compression_level(config->compression_levels, optarg) < 0) {
+                print_usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'g':
+            config->compress_min_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'X': {
+            // Split PREFIX=BACKENDS in place like --static, argv outlives the server
+            char *equals = strchr(optarg, '=');
+            if (!equals || optarg[0] != '/') {
+                print_usage(argv[0]);
+                return -1;
+            }
+            *equals = '\0';
+            int count = parse_upstreams(equals + 1, config->proxy_upstreams, MAX_UPSTREAMS);
+            if (count < 0) {
+                print_usage(argv[0]);
+                return -1;
+            }
+            config->proxy_prefix = optarg;
+            config->num_proxy_upstreams = count;
+            break;
+        }
+        case 'Y':
+            config->proxy_timeout_ms = parse_seconds(optarg);
+            break;
+        case 'I':
+            config->proxy_idle_connections = strtoul(optarg, NULL, 10);
+            break;
+        case 'O':
+            config->offload_threads = strtoul(optarg, NULL, 10);
+            break;
+        case 'Q':
+            config->offload_queue = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            print_usage(argv[0]);
+            return -1;
+        }
+    }
+
+    if (config->port <= 0 || config->port > 65535 || config->workers <= 0 || config->backlog <= 0
+        || config->defer_accept_seconds < 0 || config->output_high_water == 0
+        || config->file_cache_size == 0 || config->metrics_sample == 0 || config->offload_queue == 0) {
+        print_usage(argv[0]);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Allow as many open connections as the hard limit permits
+static void raise_fd_limit()
+{
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+// Pick the nth CPU we are allowed to run on, wrapping around
+static int nth_allowed_cpu(const cpu_set_t *allowed, int n)
+{
+    int count = CPU_COUNT(allowed);
+    if (count == 0) {
+        return -1;
+    }
+    n %= count;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, allowed) && n-- == 0) {
+            return cpu;
+        }
+    }
+    return -1;
+}
+
+int run_server(const ServerConfig *config)
+{
+    raise_fd_limit();
+    // sendfile and splice have no MSG_NOSIGNAL, a client that went away
+    // has to fail them with EPIPE instead of killing the process
+    signal(SIGPIPE, SIG_IGN);
+
+    cpu_set_t allowed;
+    bool can_pin = config->pin_workers && sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+
+    // Opened first, so workers can register their rings with the flusher
+    if (config->access_log_path && access_log_open(config->access_log_path, config->access_log_max_size) < 0) {
+        return -1;
+    }
+
+    // Serialized by every worker as it is created
+    if (config->max_connections && admission_register() < 0) {
+        return -1;
+    }
+
+    // Started first, so workers can register their queues with them
+    if (offload_start(config->offload_threads, config->workers) < 0) {
+        return -1;
+    }
+
+    Worker **workers = calloc(config->workers, sizeof(Worker *));
+    if (!workers)
+        return -1;
+
+    for (int i = 0; i < config->workers; i++) {
+        int cpu = can_pin ? nth_allowed_cpu(&allowed, i) : -1;
+        workers[i] = create_worker(config, i, cpu);
+        // Workers that already started are torn down when the process exits
+        if (!workers[i] || start_worker(workers[i]) < 0) {
+            perror("Failed to start worker");
+            return -1;
+        }
+    }
+
+    printf("Server listening on port %d with %d worker(s)...\n", config->port, config->workers);
+
+    for (int i = 0; i < config->workers; i++) {
+        pthread_join(workers[i]->thread, NULL);
+    }
+    // Before the workers, whose queues the offload threads take jobs from
+    offload_stop();
+    for (int i = 0; i < config->workers; i++) {
+        free_worker(workers[i]);
+    }
+    free(workers);
+    access_log_close();
+
+    return 0;
+}
@@ -0,0 +1,75 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "access_log.h"
+#include "admission.h"
+#include "client_info.h"
+#include "compression.h"
+#include "metrics.h"
+#include "offload.h"
+#include "proxy.h"
+#include "request.h"
+#include "response_cache.h"
+#include <stdbool.h>
+
+#define DEFAULT_PORT 8080
+#define DEFAULT_BACKLOG 4096 // Per worker listener, the kernel caps it at net.core.somaxconn
+#define DEFAULT_OUTPUT_HIGH_WATER (1024 * 1024)
+#define DEFAULT_MAX_BODY_SIZE (1024 * 1024)
+#define DEFAULT_HEADER_TIMEOUT_MS 10000
+#define DEFAULT_BODY_TIMEOUT_MS 30000
+#define DEFAULT_KEEP_ALIVE_TIMEOUT_MS 15000
+#define DEFAULT_WRITE_TIMEOUT_MS 30000
+
+// Called on the owning worker's thread once a request has been framed and parsed
+typedef void (*RequestHandler)(ClientInfo *client, RequestOrError *req_or_err);
+
+// Called once the headers are in for requests whose body is still arriving.
+// Returns true if it took the request, by calling stream_request_body or by
+// answering it, false to have the body buffered and the request handled as
+// usual. req is only valid during the call
+typedef bool (*StreamHandler)(ClientInfo *client, Request *req);
+
+typedef struct ServerConfig {
+    int port;
+    int backlog;
+    int defer_accept_seconds; // Hold connections back until their request arrives, 0 wakes up on connect
+    int workers; // Number of worker threads, each with its own listener and loop
+    bool pin_workers; // Pin each worker to its own CPU
+    const char *backend; // Event loop backend name, NULL for the default
+    size_t output_high_water; // Queued output bytes per connection before it stops being read
+    const char *static_prefix; // URL prefix static files are served under, NULL for none
+    const char *static_root; // Directory served under static_prefix
+    size_t file_cache_size; // Open files each worker keeps cached
+    size_t max_body_size; // Largest body buffered whole, bigger ones get a 413 unless streamed
+    // Connections waiting longer than these are closed, 0 waits forever
+    unsigned header_timeout_ms; // For a request's headers, however fast they trickle in
+    unsigned body_timeout_ms; // For each next part of a request body
+    unsigned keep_alive_timeout_ms; // For the next request on an idle connection
+    unsigned write_timeout_ms; // For the client to take more of its response
+    const char *metrics_path; // Path serving the metrics, NULL for none
+    unsigned metrics_sample; // Time one call in this many per stage
+    const char *access_log_path; // File finished requests are logged to, NULL for none
+    size_t access_log_max_size; // Size at which the access log is rotated, 0 never rotates
+    size_t response_cache_size; // Bytes of cached responses per worker, 0 turns the cache off
+    unsigned response_cache_ttl_ms; // Freshness of cached responses whose route sets none
+    int compression_levels[CONTENT_TYPE_COUNT]; // gzip level per content type, 0 never compresses it
+    size_t compress_min_size; // Smallest body gzipped on the fly
+    const char *proxy_prefix; // URL prefix forwarded to the backends, NULL for none
+    UpstreamAddress proxy_upstreams[MAX_UPSTREAMS];
+    size_t num_proxy_upstreams;
+    unsigned proxy_timeout_ms; // Longest wait on a backend, and longest a pooled connection idles
+    size_t proxy_idle_connections; // Idle connections each worker keeps per backend
+    size_t offload_threads; // Threads offloaded handlers run on, 0 runs them inline
+    size_t offload_queue; // Offloaded requests each worker may have waiting or running
+    size_t max_connections; // Open connections per worker before new ones get a 503, 0 for no cap
+    unsigned admission_latency_ms; // Loop turn length the cap adapts to, 0 keeps it fixed
+    RequestHandler handler;
+    StreamHandler stream_handler; // NULL to always buffer bodies
+} ServerConfig;
+
+extern void init_server_config(ServerConfig *config);
+extern int parse_server_args(ServerConfig *config, int argc, char **argv);
+extern int run_server(const ServerConfig *config);
+
+#endif // SERVER_H
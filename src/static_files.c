@@ -0,0 +1,569 @@
+#define _GNU_SOURCE
+#include "static_files.h"
+#include "compression.h"
+#include "worker.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/openat2.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define INDEX_FILE "index.html"
+// Anything that could make a cached fd, size or header stale
+#define WATCH_MASK (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_MOVE_SELF | IN_DELETE_SELF)
+
+static const struct {
+    const char *extension;
+    ContentType type;
+} CONTENT_TYPES[] = {
+    { "html", CONTENT_TYPE_HTML },
+    { "htm", CONTENT_TYPE_HTML },
+    { "css", CONTENT_TYPE_CSS },
+    { "js", CONTENT_TYPE_JAVASCRIPT },
+    { "mjs", CONTENT_TYPE_JAVASCRIPT },
+    { "json", CONTENT_TYPE_JSON },
+    { "txt", CONTENT_TYPE_PLAINTEXT },
+    { "png", CONTENT_TYPE_PNG },
+    { "jpg", CONTENT_TYPE_JPEG },
+    { "jpeg", CONTENT_TYPE_JPEG },
+    { "gif", CONTENT_TYPE_GIF },
+    { "svg", CONTENT_TYPE_SVG },
+    { "ico", CONTENT_TYPE_ICO },
+    { "webp", CONTENT_TYPE_WEBP },
+    { "woff2", CONTENT_TYPE_WOFF2 },
+    { "pdf", CONTENT_TYPE_PDF },
+};
+
+// Precompressed copies are looked for under these suffixes, best first
+static const struct {
+    ContentEncoding encoding;
+    const char *suffix;
+} VARIANTS[] = {
+    { CONTENT_ENCODING_BR, ".br" },
+    { CONTENT_ENCODING_GZIP, ".gz" },
+};
+
+static ContentType content_type_for(const char *path, size_t len)
+{
+    const char *dot = memrchr(path, '.', len);
+    const char *slash = memrchr(path, '/', len);
+    if (dot && (!slash || dot > slash)) {
+        StringView extension = { .data = dot + 1, .len = path + len - dot - 1 };
+        for (size_t i = 0; i < sizeof(CONTENT_TYPES) / sizeof(CONTENT_TYPES[0]); i++) {
+            if (sv_equals_ignore_case(extension, CONTENT_TYPES[i].extension)) {
+                return CONTENT_TYPES[i].type;
+            }
+        }
+    }
+    return CONTENT_TYPE_OCTET_STREAM;
+}
+
+// FNV-1a
+static uint64_t hash_path(const char *path, size_t len)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char)path[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/**
+ * Set up a worker's cache for one static files mount
+ * @param cache Cache to initialize
+ * @param prefix URL prefix, e.g. "/static", or NULL to leave static files off
+ * @param root Directory served under the prefix
+ * @param capacity Most files kept open at once
+ * @return 0 on success, -1 on failure
+ */
+int file_cache_init(FileCache *cache, const char *prefix, const char *root, size_t capacity)
+{
+    memset(cache, 0, sizeof(*cache));
+    cache->root_fd = -1;
+    cache->handle.fd = -1;
+    if (!prefix) {
+        return 0;
+    }
+
+    // "/" mounts at the top, and any other trailing slash is implied
+    cache->prefix = prefix;
+    cache->prefix_len = strlen(prefix);
+    while (cache->prefix_len > 0 && prefix[cache->prefix_len - 1] == '/') {
+        cache->prefix_len--;
+    }
+    cache->capacity = capacity;
+    cache->num_buckets = 1;
+    while (cache->num_buckets < capacity) {
+        cache->num_buckets <<= 1;
+    }
+    cache->buckets = calloc(cache->num_buckets, sizeof(CachedFile *));
+    if (!cache->buckets) {
+        return -1;
+    }
+
+    cache->root_fd = open(root, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (cache->root_fd < 0) {
+        perror("open static root failed");
+        free(cache->buckets);
+        return -1;
+    }
+    cache->handle.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (cache->handle.fd < 0) {
+        perror("inotify_init1 failed");
+        close(cache->root_fd);
+        free(cache->buckets);
+        cache->root_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+static void unref_file(CachedFile *file)
+{
+    if (--file->refs == 0) {
+        close(file->fd);
+        free(file);
+    }
+}
+
+// Called once a queued send of the file is done
+static void release_file(void *data)
+{
+    unref_file(data);
+}
+
+// Make the entry unfindable, sends still queued keep it alive. The watch is
+// kept while another entry, e.g. "dir/" and "dir/index.html", shares it
+static void evict_file(FileCache *cache, CachedFile *file, bool remove_watch)
+{
+    CachedFile **link = &cache->buckets[file->hash & (cache->num_buckets - 1)];
+    while (*link != file) {
+        link = &(*link)->hash_next;
+    }
+    *link = file->hash_next;
+
+    if (file->lru_prev) {
+        file->lru_prev->lru_next = file->lru_next;
+    } else {
+        cache->lru_head = file->lru_next;
+    }
+    if (file->lru_next) {
+        file->lru_next->lru_prev = file->lru_prev;
+    } else {
+        cache->lru_tail = file->lru_prev;
+    }
+    cache->count--;
+
+    if (remove_watch && file->wd >= 0) {
+        bool shared = false;
+        for (CachedFile *other = cache->lru_head; other && !shared; other = other->lru_next) {
+            shared = other->wd == file->wd;
+        }
+        if (!shared) {
+            inotify_rm_watch(cache->handle.fd, file->wd);
+        }
+    }
+
+    file->cached = false;
+    unref_file(file);
+}
+
+void file_cache_destroy(FileCache *cache)
+{
+    while (cache->lru_head) {
+        evict_file(cache, cache->lru_head, false);
+    }
+    free(cache->buckets);
+    cache->buckets = NULL;
+    if (cache->handle.fd >= 0) {
+        close(cache->handle.fd);
+        cache->handle.fd = -1;
+    }
+    if (cache->root_fd >= 0) {
+        close(cache->root_fd);
+        cache->root_fd = -1;
+    }
+}
+
+/**
+ * Drop every entry inotify reports a change for. Call when the cache's
+ * handle is readable
+ * @param cache Cache to update
+ */
+void file_cache_handle_changes(FileCache *cache)
+{
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    while (1) {
+        ssize_t len = read(cache->handle.fd, events, sizeof(events));
+        if (len <= 0) {
+            if (len < 0 && errno == EINTR)
+                continue;
+            return;
+        }
+
+        for (char *ptr = events; ptr < events + len;) {
+            struct inotify_event *event = (struct inotify_event *)ptr;
+            ptr += sizeof(struct inotify_event) + event->len;
+
+            // Entries are few and changes rare, a scan beats a second index
+            for (CachedFile *file = cache->lru_head; file;) {
+                CachedFile *next = file->lru_next;
+                if (file->wd == event->wd) {
+                    evict_file(cache, file, false);
+                }
+                file = next;
+            }
+            if (!(event->mask & IN_IGNORED)) {
+                inotify_rm_watch(cache->handle.fd, event->wd);
+            }
+        }
+    }
+}
+
+// Stay below the root even through symlinks, where the kernel allows it
+static int open_beneath(int root_fd, const char *path)
+{
+    struct open_how how = {
+        .flags = O_RDONLY | O_CLOEXEC | O_NONBLOCK,
+        .resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS,
+    };
+    int fd = syscall(SYS_openat2, root_fd, path, &how, sizeof(how));
+    if (fd < 0 && errno == ENOSYS) {
+        fd = openat(root_fd, path, O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+    }
+    return fd;
+}
+
+static CachedFile *open_file(FileCache *cache, const char *path, size_t path_len, uint64_t hash)
+{
+    int fd = open_beneath(cache->root_fd, path);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return NULL;
+    }
+
+    // Watch the inode that was opened, not whatever the path names later
+    char proc_path[sizeof("/proc/self/fd/") + 12];
+    snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", fd);
+    // Out of watches, e.g. at max_user_watches, the entry is checked with a
+    // stat on every hit instead. Said once, it would otherwise be every miss
+    int wd = inotify_add_watch(cache->handle.fd, proc_path, WATCH_MASK);
+    if (wd < 0 && !cache->watch_failed) {
+        perror("inotify_add_watch failed, revalidating instead");
+        cache->watch_failed = true;
+    }
+
+    CachedFile *file = malloc(sizeof(CachedFile) + path_len + 1);
+    if (!file) {
+        if (wd >= 0) {
+            inotify_rm_watch(cache->handle.fd, wd);
+        }
+        close(fd);
+        return NULL;
+    }
+    file->hash = hash;
+    file->fd = fd;
+    file->wd = wd;
+    file->dev = st.st_dev;
+    file->ino = st.st_ino;
+    file->changed = st.st_ctim;
+    file->size = st.st_size;
+    file->content_type = content_type_for(path, path_len);
+    format_http_date(file->last_modified, st.st_mtime);
+    file->headers_len = snprintf(file->headers, sizeof(file->headers),
+        "Last-Modified: %s\r\nAccept-Ranges: bytes\r\n", file->last_modified);
+    file->refs = 1;
+    file->cached = true;
+    file->path_len = path_len;
+    memcpy(file->path, path, path_len + 1);
+
+    // Only noted here, a copy is opened and cached like any file once asked for
+    file->variants = 0;
+    char variant[PATH_MAX];
+    for (size_t i = 0; i < sizeof(VARIANTS) / sizeof(VARIANTS[0]); i++) {
+        if (snprintf(variant, sizeof(variant), "%s%s", path, VARIANTS[i].suffix) < (int)sizeof(variant)
+            && faccessat(cache->root_fd, variant, R_OK, 0) == 0) {
+            file->variants |= ENCODING_BIT(VARIANTS[i].encoding);
+        }
+    }
+    return file;
+}
+
+static void touch_file(FileCache *cache, CachedFile *file)
+{
+    if (cache->lru_head == file) {
+        return;
+    }
+    // Unlink, a non-head entry always has a predecessor
+    file->lru_prev->lru_next = file->lru_next;
+    if (file->lru_next) {
+        file->lru_next->lru_prev = file->lru_prev;
+    } else {
+        cache->lru_tail = file->lru_prev;
+    }
+    file->lru_prev = NULL;
+    file->lru_next = cache->lru_head;
+    cache->lru_head->lru_prev = file;
+    cache->lru_head = file;
+}
+
+// Whether the path still names the inode that was opened, unchanged since
+static bool file_unchanged(FileCache *cache, const CachedFile *file)
+{
+    struct stat st;
+    return fstatat(cache->root_fd, file->path, &st, 0) == 0 && st.st_dev == file->dev && st.st_ino == file->ino
+        && st.st_size == file->size && st.st_ctim.tv_sec == file->changed.tv_sec
+        && st.st_ctim.tv_nsec == file->changed.tv_nsec;
+}
+
+// Find a file by its path under the root, opening it on a miss
+static CachedFile *lookup_file(FileCache *cache, const char *path, size_t path_len)
+{
+    uint64_t hash = hash_path(path, path_len);
+    CachedFile **bucket = &cache->buckets[hash & (cache->num_buckets - 1)];
+    for (CachedFile *file = *bucket; file; file = file->hash_next) {
+        if (file->hash == hash && file->path_len == path_len && memcmp(file->path, path, path_len) == 0) {
+            // Without a watch no change is reported, so it is looked for
+            if (file->wd < 0 && !file_unchanged(cache, file)) {
+                evict_file(cache, file, false);
+                break;
+            }
+            touch_file(cache, file);
+            return file;
+        }
+    }
+
+    CachedFile *file = open_file(cache, path, path_len, hash);
+    if (!file) {
+        return NULL;
+    }
+    if (cache->count == cache->capacity) {
+        evict_file(cache, cache->lru_tail, true);
+    }
+
+    file->hash_next = *bucket;
+    *bucket = file;
+    file->lru_prev = NULL;
+    file->lru_next = cache->lru_head;
+    if (cache->lru_head) {
+        cache->lru_head->lru_prev = file;
+    } else {
+        cache->lru_tail = file;
+    }
+    cache->lru_head = file;
+    cache->count++;
+    return file;
+}
+
+// Turn the part of the URL path below the prefix into a path under the
+// root. Returns false for paths that try to climb out of it
+static bool map_path(const char *rest, size_t len, char *out, size_t out_size, size_t *out_len)
+{
+    while (len > 0 && *rest == '/') {
+        rest++;
+        len--;
+    }
+    // Directories are served by their index
+    bool index = len == 0 || rest[len - 1] == '/';
+    size_t total = len + (index ? sizeof(INDEX_FILE) - 1 : 0);
+    if (total >= out_size || memchr(rest, '\0', len)) {
+        return false;
+    }
+
+    for (size_t i = 0; i < len;) {
+        const char *end = memchr(rest + i, '/', len - i);
+        size_t segment = (end ? (size_t)(end - rest) : len) - i;
+        if (segment == 2 && rest[i] == '.' && rest[i + 1] == '.') {
+            return false;
+        }
+        i += segment + 1;
+    }
+
+    memcpy(out, rest, len);
+    if (index) {
+        memcpy(out + len, INDEX_FILE, sizeof(INDEX_FILE) - 1);
+    }
+    out[total] = '\0';
+    *out_len = total;
+    return true;
+}
+
+static bool parse_offset(const char **curr, const char *end, off_t *value)
+{
+    const char *start = *curr;
+    off_t result = 0;
+    while (*curr < end && **curr >= '0' && **curr <= '9') {
+        if (result > (INT64_MAX - 9) / 10) {
+            return false;
+        }
+        result = result * 10 + (**curr - '0');
+        (*curr)++;
+    }
+    *value = result;
+    return *curr > start;
+}
+
+typedef enum RangeResult {
+    RANGE_NONE, // Send the whole file
+    RANGE_SATISFIABLE,
+    RANGE_UNSATISFIABLE,
+} RangeResult;
+
+// Parse a single "bytes=first-last", "bytes=first-" or "bytes=-suffix"
+// range. Multiple ranges and anything malformed get the whole file, which
+// RFC 9110 allows
+static RangeResult parse_range(StringView value, off_t size, off_t *first, off_t *last)
+{
+    static const char UNIT[] = "bytes=";
+    if (value.len < sizeof(UNIT) - 1 || strncasecmp(value.data, UNIT, sizeof(UNIT) - 1) != 0
+        || memchr(value.data, ',', value.len)) {
+        return RANGE_NONE;
+    }
+    const char *curr = value.data + sizeof(UNIT) - 1;
+    const char *end = value.data + value.len;
+
+    if (curr < end && *curr == '-') {
+        curr++;
+        off_t suffix;
+        if (!parse_offset(&curr, end, &suffix) || curr != end) {
+            return RANGE_NONE;
+        }
+        if (suffix == 0 || size == 0) {
+            return RANGE_UNSATISFIABLE;
+        }
+        *first = suffix < size ? size - suffix : 0;
+        *last = size - 1;
+        return RANGE_SATISFIABLE;
+    }
+
+    if (!parse_offset(&curr, end, first) || curr == end || *curr != '-') {
+        return RANGE_NONE;
+    }
+    curr++;
+    if (curr == end) {
+        *last = size - 1;
+    } else if (!parse_offset(&curr, end, last) || curr != end || *last < *first) {
+        return RANGE_NONE;
+    }
+    if (*first >= size) {
+        return RANGE_UNSATISFIABLE;
+    }
+    if (*last >= size) {
+        *last = size - 1;
+    }
+    return RANGE_SATISFIABLE;
+}
+
+// The best precompressed copy of file the client accepts, or file itself.
+// Opening a copy may evict file, so only the result may be used after this
+static CachedFile *pick_variant(FileCache *cache, CachedFile *file, unsigned accepted, char *path, size_t path_len,
+    ContentEncoding *encoding)
+{
+    unsigned wanted = file->variants & accepted;
+    for (size_t i = 0; wanted && i < sizeof(VARIANTS) / sizeof(VARIANTS[0]); i++) {
+        size_t suffix_len = strlen(VARIANTS[i].suffix);
+        if (!(wanted & ENCODING_BIT(VARIANTS[i].encoding)) || path_len + suffix_len >= PATH_MAX) {
+            continue;
+        }
+        memcpy(path + path_len, VARIANTS[i].suffix, suffix_len + 1);
+        CachedFile *variant = lookup_file(cache, path, path_len + suffix_len);
+        path[path_len] = '\0';
+        if (variant) {
+            *encoding = VARIANTS[i].encoding;
+            return variant;
+        }
+    }
+    return file;
+}
+
+/**
+ * Answer a GET or HEAD under the static files prefix straight from the
+ * worker's file cache, with the body sent by sendfile
+ * @param client Client to answer
+ * @param req Request to answer
+ * @return Whether a response was queued, or why not
+ */
+StaticFileResult serve_static_file(ClientInfo *client, const Request *req)
+{
+    FileCache *cache = &client->worker->files;
+    if (cache->root_fd < 0 || (req->method != METHOD_GET && req->method != METHOD_HEAD)) {
+        return STATIC_FILE_SKIPPED;
+    }
+
+    // The prefix has to end at a segment boundary, "/static" isn't "/statics"
+    StringView path = req->path;
+    if (path.len < cache->prefix_len || memcmp(path.data, cache->prefix, cache->prefix_len) != 0
+        || (path.len > cache->prefix_len && path.data[cache->prefix_len] != '/')) {
+        return STATIC_FILE_SKIPPED;
+    }
+
+    char relative[PATH_MAX];
+    size_t relative_len;
+    if (!map_path(path.data + cache->prefix_len, path.len - cache->prefix_len, relative, sizeof(relative),
+            &relative_len)) {
+        return STATIC_FILE_NOT_FOUND;
+    }
+    CachedFile *file = lookup_file(cache, relative, relative_len);
+    if (!file) {
+        return STATIC_FILE_NOT_FOUND;
+    }
+    ContentType content_type = file->content_type;
+    ContentEncoding encoding = file->variants ? CONTENT_ENCODING_IDENTITY : CONTENT_ENCODING_NONE;
+    file = pick_variant(cache, file, client->accepted_encodings, relative, relative_len, &encoding);
+
+    Response res = { 0 };
+    res.status = STATUS_OK;
+    res.content_type = content_type;
+    res.content_encoding = encoding;
+    res.content_len = file->size;
+    res.extra_headers = file->headers;
+    res.extra_headers_len = file->headers_len;
+
+    // Ranges only apply to the version the client already has part of
+    off_t first = 0, last = file->size - 1;
+    const StringView *range = request_header(req, HEADER_RANGE);
+    const StringView *if_range = request_header(req, HEADER_IF_RANGE);
+    char headers[MAX_FILE_HEADERS_LEN + sizeof("Content-Range: bytes -/\r\n") + 3 * 20];
+    if (range && (!if_range || sv_equals(*if_range, file->last_modified))) {
+        switch (parse_range(*range, file->size, &first, &last)) {
+        case RANGE_NONE:
+            break;
+        case RANGE_SATISFIABLE:
+            res.status = STATUS_PARTIAL_CONTENT;
+            res.content_len = last - first + 1;
+            res.extra_headers_len = snprintf(headers, sizeof(headers), "%sContent-Range: bytes %lld-%lld/%lld\r\n",
+                file->headers, (long long)first, (long long)last, (long long)file->size);
+            res.extra_headers = headers;
+            break;
+        case RANGE_UNSATISFIABLE:
+            res.status = STATUS_RANGE_NOT_SATISFIABLE;
+            res.content_len = 0;
+            res.extra_headers_len = snprintf(headers, sizeof(headers), "Content-Range: bytes */%lld\r\n",
+                (long long)file->size);
+            res.extra_headers = headers;
+            break;
+        }
+    }
+
+    // Headers are copied as they are queued, the body follows with sendfile
+    if (!write_response(client, &res) || req->method == METHOD_HEAD || res.content_len == 0) {
+        return STATIC_FILE_SERVED;
+    }
+    file->refs++;
+    if (!queue_client_file(client, file->fd, first, res.content_len, release_file, file)) {
+        unref_file(file);
+        client->state = CLIENT_DONE;
+    }
+    return STATIC_FILE_SERVED;
+}
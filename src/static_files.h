@@ -0,0 +1,72 @@
+#ifndef STATIC_FILES_H
+#define STATIC_FILES_H
+
+#include "client_info.h"
+#include "common.h"
+#include "event_loop.h"
+#include "request.h"
+#include "response.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+#define DEFAULT_FILE_CACHE_SIZE 1024
+#define MAX_FILE_HEADERS_LEN 128
+
+// An open file and everything needed to answer for it without touching the
+// file system again, until inotify says it changed
+typedef struct CachedFile {
+    struct CachedFile *hash_next;
+    struct CachedFile *lru_prev; // Towards the most recently used
+    struct CachedFile *lru_next;
+    uint64_t hash;
+    int fd;
+    int wd; // inotify watch, shared by every entry for the same inode, -1 if none could be added
+    // What the path named when it was opened, compared again on every hit
+    // while there is no watch
+    dev_t dev;
+    ino_t ino;
+    struct timespec changed;
+    off_t size;
+    ContentType content_type;
+    char last_modified[HTTP_DATE_LEN + 1];
+    char headers[MAX_FILE_HEADERS_LEN]; // Prebuilt Last-Modified and Accept-Ranges lines
+    size_t headers_len;
+    int refs; // The cache's own reference plus one per queued send
+    bool cached; // Still findable, otherwise freed once the last send is done
+    // ENCODING_BIT of each precompressed copy next to the file, e.g. app.js.gz,
+    // as found when the file was opened
+    unsigned variants;
+    size_t path_len;
+    char path[]; // Relative to the root, NUL terminated
+} CachedFile;
+
+// One worker's view of a static files mount, never shared between workers
+typedef struct FileCache {
+    EventHandle handle; // inotify instance, must be first
+    int root_fd; // -1 when static files are off
+    const char *prefix; // URL prefix the root is mounted at
+    size_t prefix_len;
+    CachedFile **buckets;
+    size_t num_buckets; // Power of two
+    CachedFile *lru_head; // Most recently used
+    CachedFile *lru_tail;
+    size_t count;
+    size_t capacity;
+    bool watch_failed; // inotify_add_watch has failed, only the first failure is reported
+} FileCache;
+
+typedef enum StaticFileResult {
+    STATIC_FILE_SKIPPED, // Not under the prefix, or not a GET or HEAD
+    STATIC_FILE_SERVED, // A response was queued
+    STATIC_FILE_NOT_FOUND,
+} StaticFileResult;
+
+extern int file_cache_init(FileCache *cache, const char *prefix, const char *root, size_t capacity);
+extern void file_cache_destroy(FileCache *cache);
+extern void file_cache_handle_changes(FileCache *cache);
+extern StaticFileResult serve_static_file(ClientInfo *client, const Request *req);
+
+#endif // STATIC_FILES_H
@@ -0,0 +1,21 @@
+#ifndef TEST_H
+#define TEST_H
+
+#include <stdio.h>
+
+// Checks that failed so far, a test exits with TEST_RESULT once done
+static int test_failures;
+
+// Report a failed check with where it is and keep going, so one run shows
+// every check that fails
+#define CHECK(cond)                                                                   \
+    do {                                                                              \
+        if (!(cond)) {                                                                \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            test_failures++;                                                          \
+        }                                                                             \
+    } while (0)
+
+#define TEST_RESULT() (test_failures > 0 ? 1 : 0)
+
+#endif // TEST_H
@@ -0,0 +1,227 @@
+#include "timer_wheel.h"
+#include <limits.h>
+#include <string.h>
+#include <time.h>
+
+#define SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+// Top level slots come round again after a full turn of the wheel, so
+// anything further out than half a turn is brought in to half a turn
+#define MAX_DELAY_TICKS (((uint64_t)1 << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) / 2)
+
+uint64_t monotonic_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void timer_wheel_init(TimerWheel *wheel, uint64_t now_ms)
+{
+    memset(wheel, 0, sizeof(TimerWheel));
+    wheel->now_ms = now_ms;
+    wheel->now = now_ms / TIMER_TICK_MS;
+}
+
+void timer_init(Timer *timer, TimerCallback callback, void *data)
+{
+    timer->next = NULL;
+    timer->pprev = NULL;
+    timer->expires = 0;
+    timer->slot = 0;
+    timer->callback = callback;
+    timer->data = data;
+}
+
+// The level is the highest digit in which expires and the current tick
+// differ, so the slot comes up before the timer is due and it then moves
+// down until it reaches level 0 on its own tick
+static void link_timer(TimerWheel *wheel, Timer *timer)
+{
+    uint64_t differ = timer->expires ^ wheel->now;
+    unsigned level = 0;
+    if (differ >= TIMER_WHEEL_SLOTS) {
+        level = (63 - __builtin_clzll(differ)) / TIMER_WHEEL_BITS;
+        if (level >= TIMER_WHEEL_LEVELS) {
+            level = TIMER_WHEEL_LEVELS - 1;
+        }
+    }
+    unsigned index = (timer->expires >> (level * TIMER_WHEEL_BITS)) & SLOT_MASK;
+
+    Timer **head = &wheel->slots[level][index];
+    timer->next = *head;
+    if (*head) {
+        (*head)->pprev = &timer->next;
+    }
+    *head = timer;
+    timer->pprev = head;
+    timer->slot = level * TIMER_WHEEL_SLOTS + index;
+    wheel->occupied[level] |= 1ULL << index;
+}
+
+static void unlink_timer(TimerWheel *wheel, Timer *timer)
+{
+    *timer->pprev = timer->next;
+    if (timer->next) {
+        timer->next->pprev = timer->pprev;
+    }
+    timer->next = NULL;
+    timer->pprev = NULL;
+
+    unsigned level = timer->slot / TIMER_WHEEL_SLOTS;
+    unsigned index = timer->slot % TIMER_WHEEL_SLOTS;
+    if (!wheel->slots[level][index]) {
+        wheel->occupied[level] &= ~(1ULL << index);
+    }
+}
+
+/**
+ * Start a timer, or restart it if it is already pending
+ * @param wheel Wheel of the loop the timer runs on
+ * @param timer Timer to start
+ * @param delay_ms Time from the last advance until the callback runs,
+ * rounded up to whole ticks
+ */
+void timer_schedule(TimerWheel *wheel, Timer *timer, uint64_t delay_ms)
+{
+    if (timer_pending(timer)) {
+        unlink_timer(wheel, timer);
+        wheel->count--;
+    }
+
+    uint64_t expires = (wheel->now_ms + delay_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    if (expires < wheel->now) {
+        expires = wheel->now;
+    } else if (expires - wheel->now > MAX_DELAY_TICKS) {
+        expires = wheel->now + MAX_DELAY_TICKS;
+    }
+    timer->expires = expires;
+    link_timer(wheel, timer);
+    wheel->count++;
+}
+
+void timer_cancel(TimerWheel *wheel, Timer *timer)
+{
+    if (timer_pending(timer)) {
+        unlink_timer(wheel, timer);
+        wheel->count--;
+    }
+}
+
+// Take a slot's timers off the wheel, leaving them linked behind *head so
+// callbacks can still cancel any of them
+static Timer *detach_slot(TimerWheel *wheel, unsigned level, unsigned index, Timer **head)
+{
+    *head = wheel->slots[level][index];
+    wheel->slots[level][index] = NULL;
+    wheel->occupied[level] &= ~(1ULL << index);
+    if (*head) {
+        (*head)->pprev = head;
+    }
+    return *head;
+}
+
+// At the start of every turn of level 0, move the timers of the higher
+// level slots that just came up one or more levels down. Higher levels go
+// first, since what they shed may land in a lower slot that is also due
+static void cascade(TimerWheel *wheel)
+{
+    unsigned top = 1;
+    while (top < TIMER_WHEEL_LEVELS - 1 && ((wheel->now >> (top * TIMER_WHEEL_BITS)) & SLOT_MASK) == 0) {
+        top++;
+    }
+    for (unsigned level = top; level >= 1; level--) {
+        Timer *moving;
+        detach_slot(wheel, level, (wheel->now >> (level * TIMER_WHEEL_BITS)) & SLOT_MASK, &moving);
+        while (moving) {
+            Timer *timer = moving;
+            unlink_timer(wheel, timer);
+            link_timer(wheel, timer);
+        }
+    }
+}
+
+/**
+ * Run the callbacks of every timer due by now_ms. Callbacks may schedule and
+ * cancel timers, including other expired ones
+ * @param wheel Wheel to advance
+ * @param now_ms Current monotonic time
+ */
+void timer_wheel_advance(TimerWheel *wheel, uint64_t now_ms)
+{
+    wheel->now_ms = now_ms;
+    uint64_t target = now_ms / TIMER_TICK_MS;
+
+    while (wheel->now <= target) {
+        if (wheel->count == 0) {
+            wheel->now = target + 1;
+            break;
+        }
+
+        unsigned index = wheel->now & SLOT_MASK;
+        if (index == 0) {
+            cascade(wheel);
+        }
+
+        // Skip ticks with nothing due, up to the next occupied slot or the
+        // next turn, whichever comes first
+        uint64_t due = wheel->occupied[0] >> index;
+        if (!(due & 1)) {
+            uint64_t next = due ? wheel->now + __builtin_ctzll(due) : (wheel->now | SLOT_MASK) + 1;
+            wheel->now = next <= target ? next : target + 1;
+            continue;
+        }
+
+        Timer *expired;
+        detach_slot(wheel, 0, index, &expired);
+        // Timers scheduled by the callbacks belong to later ticks
+        wheel->now++;
+        while (expired) {
+            Timer *timer = expired;
+            unlink_timer(wheel, timer);
+            wheel->count--;
+            timer->callback(timer);
+        }
+    }
+}
+
+/**
+ * How long the loop may wait before the next timer is due
+ * @param wheel Wheel to check
+ * @return Milliseconds from the last advance, or -1 if no timer is pending
+ */
+int timer_wheel_timeout(const TimerWheel *wheel)
+{
+    if (wheel->count == 0) {
+        return -1;
+    }
+
+    // Level 0 slots are exact ticks, the higher ones are due when they
+    // cascade. Only the top level can hold slots behind the current one,
+    // which are a whole turn away
+    uint64_t next = UINT64_MAX;
+    for (unsigned level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        if (!wheel->occupied[level]) {
+            continue;
+        }
+        unsigned shift = level * TIMER_WHEEL_BITS;
+        unsigned index = (wheel->now >> shift) & SLOT_MASK;
+        uint64_t turn = (wheel->now >> (shift + TIMER_WHEEL_BITS)) << (shift + TIMER_WHEEL_BITS);
+        uint64_t ahead = wheel->occupied[level] >> index;
+        uint64_t tick;
+        if (ahead) {
+            tick = turn + ((uint64_t)(index + __builtin_ctzll(ahead)) << shift);
+        } else {
+            tick = turn + ((uint64_t)TIMER_WHEEL_SLOTS << shift)
+                + ((uint64_t)__builtin_ctzll(wheel->occupied[level]) << shift);
+        }
+        if (tick < next) {
+            next = tick;
+        }
+    }
+
+    uint64_t due_ms = next * TIMER_TICK_MS;
+    if (due_ms <= wheel->now_ms) {
+        return 0;
+    }
+    return due_ms - wheel->now_ms > INT_MAX ? INT_MAX : (int)(due_ms - wheel->now_ms);
+}
@@ -0,0 +1,55 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define TIMER_TICK_MS 10
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+// Four levels of 64 slots cover 2^24 ticks, a bit under two days
+#define TIMER_WHEEL_LEVELS 4
+
+typedef struct Timer Timer;
+
+typedef void (*TimerCallback)(Timer *timer);
+
+// Embedded in whatever it times, nothing is allocated per timer
+struct Timer {
+    Timer *next;
+    Timer **pprev; // NULL while the timer isn't scheduled
+    uint64_t expires; // Tick the timer fires at
+    uint16_t slot; // level * TIMER_WHEEL_SLOTS + slot index, while scheduled
+    TimerCallback callback;
+    void *data;
+};
+
+// Hashed hierarchical wheel. Level 0 has one slot per tick, every level
+// above it one slot per whole turn of the level below, and timers move down
+// a level each time their slot comes up. Scheduling and cancelling are a
+// list insert and unlink, and a bitmap per level finds the next expiry
+// without walking empty slots
+typedef struct TimerWheel {
+    uint64_t now; // Next tick to be processed
+    uint64_t now_ms; // Monotonic time of the last advance
+    uint64_t occupied[TIMER_WHEEL_LEVELS]; // Bit per slot that has timers
+    Timer *slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+    size_t count;
+} TimerWheel;
+
+extern uint64_t monotonic_ms();
+extern void timer_wheel_init(TimerWheel *wheel, uint64_t now_ms);
+extern void timer_init(Timer *timer, TimerCallback callback, void *data);
+extern void timer_schedule(TimerWheel *wheel, Timer *timer, uint64_t delay_ms);
+extern void timer_cancel(TimerWheel *wheel, Timer *timer);
+extern int timer_wheel_timeout(const TimerWheel *wheel);
+extern void timer_wheel_advance(TimerWheel *wheel, uint64_t now_ms);
+
+// Whether the timer is waiting to fire
+static inline bool timer_pending(const Timer *timer)
+{
+    return timer->pprev != NULL;
+}
+
+#endif // TIMER_WHEEL_H
@@ -0,0 +1,172 @@
+#include "test.h"
+#include "timer_wheel.h"
+#include <stdlib.h>
+
+#define NUM_TIMERS 2000
+#define MAX_DELAY_MS (20 * 3600 * 1000ULL)
+#define START_MS 123456789ULL
+
+typedef struct TestTimer {
+    Timer timer;
+    uint64_t due_ms; // First tick boundary at or after the deadline
+    uint64_t fired_ms; // now_ms of the advance that ran it
+    int fired;
+} TestTimer;
+
+static TimerWheel wheel;
+static TestTimer timers[NUM_TIMERS];
+static uint64_t now_ms;
+static uint64_t last_ms; // Time of the advance before the current one
+
+static void on_fire(Timer *timer)
+{
+    TestTimer *test = timer->data;
+    test->fired++;
+    test->fired_ms = now_ms;
+    // Due by now, and not already due at the advance before
+    CHECK(test->due_ms <= now_ms);
+    CHECK(test->due_ms > last_ms);
+}
+
+static void schedule(TestTimer *test, uint64_t delay_ms)
+{
+    uint64_t due_tick = (wheel.now_ms + delay_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    if (due_tick < wheel.now) {
+        due_tick = wheel.now;
+    }
+    test->due_ms = due_tick * TIMER_TICK_MS;
+    test->fired = 0;
+    timer_schedule(&wheel, &test->timer, delay_ms);
+}
+
+// Mostly short delays, as for reads, with some spanning every level
+static uint64_t random_delay()
+{
+    switch (rand() % 4) {
+    case 0:
+        return rand() % 100;
+    case 1:
+        return rand() % 10000;
+    case 2:
+        return (uint64_t)rand() % (30 * 60 * 1000);
+    default:
+        return (uint64_t)rand() * 1000ULL % MAX_DELAY_MS;
+    }
+}
+
+static uint64_t random_step()
+{
+    switch (rand() % 10) {
+    case 0:
+        return (uint64_t)rand() % (2 * 3600 * 1000);
+    case 1:
+    case 2:
+        return rand() % 10000;
+    default:
+        return rand() % 50;
+    }
+}
+
+// Timers fire on the first advance past their deadline, never early and
+// exactly once, however far each advance jumps, and the loop is never told
+// to sleep past the next one
+static void test_random_schedule()
+{
+    now_ms = last_ms = START_MS;
+    timer_wheel_init(&wheel, now_ms);
+    for (int i = 0; i < NUM_TIMERS; i++) {
+        timer_init(&timers[i].timer, on_fire, &timers[i]);
+        schedule(&timers[i], random_delay());
+    }
+
+    int cancelled = 0;
+    for (int round = 0; wheel.count > 0 && round < 1000000; round++) {
+        // Cancel or move some pending timers along the way
+        TestTimer *test = &timers[rand() % NUM_TIMERS];
+        if (timer_pending(&test->timer)) {
+            if (rand() % 20 == 0) {
+                timer_cancel(&wheel, &test->timer);
+                CHECK(!timer_pending(&test->timer));
+                test->due_ms = UINT64_MAX;
+                cancelled++;
+            } else if (rand() % 20 == 0) {
+                schedule(test, random_delay());
+            }
+        }
+
+        int timeout = timer_wheel_timeout(&wheel);
+        uint64_t earliest = UINT64_MAX;
+        for (int i = 0; i < NUM_TIMERS; i++) {
+            if (timer_pending(&timers[i].timer) && timers[i].due_ms < earliest) {
+                earliest = timers[i].due_ms;
+            }
+        }
+        CHECK(timeout >= 0);
+        CHECK(earliest == UINT64_MAX || now_ms + timeout <= (earliest > now_ms ? earliest : now_ms));
+
+        last_ms = now_ms;
+        now_ms += random_step();
+        timer_wheel_advance(&wheel, now_ms);
+    }
+
+    CHECK(wheel.count == 0);
+    CHECK(timer_wheel_timeout(&wheel) == -1);
+    int fired = 0;
+    for (int i = 0; i < NUM_TIMERS; i++) {
+        CHECK(timers[i].fired <= 1);
+        CHECK(timers[i].fired == (timers[i].due_ms != UINT64_MAX));
+        fired += timers[i].fired;
+    }
+    CHECK(fired + cancelled == NUM_TIMERS);
+}
+
+static Timer *victim;
+static int rescheduled;
+
+// Cancels another timer due on the same tick, then comes back once
+static void cancel_and_repeat(Timer *timer)
+{
+    TestTimer *test = timer->data;
+    test->fired++;
+    timer_cancel(&wheel, victim);
+    if (!rescheduled++) {
+        timer_schedule(&wheel, timer, 50);
+    }
+}
+
+static void count_fire(Timer *timer)
+{
+    ((TestTimer *)timer->data)->fired++;
+}
+
+// Callbacks can cancel other expired timers and reschedule themselves
+static void test_callbacks()
+{
+    TestTimer first = { 0 }, second = { 0 };
+    timer_wheel_init(&wheel, START_MS);
+    timer_init(&first.timer, cancel_and_repeat, &first);
+    timer_init(&second.timer, count_fire, &second);
+    timer_schedule(&wheel, &first.timer, 100);
+    timer_schedule(&wheel, &second.timer, 100);
+    victim = &second.timer;
+    rescheduled = 0;
+
+    timer_wheel_advance(&wheel, START_MS + 99);
+    CHECK(first.fired == 0 && second.fired == 0);
+    timer_wheel_advance(&wheel, START_MS + 200);
+    // Whichever ran first, the one that cancels always runs
+    CHECK(first.fired == 1);
+    CHECK(!timer_pending(&second.timer));
+    CHECK(timer_pending(&first.timer));
+    timer_wheel_advance(&wheel, START_MS + 260);
+    CHECK(first.fired == 2);
+    CHECK(wheel.count == 0);
+}
+
+int main()
+{
+    srand(1);
+    test_random_schedule();
+    test_callbacks();
+    return TEST_RESULT();
+}
@@ -0,0 +1,291 @@
+#include "url.h"
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+static int hex_value(char c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    c |= 0x20;
+    return c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+}
+
+// Decode the "%XX" at data[0], false unless it is followed by two hex digits
+static bool decode_escape(const char *data, const char *end, char *c)
+{
+    if (end - data < 3) {
+        return false;
+    }
+    int high = hex_value(data[1]), low = hex_value(data[2]);
+    if (high < 0 || low < 0) {
+        return false;
+    }
+    *c = (char)(high << 4 | low);
+    return true;
+}
+
+// Offset of the first byte that decodes to something else, len if there is
+// none. Sixteen bytes at a time where SSE2 is available, which is all of the
+// common case of a value with nothing to decode
+static size_t first_escape(const char *data, size_t len, bool plus_is_space)
+{
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i percent = _mm_set1_epi8('%');
+    const __m128i plus = _mm_set1_epi8(plus_is_space ? '+' : '%');
+    for (; i + 16 <= len; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(data + i));
+        unsigned found = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(block, percent), _mm_cmpeq_epi8(block, plus)));
+        if (found) {
+            return i + __builtin_ctz(found);
+        }
+    }
+#endif
+    for (; i < len; i++) {
+        if (data[i] == '%' || (plus_is_space && data[i] == '+')) {
+            break;
+        }
+    }
+    return i;
+}
+
+/**
+ * Whether a path can be used as it arrived: nothing percent-encoded and no
+ * empty, "." or ".." segments. Checked sixteen bytes at a time where SSE2
+ * is available, so clean paths cost one pass and no writes
+ * @param path Path starting with '/'
+ * @param len Length of path
+ * @return false if url_normalize_path would change it
+ */
+bool url_path_is_normal(const char *path, size_t len)
+{
+    size_t i = 0;
+    unsigned after_slash = 0; // Whether the byte before i is a '/'
+#ifdef __SSE2__
+    const __m128i percent = _mm_set1_epi8('%');
+    const __m128i slash = _mm_set1_epi8('/');
+    const __m128i dot = _mm_set1_epi8('.');
+    for (; i + 16 <= len; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(path + i));
+        unsigned escapes = _mm_movemask_epi8(_mm_cmpeq_epi8(block, percent));
+        unsigned slashes = _mm_movemask_epi8(_mm_cmpeq_epi8(block, slash));
+        unsigned dots = _mm_movemask_epi8(_mm_cmpeq_epi8(block, dot));
+        // A '/' or '.' right after a '/' starts an empty or dot segment
+        if (escapes | ((slashes << 1 | after_slash) & (slashes | dots))) {
+            return false;
+        }
+        after_slash = slashes >> 15;
+    }
+#endif
+    for (; i < len; i++) {
+        char c = path[i];
+        if (c == '%' || (after_slash && (c == '/' || c == '.'))) {
+            return false;
+        }
+        after_slash = c == '/';
+    }
+    return true;
+}
+
+// Drop the segment just written at path[start] up to *out if it is "." or
+// "..", along with the one before it for "..". False if that would climb
+// above the root
+static bool end_segment(const char *path, size_t start, size_t *out)
+{
+    size_t len = *out - start;
+    if (len == 1 && path[start] == '.') {
+        *out = start;
+    } else if (len == 2 && path[start] == '.' && path[start + 1] == '.') {
+        if (start <= 1) {
+            return false;
+        }
+        size_t end = start - 1;
+        while (end > 0 && path[end - 1] != '/') {
+            end--;
+        }
+        *out = end;
+    }
+    return true;
+}
+
+/**
+ * Percent-decode a path in place and resolve it in the same pass: runs of
+ * '/' collapse to one, "." segments go away and ".." removes the segment
+ * before it. Decoded bytes count, so "%2e%2e" is ".." and "%2f" separates
+ * segments. The result is never longer than the input
+ * @param path Path starting with '/', rewritten in place
+ * @param len Length of path, updated to the result's
+ * @return false for a bad escape, an encoded NUL, or ".." above the root
+ */
+bool url_normalize_path(char *path, size_t *len)
+{
+    const char *end = path + *len;
+    size_t in = 0, out = 0, segment = 0;
+    while (path + in < end) {
+        char c = path[in];
+        if (c == '%') {
+            if (!decode_escape(path + in, end, &c) || c == '\0') {
+                return false;
+            }
+            in += 2;
+        }
+        in++;
+        if (c != '/') {
+            path[out++] = c;
+            continue;
+        }
+        if (!end_segment(path, segment, &out)) {
+            return false;
+        }
+        if (out == 0 || path[out - 1] != '/') {
+            path[out++] = '/';
+        }
+        segment = out;
+    }
+    if (!end_segment(path, segment, &out)) {
+        return false;
+    }
+    *len = out;
+    return true;
+}
+
+/**
+ * Percent-decode in place. Runs with nothing to decode are found sixteen
+ * bytes at a time and left alone when there is nothing before them to
+ * shift over, so a plain value is only read
+ * @param data Bytes to decode, rewritten in place
+ * @param len Length of data
+ * @param plus_is_space Whether '+' means ' ', as it does in query strings
+ * @return Length of the decoded bytes, or -1 for a bad escape
+ */
+ssize_t url_decode(char *data, size_t len, bool plus_is_space)
+{
+    const char *end = data + len;
+    size_t in = first_escape(data, len, plus_is_space), out = in;
+    while (in < len) {
+        char c = ' ';
+        if (data[in] == '%') {
+            if (!decode_escape(data + in, end, &c)) {
+                return -1;
+            }
+            in += 2;
+        }
+        in++;
+        data[out++] = c;
+
+        size_t run = first_escape(data + in, len - in, plus_is_space);
+        memmove(data + out, data + in, run);
+        in += run;
+        out += run;
+    }
+    return out;
+}
+
+/**
+ * Start walking the pairs of a query string
+ * @param iter Iterator to set up
+ * @param query Query string without the '?', e.g. Request.query
+ */
+void query_iter_init(QueryIter *iter, StringView query)
+{
+    iter->curr = query.data;
+    iter->end = query.data + query.len;
+}
+
+/**
+ * Take the next name=value pair, skipping empty ones. Both halves are
+ * views into the query and still encoded
+ * @param iter Iterator from query_iter_init
+ * @param param Filled in with the pair
+ * @return false once every pair has been taken
+ */
+bool query_next(QueryIter *iter, QueryParam *param)
+{
+    while (iter->curr < iter->end) {
+        const char *start = iter->curr;
+        const char *amp = memchr(start, '&', iter->end - start);
+        const char *pair_end = amp ? amp : iter->end;
+        iter->curr = amp ? amp + 1 : iter->end;
+        if (pair_end == start) {
+            continue;
+        }
+        const char *equals = memchr(start, '=', pair_end - start);
+        const char *name_end = equals ? equals : pair_end;
+        param->name = (StringView) { .data = start, .len = name_end - start };
+        param->value = equals ? (StringView) { .data = equals + 1, .len = pair_end - equals - 1 }
+                              : (StringView) { .data = pair_end, .len = 0 };
+        return true;
+    }
+    return false;
+}
+
+// Whether an encoded name decodes to wanted, decoding as it compares so
+// nothing is written
+static bool name_equals(StringView encoded, const char *wanted)
+{
+    const char *curr = encoded.data, *end = encoded.data + encoded.len;
+    while (curr < end) {
+        char c = *curr;
+        if (c == '+') {
+            c = ' ';
+        } else if (c == '%') {
+            if (!decode_escape(curr, end, &c)) {
+                return false;
+            }
+            curr += 2;
+        }
+        curr++;
+        if (*wanted == '\0' || c != *wanted++) {
+            return false;
+        }
+    }
+    return *wanted == '\0';
+}
+
+/**
+ * Find the first pair whose decoded name is name. Only names are looked
+ * at on the way, no value is decoded
+ * @param query Query string without the '?'
+ * @param name Decoded name to look for
+ * @param value Set to the pair's value, still encoded
+ * @return Whether the name was there
+ */
+bool query_find(StringView query, const char *name, StringView *value)
+{
+    QueryIter iter;
+    QueryParam param;
+    query_iter_init(&iter, query);
+    while (query_next(&iter, &param)) {
+        if (name_equals(param.name, name)) {
+            *value = param.value;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Decode the value of a query parameter into a caller's buffer
+ * @param query Query string without the '?'
+ * @param name Decoded name to look for
+ * @param out Where the decoded value goes, NUL terminated
+ * @param out_size Size of out, has to fit the value as it was encoded
+ * @return Length of the decoded value, or -1 if the name isn't there, the
+ * value doesn't fit or it has a bad escape
+ */
+ssize_t query_get(StringView query, const char *name, char *out, size_t out_size)
+{
+    StringView value;
+    if (!query_find(query, name, &value) || value.len >= out_size) {
+        return -1;
+    }
+    memcpy(out, value.data, value.len);
+    ssize_t len = url_decode(out, value.len, true);
+    if (len >= 0) {
+        out[len] = '\0';
+    }
+    return len;
+}
@@ -0,0 +1,31 @@
+#ifndef URL_H
+#define URL_H
+
+#include "common.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// One name=value pair of a query string, both still percent-encoded
+typedef struct QueryParam {
+    StringView name;
+    StringView value; // Empty if the pair has no '='
+} QueryParam;
+
+// Walks a query string a pair at a time. Nothing is decoded until a
+// handler asks for a value, see query_get
+typedef struct QueryIter {
+    const char *curr;
+    const char *end;
+} QueryIter;
+
+extern bool url_path_is_normal(const char *path, size_t len);
+extern bool url_normalize_path(char *path, size_t *len);
+extern ssize_t url_decode(char *data, size_t len, bool plus_is_space);
+
+extern void query_iter_init(QueryIter *iter, StringView query);
+extern bool query_next(QueryIter *iter, QueryParam *param);
+extern bool query_find(StringView query, const char *name, StringView *value);
+extern ssize_t query_get(StringView query, const char *name, char *out, size_t out_size);
+
+#endif // URL_H
@@ -0,0 +1,154 @@
+#include "test.h"
+#include "url.h"
+#include <string.h>
+
+#define MAX_PATH_LEN 128
+
+// Normalize a copy of path, expected is NULL where it has to be refused. A
+// path reported as already normal has to come out as it went in
+static void check_path(const char *path, const char *expected)
+{
+    char buf[MAX_PATH_LEN];
+    size_t len = strlen(path);
+    memcpy(buf, path, len);
+    bool normal = url_path_is_normal(path, len);
+    bool ok = url_normalize_path(buf, &len);
+    if (!expected) {
+        CHECK(!ok);
+        CHECK(!normal);
+        return;
+    }
+    CHECK(ok);
+    CHECK(len == strlen(expected) && memcmp(buf, expected, len) == 0);
+    CHECK(!normal || strcmp(path, expected) == 0);
+}
+
+static void test_normalize_path()
+{
+    check_path("/", "/");
+    check_path("/a/b", "/a/b");
+    check_path("//a///b//", "/a/b/");
+    check_path("/a/./b/.", "/a/b/");
+    check_path("/./", "/");
+    check_path("/a/b/..", "/a/");
+    check_path("/a/../b", "/b");
+    check_path("/a/b/../../c", "/c");
+    check_path("/a/..b/c./.d", "/a/..b/c./.d");
+    check_path("/%41%62c", "/Abc");
+    // Escapes decode before segments are resolved
+    check_path("/a%2fb", "/a/b");
+    check_path("/a%2F..%2Fb", "/b");
+    check_path("/a/%2e%2E/b", "/b");
+    check_path("/a/%2e/b", "/a/b");
+
+    // Nothing climbs above the root, however it is spelled
+    check_path("/..", NULL);
+    check_path("/../etc/passwd", NULL);
+    check_path("/a/../..", NULL);
+    check_path("/%2e%2e/etc/passwd", NULL);
+    check_path("/a%2f..%2f..%2fetc", NULL);
+    check_path("//..", NULL);
+    // Encoded NULs and bad escapes are refused
+    check_path("/a%00.txt", NULL);
+    check_path("/a%zz", NULL);
+    check_path("/a%2", NULL);
+    check_path("/a%", NULL);
+}
+
+// The SSE2 check has to see empty and dot segments, and escapes, wherever
+// they fall in its sixteen byte blocks
+static void test_path_is_normal()
+{
+    char path[48];
+    memset(path, 'a', sizeof(path));
+    path[0] = '/';
+    CHECK(url_path_is_normal(path, sizeof(path)));
+    for (size_t at = 1; at + 1 < sizeof(path); at++) {
+        const char *const marks[] = { "//", "/.", "%" };
+        for (size_t m = 0; m < 3; m++) {
+            char copy[sizeof(path)];
+            memcpy(copy, path, sizeof(path));
+            memcpy(copy + at, marks[m], strlen(marks[m]));
+            CHECK(!url_path_is_normal(copy, sizeof(copy)));
+        }
+        // A '/' alone is just a separator
+        char copy[sizeof(path)];
+        memcpy(copy, path, sizeof(path));
+        copy[at] = '/';
+        CHECK(url_path_is_normal(copy, sizeof(copy)) == (at > 1));
+    }
+}
+
+static void check_decode(const char *in, bool plus_is_space, const char *expected, ssize_t expected_len)
+{
+    char buf[MAX_PATH_LEN];
+    size_t len = strlen(in);
+    memcpy(buf, in, len);
+    ssize_t decoded = url_decode(buf, len, plus_is_space);
+    CHECK(decoded == expected_len);
+    if (expected && decoded >= 0) {
+        CHECK(memcmp(buf, expected, decoded) == 0);
+    }
+}
+
+static void test_decode()
+{
+    check_decode("plain", true, "plain", 5);
+    check_decode("a%20b+c", true, "a b c", 5);
+    check_decode("a%20b+c", false, "a b+c", 5);
+    check_decode("%e2%82%AC", false, "\xe2\x82\xac", 3);
+    // Values may hold NULs, they are measured rather than terminated
+    check_decode("a%00b", false, "a\0b", 3);
+    check_decode("0123456789abcdefghij%21klmnopqrstuvwxyz+", true, "0123456789abcdefghij!klmnopqrstuvwxyz ", 38);
+    check_decode("%", false, NULL, -1);
+    check_decode("abc%4", false, NULL, -1);
+    check_decode("0123456789abcdefghij%g1", false, NULL, -1);
+}
+
+static StringView view(const char *str)
+{
+    return (StringView) { .data = str, .len = strlen(str) };
+}
+
+static void test_query()
+{
+    StringView query = view("&a=1&b=hello%20world&&c&na%6De=x&a+b=2&a=3&bad=%zz&");
+    char out[16];
+    CHECK(query_get(query, "a", out, sizeof(out)) == 1 && strcmp(out, "1") == 0);
+    CHECK(query_get(query, "b", out, sizeof(out)) == 11 && strcmp(out, "hello world") == 0);
+    CHECK(query_get(query, "c", out, sizeof(out)) == 0 && strcmp(out, "") == 0);
+    // Names are compared decoded
+    CHECK(query_get(query, "name", out, sizeof(out)) == 1 && strcmp(out, "x") == 0);
+    CHECK(query_get(query, "a b", out, sizeof(out)) == 1 && strcmp(out, "2") == 0);
+    CHECK(query_get(query, "missing", out, sizeof(out)) == -1);
+    CHECK(query_get(query, "na", out, sizeof(out)) == -1);
+    CHECK(query_get(query, "bad", out, sizeof(out)) == -1);
+    // The value has to fit as it was sent, terminator included
+    CHECK(query_get(query, "b", out, 14) == 11);
+    CHECK(query_get(query, "b", out, 13) == -1);
+
+    StringView value;
+    CHECK(query_find(query, "b", &value) && sv_equals(value, "hello%20world"));
+
+    QueryIter iter;
+    QueryParam param;
+    size_t count = 0;
+    query_iter_init(&iter, query);
+    while (query_next(&iter, &param)) {
+        CHECK(param.name.len > 0);
+        count++;
+    }
+    CHECK(count == 7);
+
+    query_iter_init(&iter, view(""));
+    CHECK(!query_next(&iter, &param));
+}
+
+int main()
+{
+    test_normalize_path();
+    test_path_is_normal();
+    test_decode();
+    test_query();
+    return TEST_RESULT();
+}
@@ -0,0 +1,619 @@
+#define _GNU_SOURCE
+#include "worker.h"
+#include "http_utils.h"
+#include "request.h"
+#include "request_body.h"
+#include "request_parser.h"
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define CONNECTIONS_PER_SLAB 256
+#define CLIENTS_PER_SLAB 64
+
+// Every worker binds its own socket to the same port with SO_REUSEPORT,
+// so the kernel load balances incoming connections between them
+static int create_listen_socket(const ServerConfig *config)
+{
+    int fd;
+    struct sockaddr_in address;
+    int opt = 1;
+
+    if ((fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+        perror("socket failed");
+        return -1;
+    }
+
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt))
+        || setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt))) {
+        perror("setsockopt failed");
+        close(fd);
+        return -1;
+    }
+
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(config->port);
+
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        perror("bind failed");
+        close(fd);
+        return -1;
+    }
+
+    if (listen(fd, config->backlog) < 0) {
+        perror("listen failed");
+        close(fd);
+        return -1;
+    }
+
+    // Only wake up for connections once their request has arrived
+    int defer_seconds = config->defer_accept_seconds;
+    if (defer_seconds > 0 && setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer_seconds, sizeof(defer_seconds))) {
+        perror("setsockopt TCP_DEFER_ACCEPT failed");
+    }
+
+    return fd;
+}
+
+static void track_connection(Worker *worker, Connection *conn)
+{
+    conn->prev = NULL;
+    conn->next = worker->connections;
+    if (worker->connections) {
+        worker->connections->prev = conn;
+    }
+    worker->connections = conn;
+    worker->num_connections++;
+    metrics_set(&worker->metrics.connections_active, worker->num_connections);
+}
+
+static void untrack_connection(Worker *worker, Connection *conn)
+{
+    if (conn->prev) {
+        conn->prev->next = conn->next;
+    } else {
+        worker->connections = conn->next;
+    }
+    if (conn->next) {
+        conn->next->prev = conn->prev;
+    }
+    worker->num_connections--;
+    metrics_set(&worker->metrics.connections_active, worker->num_connections);
+}
+
+// Shut the socket down and free everything the connection holds
+static void release_connection(Connection *conn)
+{
+    // Signal that we're done sending
+    shutdown(conn->handle.fd, SHUT_WR);
+    free_client(conn->client);
+    free_connection(conn);
+}
+
+void close_connection(Worker *worker, Connection *conn)
+{
+    ClientInfo *client = conn->client;
+    if (client) {
+        abort_proxy(client);
+        abort_offload(client);
+    }
+    untrack_connection(worker, conn);
+    timer_cancel(&worker->loop->timers, &conn->timer);
+    if (event_loop_remove(worker->loop, &conn->handle) > 0) {
+        // Completion backends report EVENT_CLOSED once in-flight sends are done
+        if (client) {
+            client->state = CLIENT_CLOSING;
+        }
+        return;
+    }
+    release_connection(conn);
+}
+
+void close_client(Worker *worker, ClientInfo *client)
+{
+    close_connection(worker, client->conn);
+}
+
+// Give the stream handler the first look at a request whose body is still
+// on its way. If it doesn't take the body, the body is buffered and the
+// request goes to the regular handler once it is complete
+static void offer_request_body(Worker *worker, ClientInfo *client, Request *req)
+{
+    client->offer_body = false;
+    if (!worker->config->stream_handler(client, req)) {
+        client->state = CLIENT_WRITING;
+        if (check_http_end(client)) {
+            client->state = CLIENT_READY;
+        }
+        return;
+    }
+    metrics_add(&worker->metrics.requests, 1);
+
+    if (client->state == CLIENT_BODY) {
+        deliver_request_body(client);
+    } else if (client->state == CLIENT_READY) {
+        // Answered without the body, which would have to be read to find
+        // the next request
+        client->keep_alive = false;
+        finish_client_request(client, worker->loop);
+    }
+}
+
+// Answer every complete request in the buffer, pipelined ones included,
+// and send all of the responses together
+static void process_requests(Worker *worker, ClientInfo *client)
+{
+    RequestOrError req_or_err;
+
+    while (client->state == CLIENT_READY) {
+        // Don't answer more while the client isn't taking what it has
+        if (client_output_over_high_water(client)) {
+            flush_client(client);
+            // A failed send drops the queue along with the connection
+            if (client->state != CLIENT_READY || client_output_over_high_water(client)) {
+                break;
+            }
+        }
+
+        Metrics *metrics = &worker->metrics;
+        uint64_t start = metrics_start(metrics, STAGE_PARSE);
+        parse_request(client, &req_or_err);
+        metrics_end(metrics, STAGE_PARSE, start);
+        if (worker->access_log.records) {
+            start_client_request(client, &req_or_err);
+        }
+        if (req_or_err.has_error) {
+            // Framing can't be trusted after a malformed request
+            client->keep_alive = false;
+            client->head_request = false;
+            metrics_add(&metrics->parse_errors, 1);
+        } else {
+            client->keep_alive = req_or_err.data.req.keep_alive;
+            client->http_1_0 = req_or_err.data.req.minor_version == 0;
+            client->head_request = req_or_err.data.req.method == METHOD_HEAD;
+            client->accepted_encodings
+                = parse_accept_encoding(request_header(&req_or_err.data.req, HEADER_ACCEPT_ENCODING));
+            if (client->offer_body) {
+                offer_request_body(worker, client, &req_or_err.data.req);
+                continue;
+            }
+        }
+
+        // Offered bodies are counted once, when they are taken or handled
+        metrics_add(&metrics->requests, 1);
+        start = metrics_start(metrics, STAGE_HANDLER);
+        worker->config->handler(client, &req_or_err);
+        metrics_end(metrics, STAGE_HANDLER, start);
+
+        if (client->state == CLIENT_READY) {
+            finish_client_request(client, worker->loop);
+        }
+    }
+
+    flush_client(client);
+}
+
+// Reading is held off while output is over the high-water mark, while a
+// streamed body's handler is paused, or while a backend, an offload thread
+// or a response producer answers, so the kernel's receive window pushes back
+// on clients that send faster than they are served
+static bool holds_reads(ClientInfo *client)
+{
+    return client_output_over_high_water(client) || client->state == CLIENT_UPSTREAM
+        || client->state == CLIENT_OFFLOADED || client->state == CLIENT_PRODUCING
+        || (client->state == CLIENT_BODY && client->body_paused);
+}
+
+static bool should_read(ClientInfo *client)
+{
+    return client->unread_data && client->state != CLIENT_DONE && !holds_reads(client);
+}
+
+// Completion backends receive on their own, so holding reads off means
+// stopping them
+static void update_receiving(Worker *worker, ClientInfo *client)
+{
+    if (!event_loop_completes_io(worker->loop)) {
+        return;
+    }
+    if (holds_reads(client)) {
+        event_loop_pause_recv(worker->loop, &client->conn->handle);
+    } else {
+        event_loop_resume_recv(worker->loop, &client->conn->handle);
+    }
+}
+
+static unsigned timeout_ms(const ServerConfig *config, ClientTimeout timeout)
+{
+    switch (timeout) {
+    case TIMEOUT_HEADERS:
+        return config->header_timeout_ms;
+    case TIMEOUT_BODY:
+        return config->body_timeout_ms;
+    case TIMEOUT_KEEP_ALIVE:
+        return config->keep_alive_timeout_ms;
+    case TIMEOUT_WRITE:
+        return config->write_timeout_ms;
+    default:
+        return 0;
+    }
+}
+
+// Point the connection's timer at whatever it is waiting for. It only
+// restarts when that changes or the connection makes the matching kind of
+// progress: a request finishing for headers and idle time, bytes for bodies
+// and output. Headers trickled in a byte at a time still have to be
+// complete by the original deadline
+static void update_connection_timeout(Worker *worker, Connection *conn)
+{
+    ClientInfo *client = conn->client;
+    ClientTimeout timeout = TIMEOUT_NONE;
+    uint64_t mark = 0;
+    if (!client) {
+        // A new connection has until its first headers are in
+        timeout = conn->requests > 0 ? TIMEOUT_KEEP_ALIVE : TIMEOUT_HEADERS;
+        mark = conn->requests;
+    } else if (client_has_pending_output(client)) {
+        timeout = TIMEOUT_WRITE;
+        mark = conn->bytes_sent;
+    } else if (client->state == CLIENT_BODY) {
+        // A paused body waits on its handler, not on the client
+        timeout = client->body_paused ? TIMEOUT_NONE : TIMEOUT_BODY;
+        mark = conn->bytes_received;
+    } else if (client->state == CLIENT_WRITING && client->headers_len > 0) {
+        timeout = TIMEOUT_BODY;
+        mark = conn->bytes_received;
+    } else if (client->state == CLIENT_WRITING) {
+        bool idle = client->buf_used == client->buf_start && conn->requests > 0;
+        timeout = idle ? TIMEOUT_KEEP_ALIVE : TIMEOUT_HEADERS;
+        mark = conn->requests;
+    }
+
+    if (timeout == conn->timeout && mark == conn->timeout_mark) {
+        return;
+    }
+    conn->timeout = timeout;
+    conn->timeout_mark = mark;
+    unsigned delay = timeout_ms(worker->config, timeout);
+    if (delay == 0) {
+        timer_cancel(&worker->loop->timers, &conn->timer);
+    } else {
+        timer_schedule(&worker->loop->timers, &conn->timer, delay);
+    }
+}
+
+/**
+ * Read, deliver and answer whatever the client is ready for, then close it
+ * if it is done. The client may be gone when this returns
+ * @param worker Worker that owns the client
+ * @param client Client to serve
+ */
+void service_client(Worker *worker, ClientInfo *client)
+{
+    do {
+        if (should_read(client)) {
+            client->unread_data = false;
+            handle_client_data(client);
+        }
+        if (client->state == CLIENT_BODY) {
+            deliver_request_body(client);
+            // The last fragment's response, before moving on
+            if (client_has_pending_output(client)) {
+                flush_client(client);
+            }
+        }
+        // A proxied response that stopped for the client to catch up
+        if (client->upstream) {
+            resume_proxy(client);
+        }
+        // The rest of a response that waited for the client to catch up
+        if (client->state == CLIENT_PRODUCING) {
+            resume_client_response(client);
+        }
+        if (client->state == CLIENT_READY) {
+            process_requests(worker, client);
+        }
+        // Sending may have made room for reads that were held back
+    } while (should_read(client));
+
+    // Anything still queued has to go out before the connection is closed
+    if (client->state == CLIENT_DONE && !client_has_pending_output(client)) {
+        close_client(worker, client);
+        return;
+    }
+    update_receiving(worker, client);
+    Connection *conn = client->conn;
+    // Idle until the next request, so only the Connection has to stay
+    if (client_is_idle(client)) {
+        free_client(client);
+    }
+    update_connection_timeout(worker, conn);
+}
+
+static void on_client_event(EventLoop *loop, EventHandle *handle, const Event *event)
+{
+    Worker *worker = loop->user_data;
+    Connection *conn = (Connection *)handle;
+
+    if (event->events & EVENT_CLOSED) {
+        release_connection(conn);
+        return;
+    }
+
+    ClientInfo *client = conn->client;
+    if (!client && !(client = create_client(conn))) {
+        perror("Failed to create client structure");
+        if (event->data) {
+            event_loop_release_buffer(loop, event->buffer_id);
+        }
+        close_connection(worker, conn);
+        return;
+    }
+
+    if (event->events & EVENT_SENT) {
+        complete_client_send(client, event->result);
+    }
+    if (event->events & EVENT_WRITABLE) {
+        resume_client_output(client);
+    }
+    if (event->events & EVENT_RECEIVED) {
+        receive_client_data(client, loop, event);
+    }
+    if (event->events & (EVENT_READABLE | EVENT_HANGUP)) {
+        client->unread_data = true;
+    }
+    if (event->events & EVENT_ERROR) {
+        client->state = CLIENT_DONE;
+        // A blocked write fails now and drops the rest of the queue
+        if (client->write_blocked) {
+            resume_client_output(client);
+        }
+    }
+
+    service_client(worker, client);
+}
+
+// Whatever the connection was waiting for isn't coming, or not soon enough
+static void on_connection_timeout(Timer *timer)
+{
+    Connection *conn = timer->data;
+    debug_log("Worker %d timed out connection on fd %d\n", conn->worker->id, conn->handle.fd);
+    close_connection(conn->worker, conn);
+}
+
+static void accept_client(Worker *worker, int client_fd)
+{
+    if (!admit_connection(&worker->admission, client_fd)) {
+        debug_log("Worker %d shed connection on fd %d\n", worker->id, client_fd);
+        return;
+    }
+
+    Connection *conn = create_connection(worker, client_fd);
+    if (!conn) {
+        perror("Failed to create connection");
+        close(client_fd);
+        return;
+    }
+
+    // Responses are already coalesced into one write per flush, so Nagle
+    // would only hold the last segment back
+    int opt = 1;
+    setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+
+    // Watch the connection, its pointer is what the loop hands back
+    conn->handle.callback = on_client_event;
+    conn->timer.callback = on_connection_timeout;
+    if (event_loop_recv(worker->loop, &conn->handle) < 0) {
+        perror("Failed to watch client");
+        free_connection(conn);
+        return;
+    }
+    track_connection(worker, conn);
+    update_connection_timeout(worker, conn);
+    metrics_add(&worker->metrics.connections_accepted, 1);
+    conn->accepted_at = metrics_start(&worker->metrics, STAGE_FIRST_BYTE);
+
+    debug_log("Worker %d accepted connection on fd %d\n", worker->id, client_fd);
+}
+
+static void on_listen_event(EventLoop *loop, EventHandle *handle, const Event *event)
+{
+    Worker *worker = loop->user_data;
+
+    if (event->events & EVENT_ACCEPTED) {
+        accept_client(worker, event->result);
+        return;
+    }
+
+    // Edge-triggered, so drain every pending connection. The flags come with
+    // the fd, saving a fcntl round trip per connection
+    while (1) {
+        int client_fd = accept4(handle->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if (client_fd < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("accept failed");
+            return;
+        }
+
+        accept_client(worker, client_fd);
+    }
+}
+
+static void on_file_changes(EventLoop *loop, EventHandle *handle, const Event *event)
+{
+    (void)loop;
+    (void)event;
+    file_cache_handle_changes((FileCache *)handle);
+}
+
+Worker *create_worker(const ServerConfig *config, int id, int cpu)
+{
+    Worker *worker = calloc(1, sizeof(Worker));
+    if (!worker)
+        return NULL;
+
+    worker->id = id;
+    worker->cpu = cpu;
+    worker->config = config;
+    slab_pool_init(&worker->connection_pool, sizeof(Connection), CONNECTIONS_PER_SLAB);
+    slab_pool_init(&worker->client_pool, sizeof(ClientInfo), CLIENTS_PER_SLAB);
+    buffer_pool_init(&worker->buffers);
+
+    if (prepare_static_responses(&worker->static_responses, &worker->date) < 0) {
+        fprintf(stderr, "Failed to prepare static responses\n");
+        free(worker);
+        return NULL;
+    }
+
+    worker->loop = create_event_loop(config->backend);
+    if (!worker->loop) {
+        free_static_responses(&worker->static_responses);
+        free(worker);
+        return NULL;
+    }
+    worker->loop->user_data = worker;
+
+    // Every worker caches its own fds, so lookups never need a lock
+    if (file_cache_init(&worker->files, config->static_prefix, config->static_root, config->file_cache_size) < 0) {
+        free_event_loop(worker->loop);
+        free_static_responses(&worker->static_responses);
+        free(worker);
+        return NULL;
+    }
+    worker->files.handle.callback = on_file_changes;
+    if (worker->files.root_fd >= 0 && event_loop_add(worker->loop, &worker->files.handle, EVENT_READABLE) < 0) {
+        perror("Failed to watch static files");
+        file_cache_destroy(&worker->files);
+        free_event_loop(worker->loop);
+        free_static_responses(&worker->static_responses);
+        free(worker);
+        return NULL;
+    }
+
+    worker->listen_handle.fd = create_listen_socket(config);
+    worker->listen_handle.callback = on_listen_event;
+    if (worker->listen_handle.fd < 0) {
+        free_event_loop(worker->loop);
+        file_cache_destroy(&worker->files);
+        free_static_responses(&worker->static_responses);
+        free(worker);
+        return NULL;
+    }
+
+    if (event_loop_accept(worker->loop, &worker->listen_handle) < 0) {
+        perror("Failed to watch server socket");
+        close(worker->listen_handle.fd);
+        free_event_loop(worker->loop);
+        file_cache_destroy(&worker->files);
+        free_static_responses(&worker->static_responses);
+        free(worker);
+        return NULL;
+    }
+
+    if (config->access_log_path && access_log_ring_init(&worker->access_log) < 0) {
+        close(worker->listen_handle.fd);
+        free_event_loop(worker->loop);
+        file_cache_destroy(&worker->files);
+        free_static_responses(&worker->static_responses);
+        free(worker);
+        return NULL;
+    }
+
+    if (response_cache_init(&worker->response_cache, config->response_cache_size, config->response_cache_ttl_ms) < 0) {
+        access_log_ring_destroy(&worker->access_log);
+        close(worker->listen_handle.fd);
+        free_event_loop(worker->loop);
+        file_cache_destroy(&worker->files);
+        free_static_responses(&worker->static_responses);
+        free(worker);
+        return NULL;
+    }
+
+    compressor_init(&worker->compressor, config->compression_levels, config->compress_min_size);
+    proxy_pool_init(&worker->proxy, worker);
+    if (offload_queue_init(&worker->offload, worker, config->offload_queue) < 0) {
+        proxy_pool_destroy(&worker->proxy);
+        // Clients let go of their jobs when they close
+        offload_queue_destroy(&worker->offload);
+        compressor_destroy(&worker->compressor);
+        response_cache_destroy(&worker->response_cache);
+        access_log_ring_destroy(&worker->access_log);
+        close(worker->listen_handle.fd);
+        free_event_loop(worker->loop);
+        file_cache_destroy(&worker->files);
+        free_static_responses(&worker->static_responses);
+        free(worker);
+        return NULL;
+    }
+
+    // Only registered once nothing can fail, /metrics may read it from now on
+    metrics_init(&worker->metrics, config->metrics_sample);
+    admission_init(&worker->admission, worker);
+    return worker;
+}
+
+void free_worker(Worker *worker)
+{
+    if (worker) {
+        // Unlinked first, so /metrics stops adding it up before it goes away
+        metrics_destroy(&worker->metrics);
+        while (worker->connections) {
+            close_connection(worker, worker->connections);
+        }
+        close(worker->listen_handle.fd);
+        // After the clients, which hand their backend connections back first
+        proxy_pool_destroy(&worker->proxy);
+        // After the clients too, closing them let go of their in-flight jobs
+        offload_queue_destroy(&worker->offload);
+        access_log_ring_destroy(&worker->access_log);
+        // After the clients, whose queued sends may still hold entries
+        response_cache_destroy(&worker->response_cache);
+        compressor_destroy(&worker->compressor);
+        admission_destroy(&worker->admission);
+        free_event_loop(worker->loop);
+        file_cache_destroy(&worker->files);
+        slab_pool_destroy(&worker->client_pool);
+        slab_pool_destroy(&worker->connection_pool);
+        buffer_pool_destroy(&worker->buffers);
+        free_static_responses(&worker->static_responses);
+        free(worker);
+    }
+}
+
+static void *worker_main(void *arg)
+{
+    Worker *worker = arg;
+
+    if (worker->cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(worker->cpu, &cpus);
+        int err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        if (err != 0) {
+            fprintf(stderr, "Worker %d could not be pinned to CPU %d\n", worker->id, worker->cpu);
+        }
+    }
+
+    event_loop_run(worker->loop);
+    return NULL;
+}
+
+int start_worker(Worker *worker)
+{
+    int err = pthread_create(&worker->thread, NULL, worker_main, worker);
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
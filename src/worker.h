@@ -0,0 +1,53 @@
+#ifndef WORKER_H
+#define WORKER_H
+
+#include "access_log.h"
+#include "admission.h"
+#include "client_info.h"
+#include "compression.h"
+#include "event_loop.h"
+#include "metrics.h"
+#include "offload.h"
+#include "pool.h"
+#include "proxy.h"
+#include "response.h"
+#include "response_cache.h"
+#include "server.h"
+#include "static_files.h"
+#include <pthread.h>
+#include <stddef.h>
+
+// Everything a worker thread touches while serving lives here, so workers
+// never share mutable state and need no locks
+typedef struct Worker {
+    int id;
+    int cpu; // CPU the worker is pinned to, -1 if not pinned
+    pthread_t thread;
+    const ServerConfig *config;
+    EventLoop *loop;
+    EventHandle listen_handle; // SO_REUSEPORT listener owned by this worker
+    Connection *connections; // Intrusive list of open connections
+    size_t num_connections;
+    SlabPool connection_pool; // Connection records, reused across connections
+    SlabPool client_pool; // ClientInfo structs, only held by busy connections
+    BufferPool buffers; // Read, output and arena buffers
+    DateCache date;
+    StaticResponses static_responses; // This worker's copies, so Date patches need no locking
+    FileCache files; // Open static files, root_fd is -1 when they are off
+    Metrics metrics;
+    Compressor compressor; // Reused for every gzipped response
+    ResponseCache response_cache; // Pre-serialized responses of cacheable routes, max_bytes is 0 when off
+    ProxyPool proxy; // Backend connections, prefix is NULL when proxying is off
+    OffloadQueue offload; // Jobs for the offload threads, jobs is NULL when handlers run inline
+    Admission admission; // Connection cap, limit is 0 when every connection is admitted
+    AccessLogRing access_log; // Finished requests for the flusher, records is NULL when logging is off
+} Worker;
+
+extern Worker *create_worker(const ServerConfig *config, int id, int cpu);
+extern void free_worker(Worker *worker);
+extern int start_worker(Worker *worker);
+extern void close_connection(Worker *worker, Connection *conn);
+extern void close_client(Worker *worker, ClientInfo *client);
+extern void service_client(Worker *worker, ClientInfo *client);
+
+#endif // WORKER_H